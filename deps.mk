@@ -131,7 +131,7 @@ $(OBJDIR)/modules/misc.o: modules/misc.c src/deark-config.h \
 $(OBJDIR)/modules/mp3.o: modules/mp3.c src/deark-config.h \
  src/deark-private.h src/deark.h src/deark-fmtutil.h
 $(OBJDIR)/modules/mscompress.o: modules/mscompress.c src/deark-config.h \
- src/deark-private.h src/deark.h
+ src/deark-private.h src/deark.h src/deark-fmtutil.h
 $(OBJDIR)/modules/msp.o: modules/msp.c src/deark-config.h \
  src/deark-private.h src/deark.h
 $(OBJDIR)/modules/nokia.o: modules/nokia.c src/deark-config.h \
@@ -244,14 +244,22 @@ $(OBJDIR)/src/deark-char.o: src/deark-char.c src/deark-config.h \
  src/deark-private.h src/deark.h
 $(OBJDIR)/src/deark-cmd.o: src/deark-cmd.c src/deark-config.h \
  src/deark-user.h src/deark.h
+$(OBJDIR)/src/deark-crc.o: src/deark-crc.c src/deark-config.h \
+ src/deark-private.h src/deark.h
 $(OBJDIR)/src/deark-data.o: src/deark-data.c src/deark-config.h \
  src/deark-private.h src/deark.h
 $(OBJDIR)/src/deark-dbuf.o: src/deark-dbuf.c src/deark-config.h \
  src/deark-private.h src/deark.h
+$(OBJDIR)/src/deark-dedup.o: src/deark-dedup.c src/deark-config.h \
+ src/deark-private.h src/deark.h
 $(OBJDIR)/src/deark-fmtutil.o: src/deark-fmtutil.c src/deark-config.h \
  src/deark-private.h src/deark.h src/deark-fmtutil.h
 $(OBJDIR)/src/deark-font.o: src/deark-font.c src/deark-config.h \
  src/deark-private.h src/deark.h
+$(OBJDIR)/src/deark-index.o: src/deark-index.c src/deark-config.h \
+ src/deark-private.h src/deark.h
+$(OBJDIR)/src/deark-inflate.o: src/deark-inflate.c src/deark-config.h \
+ src/deark-private.h src/deark.h
 $(OBJDIR)/src/deark-liblzw.o: src/deark-liblzw.c src/deark-config.h \
  src/deark-private.h src/deark.h src/../foreign/liblzw.h
 $(OBJDIR)/src/deark-miniz.o: src/deark-miniz.c src/deark-config.h \
@@ -267,3 +275,5 @@ $(OBJDIR)/src/deark-user.o: src/deark-user.c src/deark-config.h \
 $(OBJDIR)/src/deark-util.o: src/deark-util.c src/deark-config.h \
  src/deark-private.h src/deark.h
 $(OBJDIR)/src/deark-win.o: src/deark-win.c src/deark-config.h
+$(OBJDIR)/src/deark-writer.o: src/deark-writer.c src/deark-config.h \
+ src/deark-private.h src/deark.h
@@ -37,16 +37,17 @@ struct de_liblzwctx {
 	deark *c;
 	dbuf *inf;
 	i64 inf_fpos;
+	i64 inf_endpos;
 	int arcfs_mode;
 
-	int eof;
-
 	unsigned char *inbuf, *outbuf, *stackp;
-	unsigned char *unreadbuf;
-	size_t stackp_diff;
 	size_t insize, outpos;
 	i64 rsize;
 
+	dbuf *outf;
+	int has_maxlen;
+	i64 nbytes_still_to_write;
+
 	unsigned char flags;
 	int maxbits, block_mode;
 
@@ -63,54 +64,68 @@ struct de_liblzwctx {
 /*
  * Misc common define cruft
  */
-#define BUFSIZE      4096
-#define IN_BUFSIZE   (BUFSIZE + 64)
-#define OUT_BUFSIZE  (BUFSIZE + 2048)
+/* Deark: Input is read, and output is written, in large blocks. The input
+ * buffer has some extra room for the unused bytes from the previous block.
+ * The output buffer can hold the longest possible string (just under
+ * 1<<BITS bytes). */
+#define IN_READSIZE  65536
+#define IN_BUFSIZE   (IN_READSIZE + 64)
+#define OUT_BUFSIZE  65536
 #define BITS         16
 #define INIT_BITS    9			/* initial number of bits/code */
 #define MAXCODE(n)   (1L << (n))
 #define FIRST        257					/* first free entry */
 #define CLEAR        256					/* table clear output code */
 
+/* Deark: Read up to n bytes from the input segment. Bytes past the end of
+ * the file read as 0. */
+static i64 lzw_read_input(struct de_liblzwctx *lzw, u8 *buf, i64 n)
+{
+	if (lzw->inf_fpos + n > lzw->inf_endpos)
+		n = lzw->inf_endpos - lzw->inf_fpos;
+	if (n < 1)
+		return 0;
+	dbuf_read(lzw->inf, buf, lzw->inf_fpos, n);
+	lzw->inf_fpos += n;
+	return n;
+}
 
 /*
  * Open LZW file
  */
-static struct de_liblzwctx *de_liblzw_dbufopen(dbuf *inf, unsigned int dflags, u8 lzwmode)
+static struct de_liblzwctx *de_liblzw_dbufopen(dbuf *inf, i64 pos, i64 len,
+	unsigned int dflags, u8 lzwmode)
 {
 	struct de_liblzwctx *ret = NULL;
-	i64 inf_fpos = 0;
 	int has_header;
 
 	has_header = (dflags&0x1)?1:0;
 
-	if(has_header) {
-		unsigned char buf[3];
-
-		if (dbuf_standard_read(inf, buf, 3, &inf_fpos) != 3) {
-			de_err(inf->c, "Not in compress format");
-			goto err_out;
-		}
-
-		if (buf[0] != LZW_MAGIC_1 || buf[1] != LZW_MAGIC_2 || buf[2] & 0x60) {
-			de_err(inf->c, "Not in compress format");
-			goto err_out;
-		}
-		lzwmode = buf[2];
-	}
-
 	ret = de_malloc(inf->c, sizeof(*ret));
 
 	ret->c = inf->c;
 	ret->inf = inf;
-	ret->inf_fpos = inf_fpos;
+	ret->inf_fpos = pos;
+	ret->inf_endpos = pos + len;
 	ret->arcfs_mode = (dflags&0x2)?1:0;
 
-	ret->eof = 0;
 	ret->inbuf = de_malloc(ret->c, sizeof(unsigned char) * IN_BUFSIZE);
 	ret->outbuf = de_malloc(ret->c, sizeof(unsigned char) * OUT_BUFSIZE);
 	ret->stackp = NULL;
+
 	if(has_header) {
+		if (lzw_read_input(ret, ret->inbuf, 3) != 3) {
+			de_err(inf->c, "Not in compress format");
+			goto err_out_free;
+		}
+
+		if (ret->inbuf[0] != LZW_MAGIC_1 || ret->inbuf[1] != LZW_MAGIC_2 ||
+			ret->inbuf[2] & 0x60)
+		{
+			de_err(inf->c, "Not in compress format");
+			goto err_out_free;
+		}
+		lzwmode = ret->inbuf[2];
 		ret->insize = 3; /* we read three bytes above */
 	}
 	else {
@@ -128,7 +143,7 @@ static struct de_liblzwctx *de_liblzw_dbufopen(dbuf *inf, unsigned int dflags, u
 	ret->bitmask = (1<<INIT_BITS)-1;
 	ret->oldcode = -1;
 	ret->finchar = 0;
-	ret->posbits = 3<<3;
+	ret->posbits = has_header ? (3<<3) : 0;
 	ret->free_ent = ((ret->block_mode) ? FIRST : 256);
 
 	/* initialize the first 256 entries in the table */
@@ -142,9 +157,6 @@ static struct de_liblzwctx *de_liblzw_dbufopen(dbuf *inf, unsigned int dflags, u
 
 	return ret;
 
-err_out:
-	return NULL;
-
 err_out_free:
 	if(ret) {
 		de_free(inf->c, ret->inbuf);
@@ -185,31 +197,42 @@ static int de_liblzw_close(struct de_liblzwctx *lzw)
 
 #define lzw_de_stack				((unsigned char *)&(lzw->htab[HSIZE-1]))
 
+/* Deark: Write n bytes to the output file, respecting the size limit.
+ * Returns 0 if the limit has been reached. */
+static int lzw_write_output(struct de_liblzwctx *lzw, const u8 *buf, size_t n)
+{
+	if (lzw->has_maxlen && (i64)n > lzw->nbytes_still_to_write)
+		n = (size_t)lzw->nbytes_still_to_write;
+	if (n > 0) {
+		dbuf_write(lzw->outf, buf, (i64)n);
+		lzw->nbytes_still_to_write -= (i64)n;
+	}
+	return !(lzw->has_maxlen && lzw->nbytes_still_to_write < 1);
+}
+
 /*
- * Read LZW file
+ * Decompress LZW file
+ * Deark: Originally this was a read() function that decompressed into the
+ * caller's buffer, and had to be able to stop and resume at any point.
+ * Instead, this decompresses everything (or until has_maxlen/max_out_len is
+ * satisfied), writing straight to outf.
+ * Returns 0 on error.
  */
-static i64 de_liblzw_read(struct de_liblzwctx *lzw, u8 *readbuf, size_t count)
+static int de_liblzw_decompress(struct de_liblzwctx *lzw, dbuf *outf,
+	int has_maxlen, i64 max_out_len)
 {
-	size_t count_left = count;
 	unsigned char *inbuf = lzw->inbuf;
 	unsigned char *outbuf = lzw->outbuf;
+	size_t stackp_diff;
+	int retval = 0;
 
 	i32 maxmaxcode = MAXCODE(lzw->maxbits);
 
-	if (!count || lzw->eof)
-		return 0;
-
-	if (lzw->stackp != NULL) {
-		if (lzw->outpos) {
-			if (lzw->outpos >= count) {
-				outbuf = lzw->unreadbuf;
-				goto empty_existing_buffer;
-			} else /*if (lzw->outpos < count)*/ {
-				memcpy(readbuf, lzw->unreadbuf, lzw->outpos);
-				goto resume_partial_reading;
-			}
-		}
-		goto resume_reading;
+	lzw->outf = outf;
+	lzw->has_maxlen = has_maxlen;
+	lzw->nbytes_still_to_write = max_out_len;
+	if (has_maxlen && max_out_len < 1) {
+		return 1;
 	}
 
 	do {
@@ -226,8 +249,8 @@ resetbuf:
 			lzw->posbits = 0;
 		}
 
-		if (lzw->insize < IN_BUFSIZE-BUFSIZE) {
-			lzw->rsize = dbuf_standard_read(lzw->inf, inbuf+lzw->insize, BUFSIZE, &lzw->inf_fpos);
+		if (lzw->insize < IN_BUFSIZE-IN_READSIZE) {
+			lzw->rsize = lzw_read_input(lzw, inbuf+lzw->insize, IN_READSIZE);
 			lzw->insize += (size_t)lzw->rsize;
 		}
 
@@ -254,7 +277,7 @@ resetbuf:
 			if (lzw->oldcode == -1) {
 				if (lzw->code >= 256) {
 					de_err(lzw->c, "LZW decompression error");
-					return -1;
+					goto done;
 				}
 				outbuf[lzw->outpos++] = lzw->finchar = lzw->oldcode = lzw->code;
 				continue;
@@ -277,7 +300,7 @@ resetbuf:
 			if (lzw->code >= lzw->free_ent) {
 				if ((lzw->code > lzw->free_ent) && !lzw->arcfs_mode) {
 					de_err(lzw->c, "LZW decompression error");
-					return -1;
+					goto done;
 				}
 
 				*--lzw->stackp = lzw->finchar;
@@ -288,7 +311,7 @@ resetbuf:
 			while (lzw->code >= 256) {
 				if(lzw->stackp==(unsigned char*)&lzw->htab[0]) {
 					de_err(lzw->c, "LZW decompression error");
-					return -1;
+					goto done;
 				}
 				*--lzw->stackp = (unsigned char)lzw->htab[lzw->code];
 				lzw->code = lzw->codetab[lzw->code];
@@ -296,47 +319,30 @@ resetbuf:
 
 			if(lzw->stackp==(unsigned char*)&lzw->htab[0]) {
 				de_err(lzw->c, "LZW decompression error");
-				return -1;
+				goto done;
 			}
 			*--lzw->stackp = (lzw->finchar = lzw->htab[lzw->code]);
 
 			/* And put them out in forward order */
-			{
-				lzw->stackp_diff = lzw_de_stack - lzw->stackp;
-
-				if (lzw->outpos+lzw->stackp_diff >= BUFSIZE) {
-					do {
-						if (lzw->stackp_diff > BUFSIZE-lzw->outpos)
-							lzw->stackp_diff = BUFSIZE-lzw->outpos;
-
-						if (lzw->stackp_diff > 0) {
-							memcpy(outbuf+lzw->outpos, lzw->stackp, lzw->stackp_diff);
-							lzw->outpos += lzw->stackp_diff;
-						}
-
-						if (lzw->outpos >= BUFSIZE) {
-							if (lzw->outpos < count_left) {
-								memcpy(readbuf, outbuf, lzw->outpos);
-resume_partial_reading:
-								readbuf += lzw->outpos;
-								count_left -= lzw->outpos;
-							} else {
-empty_existing_buffer:
-								lzw->outpos -= count_left;
-								memcpy(readbuf, outbuf, count_left);
-								lzw->unreadbuf = outbuf + count_left;
-								return count;
-							}
-resume_reading:
-							lzw->outpos = 0;
-						}
-						lzw->stackp += lzw->stackp_diff;
-					} while ((lzw->stackp_diff = (lzw_de_stack-lzw->stackp)) > 0);
-				} else {
-					memcpy(outbuf+lzw->outpos, lzw->stackp, lzw->stackp_diff);
-					lzw->outpos += lzw->stackp_diff;
+			stackp_diff = lzw_de_stack - lzw->stackp;
+			if (lzw->outpos+stackp_diff > OUT_BUFSIZE) {
+				if (!lzw_write_output(lzw, outbuf, lzw->outpos)) {
+					lzw->outpos = 0;
+					retval = 1;
+					goto done;
+				}
+				lzw->outpos = 0;
+				if (stackp_diff > OUT_BUFSIZE) {
+					/* Won't fit in outbuf; write it from the stack. */
+					if (!lzw_write_output(lzw, lzw->stackp, stackp_diff)) {
+						retval = 1;
+						goto done;
+					}
+					stackp_diff = 0;
 				}
 			}
+			memcpy(outbuf+lzw->outpos, lzw->stackp, stackp_diff);
+			lzw->outpos += stackp_diff;
 
 			/* Generate the new entry. */
 			if ((lzw->code = lzw->free_ent) < maxmaxcode) {
@@ -346,15 +352,20 @@ resume_reading:
 			}
 
 			lzw->oldcode = lzw->incode;	/* Remember previous code. */
+
+			/* Stop when we have enough output. */
+			if (lzw->has_maxlen && (i64)lzw->outpos >= lzw->nbytes_still_to_write) {
+				retval = 1;
+				goto done;
+			}
 		}
     } while (lzw->rsize != 0);
 
-	if (lzw->outpos < count_left) {
-		lzw->eof = 1;
-		memcpy(readbuf, outbuf, lzw->outpos);
-		count_left -= lzw->outpos;
-		return (count - count_left);
-	} else {
-		goto empty_existing_buffer;
-	}
+	retval = 1;
+
+done:
+	/* Deark: On error, we still write the output decoded so far. */
+	lzw_write_output(lzw, outbuf, lzw->outpos);
+	lzw->outpos = 0;
+	return retval;
 }
@@ -20,8 +20,12 @@
 
 */
 
-#define HUFF_NODECODE 0
-#define HUFF_DECODE   1
+// After the tree is read, it is converted to lookup tables. The first-level
+// table is indexed by the next HUFF_TABLEBITS bits of input. Codes that are
+// longer than that continue in a subtable, indexed by up to
+// HUFF_SUBTABLEBITS more bits, and so on.
+#define HUFF_TABLEBITS    10
+#define HUFF_SUBTABLEBITS 6
 
 struct huff_node {
 	int flag;
@@ -29,6 +33,12 @@ struct huff_node {
 	struct huff_node *one, *zero;
 };
 
+struct huff_tableentry {
+	u16 value; // The byte value (if a leaf), or the subtable's first entry
+	u8 nbits; // Bits used (if a leaf), or the subtable's index size
+	u8 is_leaf;
+};
+
 struct huffctx {
 	deark *c;
 	dbuf *inf;
@@ -46,6 +56,18 @@ struct huffctx {
 	// Originally 512, but changed to 515 because that's what macutil does.
 #define HUFF_NODELISTSIZE 515
 	struct huff_node nodelist[HUFF_NODELISTSIZE];
+
+	struct huff_tableentry *tbl;
+	size_t tbl_used;
+	size_t tbl_alloc;
+	unsigned int root_tbits;
+
+	// Bit reader used for decoding. The low nbits bits of bitbuf are valid.
+	u64 bitbuf;
+	unsigned int nbits;
+	size_t inbuf_pos;
+	size_t inbuf_len;
+	u8 inbuf[4096];
 };
 
 static u8 huff_getc(struct huffctx *hctx)
@@ -75,32 +97,22 @@ static unsigned int huff_getbit(struct huffctx *hctx)
 	return((hctx->b >> hctx->bit) & 1);
 }
 
-/* This routine returns the next 8 bits.  If decoding is on, it finds the
-byte in the decoding tree based on the bits from the input stream.  If
-decoding is not on, it either gets it directly from the input stream or
-puts it together from 8 calls to getbit(), depending on whether or not we
-are currently on a byte boundary
+/* This routine returns the next 8 bits.  It either gets it directly from
+the input stream or puts it together from 8 calls to getbit(), depending on
+whether or not we are currently on a byte boundary
 */
-static u8 huff_gethuffbyte(struct huffctx *hctx, int decode)
+// (Decoding is done by huff_decode_all(), using lookup tables.)
+static u8 huff_gethuffbyte(struct huffctx *hctx)
 {
-	struct huff_node *np;
 	int i;
 	unsigned int b;
 
-	if (decode == HUFF_DECODE) {
-		np = hctx->nodelist;
-		while (np->flag == 0)
-			np = (huff_getbit(hctx)) ? np->one : np->zero;
-		b = (unsigned int)np->byte;
-	}
-	else {
-		if (hctx->bit == 0)	/* on byte boundary? */
-			b = (unsigned int)huff_getc(hctx);
-		else {		/* no, put a byte together */
-			b = 0;
-			for (i = 8; i > 0; i--) {
-				b = (b << 1) + huff_getbit(hctx);
-			}
+	if (hctx->bit == 0)	/* on byte boundary? */
+		b = (unsigned int)huff_getc(hctx);
+	else {		/* no, put a byte together */
+		b = 0;
+		for (i = 8; i > 0; i--) {
+			b = (b << 1) + huff_getbit(hctx);
 		}
 	}
 	return (u8)b;
@@ -132,7 +144,7 @@ static struct huff_node *huff_read_tree(struct huffctx *hctx, int depth)
 
 	if (huff_getbit(hctx) == 1) {
 		np->flag = 1;
-		np->byte = huff_gethuffbyte(hctx, HUFF_NODECODE);
+		np->byte = huff_gethuffbyte(hctx);
 	}
 	else {
 		np->flag = 0;
@@ -142,10 +154,157 @@ static struct huff_node *huff_read_tree(struct huffctx *hctx, int depth)
 	return(np);
 }
 
-static int huff_main(struct huffctx *hctx)
+static unsigned int huff_tree_height(struct huff_node *np)
+{
+	unsigned int h0, h1;
+
+	if(np->flag) return 0;
+	h0 = huff_tree_height(np->zero);
+	h1 = huff_tree_height(np->one);
+	return 1 + (h0>h1 ? h0 : h1);
+}
+
+// Make a table of 2^tbits entries for the subtree at np, and (recursively)
+// any subtables it needs. Returns the index of its first entry.
+static size_t huff_build_table(struct huffctx *hctx, struct huff_node *np,
+	unsigned int tbits)
+{
+	size_t first;
+	size_t idx;
+	size_t nentries = (size_t)1 << tbits;
+
+	first = hctx->tbl_used;
+	hctx->tbl_used += nentries;
+
+	for(idx=0; idx<nentries; idx++) {
+		struct huff_node *np2 = np;
+		struct huff_tableentry *e;
+		unsigned int d;
+
+		// Follow the bits of idx, MSB first, as far as they go.
+		for(d=0; d<tbits && !np2->flag; d++) {
+			np2 = ((idx>>(tbits-1-d)) & 1) ? np2->one : np2->zero;
+		}
+
+		if(np2->flag) {
+			e = &hctx->tbl[first+idx];
+			e->is_leaf = 1;
+			e->value = (u16)np2->byte;
+			e->nbits = (u8)d;
+		}
+		else {
+			unsigned int subtbits;
+			size_t sub;
+
+			subtbits = huff_tree_height(np2);
+			if(subtbits > HUFF_SUBTABLEBITS) subtbits = HUFF_SUBTABLEBITS;
+			sub = huff_build_table(hctx, np2, subtbits);
+			e = &hctx->tbl[first+idx];
+			e->is_leaf = 0;
+			e->value = (u16)sub;
+			e->nbits = (u8)subtbits;
+		}
+	}
+
+	return first;
+}
+
+static void huff_make_tables(struct huffctx *hctx)
+{
+	// Each internal node at the edge of a table can start a subtable.
+	hctx->tbl_alloc = ((size_t)1<<HUFF_TABLEBITS) +
+		HUFF_NODELISTSIZE * ((size_t)1<<HUFF_SUBTABLEBITS);
+	hctx->tbl = de_mallocarray(hctx->c, (i64)hctx->tbl_alloc, sizeof(struct huff_tableentry));
+	hctx->tbl_used = 0;
+
+	hctx->root_tbits = huff_tree_height(&hctx->nodelist[0]);
+	if(hctx->root_tbits > HUFF_TABLEBITS) hctx->root_tbits = HUFF_TABLEBITS;
+	huff_build_table(hctx, &hctx->nodelist[0], hctx->root_tbits);
+}
+
+static void huff_refill(struct huffctx *hctx)
+{
+	while(hctx->nbits <= 56) {
+		if(hctx->inbuf_pos >= hctx->inbuf_len) {
+			i64 amt = hctx->cmpr_pos + hctx->cmpr_len - hctx->in_pos;
+
+			if(amt<=0) return;
+			if(amt > (i64)sizeof(hctx->inbuf)) amt = (i64)sizeof(hctx->inbuf);
+			dbuf_read(hctx->inf, hctx->inbuf, hctx->in_pos, amt);
+			hctx->in_pos += amt;
+			hctx->inbuf_len = (size_t)amt;
+			hctx->inbuf_pos = 0;
+		}
+		hctx->bitbuf = (hctx->bitbuf<<8) | (u64)hctx->inbuf[hctx->inbuf_pos++];
+		hctx->nbits += 8;
+	}
+}
+
+// Returns the next n bits (n<=16), without consuming them.
+// Bits past the end of the input data read as 0.
+static unsigned int huff_peekbits(struct huffctx *hctx, unsigned int n)
+{
+	if(n==0) return 0;
+	if(hctx->nbits < n) {
+		huff_refill(hctx);
+		if(hctx->nbits < n) {
+			return (unsigned int)(hctx->bitbuf << (n - hctx->nbits)) & ((1U<<n)-1);
+		}
+	}
+	return (unsigned int)(hctx->bitbuf >> (hctx->nbits - n)) & ((1U<<n)-1);
+}
+
+static void huff_skipbits(struct huffctx *hctx, unsigned int n)
+{
+	if(n > hctx->nbits) {
+		// We needed bits that aren't there.
+		hctx->error_flag = 1;
+		hctx->bitbuf = 0;
+		hctx->nbits = 0;
+		return;
+	}
+	hctx->nbits -= n;
+	hctx->bitbuf &= ((u64)1 << hctx->nbits) - 1;
+}
+
+static void huff_decode_all(struct huffctx *hctx)
 {
 	i64 obytes;
+	size_t outlen = 0;
+	u8 outbuf[4096];
+
+	// Take over the partial byte left by huff_getbit().
+	hctx->bitbuf = (u64)(hctx->b & ((1U<<hctx->bit)-1));
+	hctx->nbits = hctx->bit;
+	hctx->inbuf_pos = 0;
+	hctx->inbuf_len = 0;
 
+	obytes = hctx->unc_len;
+	while (obytes > 0 && !hctx->error_flag) {
+		const struct huff_tableentry *e;
+		unsigned int tbits = hctx->root_tbits;
+
+		e = &hctx->tbl[huff_peekbits(hctx, tbits)];
+		while(!e->is_leaf) {
+			huff_skipbits(hctx, tbits);
+			tbits = e->nbits;
+			e = &hctx->tbl[(size_t)e->value + huff_peekbits(hctx, tbits)];
+		}
+		huff_skipbits(hctx, e->nbits);
+
+		outbuf[outlen++] = (u8)e->value;
+		if(outlen >= sizeof(outbuf)) {
+			dbuf_write(hctx->outf, outbuf, (i64)outlen);
+			outlen = 0;
+		}
+		obytes -= 1;
+	}
+
+	dbuf_write(hctx->outf, outbuf, (i64)outlen);
+}
+
+static int huff_main(struct huffctx *hctx)
+{
 	hctx->in_pos = hctx->cmpr_pos;
 
 	hctx->nodeptr_idx = 0;
@@ -153,14 +312,10 @@ static int huff_main(struct huffctx *hctx)
 	huff_read_tree(hctx, 0);
 	if(hctx->error_flag) return 0;
 
-	obytes = hctx->unc_len;
-	while (obytes > 0 && !hctx->error_flag) {
-		u8 ch;
-
-		ch = huff_gethuffbyte(hctx, HUFF_DECODE);
-		dbuf_writebyte(hctx->outf, ch);
-		obytes -= 1;
-	}
+	huff_make_tables(hctx);
+	huff_decode_all(hctx);
+	de_free(hctx->c, hctx->tbl);
+	hctx->tbl = NULL;
 
 	return hctx->error_flag ? 0 : 1;
 }
@@ -6,6 +6,7 @@
 
 #include <deark-config.h>
 #include <deark-private.h>
+#include <deark-fmtutil.h>
 DE_DECLARE_MODULE(de_module_abk);
 DE_DECLARE_MODULE(de_module_amos_source);
 
@@ -49,12 +50,9 @@ struct amosbank {
 static void do_read_sprite_image(deark *c, lctx *d, struct amosbank *bk, i64 pos)
 {
 	i64 width, height;
-	i64 i, j;
-	i64 plane;
-	unsigned int palent;
-	u8 b;
+	i64 j;
 	i64 rowspan, planespan;
-	u32 clr;
+	u8 *row = NULL;
 	de_bitmap *img = NULL;
 
 	width = bk->xsize * 16;
@@ -73,24 +71,18 @@ static void do_read_sprite_image(deark *c, lctx *d, struct amosbank *bk, i64 pos
 	rowspan = bk->xsize*2;
 	planespan = rowspan*bk->ysize;
 
+	row = de_malloc(c, width);
 	for(j=0; j<height; j++) {
-		for(i=0; i<width; i++) {
-			palent = 0;
-			for(plane=0; plane<bk->nplanes; plane++) {
-				b = de_get_bits_symbol(bk->f, 1, pos + plane*planespan + j*rowspan, i);
-				if(b) palent |= (1<<plane);
-			}
-			if(palent<=255) clr = bk->pal[palent];
-			else clr=0;
-
-			de_bitmap_setpixel_rgb(img, i, j, clr);
-		}
+		de_fmtutil_planar_to_chunky_dbuf(bk->f, pos + j*rowspan, bk->nplanes,
+			planespan, width, row, 0);
+		de_bitmap_setrow_paletted(img, j, row, width, bk->pal);
 	}
 
 	de_bitmap_write_to_file(img, NULL, 0);
 
 done:
 	de_bitmap_destroy(img);
+	de_free(c, row);
 }
 
 static int do_sprite_object(deark *c, lctx *d, struct amosbank *bk, i64 obj_idx,
@@ -206,10 +206,10 @@ static int do_read_main_icon(deark *c, lctx *d,
 	i64 width, height;
 	i64 depth;
 	i64 src_rowspan, src_planespan;
-	i64 i, j, plane;
+	i64 i, j;
 	int retval = 0;
 	de_bitmap *img = NULL;
-	u8 b, b1;
+	u8 *row = NULL;
 	u32 pal[256];
 
 	de_dbg(c, "main icon #%d, at %d", (int)icon_index, (int)pos);
@@ -269,15 +269,12 @@ static int do_read_main_icon(deark *c, lctx *d,
 
 	pos += 20;
 
+	row = de_malloc(c, width);
 	for(j=0; j<height; j++) {
-		for(i=0; i<width; i++) {
-			b = 0x00;
-			for(plane=0; plane<depth; plane++) {
-				b1 = de_get_bits_symbol(c->infile, 1, pos+plane*src_planespan + j*src_rowspan, i);
-				b = (b<<1) | b1;
-			}
-			de_bitmap_setpixel_rgb(img, i, j, pal[b]);
-		}
+		// The first plane is the most significant bit.
+		de_fmtutil_planar_to_chunky_dbuf(c->infile, pos + j*src_rowspan, depth,
+			src_planespan, width, row, DE_PLANARFLAG_FIRSTPLANEHIGH);
+		de_bitmap_setrow_paletted(img, j, row, width, pal);
 	}
 
 	de_bitmap_write_to_file(img, NULL, (d->has_newicons||d->has_glowicons)?DE_CREATEFLAG_IS_AUX:0);
@@ -286,6 +283,7 @@ static int do_read_main_icon(deark *c, lctx *d,
 
 done:
 	de_bitmap_destroy(img);
+	de_free(c, row);
 	de_dbg_indent(c, -1);
 	return retval;
 }
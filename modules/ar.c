@@ -165,6 +165,7 @@ static void de_run_ar(deark *c, de_module_params *mparams)
 	pos = 8;
 	while(1) {
 		if(pos >= c->infile->len) break;
+		if(de_output_file_limit_reached(c)) break;
 		ret = do_ar_item(c, d, pos, &item_len);
 		if(!ret || item_len<1) break;
 		pos += item_len;
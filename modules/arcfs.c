@@ -344,6 +344,7 @@ static void do_members(deark *c, lctx *d, i64 pos1)
 
 	for(k=0; k<d->nmembers; k++) {
 		if(pos>=c->infile->len) break;
+		if(de_output_file_limit_reached(c)) break;
 		de_dbg(c, "member[%d]", (int)k);
 		de_dbg_indent(c, 1);
 		do_member(c, d, k, pos);
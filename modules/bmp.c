@@ -516,8 +516,17 @@ static de_bitmap *bmp_bitmap_create(deark *c, lctx *d, int bypp)
 static void do_image_paletted(deark *c, lctx *d, dbuf *bits, i64 bits_offset)
 {
 	de_bitmap *img = NULL;
+	int bypp = d->pal_is_grayscale?1:3;
 
-	img = bmp_bitmap_create(c, d, d->pal_is_grayscale?1:3);
+	if(d->bitcount==1 || d->bitcount==2 || d->bitcount==4 || d->bitcount==8) {
+		// Store the palette indices as they are, instead of expanding them.
+		img = de_bitmap_create_indexed(c, d->width, d->height, bypp,
+			(int)d->bitcount, d->pal, 256);
+		img->flipped = !d->top_down;
+	}
+	else {
+		img = bmp_bitmap_create(c, d, bypp);
+	}
 	de_convert_image_paletted(bits, bits_offset,
 		d->bitcount, d->rowspan, d->pal, img, 0);
 	de_bitmap_write_to_file_finfo(img, d->fi, 0);
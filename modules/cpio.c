@@ -451,10 +451,13 @@ static void de_run_cpio(deark *c, de_module_params *mparams)
 		break;
 	}
 
+	pos = de_index_find_start(c, pos);
 	while(1) {
 		if(d->trailer_found) break;
 		if(pos >= c->infile->len) break;
+		if(de_output_file_limit_reached(c)) break;
 		bytes_consumed = 0;
+		de_index_member(c, pos);
 		ret = read_member(c, d, pos, &bytes_consumed);
 		if(!ret) break;
 		if(bytes_consumed<1) break;
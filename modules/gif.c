@@ -40,7 +40,6 @@ struct gif_image_data {
 	de_bitmap *img;
 	i64 xpos, ypos;
 	i64 width, height;
-	i64 pixels_set;
 	int interlaced;
 	int has_local_color_table;
 	i64 local_color_table_size;
@@ -48,266 +47,58 @@ struct gif_image_data {
 	u32 local_ct[256];
 };
 
-static void do_record_pixel(deark *c, lctx *d, struct gif_image_data *gi, unsigned int coloridx,
-	int offset)
+// Convert the decoded palette indices to pixels in gi->img.
+// npixels is the number of pixels that were decoded, which may be more or
+// less than the image size.
+static void do_render_image(deark *c, lctx *d, struct gif_image_data *gi,
+	const u8 *pixels, i64 npixels)
 {
-	i64 pixnum;
-	i64 xi, yi;
-	i64 yi1;
-	u32 clr;
-
-	if(coloridx>255) return;
-
-	pixnum = gi->pixels_set + offset;
-	xi = pixnum%gi->width;
-	yi1 = pixnum/gi->width;
-	if(gi->interlace_map && yi1<gi->height) {
-		yi = gi->interlace_map[yi1];
-	}
-	else {
-		yi = yi1;
-	}
-
-	if(gi->has_local_color_table && coloridx<gi->local_color_table_size) {
-		clr = gi->local_ct[coloridx];
-	}
-	else {
-		clr = d->global_ct[coloridx];
-	}
-
-	if(d->gce && d->gce->trns_color_idx_valid &&
-		(d->gce->trns_color_idx == coloridx))
-	{
-		// Make this pixel transparent
-		clr = DE_SET_ALPHA(clr, 0);
-	}
-	else {
-		clr = DE_SET_ALPHA(clr, 0xff);
-	}
-
-	de_bitmap_setpixel_rgb(gi->img, xi, yi, clr);
-}
-
-////////////////////////////////////////////////////////
-//                    LZW decoder
-////////////////////////////////////////////////////////
-
-struct lzw_tableentry {
-	u16 parent; // pointer to previous table entry (if not a root code)
-	u16 length;
-	u8 firstchar;
-	u8 lastchar;
-};
-
-struct lzwdeccontext {
-	unsigned int root_codesize;
-	unsigned int current_codesize;
-	int eoi_flag;
-	unsigned int oldcode;
-	unsigned int pending_code;
-	unsigned int bits_in_pending_code;
-	unsigned int num_root_codes;
-	int ncodes_since_clear;
-
-	unsigned int clear_code;
-	unsigned int eoi_code;
-	unsigned int last_code_added;
-
-	unsigned int ct_used; // Number of items used in the code table
-	struct lzw_tableentry ct[4096]; // Code table
-};
+	u32 pal[256];
+	i64 nrows;
+	i64 j;
+	unsigned int k;
 
-static int lzw_init(deark *c, struct lzwdeccontext *lz, unsigned int root_codesize)
-{
-	unsigned int i;
-
-	de_zeromem(lz, sizeof(struct lzwdeccontext));
-
-	if(root_codesize<2 || root_codesize>11) {
-		de_err(c, "Invalid LZW root codesize (%u)", root_codesize);
-		return 0;
-	}
-
-	lz->root_codesize = root_codesize;
-	lz->num_root_codes = 1<<lz->root_codesize;
-	lz->clear_code = lz->num_root_codes;
-	lz->eoi_code = lz->num_root_codes+1;
-	for(i=0; i<lz->num_root_codes; i++) {
-		lz->ct[i].parent = 0;
-		lz->ct[i].length = 1;
-		lz->ct[i].lastchar = (u8)i;
-		lz->ct[i].firstchar = (u8)i;
-	}
-
-	return 1;
-}
-
-static void lzw_clear(struct lzwdeccontext *lz)
-{
-	lz->ct_used = lz->num_root_codes+2;
-	lz->current_codesize = lz->root_codesize+1;
-	lz->ncodes_since_clear=0;
-	lz->oldcode=0;
-}
-
-// Decode an LZW code to one or more pixels, and record it in the image.
-static void lzw_emit_code(deark *c, lctx *d, struct gif_image_data *gi, struct lzwdeccontext *lz,
-		unsigned int first_code)
-{
-	unsigned int code;
-	code = first_code;
+	for(k=0; k<256; k++) {
+		u32 clr;
 
-	// An LZW code may decode to more than one pixel. Note that the pixels for
-	// an LZW code are decoded in reverse order (right to left).
-
-	while(1) {
-		do_record_pixel(c, d, gi, (unsigned int)lz->ct[code].lastchar, (int)(lz->ct[code].length-1));
-		if(lz->ct[code].length<=1) break;
-		// The codes are structured as a "forest" (multiple trees).
-		// Go to the parent code, which will have a length 1 less than this one.
-		code = (unsigned int)lz->ct[code].parent;
-	}
-
-	// Track the total number of pixels decoded in this image.
-	gi->pixels_set += lz->ct[first_code].length;
-}
-
-// Add a code to the dictionary.
-// Sets d->last_code_added to the position where it was added.
-// Returns 1 if successful, 2 if table is full, 0 on error.
-static int lzw_add_to_dict(deark *c, struct lzwdeccontext *lz, unsigned int oldcode, u8 val)
-{
-	static const unsigned int last_code_of_size[] = {
-		// The first 3 values are unused.
-		0,0,0,7,15,31,63,127,255,511,1023,2047,4095
-	};
-	unsigned int newpos;
-
-	if(lz->ct_used>=4096) {
-		lz->last_code_added = 0;
-		return 2;
-	}
-
-	newpos = lz->ct_used;
-
-	if(oldcode >= newpos) {
-		de_err(c, "GIF decoding error");
-		return 0;
-	}
-
-	lz->ct_used++;
-
-	lz->ct[newpos].parent = (u16)oldcode;
-	lz->ct[newpos].length = lz->ct[oldcode].length + 1;
-	lz->ct[newpos].firstchar = lz->ct[oldcode].firstchar;
-	lz->ct[newpos].lastchar = val;
-
-	// If we've used the last code of this size, we need to increase the codesize.
-	if(newpos == last_code_of_size[lz->current_codesize]) {
-		if(lz->current_codesize<12) {
-			lz->current_codesize++;
+		if(gi->has_local_color_table && k<gi->local_color_table_size) {
+			clr = gi->local_ct[k];
 		}
-	}
-
-	lz->last_code_added = newpos;
-
-	return 1;
-}
-
-// Process a single LZW code that was read from the input stream.
-static int lzw_process_code(deark *c, lctx *d, struct gif_image_data *gi, struct lzwdeccontext *lz,
-		unsigned int code)
-{
-	int ret;
-
-	if(code==lz->eoi_code) {
-		lz->eoi_flag=1;
-		return 1;
-	}
-
-	if(code==lz->clear_code) {
-		lzw_clear(lz);
-		return 1;
-	}
-
-	lz->ncodes_since_clear++;
-
-	if(lz->ncodes_since_clear==1) {
-		// Special case for the first code.
-		lzw_emit_code(c, d, gi, lz, code);
-		lz->oldcode = code;
-		return 1;
-	}
-
-	// Is code in code table?
-	if(code < lz->ct_used) {
-		// Yes, code is in table.
-		lzw_emit_code(c, d, gi, lz, code);
-
-		// Let k = the first character of the translation of the code.
-		// Add <oldcode>k to the dictionary.
-		ret = lzw_add_to_dict(c, lz,lz->oldcode,lz->ct[code].firstchar);
-		if(ret==0) return 0;
-	}
-	else {
-		// No, code is not in table.
-		if(lz->oldcode>=lz->ct_used) {
-			de_err(c, "GIF decoding error");
-			return 0;
+		else {
+			clr = d->global_ct[k];
 		}
 
-		// Let k = the first char of the translation of oldcode.
-		// Add <oldcode>k to the dictionary.
-		ret = lzw_add_to_dict(c, lz,lz->oldcode,lz->ct[lz->oldcode].firstchar);
-		if(ret==0) return 0;
-		if(ret==1) {
-			// Write <oldcode>k to the output stream.
-			lzw_emit_code(c, d, gi, lz, lz->last_code_added);
+		if(d->gce && d->gce->trns_color_idx_valid &&
+			(d->gce->trns_color_idx == k))
+		{
+			// Make this color transparent
+			pal[k] = DE_SET_ALPHA(clr, 0);
+		}
+		else {
+			pal[k] = DE_SET_ALPHA(clr, 0xff);
 		}
 	}
-	lz->oldcode = code;
 
-	return 1;
-}
+	if(npixels > gi->width*gi->height) npixels = gi->width*gi->height;
+	nrows = (npixels + gi->width - 1) / gi->width;
 
-// Decode as much as possible of the provided LZW-encoded data.
-// Any unfinished business is recorded, to be continued the next time
-// this function is called.
-static int lzw_process_bytes(deark *c, lctx *d, struct gif_image_data *gi, struct lzwdeccontext *lz,
-	u8 *data, i64 data_size)
-{
-	i64 i;
-	int b;
-	int retval=0;
-
-	for(i=0;i<data_size;i++) {
-		// Look at the bits one at a time.
-		for(b=0;b<8;b++) {
-			if(lz->eoi_flag) { // Stop if we've seen an EOI (end of image) code.
-				retval=1;
-				goto done;
-			}
-
-			if(data[i]&(1<<b))
-				lz->pending_code |= 1<<lz->bits_in_pending_code;
-			lz->bits_in_pending_code++;
+	for(j=0; j<nrows; j++) {
+		i64 yi;
+		i64 nrowpixels;
 
-			// When we get enough bits to form a complete LZW code, process it.
-			if(lz->bits_in_pending_code >= lz->current_codesize) {
-				if(!lzw_process_code(c, d, gi, lz, lz->pending_code)) goto done;
-				lz->pending_code=0;
-				lz->bits_in_pending_code=0;
-			}
+		if(gi->interlace_map) {
+			yi = gi->interlace_map[j];
+		}
+		else {
+			yi = j;
 		}
-	}
-	retval=1;
 
-done:
-	return retval;
+		nrowpixels = npixels - j*gi->width;
+		if(nrowpixels > gi->width) nrowpixels = gi->width;
+		de_bitmap_setrow_paletted(gi->img, yi, &pixels[j*gi->width], nrowpixels, pal);
+	}
 }
 
-////////////////////////////////////////////////////////
-
 static int do_read_header(deark *c, lctx *d, i64 pos)
 {
 	de_ucstring *ver = NULL;
@@ -982,7 +773,8 @@ static int do_image_internal(deark *c, lctx *d,
 	int failure_flag = 0;
 	int saved_indent_level;
 	unsigned int lzw_min_code_size;
-	struct lzwdeccontext *lz = NULL;
+	struct de_lzwdecoder *lz = NULL;
+	u8 *pixels = NULL; // The decoded palette indices
 	u8 buf[256];
 
 	de_dbg_indent_save(c, &saved_indent_level);
@@ -1035,12 +827,13 @@ static int do_image_internal(deark *c, lctx *d,
 		gi->img = de_bitmap_create(c, gi->width, gi->height, bypp);
 	}
 
-	lz = de_malloc(c, sizeof(struct lzwdeccontext));
-	if(!lzw_init(c, lz, lzw_min_code_size)) {
-		failure_flag = 1;
-	}
 	if(!failure_flag) {
-		lzw_clear(lz);
+		pixels = de_malloc(c, gi->width*gi->height);
+		lz = de_fmtutil_lzwdec_create(c, lzw_min_code_size, 0, pixels,
+			gi->width*gi->height);
+		if(!lz) {
+			failure_flag = 1;
+		}
 	}
 
 	if(gi->interlaced && !failure_flag) {
@@ -1059,8 +852,9 @@ static int do_image_internal(deark *c, lctx *d,
 
 		de_read(buf, pos, n);
 
-		if(!lz->eoi_flag && !failure_flag) {
-			if(!lzw_process_bytes(c, d, gi, lz, buf, n)) {
+		if(!failure_flag) {
+			if(!de_fmtutil_lzwdec_process_bytes(lz, buf, n)) {
+				de_err(c, "GIF decoding error");
 				failure_flag = 1;
 			}
 		}
@@ -1071,9 +865,14 @@ static int do_image_internal(deark *c, lctx *d,
 
 	*bytesused = pos - pos1;
 
+	if(!failure_flag) {
+		do_render_image(c, d, gi, pixels, de_fmtutil_lzwdec_get_nbytes_decoded(lz));
+	}
+
 	retval = 1;
 done:
-	de_free(c, lz);
+	de_fmtutil_lzwdec_destroy(lz);
+	de_free(c, pixels);
 	if(failure_flag) {
 		de_bitmap_destroy(gi->img);
 		gi->img = NULL;
@@ -24,11 +24,38 @@ struct member_data {
 	struct de_crcobj *crco; // A copy of lctx->crco
 };
 
+struct gz_pool;
+
 typedef struct lctx_struct {
 	dbuf *output_file;
 	struct de_crcobj *crco;
+	i64 member_count;
+	struct gz_pool *pool; // Used if we're decompressing BGZF members in parallel
+	u8 pool_failed;
+
+	u8 mkindex;
+	dbuf *index_recs; // Checkpoint records for the index, for "-opt gzip:mkindex"
+
+	u8 use_range;
+	i64 range_start, range_len;
+	const char *index_fn; // The index we're reading, for "-opt gzip:index"
+	dbuf *range_idxf; // The open index file, after it has been checked
 } lctx;
 
+// Index file format ("-opt gzip:mkindex"). All integers are little-endian.
+// Header (48 bytes): Signature "DEARKGZI", version (u32, =2), window size
+//  (u32), position of the first member's compressed data (i64), size of the
+//  gzip file (i64), size of the first member's compressed data (i64), CRC-32
+//  and ISIZE from that member's trailer (u32, u32).
+// Then one record per checkpoint, in order: position in the compressed data,
+//  in bits, relative to its start (i64); position in the decompressed data
+//  (i64); the 32K of decompressed data before that position.
+// Only the first member is indexed.
+#define GZIDX_VERSION  2
+#define GZIDX_HDRSIZE  48
+#define GZIDX_RECSIZE  (16+DE_INFLATE_WINDOW_SIZE)
+#define GZIDX_SPAN     1048576
+
 static const char *get_os_name(u8 n)
 {
 	const char *names[14] = { "FAT", "Amiga", "VMS", "Unix",
@@ -48,6 +75,426 @@ static void our_writecallback(dbuf *f, const u8 *buf, i64 buf_len)
 	de_crcobj_addbuf(md->crco, buf, buf_len);
 }
 
+// Parallel decompression of BGZF files.
+// BGZF ("blocked gzip", common in bioinformatics) is a series of small gzip
+// members, each of which records its own size in an extra field. So we can
+// find all the members without decompressing anything, and decompress
+// several at once. The main thread parses each member's header, and queues
+// its compressed data as a job. Worker threads decompress the jobs, and the
+// main thread writes the results to the output file in order.
+
+#define GZ_MAX_THREADS 32
+
+struct gz_job {
+	i64 member_pos;
+	i64 trailer_pos;
+	dbuf *cmpr_data;
+	dbuf *outf; // A membuf with a fixed maximum size
+	struct de_crcobj *crco;
+	int ok;
+	const char *errmsg;
+	u8 done;
+};
+
+struct gz_pool {
+	int num_threads;
+	de_thread *threads[GZ_MAX_THREADS];
+	de_mutex *mutex;
+	de_cond *cond; // Signaled when a job is queued or finished, or on shutdown
+	u8 shutdown;
+	u8 abandon; // Set on a fatal error: Quit without running the queued jobs
+	// Jobs are numbered in the order they're queued. Job n uses
+	// jobs[n % num_slots].
+	i64 num_slots;
+	struct gz_job *jobs;
+	i64 next_to_commit;
+	i64 next_to_run;
+	i64 next_to_queue;
+};
+
+// Returns the total size of the gzip member at pos1, if it's a BGZF block.
+// Otherwise returns 0.
+static i64 get_bgzf_block_size(deark *c, i64 pos1)
+{
+	i64 xlen;
+	i64 pos;
+	u8 buf[4];
+
+	if(pos1+28 > c->infile->len) return 0;
+	if(dbuf_memcmp(c->infile, pos1, "\x1f\x8b\x08", 3)) return 0;
+	if(!(de_getbyte(pos1+3) & GZIPFLAG_FEXTRA)) return 0;
+	xlen = de_getu16le(pos1+10);
+
+	// Look for the "BC" subfield
+	pos = pos1+12;
+	while(pos+4 <= pos1+12+xlen) {
+		i64 slen;
+
+		de_read(buf, pos, 4);
+		slen = (i64)buf[2] | ((i64)buf[3]<<8);
+		if(buf[0]=='B' && buf[1]=='C' && slen==2) {
+			i64 bsize = de_getu16le(pos+4) + 1;
+
+			if(bsize < 12+xlen+8 || pos1+bsize > c->infile->len) return 0;
+			// Uncompressed size must be at most 64K
+			if(de_getu32le(pos1+bsize-4) > 65536) return 0;
+			return bsize;
+		}
+		pos += 4+slen;
+	}
+	return 0;
+}
+
+static int is_bgzf_file(deark *c)
+{
+	i64 pos = 0;
+
+	while(pos < c->infile->len) {
+		i64 bsize;
+
+		bsize = get_bgzf_block_size(c, pos);
+		if(bsize==0) return 0;
+		pos += bsize;
+	}
+	return 1;
+}
+
+static void gz_run_job(struct gz_job *job)
+{
+	struct de_inflate_params ip;
+
+	de_zeromem(&ip, sizeof(struct de_inflate_params));
+	ip.from_worker_thread = 1;
+	job->ok = de_fast_inflate_ex(job->cmpr_data, 0, job->cmpr_data->len, job->outf, &ip);
+	job->errmsg = ip.errmsg;
+	de_crcobj_addslice(job->crco, job->outf, 0, job->outf->len);
+}
+
+static void gz_worker_main(void *userdata)
+{
+	struct gz_pool *pool = (struct gz_pool*)userdata;
+
+	de_mutex_lock(pool->mutex);
+	while(1) {
+		if(pool->abandon) break;
+		if(pool->next_to_run < pool->next_to_queue) {
+			struct gz_job *job = &pool->jobs[pool->next_to_run % pool->num_slots];
+
+			pool->next_to_run++;
+			de_mutex_unlock(pool->mutex);
+			gz_run_job(job);
+			de_mutex_lock(pool->mutex);
+			job->done = 1;
+			de_cond_broadcast(pool->cond);
+			continue;
+		}
+		if(pool->shutdown) break;
+		de_cond_wait(pool->cond, pool->mutex);
+	}
+	de_mutex_unlock(pool->mutex);
+}
+
+// Wait for the oldest job to finish, and write its output.
+static void gz_pool_commit_one(deark *c, lctx *d)
+{
+	struct gz_pool *pool = d->pool;
+	struct gz_job *job = &pool->jobs[pool->next_to_commit % pool->num_slots];
+	u32 crc_calculated, crc_reported;
+
+	de_mutex_lock(pool->mutex);
+	while(!job->done) {
+		de_cond_wait(pool->cond, pool->mutex);
+	}
+	de_mutex_unlock(pool->mutex);
+
+	if(d->pool_failed) {
+		;
+	}
+	else if(!job->ok) {
+		de_err(c, "Inflate error in member at %"I64_FMT": %s", job->member_pos,
+			job->errmsg ? job->errmsg : "?");
+		d->pool_failed = 1;
+	}
+	else {
+		dbuf_copy(job->outf, 0, job->outf->len, d->output_file);
+
+		crc_calculated = de_crcobj_getval(job->crco);
+		crc_reported = (u32)de_getu32le(job->trailer_pos);
+		de_dbg2(c, "member at %"I64_FMT": %"I64_FMT" bytes, crc32 0x%08x",
+			job->member_pos, job->outf->len, (unsigned int)crc_calculated);
+		if(crc_calculated != crc_reported) {
+			de_warn(c, "CRC check failed: Expected 0x%08x, got 0x%08x",
+				(unsigned int)crc_reported, (unsigned int)crc_calculated);
+		}
+	}
+
+	dbuf_close(job->cmpr_data);
+	job->cmpr_data = NULL;
+	dbuf_close(job->outf);
+	job->outf = NULL;
+	pool->next_to_commit++;
+}
+
+// Queue the compressed data of a BGZF member for decompression.
+static void gz_pool_submit(deark *c, lctx *d, i64 member_pos, i64 cmpr_pos,
+	i64 trailer_pos)
+{
+	struct gz_pool *pool = d->pool;
+	struct gz_job *job;
+
+	// If all the slots are in use, make room.
+	if(pool->next_to_queue - pool->next_to_commit >= pool->num_slots) {
+		gz_pool_commit_one(c, d);
+	}
+
+	job = &pool->jobs[pool->next_to_queue % pool->num_slots];
+	job->member_pos = member_pos;
+	job->trailer_pos = trailer_pos;
+	job->cmpr_data = dbuf_create_membuf(c, trailer_pos-cmpr_pos, 0);
+	dbuf_copy(c->infile, cmpr_pos, trailer_pos-cmpr_pos, job->cmpr_data);
+	// The worker can't safely reallocate memory, so the output buffer must
+	// be allocated now, at the maximum size of a BGZF block.
+	job->outf = dbuf_create_membuf(c, 65536, 0x1);
+	de_crcobj_reset(job->crco);
+	job->ok = 0;
+	job->errmsg = NULL;
+	job->done = 0;
+
+	de_mutex_lock(pool->mutex);
+	pool->next_to_queue++;
+	de_cond_broadcast(pool->cond);
+	de_mutex_unlock(pool->mutex);
+}
+
+static void gz_pool_stop_threads(struct gz_pool *pool, int abandon)
+{
+	int k;
+
+	de_mutex_lock(pool->mutex);
+	pool->shutdown = 1;
+	if(abandon) pool->abandon = 1;
+	de_cond_broadcast(pool->cond);
+	de_mutex_unlock(pool->mutex);
+	for(k=0; k<pool->num_threads; k++) {
+		de_thread_join(pool->threads[k]);
+		pool->threads[k] = NULL;
+	}
+	pool->num_threads = 0;
+}
+
+// Called by de_fatalerror(). The workers use memory that is about to be
+// freed (or the process is about to end), so stop them now. Everything else
+// is left to the fatal error handling.
+static void gz_pool_fatalerror_cleanup(deark *c, void *userdata)
+{
+	gz_pool_stop_threads((struct gz_pool*)userdata, 1);
+}
+
+static void gz_pool_destroy(deark *c, lctx *d)
+{
+	struct gz_pool *pool = d->pool;
+	int k;
+
+	if(!pool) return;
+
+	c->fatalerror_cleanup_fn = NULL;
+	c->fatalerror_cleanup_userdata = NULL;
+	gz_pool_stop_threads(pool, 0);
+
+	for(k=0; k<pool->num_slots; k++) {
+		dbuf_close(pool->jobs[k].cmpr_data);
+		dbuf_close(pool->jobs[k].outf);
+		de_crcobj_destroy(pool->jobs[k].crco);
+	}
+	de_free(c, pool->jobs);
+	de_cond_destroy(pool->cond);
+	de_mutex_destroy(pool->mutex);
+	de_free(c, pool);
+	d->pool = NULL;
+}
+
+// On failure (e.g. if threads aren't supported), leaves d->pool NULL.
+static void gz_pool_create(deark *c, lctx *d, int num_threads)
+{
+	struct gz_pool *pool;
+	int k;
+
+	pool = de_malloc(c, sizeof(struct gz_pool));
+	d->pool = pool;
+	pool->mutex = de_mutex_create(c);
+	pool->cond = de_cond_create(c);
+	pool->num_slots = 4*(i64)num_threads;
+	pool->jobs = de_mallocarray(c, pool->num_slots, sizeof(struct gz_job));
+	for(k=0; k<pool->num_slots; k++) {
+		pool->jobs[k].crco = de_crcobj_create(c, DE_CRCOBJ_CRC32_IEEE);
+	}
+	c->fatalerror_cleanup_fn = gz_pool_fatalerror_cleanup;
+	c->fatalerror_cleanup_userdata = (void*)pool;
+
+	for(k=0; k<num_threads; k++) {
+		pool->threads[pool->num_threads] = de_thread_create(c, gz_worker_main, (void*)pool);
+		if(!pool->threads[pool->num_threads]) break;
+		pool->num_threads++;
+	}
+
+	if(pool->num_threads<1) {
+		gz_pool_destroy(c, d);
+		return;
+	}
+	de_dbg(c, "decompressing BGZF blocks using %d threads", pool->num_threads);
+}
+
+static void index_checkpoint_cb(struct de_inflate_params *ip,
+	const struct de_inflate_checkpoint *cp)
+{
+	lctx *d = (lctx*)ip->userdata;
+
+	dbuf_writeu64le(d->index_recs, (u64)cp->in_bitpos);
+	dbuf_writeu64le(d->index_recs, (u64)cp->out_pos);
+	dbuf_write(d->index_recs, cp->window, DE_INFLATE_WINDOW_SIZE);
+}
+
+// Decompress the first member, and write an index file for it.
+// The header includes the member's trailer, which we can't find until we've
+// decompressed it, so the records are collected in memory until then.
+static int do_decompress_and_index(deark *c, lctx *d, i64 pos, i64 *cmpr_data_len)
+{
+	struct de_inflate_params ip;
+	dbuf *idxf = NULL;
+	i64 trailer_pos;
+	int retval;
+
+	d->index_recs = dbuf_create_membuf(c, 0, 0);
+
+	de_zeromem(&ip, sizeof(struct de_inflate_params));
+	ip.checkpoint_fn = index_checkpoint_cb;
+	ip.checkpoint_span = GZIDX_SPAN;
+	ip.userdata = (void*)d;
+	retval = de_fast_inflate_ex(c->infile, pos, c->infile->len - pos, d->output_file, &ip);
+	*cmpr_data_len = ip.bytes_consumed;
+	if(!retval) goto done;
+
+	trailer_pos = pos + ip.bytes_consumed;
+	if(trailer_pos+8 > c->infile->len) {
+		de_warn(c, "gzip trailer not found; not writing an index");
+		goto done;
+	}
+
+	de_dbg(c, "index checkpoints: %"I64_FMT, d->index_recs->len / GZIDX_RECSIZE);
+	idxf = dbuf_create_output_file(c, "gzidx", NULL, DE_CREATEFLAG_IS_AUX);
+	dbuf_write(idxf, (const u8*)"DEARKGZI", 8);
+	dbuf_writeu32le(idxf, GZIDX_VERSION);
+	dbuf_writeu32le(idxf, DE_INFLATE_WINDOW_SIZE);
+	dbuf_writeu64le(idxf, (u64)pos);
+	dbuf_writeu64le(idxf, (u64)c->infile->len);
+	dbuf_writeu64le(idxf, (u64)ip.bytes_consumed);
+	dbuf_copy(c->infile, trailer_pos, 8, idxf);
+	dbuf_copy(d->index_recs, 0, d->index_recs->len, idxf);
+
+done:
+	dbuf_close(idxf);
+	dbuf_close(d->index_recs);
+	d->index_recs = NULL;
+	return retval;
+}
+
+static int check_index_file(deark *c, dbuf *idxf, i64 cmpr_pos)
+{
+	i64 cmpr_len;
+	i64 trailer_pos;
+
+	if(dbuf_memcmp(idxf, 0, "DEARKGZI", 8) ||
+		dbuf_getu32le(idxf, 12)!=DE_INFLATE_WINDOW_SIZE)
+	{
+		de_err(c, "Not a gzip index file");
+		return 0;
+	}
+	if(dbuf_getu32le(idxf, 8)!=GZIDX_VERSION) {
+		de_err(c, "Unsupported gzip index version; rebuild it with gzip:mkindex");
+		return 0;
+	}
+
+	// The trailer has the CRC and size of the decompressed data, so comparing
+	// it catches most cases of the gzip file being replaced by a different
+	// one of the same size.
+	cmpr_len = dbuf_geti64le(idxf, 32);
+	trailer_pos = cmpr_pos + cmpr_len;
+	if(dbuf_geti64le(idxf, 16)!=cmpr_pos || dbuf_geti64le(idxf, 24)!=c->infile->len ||
+		cmpr_len<0 || cmpr_len > c->infile->len - cmpr_pos - 8 ||
+		dbuf_getu32le(idxf, 40)!=de_getu32le(trailer_pos) ||
+		dbuf_getu32le(idxf, 44)!=de_getu32le(trailer_pos+4))
+	{
+		de_err(c, "Index file does not match this gzip file");
+		return 0;
+	}
+	return 1;
+}
+
+// Find the last checkpoint in the index file at or before the given
+// decompressed position, and read it into *cp.
+// Returns 0 if there isn't one.
+static int find_checkpoint(deark *c, dbuf *idxf, i64 target,
+	struct de_inflate_checkpoint *cp)
+{
+	i64 num_recs;
+	i64 lo, hi;
+	i64 found = -1;
+
+	num_recs = (idxf->len - GZIDX_HDRSIZE) / GZIDX_RECSIZE;
+	de_dbg(c, "index checkpoints: %"I64_FMT, num_recs);
+
+	// Binary search for the last checkpoint whose output position is <= target.
+	lo = 0;
+	hi = num_recs-1;
+	while(lo<=hi) {
+		i64 mid = lo + (hi-lo)/2;
+
+		if(dbuf_geti64le(idxf, GZIDX_HDRSIZE + mid*GZIDX_RECSIZE + 8) <= target) {
+			found = mid;
+			lo = mid+1;
+		}
+		else {
+			hi = mid-1;
+		}
+	}
+	if(found<0) return 0;
+
+	cp->in_bitpos = dbuf_geti64le(idxf, GZIDX_HDRSIZE + found*GZIDX_RECSIZE);
+	cp->out_pos = dbuf_geti64le(idxf, GZIDX_HDRSIZE + found*GZIDX_RECSIZE + 8);
+	dbuf_read(idxf, cp->window, GZIDX_HDRSIZE + found*GZIDX_RECSIZE + 16,
+		DE_INFLATE_WINDOW_SIZE);
+	de_dbg(c, "using checkpoint %"I64_FMT" (bit %"I64_FMT", output pos %"I64_FMT")",
+		found, cp->in_bitpos, cp->out_pos);
+	return 1;
+}
+
+// For "-opt gzip:range". Extract part of the first member's decompressed
+// data, starting from the nearest checkpoint in the index file if there is
+// one. The CRC can't be checked.
+static void do_decompress_range(deark *c, lctx *d, i64 pos)
+{
+	struct de_inflate_params ip;
+	struct de_inflate_checkpoint *cp = NULL;
+
+	de_zeromem(&ip, sizeof(struct de_inflate_params));
+	ip.use_out_range = 1;
+	ip.out_range_start = d->range_start;
+	ip.out_range_len = d->range_len;
+
+	if(d->range_idxf) {
+		cp = de_malloc(c, sizeof(struct de_inflate_checkpoint));
+		if(find_checkpoint(c, d->range_idxf, d->range_start, cp)) {
+			ip.resume_from = cp;
+		}
+	}
+
+	de_dbg(c, "extracting decompressed bytes %"I64_FMT"-%"I64_FMT, d->range_start,
+		d->range_start+d->range_len-1);
+	(void)de_fast_inflate_ex(c->infile, pos, c->infile->len - pos, d->output_file, &ip);
+
+	de_free(c, cp);
+}
+
 static int do_gzip_read_member(deark *c, lctx *d, i64 pos1, i64 *member_size)
 {
 	u8 b0, b1;
@@ -152,6 +599,14 @@ static int do_gzip_read_member(deark *c, lctx *d, i64 pos1, i64 *member_size)
 
 	de_dbg(c, "compressed blocks at %d", (int)pos);
 
+	if(d->use_range && d->index_fn && !d->range_idxf) {
+		// Check the index before creating the output file, so that a
+		// mismatch doesn't leave an empty file behind.
+		d->range_idxf = dbuf_open_input_file(c, d->index_fn);
+		if(!d->range_idxf) goto done;
+		if(!check_index_file(c, d->range_idxf, pos)) goto done;
+	}
+
 	if(!d->output_file) {
 		// Although any member can have a name and mod time, this metadata
 		// is ignored for members after the first one.
@@ -173,12 +628,43 @@ static int do_gzip_read_member(deark *c, lctx *d, i64 pos1, i64 *member_size)
 		de_finfo_destroy(c, fi);
 	}
 
+	if(dbuf_is_discarded(d->output_file)) {
+		// All members are written to the same file, so if it's not going to
+		// be written, there's nothing more to do. (We can't find the next
+		// member without decompressing this one.)
+		pos = c->infile->len;
+		retval = 1;
+		goto done;
+	}
+
+	if(d->use_range) {
+		// Only the first member is supported
+		do_decompress_range(c, d, pos);
+		pos = c->infile->len;
+		retval = 1;
+		goto done;
+	}
+
+	if(d->pool) {
+		i64 member_end = pos1 + get_bgzf_block_size(c, pos1);
+
+		gz_pool_submit(c, d, pos1, pos, member_end-8);
+		pos = member_end;
+		retval = 1;
+		goto done;
+	}
+
 	d->output_file->writecallback_fn = our_writecallback;
 	d->output_file->userdata = (void*)md;
 	md->crco = d->crco;
 	de_crcobj_reset(md->crco);
 
-	ret = de_uncompress_deflate(c->infile, pos, c->infile->len - pos, d->output_file, &cmpr_data_len);
+	if(d->mkindex && d->member_count==0) {
+		ret = do_decompress_and_index(c, d, pos, &cmpr_data_len);
+	}
+	else {
+		ret = de_uncompress_deflate(c->infile, pos, c->infile->len - pos, d->output_file, &cmpr_data_len);
+	}
 
 	crc_calculated = de_crcobj_getval(md->crco);
 	d->output_file->writecallback_fn = NULL;
@@ -215,26 +701,90 @@ done:
 	return retval;
 }
 
+// For "-opt gzip:range". Parse a nonnegative decimal number at the start of
+// s, which must be followed by endchar or the end of the string.
+// Returns 0 if it's not valid.
+static int parse_range_number(const char *s, char endchar, i64 *pn)
+{
+	char *endptr = NULL;
+
+	if(s[0]<'0' || s[0]>'9') return 0;
+	*pn = de_strtoll(s, &endptr, 10);
+	if(*pn<0) return 0;
+	if(*endptr!='\0' && *endptr!=endchar) return 0;
+	return 1;
+}
+
 static void de_run_gzip(deark *c, de_module_params *mparams)
 {
 	lctx *d = NULL;
 	i64 pos;
 	i64 member_size;
+	int num_threads;
+	const char *s;
 
 	d = de_malloc(c, sizeof(lctx));
 	d->crco = de_crcobj_create(c, DE_CRCOBJ_CRC32_IEEE);
 
+	d->mkindex = (u8)de_get_ext_option_bool(c, "gzip:mkindex", 0);
+	s = de_get_ext_option(c, "gzip:range");
+	if(s) {
+		const char *s2;
+
+		d->use_range = 1;
+		d->range_len = 0x7fffffffffffffffLL;
+		s2 = de_strchr(s, ',');
+		if(!parse_range_number(s, ',', &d->range_start) ||
+			(s2 && !parse_range_number(s2+1, '\0', &d->range_len)))
+		{
+			de_err(c, "Bad gzip:range option \"%s\" (expected <start>[,<len>])", s);
+			goto done;
+		}
+		// So that range_start+range_len can't overflow.
+		if(d->range_len > 0x7fffffffffffffffLL - d->range_start) {
+			d->range_len = 0x7fffffffffffffffLL - d->range_start;
+		}
+		d->index_fn = de_get_ext_option(c, "gzip:index");
+		if(!d->index_fn) d->index_fn = de_get_ext_option(c, "file2");
+	}
+
+	// In batch mode, -j is a better way to use more threads.
+	num_threads = c->batch_mode ? 1 : de_get_cpu_count();
+	s = de_get_ext_option(c, "gzip:threads");
+	if(s) {
+		num_threads = de_atoi(s);
+		if(num_threads<1) num_threads = de_get_cpu_count();
+	}
+	if(num_threads>GZ_MAX_THREADS) num_threads = GZ_MAX_THREADS;
+	if(num_threads>1 && !d->use_range && !d->mkindex && is_bgzf_file(c)) {
+		gz_pool_create(c, d, num_threads);
+	}
+
 	pos = 0;
 	while(1) {
 		if(pos >= c->infile->len) break;
+		if(d->pool_failed) break;
 		if(!do_gzip_read_member(c, d, pos, &member_size)) {
 			break;
 		}
 		if(member_size<=0) break;
 
 		pos += member_size;
+		d->member_count++;
+	}
+	if(d->pool) {
+		while(d->pool->next_to_commit < d->pool->next_to_queue) {
+			gz_pool_commit_one(c, d);
+		}
+		gz_pool_destroy(c, d);
+	}
+	if(d->mkindex && d->member_count>1) {
+		de_warn(c, "The index only covers the first member of this gzip file");
 	}
+
+done:
 	dbuf_close(d->output_file);
+	dbuf_close(d->range_idxf);
 
 	if(d) {
 		de_crcobj_destroy(d->crco);
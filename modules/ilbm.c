@@ -175,27 +175,26 @@ static u8 getbit(const u8 *m, i64 bitnum)
 static void do_deplanarize(deark *c, lctx *d, struct img_info *ii,
 	const u8 *row_orig, u8 *row_deplanarized)
 {
-	i64 i;
+	i64 bytes_per_row_per_plane = ii->bits_per_row_per_plane/8;
+	i64 i, k;
 	i64 sample;
-	i64 bit;
-	u8 b;
+	u8 tmpbuf[1024];
 
 	if(d->planes>=1 && d->planes<=8) {
-		de_zeromem(row_deplanarized, (size_t)ii->width);
-		for(i=0; i<ii->width; i++) {
-			for(bit=0; bit<d->planes; bit++) {
-				b = getbit(row_orig, bit*ii->bits_per_row_per_plane +i);
-				if(b) row_deplanarized[i] |= (1<<bit);
-			}
-		}
+		de_fmtutil_planar_to_chunky(row_orig, d->planes, bytes_per_row_per_plane, 2,
+			ii->width, row_deplanarized, 0);
 	}
 	else if(d->planes==24) {
-		de_zeromem(row_deplanarized, (size_t)(ii->width*3));
-		for(i=0; i<ii->width; i++) {
+		// Each sample is a set of 8 planes. Deplanarize them one at a time,
+		// a chunk of pixels at a time.
+		for(i=0; i<ii->width; i+=(i64)sizeof(tmpbuf)) {
+			i64 n = de_min_int(ii->width-i, (i64)sizeof(tmpbuf));
+
 			for(sample=0; sample<3; sample++) {
-				for(bit=0; bit<8; bit++) {
-					b = getbit(row_orig, (sample*8+bit)*ii->bits_per_row_per_plane + i);
-					if(b) row_deplanarized[i*3 + sample] |= (1<<bit);
+				de_fmtutil_planar_to_chunky(&row_orig[sample*8*bytes_per_row_per_plane + i/8],
+					8, bytes_per_row_per_plane, 2, n, tmpbuf, 0);
+				for(k=0; k<n; k++) {
+					row_deplanarized[(i+k)*3 + sample] = tmpbuf[k];
 				}
 			}
 		}
@@ -205,17 +204,9 @@ static void do_deplanarize(deark *c, lctx *d, struct img_info *ii,
 static void get_row_acbm(deark *c, lctx *d, struct img_info *ii,
 	dbuf *unc_pixels, i64 j, u8 *row)
 {
-	i64 i;
-	i64 bit;
-	u8 b;
-
-	de_zeromem(row, (size_t)ii->width);
-	for(i=0; i<ii->width; i++) {
-		for(bit=0; bit<d->planes; bit++) {
-			b = de_get_bits_symbol(unc_pixels, 1, bit*ii->planespan + j*ii->rowspan, i);
-			if(b) row[i] |= (1<<bit);
-		}
-	}
+	// (Only 8 planes fit in a byte.)
+	de_fmtutil_planar_to_chunky_dbuf(unc_pixels, j*ii->rowspan,
+		de_min_int(d->planes, 8), ii->planespan, ii->width, row, 0);
 }
 
 static void get_row_vdat(deark *c, lctx *d, struct img_info *ii,
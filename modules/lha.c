@@ -429,6 +429,7 @@ static void do_extract_file(deark *c, lctx *d, struct member_data *md)
 		fi->original_filename_flag = 1;
 	}
 	outf = dbuf_create_output_file(c, NULL, fi, 0x0);
+	if(dbuf_is_discarded(outf)) goto done;
 
 	if(!d->crco) {
 		d->crco = de_crcobj_create(c, DE_CRCOBJ_CRC16_ARC);
@@ -447,6 +448,7 @@ static void do_extract_file(deark *c, lctx *d, struct member_data *md)
 		de_err(c, "CRC check failed");
 	}
 
+done:
 	dbuf_close(outf);
 	de_finfo_destroy(c, fi);
 }
@@ -690,10 +692,12 @@ static void de_run_lha(deark *c, de_module_params *mparams)
 		d->try_to_extract = 0;
 	}
 
-	pos = 0;
+	pos = de_index_find_start(c, 0);
 	while(1) {
 		if(pos >= c->infile->len) break;
+		if(de_output_file_limit_reached(c)) break;
 
+		de_index_member(c, pos);
 		md = de_malloc(c, sizeof(struct member_data));
 		if(!do_read_member(c, d, md, pos)) goto done;
 		if(md->total_size<1) goto done;
@@ -154,28 +154,47 @@ static int crc_cbfn(struct de_bufferedreadctx *brctx, const u8 *buf,
 	i64 buf_len)
 {
 	struct crcctx_struct *crcctx = (struct crcctx_struct*)brctx->userdata;
-	de_crcobj_addbuf(crcctx->crco_32ieee, buf, buf_len);
-	de_crcobj_addbuf(crcctx->crco_16arc, buf, buf_len);
-	de_crcobj_addbuf(crcctx->crco_16ccitt, buf, buf_len);
+	if(crcctx->crco_32ieee) de_crcobj_addbuf(crcctx->crco_32ieee, buf, buf_len);
+	if(crcctx->crco_16arc) de_crcobj_addbuf(crcctx->crco_16arc, buf, buf_len);
+	if(crcctx->crco_16ccitt) de_crcobj_addbuf(crcctx->crco_16ccitt, buf, buf_len);
 	return 1;
 }
 
 static void de_run_crc(deark *c, de_module_params *mparams)
 {
 	struct crcctx_struct crcctx;
-
-	crcctx.crco_32ieee = de_crcobj_create(c, DE_CRCOBJ_CRC32_IEEE);
-	crcctx.crco_16arc = de_crcobj_create(c, DE_CRCOBJ_CRC16_ARC);
-	crcctx.crco_16ccitt = de_crcobj_create(c, DE_CRCOBJ_CRC16_CCITT);
+	const char *crctype;
+
+	de_zeromem(&crcctx, sizeof(struct crcctx_struct));
+	// "-opt crc:type=..." selects just one CRC type, mainly for benchmarking
+	// (see scripts/bench-crc.sh).
+	crctype = de_get_ext_option(c, "crc:type");
+	if(!crctype || !de_strcmp(crctype, "crc32"))
+		crcctx.crco_32ieee = de_crcobj_create(c, DE_CRCOBJ_CRC32_IEEE);
+	if(!crctype || !de_strcmp(crctype, "crc16arc"))
+		crcctx.crco_16arc = de_crcobj_create(c, DE_CRCOBJ_CRC16_ARC);
+	if(!crctype || !de_strcmp(crctype, "crc16ccitt"))
+		crcctx.crco_16ccitt = de_crcobj_create(c, DE_CRCOBJ_CRC16_CCITT);
+	if(!crcctx.crco_32ieee && !crcctx.crco_16arc && !crcctx.crco_16ccitt) {
+		de_err(c, "Unknown crc:type \"%s\" (valid types: crc32, crc16arc, crc16ccitt)",
+			crctype);
+		return;
+	}
 
 	dbuf_buffered_read(c->infile, 0, c->infile->len, crc_cbfn, (void*)&crcctx);
 
-	de_printf(c, DE_MSGTYPE_MESSAGE, "CRC-32-IEEE: 0x%08x\n",
-		(unsigned int)de_crcobj_getval(crcctx.crco_32ieee));
-	de_printf(c, DE_MSGTYPE_MESSAGE, "CRC-16-IBM/ARC: 0x%04x\n",
-		(unsigned int)de_crcobj_getval(crcctx.crco_16arc));
-	de_printf(c, DE_MSGTYPE_MESSAGE, "CRC-16-CCITT: 0x%04x\n",
-		(unsigned int)de_crcobj_getval(crcctx.crco_16ccitt));
+	if(crcctx.crco_32ieee) {
+		de_printf(c, DE_MSGTYPE_MESSAGE, "CRC-32-IEEE: 0x%08x\n",
+			(unsigned int)de_crcobj_getval(crcctx.crco_32ieee));
+	}
+	if(crcctx.crco_16arc) {
+		de_printf(c, DE_MSGTYPE_MESSAGE, "CRC-16-IBM/ARC: 0x%04x\n",
+			(unsigned int)de_crcobj_getval(crcctx.crco_16arc));
+	}
+	if(crcctx.crco_16ccitt) {
+		de_printf(c, DE_MSGTYPE_MESSAGE, "CRC-16-CCITT: 0x%04x\n",
+			(unsigned int)de_crcobj_getval(crcctx.crco_16ccitt));
+	}
 
 	de_crcobj_destroy(crcctx.crco_32ieee);
 	de_crcobj_destroy(crcctx.crco_16arc);
@@ -6,6 +6,7 @@
 
 #include <deark-config.h>
 #include <deark-private.h>
+#include <deark-fmtutil.h>
 DE_DECLARE_MODULE(de_module_mscompress);
 
 #define FMT_SZDD 1
@@ -102,53 +103,17 @@ static void do_uncompress_SZDD(deark *c,
 	dbuf *inf, i64 pos1, i64 input_len,
 	dbuf *outf, i64 expected_output_len)
 {
-	i64 pos = pos1;
-	u8 *window = NULL;
-	unsigned int wpos;
-	i64 nbytes_read;
-
-	window = de_malloc(c, 4096);
-	wpos = 4096 - 16;
-	de_memset(window, 0x20, 4096);
-
-	while(1) {
-		unsigned int control;
-		unsigned int cbit;
-
-		if(pos >= (pos1+input_len)) break; // Out of input data
-
-		control = (unsigned int)dbuf_getbyte(inf, pos++);
-
-		for(cbit=0x01; cbit&0xff; cbit<<=1) {
-			if(control & cbit) { // literal
-				u8 b;
-				b = dbuf_getbyte(inf, pos++);
-				dbuf_writebyte(outf, b);
-				if(outf->len >= expected_output_len) goto unc_done;
-				window[wpos] = b;
-				wpos++; wpos &= 4095;
-			}
-			else { // match
-				unsigned int matchpos;
-				unsigned int matchlen;
-				matchpos = (unsigned int)dbuf_getbyte(inf, pos++);
-				matchlen = (unsigned int)dbuf_getbyte(inf, pos++);
-				matchpos |= (matchlen & 0xf0) << 4;
-				matchpos &= 4095;
-				matchlen = (matchlen & 0x0f) + 3;
-				while(matchlen--) {
-					dbuf_writebyte(outf, window[matchpos]);
-					if(outf->len >= expected_output_len) goto unc_done;
-					window[wpos] = window[matchpos];
-					wpos++; wpos &= 4095;
-					matchpos++; matchpos &= 4095;
-				}
-			}
-		}
-	}
+	struct de_lzss_params lzp;
+	i64 nbytes_read = 0;
+
+	de_zeromem(&lzp, sizeof(struct de_lzss_params));
+	lzp.window_size = 4096;
+	lzp.initial_wpos = 4096 - 16;
+	lzp.fill_byte = 0x20;
+	lzp.has_max_output_len = 1;
+	lzp.max_output_len = expected_output_len;
+	de_fmtutil_decompress_lzss1(inf, pos1, input_len, outf, &lzp, &nbytes_read);
 
-unc_done:
-	nbytes_read = pos-pos1;
 	de_dbg(c, "uncompressed %d bytes to %d bytes",
 		(int)nbytes_read, (int)outf->len);
 
@@ -156,8 +121,6 @@ unc_done:
 		de_warn(c, "Expected %d output bytes, got %d",
 			(int)expected_output_len, (int)outf->len);
 	}
-
-	de_free(c, window);
 }
 
 static int detect_fmt_internal(deark *c)
@@ -6,6 +6,7 @@
 
 #include <deark-config.h>
 #include <deark-private.h>
+#include <deark-fmtutil.h>
 DE_DECLARE_MODULE(de_module_pcx);
 DE_DECLARE_MODULE(de_module_mswordscr);
 DE_DECLARE_MODULE(de_module_dcx);
@@ -409,16 +410,29 @@ static void do_bitmap_paletted(deark *c, lctx *d)
 
 	img = de_bitmap_create(c, d->width, d->height, 3);
 
-	for(j=0; j<d->height; j++) {
-		for(i=0; i<d->width; i++) {
-			palent = 0;
-			for(plane=0; plane<d->planes; plane++) {
-				b = de_get_bits_symbol(d->unc_pixels, d->bits,
-					j*d->rowspan + plane*d->rowspan_raw, i);
-				palent |= b<<(plane*d->bits);
+	if(d->bits==1 && d->planes<=8) {
+		// The common case of 1-bit planes
+		u8 *row = de_malloc(c, d->width);
+
+		for(j=0; j<d->height; j++) {
+			de_fmtutil_planar_to_chunky_dbuf(d->unc_pixels, j*d->rowspan, d->planes,
+				d->rowspan_raw, d->width, row, 0);
+			de_bitmap_setrow_paletted(img, j, row, d->width, d->pal);
+		}
+		de_free(c, row);
+	}
+	else {
+		for(j=0; j<d->height; j++) {
+			for(i=0; i<d->width; i++) {
+				palent = 0;
+				for(plane=0; plane<d->planes; plane++) {
+					b = de_get_bits_symbol(d->unc_pixels, d->bits,
+						j*d->rowspan + plane*d->rowspan_raw, i);
+					palent |= b<<(plane*d->bits);
+				}
+				if(palent>255) palent=0; // Should be impossible.
+				de_bitmap_setpixel_rgb(img, i, j, d->pal[palent]);
 			}
-			if(palent>255) palent=0; // Should be impossible.
-			de_bitmap_setpixel_rgb(img, i, j, d->pal[palent]);
 		}
 	}
 
@@ -167,6 +167,123 @@ done:
 	return retval;
 }
 
+struct payload_streamctx {
+	struct de_inflatestream *ifs;
+	struct de_crcobj *crco;
+	i64 nbytes_produced;
+};
+
+static i64 payload_streamread_cb(dbuf *f, u8 *buf, i64 buf_len)
+{
+	struct payload_streamctx *psc = (struct payload_streamctx*)f->userdata;
+	i64 n;
+
+	n = de_inflatestream_read(psc->ifs, buf, buf_len);
+	de_crcobj_addbuf(psc->crco, buf, n);
+	psc->nbytes_produced += n;
+	return n;
+}
+
+// Find the start of the Deflate data in a gzip-compressed payload.
+// Returns 0 if the header isn't something we can handle.
+static int skip_gzip_header(deark *c, i64 pos1, i64 *pdatapos)
+{
+	i64 pos = pos1;
+	i64 foundpos;
+	u8 flags;
+
+	if(de_getbyte(pos+2) != 8) return 0; // Compression method must be Deflate
+	flags = de_getbyte(pos+3);
+	pos += 10;
+
+	if(flags & 0x04) { // FEXTRA
+		pos += 2 + de_getu16le(pos);
+	}
+	if(flags & 0x08) { // FNAME
+		if(!dbuf_search_byte(c->infile, 0x00, pos, c->infile->len-pos, &foundpos))
+			return 0;
+		pos = foundpos+1;
+	}
+	if(flags & 0x10) { // FCOMMENT
+		if(!dbuf_search_byte(c->infile, 0x00, pos, c->infile->len-pos, &foundpos))
+			return 0;
+		pos = foundpos+1;
+	}
+	if(flags & 0x02) { // FHCRC
+		pos += 2;
+	}
+
+	if(pos+8 > c->infile->len) return 0;
+	*pdatapos = pos;
+	return 1;
+}
+
+// For "-opt rpm:cpio". Decompress a gzip-compressed payload on the fly, and
+// feed it straight to the cpio module, without making an intermediate file.
+// Returns 0 if we couldn't even start, in which case the caller should fall
+// back to extracting the compressed payload.
+static int do_extract_gzip_cpio(deark *c, lctx *d, i64 pos1)
+{
+	i64 dpos = 0;
+	i64 isize;
+	i64 cmpr_len;
+	u32 crc_reported, crc_calculated;
+	dbuf *sf = NULL;
+	u8 *drainbuf = NULL;
+	struct payload_streamctx psc;
+
+	if(!skip_gzip_header(c, pos1, &dpos)) return 0;
+
+	// The payload is a single gzip member that runs to the end of the file,
+	// so the CRC and size fields are the last 8 bytes. The size is only
+	// stored mod 2^32, so we don't use it as the stream length. The real
+	// length is found when the decompressor reaches the end of the data.
+	crc_reported = (u32)de_getu32le(c->infile->len-8);
+	isize = de_getu32le(c->infile->len-4);
+	de_dbg(c, "deflate data at %"I64_FMT", expected size (mod 2^32) %"I64_FMT, dpos, isize);
+
+	de_zeromem(&psc, sizeof(struct payload_streamctx));
+	psc.ifs = de_inflatestream_create(c->infile, dpos, c->infile->len-8-dpos, 0);
+	psc.crco = de_crcobj_create(c, DE_CRCOBJ_CRC32_IEEE);
+	sf = dbuf_open_input_stream(c, -1, payload_streamread_cb, (void*)&psc);
+
+	de_dbg(c, "decoding cpio payload");
+	de_dbg_indent(c, 1);
+	de_run_module_by_id_on_slice(c, "cpio", NULL, sf, 0, sf->len);
+	de_dbg_indent(c, -1);
+
+	// Decompress whatever the cpio module didn't need (usually just
+	// padding), so that we can check the CRC.
+	drainbuf = de_malloc(c, 65536);
+	while(payload_streamread_cb(sf, drainbuf, 65536) > 0) {
+		;
+	}
+
+	if(!de_inflatestream_get_status(psc.ifs, &cmpr_len)) {
+		de_err(c, "Failed to decompress payload");
+		goto done;
+	}
+	de_dbg(c, "decompressed %"I64_FMT" to %"I64_FMT" bytes", cmpr_len, psc.nbytes_produced);
+
+	if((psc.nbytes_produced & 0xffffffffLL) != isize) {
+		de_warn(c, "Payload size mismatch: Expected %"I64_FMT", got %"I64_FMT,
+			isize, psc.nbytes_produced);
+	}
+
+	crc_calculated = de_crcobj_getval(psc.crco);
+	if(crc_calculated != crc_reported) {
+		de_warn(c, "CRC check failed: Expected 0x%08x, got 0x%08x",
+			(unsigned int)crc_reported, (unsigned int)crc_calculated);
+	}
+
+done:
+	de_free(c, drainbuf);
+	dbuf_close(sf);
+	de_inflatestream_destroy(psc.ifs);
+	de_crcobj_destroy(psc.crco);
+	return 1;
+}
+
 static void de_run_rpm(deark *c, de_module_params *mparams)
 {
 	lctx *d = NULL;
@@ -213,6 +330,9 @@ static void de_run_rpm(deark *c, de_module_params *mparams)
 	de_read(buf, pos, 8);
 
 	if(buf[0]==0x1f && buf[1]==0x8b) {
+		if(de_get_ext_option_bool(c, "rpm:cpio", 0)) {
+			if(do_extract_gzip_cpio(c, d, pos)) goto done;
+		}
 		ext = "cpio.gz";
 	}
 	else if(buf[0]==0x42 && buf[1]==0x5a && buf[2]==0x68) {
@@ -311,6 +311,7 @@ static void do_decompress_fork(deark *c, lctx *d, struct member_data *md,
 	}
 
 	outf = dbuf_create_output_file(c, NULL, fi, 0x0);
+	if(dbuf_is_discarded(outf)) goto done;
 
 	outf->writecallback_fn = our_writecallback;
 	outf->userdata = (void*)d->crco;
@@ -456,6 +457,7 @@ static void do_sequence_of_members(deark *c, lctx *d, i64 pos1)
 
 		if((d->subdir_level==0) && (root_member_count >= d->nmembers)) break;
 		if(pos >= c->infile->len) break;
+		if(de_output_file_limit_reached(c)) break;
 
 		is_root_member = (d->subdir_level==0);
 		ret = do_member(c, d, pos, &bytes_consumed);
@@ -243,15 +243,17 @@ static void de_run_tar(deark *c, de_module_params *mparams)
 
 	d = de_malloc(c, sizeof(lctx));
 
-	pos = 0;
+	pos = de_index_find_start(c, 0);
 	while(1) {
 		if(d->found_trailer) break;
 		if(pos >= c->infile->len) break;
+		if(de_output_file_limit_reached(c)) break;
 		if(pos+512 > c->infile->len) {
 			de_warn(c, "Ignoring %d extra bytes at end of file", (int)(c->infile->len - pos));
 			break;
 		}
 
+		de_index_member(c, pos);
 		ret = read_member(c, d, pos, &item_len);
 		if(!ret || item_len<1) break;
 		pos += item_len;
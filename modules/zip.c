@@ -764,6 +764,7 @@ static void do_extract_file(deark *c, lctx *d, struct member_data *md)
 	}
 
 	outf = dbuf_create_output_file(c, NULL, fi, 0);
+	if(dbuf_is_discarded(outf)) goto done;
 	outf->writecallback_fn = our_writecallback;
 	outf->userdata = (void*)md;
 
@@ -1223,6 +1224,7 @@ static int do_central_dir(deark *c, lctx *d)
 	}
 
 	for(i=0; i<d->central_dir_num_entries; i++) {
+		if(de_output_file_limit_reached(c)) break;
 		if(!do_central_dir_entry(c, d, i, pos, &entry_size)) {
 			// TODO: Decide exactly what to do if something fails.
 			goto done;
@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Measures the speed of each CRC type that Deark supports, by running the
+# "crc" module on a large file.
+# Usage: scripts/bench-crc.sh [<file>]
+# If no file is given, a 256MB file of random data is used.
+
+if [ ! -f formats.txt ]
+then
+	echo "Run this script from the main directory"
+	exit 1
+fi
+
+DEARK=${DEARK:-./deark}
+REPS=${REPS:-3}
+T=$(mktemp -d)
+
+if [ $# -ge 1 ]
+then
+	F="$1"
+else
+	F="$T/data.bin"
+	head -c 268435456 /dev/urandom > "$F"
+fi
+
+# Read the file once, so that it's cached.
+cat "$F" > /dev/null
+
+for CRCTYPE in crc32 crc16arc crc16ccitt
+do
+	TIMEFORMAT="$CRCTYPE: %R seconds"
+	time for (( i=0; i<REPS; i++ ))
+	do
+		$DEARK -q -m crc -opt crc:type=$CRCTYPE "$F" > /dev/null
+	done
+done
+
+rm -f "$T/data.bin"
+rmdir "$T"
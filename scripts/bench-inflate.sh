@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Compares the speed of Deark's Deflate decompressor with the miniz-based one
+# ("-opt inflate:engine=miniz"), by fully extracting some files with each.
+# Usage: scripts/bench-inflate.sh <file...>
+# Useful test files include .gz, .zip, and .png files.
+
+if [ ! -f formats.txt ]
+then
+	echo "Run this script from the main directory"
+	exit 1
+fi
+
+if [ $# -lt 1 ]
+then
+	echo "Usage: $0 <file...>"
+	exit 1
+fi
+
+DEARK=${DEARK:-./deark}
+REPS=${REPS:-3}
+T=$(mktemp -d)
+
+for ENGINE in fast miniz
+do
+	TIMEFORMAT="$ENGINE: %R seconds"
+	time for (( i=0; i<REPS; i++ ))
+	do
+		for F in "$@"
+		do
+			$DEARK -q -opt inflate:engine=$ENGINE -o "$T/x" "$F"
+			rm -f "$T"/x.*
+		done
+	done
+done
+
+rmdir "$T"
@@ -0,0 +1,69 @@
+#!/usr/bin/perl
+
+# Prints the CRC lookup tables used by src/deark-crc.c, in C syntax.
+# Usage: perl scripts/mkcrctables.pl
+# Table k, entry b, is the CRC register contents after processing byte b,
+# followed by k zero bytes, starting from a register of 0.
+
+use strict;
+use warnings;
+
+# Reflected (LSB-first) CRC
+sub make_reflected {
+	my ($poly) = @_;
+	my @tbl;
+	for my $i (0..255) {
+		my $r = $i;
+		for (1..8) {
+			$r = ($r & 1) ? (($r >> 1) ^ $poly) : ($r >> 1);
+		}
+		$tbl[0][$i] = $r;
+	}
+	for my $k (1..7) {
+		for my $i (0..255) {
+			my $r = $tbl[$k-1][$i];
+			$tbl[$k][$i] = ($r >> 8) ^ $tbl[0][$r & 0xff];
+		}
+	}
+	return @tbl;
+}
+
+# Non-reflected (MSB-first) 16-bit CRC
+sub make_msbfirst16 {
+	my ($poly) = @_;
+	my @tbl;
+	for my $i (0..255) {
+		my $r = $i << 8;
+		for (1..8) {
+			$r = ($r & 0x8000) ? ((($r << 1) ^ $poly) & 0xffff) : (($r << 1) & 0xffff);
+		}
+		$tbl[0][$i] = $r;
+	}
+	for my $k (1..7) {
+		for my $i (0..255) {
+			my $r = $tbl[$k-1][$i];
+			$tbl[$k][$i] = (($r << 8) & 0xffff) ^ $tbl[0][$r >> 8];
+		}
+	}
+	return @tbl;
+}
+
+sub print_table {
+	my ($name, $type, $digits, $perline, @tbl) = @_;
+	print "static const $type ${name}[8][256] = {\n";
+	for my $k (0..7) {
+		print "\t{\n";
+		for (my $i=0; $i<256; $i+=$perline) {
+			my @items = map { sprintf("0x%0${digits}x", $tbl[$k][$_]) } ($i..$i+$perline-1);
+			print "\t\t", join(", ", @items), ($i+$perline<256 ? ",\n" : "\n");
+		}
+		print "\t}", ($k<7 ? ",\n" : "\n");
+	}
+	print "};\n";
+}
+
+print_table("crc32_ieee_table", "u32", 8, 8, make_reflected(0xedb88320));
+print "\n";
+print_table("crc16arc_table", "u16", 4, 8, make_reflected(0xa001));
+print "\n";
+print_table("crc16ccitt_table", "u16", 4, 8, make_msbfirst16(0x1021));
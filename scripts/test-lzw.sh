@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# Regression tests for the LZW decoder in deark-fmtutil.c, using small
+# handmade GIF files.
+# Usage: scripts/test-lzw.sh
+# Exits with a nonzero status if any test fails.
+
+if [ ! -f formats.txt ]
+then
+	echo "Run this script from the main directory"
+	exit 1
+fi
+
+DEARK=${DEARK:-./deark}
+T=$(mktemp -d)
+FAILED=0
+
+# Write a 4x2 GIF with a 4-color palette, whose LZW data (root code size 2,
+# so clear=4, EOI=5, and the first new code is 6) is the given bytes.
+make_gif() {
+	printf 'GIF89a\x04\x00\x02\x00\x81\x00\x00' > "$1"
+	printf '\x00\x00\x00\xff\xff\xff\xff\x00\x00\x00\xff\x00' >> "$1"
+	printf '\x2c\x00\x00\x00\x00\x04\x00\x02\x00\x00\x02\x03' >> "$1"
+	printf "$2" >> "$1"
+	printf '\x00\x3b' >> "$1"
+}
+
+# $1 = test name, $2 = LZW data, $3 = 1 if decoding should fail
+run_test() {
+	make_gif "$T/t.gif" "$2"
+	if $DEARK -q -o "$T/x" "$T/t.gif" 2>&1 | grep -q "GIF decoding error"
+	then
+		RESULT=1
+	else
+		RESULT=0
+	fi
+	rm -f "$T"/x.*
+	if [ $RESULT != $3 ]
+	then
+		echo "FAILED: $1"
+		FAILED=1
+	fi
+}
+
+# Codes: clear, 0, 0, 6, clear (4 bits), 0, EOI
+run_test "valid data with a clear code" '\x04\x4c\x28' 0
+
+# Codes: clear, 0, 0, 6, clear (4 bits), 6, EOI
+# Code 6 was defined before the clear code, so it's invalid after it.
+run_test "stale code after a clear code" '\x04\x4c\x2e' 1
+
+rm -f "$T/t.gif"
+rmdir "$T"
+if [ $FAILED = 0 ]
+then
+	echo "All tests passed"
+fi
+exit $FAILED
@@ -10,6 +10,18 @@
 #include "deark-config.h"
 #include "deark-private.h"
 
+#ifndef DE_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#define DE_BITMAP_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#define DE_BITMAP_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+static void bitmap_make_direct(de_bitmap *img);
+
 int de_good_image_dimensions_noerr(deark *c, i64 w, i64 h)
 {
 	if(w<1 || h<1 || w>c->max_image_dimension || h>c->max_image_dimension) {
@@ -63,6 +75,22 @@ int de_is_grayscale_palette(const u32 *pal, i64 num_entries)
 	return 1;
 }
 
+// Returns the color that de_bitmap_getpixel() would return after clr is
+// stored in an image with the given bytes per pixel.
+static u32 color_as_stored(int bypp, u32 clr)
+{
+	switch(bypp) {
+	case 3:
+		return DE_MAKE_OPAQUE(clr);
+	case 2:
+		return DE_MAKE_RGBA(DE_COLOR_G(clr), DE_COLOR_G(clr), DE_COLOR_G(clr),
+			DE_COLOR_A(clr));
+	case 1:
+		return DE_MAKE_GRAY(DE_COLOR_G(clr));
+	}
+	return clr;
+}
+
 static void de_bitmap_alloc_pixels(de_bitmap *img)
 {
 	if(img->bitmap) {
@@ -79,7 +107,15 @@ static void de_bitmap_alloc_pixels(de_bitmap *img)
 		img->height = 1;
 	}
 
-	img->bitmap_size = (img->width*img->bytes_per_pixel) * img->height;
+	if(img->is_indexed) {
+		// Rows are padded to a multiple of 8 pixels, so that they can be
+		// unpacked a byte at a time.
+		img->idx_rowspan = ((img->width+7)/8) * img->idx_bitdepth;
+		img->bitmap_size = img->idx_rowspan * img->height;
+	}
+	else {
+		img->bitmap_size = (img->width*img->bytes_per_pixel) * img->height;
+	}
 	img->bitmap = de_malloc(img->c, img->bitmap_size);
 }
 
@@ -89,12 +125,77 @@ struct image_scan_results {
 	int has_visible_pixels;
 };
 
+static void scan_color(de_bitmap *img, u32 clr, struct image_scan_results *isres)
+{
+	u8 a, r, g, b;
+
+	// TODO: Optimize these tests. We check for too many things we
+	// already know the answer to.
+	a = DE_COLOR_A(clr);
+	r = DE_COLOR_R(clr);
+	g = DE_COLOR_G(clr);
+	b = DE_COLOR_B(clr);
+	if(!isres->has_visible_pixels && a!=0) {
+		isres->has_visible_pixels = 1;
+	}
+	if(!isres->has_trns && a<255) {
+		isres->has_trns = 1;
+	}
+	if(!isres->has_color && img->bytes_per_pixel>=3 &&
+		((g!=r || b!=r) && a!=0) )
+	{
+		isres->has_color = 1;
+	}
+}
+
+// For indexed images, find which palette entries are used, and scan only
+// those colors.
+static void scan_indexed_image(de_bitmap *img, struct image_scan_results *isres)
+{
+	u8 byte_used[256];
+	u8 idx_used[256];
+	i64 full_bytes_per_row;
+	i64 i, j;
+	int bd = img->idx_bitdepth;
+	unsigned int k;
+
+	de_zeromem(byte_used, sizeof(byte_used));
+	de_zeromem(idx_used, sizeof(idx_used));
+	full_bytes_per_row = (img->width*bd)/8;
+
+	for(j=0; j<img->height; j++) {
+		const u8 *row = &img->bitmap[img->idx_rowspan*j];
+
+		for(i=0; i<full_bytes_per_row; i++) {
+			byte_used[row[i]] = 1;
+		}
+		// Any remaining pixels are in a partial byte, which also contains
+		// padding that we must not count.
+		for(i=full_bytes_per_row*8/bd; i<img->width; i++) {
+			idx_used[(row[(i*bd)/8] >> (8-bd-(i*bd)%8)) & ((1U<<bd)-1)] = 1;
+		}
+	}
+
+	for(k=0; k<256; k++) {
+		int n;
+
+		if(!byte_used[k]) continue;
+		for(n=0; n<8; n+=bd) {
+			idx_used[(k >> (8-bd-n)) & ((1U<<bd)-1)] = 1;
+		}
+	}
+
+	for(k=0; k<256; k++) {
+		if(idx_used[k]) {
+			scan_color(img, color_as_stored(img->bytes_per_pixel, img->pal[k]), isres);
+		}
+	}
+}
+
 // Scan the image's pixels, and report whether any are transparent, etc.
 static void scan_image(de_bitmap *img, struct image_scan_results *isres)
 {
 	i64 i, j;
-	u32 clr;
-	u8 a, r, g, b;
 
 	de_zeromem(isres, sizeof(struct image_scan_results));
 	if(img->bytes_per_pixel==1) {
@@ -102,26 +203,13 @@ static void scan_image(de_bitmap *img, struct image_scan_results *isres)
 		isres->has_visible_pixels = 1;
 		return;
 	}
+	if(img->is_indexed && img->bitmap) {
+		scan_indexed_image(img, isres);
+		return;
+	}
 	for(j=0; j<img->height; j++) {
 		for(i=0; i<img->width; i++) {
-			clr = de_bitmap_getpixel(img, i, j);
-			// TODO: Optimize these tests. We check for too many things we
-			// already know the answer to.
-			a = DE_COLOR_A(clr);
-			r = DE_COLOR_R(clr);
-			g = DE_COLOR_G(clr);
-			b = DE_COLOR_B(clr);
-			if(!isres->has_visible_pixels && a!=0) {
-				isres->has_visible_pixels = 1;
-			}
-			if(!isres->has_trns && a<255) {
-				isres->has_trns = 1;
-			}
-			if(!isres->has_color && img->bytes_per_pixel>=3 &&
-				((g!=r || b!=r) && a!=0) )
-			{
-				isres->has_color = 1;
-			}
+			scan_color(img, de_bitmap_getpixel(img, i, j), isres);
 		}
 
 		// After each row, test whether we've learned everything we can learn
@@ -145,6 +233,9 @@ static de_bitmap *de_bitmap_clone_noalloc(de_bitmap *img1)
 	de_memcpy(img2, img1, sizeof(de_bitmap));
 	img2->bitmap = 0;
 	img2->bitmap_size = 0;
+	img2->is_indexed = 0;
+	img2->idx_bitdepth = 0;
+	img2->pal = NULL;
 	return img2;
 }
 
@@ -165,6 +256,22 @@ static de_bitmap *get_optimized_image(de_bitmap *img1)
 
 	optimg = de_bitmap_clone_noalloc(img1);
 	optimg->bytes_per_pixel = opt_bytes_per_pixel;
+
+	if(img1->is_indexed && img1->bitmap) {
+		// Keep the image indexed. Only the palette has to be converted.
+		i64 k;
+
+		optimg->is_indexed = 1;
+		optimg->idx_bitdepth = img1->idx_bitdepth;
+		optimg->pal = de_mallocarray(img1->c, 256, sizeof(u32));
+		for(k=0; k<256; k++) {
+			optimg->pal[k] = color_as_stored(img1->bytes_per_pixel, img1->pal[k]);
+		}
+		de_bitmap_alloc_pixels(optimg);
+		de_memcpy(optimg->bitmap, img1->bitmap, (size_t)img1->bitmap_size);
+		return optimg;
+	}
+
 	de_bitmap_copy_rect(img1, optimg, 0, 0, img1->width, img1->height, 0, 0, 0);
 	return optimg;
 }
@@ -182,6 +289,12 @@ void de_bitmap_write_to_file_finfo(de_bitmap *img, de_finfo *fi,
 	c = img->c;
 	if(img->invalid_image_flag) return;
 
+	f = dbuf_create_output_file(c, "png", fi, createflags|DE_CREATEFLAG_NORECURSE);
+	if(dbuf_is_discarded(f)) {
+		// Don't waste time generating a PNG file that won't be written.
+		goto done;
+	}
+
 	if(!img->bitmap) de_bitmap_alloc_pixels(img);
 
 	if(createflags & DE_CREATEFLAG_OPT_IMAGE) {
@@ -194,15 +307,15 @@ void de_bitmap_write_to_file_finfo(de_bitmap *img, de_finfo *fi,
 		}
 	}
 
-	f = dbuf_create_output_file(c, "png", fi, createflags);
 	if(optimg) {
 		de_write_png(c, optimg, f);
 	}
 	else {
 		de_write_png(c, img, f);
 	}
-	dbuf_close(f);
 
+done:
+	dbuf_close(f);
 	if(optimg) de_bitmap_destroy(optimg);
 }
 
@@ -230,6 +343,7 @@ void de_bitmap_setsample(de_bitmap *img, i64 x, i64 y,
 {
 	i64 pos;
 
+	if(img->is_indexed) bitmap_make_direct(img);
 	if(!img->bitmap) de_bitmap_alloc_pixels(img);
 	if(x<0 || y<0 || x>=img->width || y>=img->height) return;
 	if(samplenum<0 || samplenum>3) return;
@@ -264,6 +378,7 @@ void de_bitmap_setpixel_gray(de_bitmap *img, i64 x, i64 y, u8 v)
 {
 	i64 pos;
 
+	if(img->is_indexed) bitmap_make_direct(img);
 	if(!img->bitmap) de_bitmap_alloc_pixels(img);
 	if(x<0 || y<0 || x>=img->width || y>=img->height) return;
 	pos = (img->width*img->bytes_per_pixel)*y + img->bytes_per_pixel*x;
@@ -298,6 +413,7 @@ void de_bitmap_setpixel_rgba(de_bitmap *img, i64 x, i64 y,
 {
 	i64 pos;
 
+	if(img->is_indexed) bitmap_make_direct(img);
 	if(!img->bitmap) de_bitmap_alloc_pixels(img);
 	if(x<0 || y<0 || x>=img->width || y>=img->height) return;
 	pos = (img->width*img->bytes_per_pixel)*y + img->bytes_per_pixel*x;
@@ -327,13 +443,127 @@ void de_bitmap_setpixel_rgba(de_bitmap *img, i64 x, i64 y,
 	}
 }
 
+// Look up npixels palette indices, and write them to dst as RGBA pixels.
+// Returns the number of pixels done, which may be less than npixels. The
+// caller does the rest.
+// There's no gather instruction in SSE2 or NEON, so the palette entries are
+// loaded one at a time. But converting them from DE_COLOR order to RGBA byte
+// order, and storing them, is done 4 pixels at a time.
+static i64 setrow_paletted_rgba_simd(u8 *dst, const u8 *src, i64 npixels,
+	const u32 *pal)
+{
+	i64 i = 0;
+
+#if defined(DE_BITMAP_SSE2)
+	{
+		const __m128i mask_rb = _mm_set1_epi32(0x00ff00ff);
+		const __m128i mask_ga = _mm_set1_epi32((int)0xff00ff00U);
+
+		for(; i+4<=npixels; i+=4) {
+			__m128i v, rb;
+
+			v = _mm_setr_epi32((int)pal[src[i]], (int)pal[src[i+1]],
+				(int)pal[src[i+2]], (int)pal[src[i+3]]);
+			// 0xAARRGGBB -> 0xAABBGGRR, which is R,G,B,A in memory.
+			rb = _mm_and_si128(v, mask_rb);
+			rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+			v = _mm_or_si128(_mm_and_si128(v, mask_ga), rb);
+			_mm_storeu_si128((__m128i*)&dst[i*4], v);
+		}
+	}
+#elif defined(DE_BITMAP_NEON) && !defined(__ARM_BIG_ENDIAN)
+	{
+		const uint32x4_t mask_rb = vdupq_n_u32(0x00ff00ffU);
+		const uint32x4_t mask_ga = vdupq_n_u32(0xff00ff00U);
+
+		for(; i+4<=npixels; i+=4) {
+			u32 tmp[4];
+			uint32x4_t v, rb;
+
+			tmp[0] = pal[src[i]];
+			tmp[1] = pal[src[i+1]];
+			tmp[2] = pal[src[i+2]];
+			tmp[3] = pal[src[i+3]];
+			v = vld1q_u32(tmp);
+			rb = vandq_u32(v, mask_rb);
+			rb = vorrq_u32(vshlq_n_u32(rb, 16), vshrq_n_u32(rb, 16));
+			v = vorrq_u32(vandq_u32(v, mask_ga), rb);
+			vst1q_u8(&dst[i*4], vreinterpretq_u8_u32(v));
+		}
+	}
+#endif
+
+	return i;
+}
+
+// Set the first npixels pixels of row y, from 8-bit palette indices.
+// pal must have 256 entries.
+void de_bitmap_setrow_paletted(de_bitmap *img, i64 y, const u8 *src,
+	i64 npixels, const u32 *pal)
+{
+	u8 *dst;
+	i64 i;
+
+	if(img->is_indexed) bitmap_make_direct(img);
+	if(!img->bitmap) de_bitmap_alloc_pixels(img);
+	if(y<0 || y>=img->height) return;
+	if(npixels > img->width) npixels = img->width;
+	dst = &img->bitmap[(img->width*img->bytes_per_pixel)*y];
+
+	switch(img->bytes_per_pixel) {
+	case 4:
+		i = setrow_paletted_rgba_simd(dst, src, npixels, pal);
+		dst += i*4;
+		for(; i<npixels; i++) {
+			u32 clr = pal[src[i]];
+			dst[0] = DE_COLOR_R(clr);
+			dst[1] = DE_COLOR_G(clr);
+			dst[2] = DE_COLOR_B(clr);
+			dst[3] = DE_COLOR_A(clr);
+			dst += 4;
+		}
+		break;
+	case 3:
+		for(i=0; i<npixels; i++) {
+			u32 clr = pal[src[i]];
+			dst[0] = DE_COLOR_R(clr);
+			dst[1] = DE_COLOR_G(clr);
+			dst[2] = DE_COLOR_B(clr);
+			dst += 3;
+		}
+		break;
+	case 2:
+		for(i=0; i<npixels; i++) {
+			u32 clr = pal[src[i]];
+			dst[0] = DE_COLOR_G(clr);
+			dst[1] = DE_COLOR_A(clr);
+			dst += 2;
+		}
+		break;
+	case 1:
+		for(i=0; i<npixels; i++) {
+			dst[i] = DE_COLOR_G(pal[src[i]]);
+		}
+		break;
+	}
+}
+
 u32 de_bitmap_getpixel(de_bitmap *img, i64 x, i64 y)
 {
 	i64 pos;
 
 	if(!img) return 0;
-	if(!img->bitmap) return 0;
 	if(x<0 || y<0 || x>=img->width || y>=img->height) return 0;
+	if(!img->bitmap) {
+		// An indexed image's pixels are all index 0.
+		return img->is_indexed ? color_as_stored(img->bytes_per_pixel, img->pal[0]) : 0;
+	}
+	if(img->is_indexed) {
+		pos = img->idx_rowspan*y + (x*img->idx_bitdepth)/8;
+		return color_as_stored(img->bytes_per_pixel,
+			img->pal[(img->bitmap[pos] >> (8-img->idx_bitdepth-(x*img->idx_bitdepth)%8)) &
+			((1U<<img->idx_bitdepth)-1)]);
+	}
 	pos = (img->width*img->bytes_per_pixel)*y + img->bytes_per_pixel*x;
 
 	switch(img->bytes_per_pixel) {
@@ -375,11 +605,52 @@ de_bitmap *de_bitmap_create(deark *c, i64 width, i64 height, int bypp)
 	return img;
 }
 
+// Create an image that stores palette indices of bitdepth (1, 2, 4, or 8)
+// bits, instead of colors. This uses much less memory, if the image can
+// stay in this form until it is written.
+// bypp is the bytes per pixel the image has if it needs to be converted to
+// the normal form, and when it is written.
+// pal has num_entries entries; the rest of the 256-entry palette is set
+// to 0.
+de_bitmap *de_bitmap_create_indexed(deark *c, i64 width, i64 height, int bypp,
+	int bitdepth, const u32 *pal, i64 num_entries)
+{
+	de_bitmap *img;
+
+	img = de_bitmap_create(c, width, height, bypp);
+	img->pal = de_mallocarray(c, 256, sizeof(u32));
+	if(num_entries>256) num_entries = 256;
+	if(num_entries>0) {
+		de_memcpy(img->pal, pal, (size_t)num_entries*sizeof(u32));
+	}
+	if(bitdepth!=1 && bitdepth!=2 && bitdepth!=4 && bitdepth!=8) {
+		bitdepth = 8;
+	}
+	img->idx_bitdepth = bitdepth;
+	img->is_indexed = 1;
+	return img;
+}
+
+// A 1-bit grayscale image, in which index 0 is black, and 1 is white.
+de_bitmap *de_bitmap_create_bilevel(deark *c, i64 width, i64 height)
+{
+	static const u32 bwpal[2] = { DE_STOCKCOLOR_BLACK, DE_STOCKCOLOR_WHITE };
+
+	return de_bitmap_create_indexed(c, width, height, 1, 1, bwpal, 2);
+}
+
+static int is_bilevel_image(de_bitmap *img)
+{
+	return img->is_indexed && img->idx_bitdepth==1 &&
+		img->pal[0]==DE_STOCKCOLOR_BLACK && img->pal[1]==DE_STOCKCOLOR_WHITE;
+}
+
 void de_bitmap_destroy(de_bitmap *b)
 {
 	if(b) {
 		deark *c = b->c;
 		if(b->bitmap) de_free(c, b->bitmap);
+		if(b->pal) de_free(c, b->pal);
 		de_free(c, b);
 	}
 }
@@ -474,28 +745,333 @@ u8 de_get_bits_symbol2(dbuf *f, int nbits, i64 bytepos, i64 bitpos)
 	return (b0<<bits_in_second_byte) | (b1>>(8-bits_in_second_byte));
 }
 
-void de_convert_row_bilevel(dbuf *f, i64 fpos, de_bitmap *img,
-	i64 rownum, unsigned int flags)
+// Row conversion kernels.
+// de_convert_row_bilevel() and de_convert_image_paletted() read each row
+// (or a chunk of it) with one dbuf_read(), unpack it with these functions,
+// and write whole runs of pixels to the bitmap, instead of calling
+// de_get_bits_symbol() and de_bitmap_setpixel_*() for every pixel.
+
+// Expand npixels 1-bit samples from src to one byte each: 0xff if the bit
+// is set, otherwise 0x00. If invert is set, the other way around.
+// Bits are in MSB-first order, unless lsbfirst is set.
+// npixels must be a multiple of 8.
+static void unpack_row_bilevel(const u8 *src, i64 npixels, int lsbfirst,
+	int invert, u8 *dst)
+{
+	i64 i = 0;
+	u8 xorval = invert ? 0xff : 0x00;
+
+#if defined(DE_BITMAP_SSE2)
+	{
+		const __m128i bits_msb = _mm_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1,
+			-128, 64, 32, 16, 8, 4, 2, 1);
+		const __m128i bits_lsb = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+			1, 2, 4, 8, 16, 32, 64, -128);
+		const __m128i bits = lsbfirst ? bits_lsb : bits_msb;
+		const __m128i xorv = _mm_set1_epi8((char)xorval);
+
+		// Each iteration turns 2 bytes into 16.
+		for(; i+16<=npixels; i+=16) {
+			__m128i v;
+
+			v = _mm_cvtsi32_si128((int)src[i/8] | ((int)src[i/8+1]<<8));
+			v = _mm_unpacklo_epi8(v, v);
+			v = _mm_unpacklo_epi16(v, v);
+			v = _mm_unpacklo_epi32(v, v);
+			v = _mm_cmpeq_epi8(_mm_and_si128(v, bits), bits);
+			_mm_storeu_si128((__m128i*)&dst[i], _mm_xor_si128(v, xorv));
+		}
+	}
+#elif defined(DE_BITMAP_NEON)
+	{
+		static const u8 bits_msb[16] = { 128, 64, 32, 16, 8, 4, 2, 1,
+			128, 64, 32, 16, 8, 4, 2, 1 };
+		static const u8 bits_lsb[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+			1, 2, 4, 8, 16, 32, 64, 128 };
+		const uint8x16_t bits = vld1q_u8(lsbfirst ? bits_lsb : bits_msb);
+		const uint8x16_t xorv = vdupq_n_u8(xorval);
+
+		for(; i+16<=npixels; i+=16) {
+			uint8x16_t v;
+
+			v = vcombine_u8(vdup_n_u8(src[i/8]), vdup_n_u8(src[i/8+1]));
+			v = vtstq_u8(v, bits);
+			vst1q_u8(&dst[i], veorq_u8(v, xorv));
+		}
+	}
+#endif
+
+	for(; i<npixels; i+=8) {
+		unsigned int b = src[i/8];
+		int k;
+
+		for(k=0; k<8; k++) {
+			unsigned int bit = lsbfirst ? ((b>>k) & 1) : ((b>>(7-k)) & 1);
+			dst[i+k] = (u8)(bit ? 0xff : 0x00) ^ xorval;
+		}
+	}
+}
+
+// Unpack npixels samples of bpp (1, 2, 4, or 8) bits each, MSB-first, from
+// src to one byte each. npixels must be a multiple of 8.
+static void unpack_row_samples(const u8 *src, i64 bpp, i64 npixels, u8 *dst)
 {
 	i64 i;
-	u8 x;
-	u8 b;
-	u8 black, white;
 
+	switch(bpp) {
+	case 1:
+		for(i=0; i<npixels; i+=8) {
+			unsigned int b = src[i/8];
+			dst[i]   = (u8)(b>>7);
+			dst[i+1] = (u8)((b>>6)&1);
+			dst[i+2] = (u8)((b>>5)&1);
+			dst[i+3] = (u8)((b>>4)&1);
+			dst[i+4] = (u8)((b>>3)&1);
+			dst[i+5] = (u8)((b>>2)&1);
+			dst[i+6] = (u8)((b>>1)&1);
+			dst[i+7] = (u8)(b&1);
+		}
+		break;
+	case 2:
+		for(i=0; i<npixels; i+=4) {
+			unsigned int b = src[i/4];
+			dst[i]   = (u8)(b>>6);
+			dst[i+1] = (u8)((b>>4)&3);
+			dst[i+2] = (u8)((b>>2)&3);
+			dst[i+3] = (u8)(b&3);
+		}
+		break;
+	case 4:
+		for(i=0; i<npixels; i+=2) {
+			unsigned int b = src[i/2];
+			dst[i]   = (u8)(b>>4);
+			dst[i+1] = (u8)(b&0x0f);
+		}
+		break;
+	case 8:
+		de_memcpy(dst, src, (size_t)npixels);
+		break;
+	}
+}
+
+// Convert a palette to a table of pixel values in the bitmap's byte order
+// (see de_bitmap_setpixel_rgba()), 4 bytes per entry.
+static void make_pixel_lut(int bypp, const u32 *pal, i64 num_entries, u8 *lut)
+{
+	i64 k;
+
+	for(k=0; k<num_entries; k++) {
+		u32 clr = pal[k];
+		u8 *ent = &lut[k*4];
+
+		switch(bypp) {
+		case 4: case 3:
+			ent[0] = DE_COLOR_R(clr);
+			ent[1] = DE_COLOR_G(clr);
+			ent[2] = DE_COLOR_B(clr);
+			ent[3] = DE_COLOR_A(clr);
+			break;
+		case 2:
+			ent[0] = DE_COLOR_G(clr);
+			ent[1] = DE_COLOR_A(clr);
+			break;
+		case 1:
+			ent[0] = DE_COLOR_G(clr);
+			break;
+		}
+	}
+}
+
+// Write npixels pixels to dst, by looking up each index in lut.
+static void write_pixels_lut(u8 *dst, const u8 *idx, i64 npixels, int bypp,
+	const u8 *lut)
+{
+	i64 i;
+
+	switch(bypp) {
+	case 4:
+		for(i=0; i<npixels; i++) {
+			de_memcpy(&dst[i*4], &lut[(size_t)idx[i]*4], 4);
+		}
+		break;
+	case 3:
+		for(i=0; i<npixels; i++) {
+			const u8 *ent = &lut[(size_t)idx[i]*4];
+			dst[i*3] = ent[0];
+			dst[i*3+1] = ent[1];
+			dst[i*3+2] = ent[2];
+		}
+		break;
+	case 2:
+		for(i=0; i<npixels; i++) {
+			de_memcpy(&dst[i*2], &lut[(size_t)idx[i]*4], 2);
+		}
+		break;
+	case 1:
+		for(i=0; i<npixels; i++) {
+			dst[i] = lut[(size_t)idx[i]*4];
+		}
+		break;
+	}
+}
+
+// Number of pixels the row functions process at a time
+#define DE_ROWCHUNK_PIXELS 1024
+
+// Write n pixels of row y of an indexed image, starting at x0, to dst, in
+// the normal form. lut is from make_pixel_lut(), for the image's palette.
+static void expand_indexed_pixels(de_bitmap *img, i64 y, i64 x0, i64 n, u8 *dst,
+	const u8 *lut)
+{
+	u8 idxbuf[DE_ROWCHUNK_PIXELS];
+	const u8 *row = &img->bitmap[img->idx_rowspan*y];
+	int bd = img->idx_bitdepth;
+	i64 i = 0;
+
+	while(i<n) {
+		i64 pos = x0+i;
+		// Start unpacking at a multiple of 8 pixels. (The rows are padded,
+		// so this never reads past the end of the row.)
+		i64 a = pos%8;
+		i64 m = de_min_int(n-i, DE_ROWCHUNK_PIXELS-8);
+
+		unpack_row_samples(&row[((pos-a)*bd)/8], bd, (a+m+7) & ~(i64)7, idxbuf);
+		write_pixels_lut(&dst[i*img->bytes_per_pixel], &idxbuf[a], m,
+			img->bytes_per_pixel, lut);
+		i += m;
+	}
+}
+
+// Convert an indexed image to the normal form.
+static void bitmap_make_direct(de_bitmap *img)
+{
+	u8 lut[256*4];
+	u8 *newbitmap;
+	i64 rowspan;
+	i64 j;
+
+	if(!img->is_indexed) return;
+	if(!img->bitmap) de_bitmap_alloc_pixels(img);
+
+	make_pixel_lut(img->bytes_per_pixel, img->pal, (i64)1<<img->idx_bitdepth, lut);
+	rowspan = img->width*img->bytes_per_pixel;
+	newbitmap = de_malloc(img->c, rowspan*img->height);
+	for(j=0; j<img->height; j++) {
+		expand_indexed_pixels(img, j, 0, img->width, &newbitmap[rowspan*j], lut);
+	}
+
+	de_free(img->c, img->bitmap);
+	img->bitmap = newbitmap;
+	img->bitmap_size = rowspan*img->height;
+	img->is_indexed = 0;
+}
+
+// Returns a pointer to row y of img, in the normal form (bytes_per_pixel
+// bytes per pixel). For indexed images, the row is converted into rowbuf,
+// which must have room for width*bytes_per_pixel bytes, and rowbuf is
+// returned. The caller must not modify the row.
+const u8 *de_bitmap_get_row(de_bitmap *img, i64 y, u8 *rowbuf)
+{
+	u8 lut[256*4];
+
+	if(!img->bitmap) de_bitmap_alloc_pixels(img);
+	if(y<0 || y>=img->height) {
+		de_zeromem(rowbuf, (size_t)(img->width*img->bytes_per_pixel));
+		return rowbuf;
+	}
+	if(!img->is_indexed) {
+		return &img->bitmap[(img->width*img->bytes_per_pixel)*y];
+	}
+
+	make_pixel_lut(img->bytes_per_pixel, img->pal, (i64)1<<img->idx_bitdepth, lut);
+	expand_indexed_pixels(img, y, 0, img->width, rowbuf, lut);
+	return rowbuf;
+}
+
+static u8 reverse_bits8(u8 b)
+{
+	b = (u8)(((b&0xf0)>>4) | ((b&0x0f)<<4));
+	b = (u8)(((b&0xcc)>>2) | ((b&0x33)<<2));
+	b = (u8)(((b&0xaa)>>1) | ((b&0x55)<<1));
+	return b;
+}
+
+// de_convert_row_bilevel() for an image from de_bitmap_create_bilevel():
+// The bits are stored as they are, except for flags.
+static void convert_row_bilevel_packed(dbuf *f, i64 fpos, de_bitmap *img,
+	i64 rownum, unsigned int flags)
+{
+	i64 nbytes;
+	i64 k;
+	u8 *dst;
+
+	if(!img->bitmap) de_bitmap_alloc_pixels(img);
+	if(rownum<0 || rownum>=img->height) return;
+	dst = &img->bitmap[img->idx_rowspan*rownum];
+	nbytes = (img->width+7)/8;
+
+	dbuf_read(f, dst, fpos, nbytes);
+	if(flags & DE_CVTF_LSBFIRST) {
+		for(k=0; k<nbytes; k++) {
+			dst[k] = reverse_bits8(dst[k]);
+		}
+	}
+	// Index 1 is white.
 	if(flags & DE_CVTF_WHITEISZERO) {
-		white = 0; black = 255;
+		for(k=0; k<nbytes; k++) {
+			dst[k] = ~dst[k];
+		}
 	}
-	else {
-		black = 0; white = 255;
+	if(img->width%8) {
+		dst[nbytes-1] &= (u8)(0xff << (8-img->width%8));
 	}
+}
 
-	for(i=0; i<img->width; i++) {
-		b = dbuf_getbyte(f, fpos + i/8);
-		if(flags & DE_CVTF_LSBFIRST)
-			x = (b >> (i%8)) & 0x01;
-		else
-			x = (b >> (7 - i%8)) & 0x01;
-		de_bitmap_setpixel_gray(img, i, rownum, x ? white : black);
+void de_convert_row_bilevel(dbuf *f, i64 fpos, de_bitmap *img,
+	i64 rownum, unsigned int flags)
+{
+	u8 srcbuf[DE_ROWCHUNK_PIXELS/8];
+	u8 graybuf[DE_ROWCHUNK_PIXELS];
+	u8 lut[2*4];
+	u32 pal[2];
+	u8 *dst;
+	i64 i;
+
+	if(img->is_indexed) {
+		if(is_bilevel_image(img)) {
+			convert_row_bilevel_packed(f, fpos, img, rownum, flags);
+			return;
+		}
+		bitmap_make_direct(img);
+	}
+	if(!img->bitmap) de_bitmap_alloc_pixels(img);
+	if(rownum<0 || rownum>=img->height) return;
+	dst = &img->bitmap[(img->width*img->bytes_per_pixel)*rownum];
+
+	pal[0] = DE_STOCKCOLOR_BLACK;
+	pal[1] = DE_STOCKCOLOR_WHITE;
+	make_pixel_lut(img->bytes_per_pixel, pal, 2, lut);
+
+	for(i=0; i<img->width; i+=DE_ROWCHUNK_PIXELS) {
+		i64 n = de_min_int(img->width - i, DE_ROWCHUNK_PIXELS);
+		i64 n_padded = (n+7) & ~(i64)7;
+		i64 k;
+
+		dbuf_read(f, srcbuf, fpos + i/8, n_padded/8);
+		unpack_row_bilevel(srcbuf, n_padded, (flags & DE_CVTF_LSBFIRST) ? 1 : 0,
+			(flags & DE_CVTF_WHITEISZERO) ? 1 : 0,
+			(img->bytes_per_pixel==1 && n==n_padded) ? &dst[i] : graybuf);
+
+		if(img->bytes_per_pixel==1) {
+			if(n!=n_padded) de_memcpy(&dst[i], graybuf, (size_t)n);
+			continue;
+		}
+		// Turn the 0x00/0xff values into palette indices
+		for(k=0; k<n; k++) {
+			graybuf[k] &= 1;
+		}
+		write_pixels_lut(&dst[i*img->bytes_per_pixel], graybuf, n,
+			img->bytes_per_pixel, lut);
 	}
 }
 
@@ -518,7 +1094,7 @@ void de_convert_and_write_image_bilevel(dbuf *f, i64 fpos,
 
 	if(!de_good_image_dimensions(c, width, height)) return;
 
-	img = de_bitmap_create(c, width, height, 1);
+	img = de_bitmap_create_bilevel(c, width, height);
 	de_convert_image_bilevel(f, fpos, rowspan, img, cvtflags);
 	de_bitmap_write_to_file_finfo(img, fi, createflags);
 	de_bitmap_destroy(img);
@@ -544,16 +1120,50 @@ void de_convert_image_paletted(dbuf *f, i64 fpos,
 	i64 bpp, i64 rowspan, const u32 *pal,
 	de_bitmap *img, unsigned int flags)
 {
+	u8 srcbuf[DE_ROWCHUNK_PIXELS];
+	u8 idxbuf[DE_ROWCHUNK_PIXELS];
+	u8 lut[256*4];
 	i64 i, j;
-	unsigned int palent;
 
 	if(bpp!=1 && bpp!=2 && bpp!=4 && bpp!=8) return;
 	if(!de_good_image_dimensions_noerr(f->c, img->width, img->height)) return;
 
+	if(img->is_indexed) {
+		if(img->idx_bitdepth==bpp &&
+			!de_memcmp(img->pal, pal, sizeof(u32)*((size_t)1<<bpp)))
+		{
+			// The image uses the same format and palette, so the indices
+			// can be stored as they are.
+			i64 nbytes = (img->width*bpp+7)/8;
+
+			if(!img->bitmap) de_bitmap_alloc_pixels(img);
+			for(j=0; j<img->height; j++) {
+				u8 *dst = &img->bitmap[img->idx_rowspan*j];
+
+				dbuf_read(f, dst, fpos+j*rowspan, nbytes);
+				if((img->width*bpp)%8) {
+					dst[nbytes-1] &= (u8)(0xff << (8-(img->width*bpp)%8));
+				}
+			}
+			return;
+		}
+		bitmap_make_direct(img);
+	}
+	if(!img->bitmap) de_bitmap_alloc_pixels(img);
+
+	make_pixel_lut(img->bytes_per_pixel, pal, (i64)1<<bpp, lut);
+
 	for(j=0; j<img->height; j++) {
-		for(i=0; i<img->width; i++) {
-			palent = (unsigned int)de_get_bits_symbol(f, bpp, fpos+j*rowspan, i);
-			de_bitmap_setpixel_rgba(img, i, j, pal[palent]);
+		u8 *dst = &img->bitmap[(img->width*img->bytes_per_pixel)*j];
+
+		for(i=0; i<img->width; i+=DE_ROWCHUNK_PIXELS) {
+			i64 n = de_min_int(img->width - i, DE_ROWCHUNK_PIXELS);
+			i64 n_padded = (n+7) & ~(i64)7;
+
+			dbuf_read(f, srcbuf, fpos + j*rowspan + (i*bpp)/8, (n_padded*bpp)/8);
+			unpack_row_samples(srcbuf, bpp, n_padded, idxbuf);
+			write_pixels_lut(&dst[i*img->bytes_per_pixel], idxbuf, n,
+				img->bytes_per_pixel, lut);
 		}
 	}
 }
@@ -564,21 +1174,206 @@ void de_bitmap_rect(de_bitmap *img,
 	i64 xpos, i64 ypos, i64 width, i64 height,
 	u32 clr, unsigned int flags)
 {
+	u8 ent[4];
+	i64 x0, x1, y0, y1;
 	i64 i, j;
+	i64 rowspan;
+	u8 *row0;
 
-	for(j=0; j<height; j++) {
-		for(i=0; i<width; i++) {
-			de_bitmap_setpixel_rgba(img, xpos+i, ypos+j, clr);
+	if(width<=0 || height<=0) return;
+	if(img->is_indexed) bitmap_make_direct(img);
+	if(!img->bitmap) de_bitmap_alloc_pixels(img);
+
+	x0 = de_max_int(xpos, 0);
+	x1 = de_min_int(xpos+width, img->width);
+	y0 = de_max_int(ypos, 0);
+	y1 = de_min_int(ypos+height, img->height);
+	if(x0>=x1 || y0>=y1) return;
+
+	// Construct the first row, then copy it to the other rows.
+	make_pixel_lut(img->bytes_per_pixel, &clr, 1, ent);
+	rowspan = img->width*img->bytes_per_pixel;
+	row0 = &img->bitmap[rowspan*y0 + img->bytes_per_pixel*x0];
+	for(i=0; i<x1-x0; i++) {
+		de_memcpy(&row0[i*img->bytes_per_pixel], ent, (size_t)img->bytes_per_pixel);
+	}
+	for(j=y0+1; j<y1; j++) {
+		de_memcpy(&row0[rowspan*(j-y0)], row0,
+			(size_t)((x1-x0)*img->bytes_per_pixel));
+	}
+}
+
+#ifdef DE_BITMAP_SSE2
+// Returns the number of pixels converted, which may be less than n.
+static i64 convert_pixels_sse2(const u8 *src, int src_bypp, u8 *dst,
+	int dst_bypp, i64 n)
+{
+	const __m128i ff = _mm_set1_epi8(-1);
+	const __m128i lo8_16 = _mm_set1_epi16(0x00ff);
+	const __m128i lo8_32 = _mm_set1_epi32(0x000000ff);
+	i64 i = 0;
+
+	switch(src_bypp*10 + dst_bypp) {
+	case 42: // RGBA -> GA
+		for(; i+8<=n; i+=8) {
+			__m128i v0 = _mm_loadu_si128((const __m128i*)&src[i*4]);
+			__m128i v1 = _mm_loadu_si128((const __m128i*)&src[i*4+16]);
+
+			// Move G to byte 0 and A to byte 1, and sign-extend to 32 bits
+			// so that packs_epi32 doesn't saturate.
+			v0 = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v0, 8), lo8_32),
+				_mm_slli_epi32(_mm_srli_epi32(v0, 24), 8));
+			v1 = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v1, 8), lo8_32),
+				_mm_slli_epi32(_mm_srli_epi32(v1, 24), 8));
+			v0 = _mm_srai_epi32(_mm_slli_epi32(v0, 16), 16);
+			v1 = _mm_srai_epi32(_mm_slli_epi32(v1, 16), 16);
+			_mm_storeu_si128((__m128i*)&dst[i*2], _mm_packs_epi32(v0, v1));
+		}
+		break;
+	case 41: // RGBA -> G
+		for(; i+16<=n; i+=16) {
+			__m128i v0 = _mm_loadu_si128((const __m128i*)&src[i*4]);
+			__m128i v1 = _mm_loadu_si128((const __m128i*)&src[i*4+16]);
+			__m128i v2 = _mm_loadu_si128((const __m128i*)&src[i*4+32]);
+			__m128i v3 = _mm_loadu_si128((const __m128i*)&src[i*4+48]);
+
+			v0 = _mm_and_si128(_mm_srli_epi32(v0, 8), lo8_32);
+			v1 = _mm_and_si128(_mm_srli_epi32(v1, 8), lo8_32);
+			v2 = _mm_and_si128(_mm_srli_epi32(v2, 8), lo8_32);
+			v3 = _mm_and_si128(_mm_srli_epi32(v3, 8), lo8_32);
+			_mm_storeu_si128((__m128i*)&dst[i], _mm_packus_epi16(
+				_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3)));
 		}
+		break;
+	case 21: // GA -> G
+		for(; i+16<=n; i+=16) {
+			__m128i v0 = _mm_loadu_si128((const __m128i*)&src[i*2]);
+			__m128i v1 = _mm_loadu_si128((const __m128i*)&src[i*2+16]);
+
+			_mm_storeu_si128((__m128i*)&dst[i], _mm_packus_epi16(
+				_mm_and_si128(v0, lo8_16), _mm_and_si128(v1, lo8_16)));
+		}
+		break;
+	case 12: // G -> GA
+		for(; i+16<=n; i+=16) {
+			__m128i g = _mm_loadu_si128((const __m128i*)&src[i]);
+
+			_mm_storeu_si128((__m128i*)&dst[i*2], _mm_unpacklo_epi8(g, ff));
+			_mm_storeu_si128((__m128i*)&dst[i*2+16], _mm_unpackhi_epi8(g, ff));
+		}
+		break;
+	case 14: // G -> RGBA
+		for(; i+16<=n; i+=16) {
+			__m128i g = _mm_loadu_si128((const __m128i*)&src[i]);
+			__m128i gg_lo = _mm_unpacklo_epi8(g, g);
+			__m128i gg_hi = _mm_unpackhi_epi8(g, g);
+			__m128i ga_lo = _mm_unpacklo_epi8(g, ff);
+			__m128i ga_hi = _mm_unpackhi_epi8(g, ff);
+
+			_mm_storeu_si128((__m128i*)&dst[i*4], _mm_unpacklo_epi16(gg_lo, ga_lo));
+			_mm_storeu_si128((__m128i*)&dst[i*4+16], _mm_unpackhi_epi16(gg_lo, ga_lo));
+			_mm_storeu_si128((__m128i*)&dst[i*4+32], _mm_unpacklo_epi16(gg_hi, ga_hi));
+			_mm_storeu_si128((__m128i*)&dst[i*4+48], _mm_unpackhi_epi16(gg_hi, ga_hi));
+		}
+		break;
+	case 24: // GA -> RGBA
+		for(; i+8<=n; i+=8) {
+			__m128i ga = _mm_loadu_si128((const __m128i*)&src[i*2]);
+			__m128i g = _mm_and_si128(ga, lo8_16);
+			__m128i gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+
+			_mm_storeu_si128((__m128i*)&dst[i*4], _mm_unpacklo_epi16(gg, ga));
+			_mm_storeu_si128((__m128i*)&dst[i*4+16], _mm_unpackhi_epi16(gg, ga));
+		}
+		break;
 	}
+	return i;
 }
+#endif
 
-// Paint or copy (all or part of) srcimg onto dstimg.
-// If srcimg and dstimg are the same image, the source and destination
-// rectangles must not overlap.
-// Flags supported:
-//   DE_BITMAPFLAG_MERGE - Merge transparent pixels (partially supported)
-void de_bitmap_copy_rect(de_bitmap *srcimg, de_bitmap *dstimg,
+// Convert n pixels from one bytes-per-pixel format to another, with the
+// same results as de_bitmap_getpixel() followed by de_bitmap_setpixel_rgba().
+static void convert_pixels(const u8 *src, int src_bypp, u8 *dst, int dst_bypp,
+	i64 n)
+{
+	i64 i = 0;
+
+	if(src_bypp==dst_bypp) {
+		de_memcpy(dst, src, (size_t)(n*dst_bypp));
+		return;
+	}
+
+#ifdef DE_BITMAP_SSE2
+	i = convert_pixels_sse2(src, src_bypp, dst, dst_bypp, n);
+#endif
+
+	for(; i<n; i++) {
+		const u8 *s = &src[i*src_bypp];
+		u8 *d = &dst[i*dst_bypp];
+		u8 r, g, b, a;
+
+		switch(src_bypp) {
+		case 4: r = s[0]; g = s[1]; b = s[2]; a = s[3]; break;
+		case 3: r = s[0]; g = s[1]; b = s[2]; a = 0xff; break;
+		case 2: r = g = b = s[0]; a = s[1]; break;
+		default: r = g = b = s[0]; a = 0xff; break;
+		}
+
+		switch(dst_bypp) {
+		case 4: d[0] = r; d[1] = g; d[2] = b; d[3] = a; break;
+		case 3: d[0] = r; d[1] = g; d[2] = b; break;
+		case 2: d[0] = g; d[1] = a; break;
+		default: d[0] = g; break;
+		}
+	}
+}
+
+// For each of n pixels whose alpha value in srcalpha (which has a stride of
+// srcalpha_stride) is nonzero, copy the pixel from src to dst.
+static void merge_pixels(const u8 *src, const u8 *srcalpha,
+	int srcalpha_stride, u8 *dst, int bypp, i64 n)
+{
+	i64 i = 0;
+
+#ifdef DE_BITMAP_SSE2
+	if(bypp==4 && srcalpha==&src[3] && srcalpha_stride==4) {
+		const __m128i amask = _mm_set1_epi32((int)0xff000000U);
+		const __m128i zero = _mm_setzero_si128();
+
+		for(; i+4<=n; i+=4) {
+			__m128i s = _mm_loadu_si128((const __m128i*)&src[i*4]);
+			__m128i d = _mm_loadu_si128((const __m128i*)&dst[i*4]);
+			__m128i m = _mm_cmpeq_epi32(_mm_and_si128(s, amask), zero);
+
+			_mm_storeu_si128((__m128i*)&dst[i*4],
+				_mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s)));
+		}
+	}
+	else if(bypp==2 && srcalpha==&src[1] && srcalpha_stride==2) {
+		const __m128i amask = _mm_set1_epi16((short)0xff00);
+		const __m128i zero = _mm_setzero_si128();
+
+		for(; i+8<=n; i+=8) {
+			__m128i s = _mm_loadu_si128((const __m128i*)&src[i*2]);
+			__m128i d = _mm_loadu_si128((const __m128i*)&dst[i*2]);
+			__m128i m = _mm_cmpeq_epi16(_mm_and_si128(s, amask), zero);
+
+			_mm_storeu_si128((__m128i*)&dst[i*2],
+				_mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s)));
+		}
+	}
+#endif
+
+	for(; i<n; i++) {
+		if(srcalpha[i*srcalpha_stride]!=0) {
+			de_memcpy(&dst[i*bypp], &src[i*bypp], (size_t)bypp);
+		}
+	}
+}
+
+// The per-pixel version of de_bitmap_copy_rect(), used when the fast path
+// can't be.
+static void copy_rect_slow(de_bitmap *srcimg, de_bitmap *dstimg,
 	i64 srcxpos, i64 srcypos, i64 width, i64 height,
 	i64 dstxpos, i64 dstypos, unsigned int flags)
 {
@@ -609,20 +1404,209 @@ void de_bitmap_copy_rect(de_bitmap *srcimg, de_bitmap *dstimg,
 	}
 }
 
+// Paint or copy (all or part of) srcimg onto dstimg.
+// If srcimg and dstimg are the same image, the source and destination
+// rectangles must not overlap.
+// Flags supported:
+//   DE_BITMAPFLAG_MERGE - Merge transparent pixels (partially supported)
+void de_bitmap_copy_rect(de_bitmap *srcimg, de_bitmap *dstimg,
+	i64 srcxpos, i64 srcypos, i64 width, i64 height,
+	i64 dstxpos, i64 dstypos, unsigned int flags)
+{
+	u8 tmpbuf[DE_ROWCHUNK_PIXELS*4];
+	u8 srcbuf[DE_ROWCHUNK_PIXELS*4];
+	u8 lut[256*4];
+	i64 x0, x1, y0, y1;
+	i64 i, j;
+	int sbypp, dbypp;
+	int merge;
+
+	if(width<=0 || height<=0) return;
+	if(dstimg->is_indexed) bitmap_make_direct(dstimg);
+	if(!dstimg->bitmap) de_bitmap_alloc_pixels(dstimg);
+	if(srcimg->is_indexed && !srcimg->bitmap) de_bitmap_alloc_pixels(srcimg);
+
+	// Clip to the destination image. Pixels that fall outside it are ignored.
+	x0 = de_max_int(0, -dstxpos);
+	x1 = de_min_int(width, dstimg->width - dstxpos);
+	y0 = de_max_int(0, -dstypos);
+	y1 = de_min_int(height, dstimg->height - dstypos);
+	if(x0>=x1 || y0>=y1) return;
+
+	// If any of the remaining pixels fall outside the source image, they
+	// need special handling, so let the slow version deal with it.
+	if(!srcimg->bitmap || srcxpos+x0<0 || srcypos+y0<0 ||
+		srcxpos+x1>srcimg->width || srcypos+y1>srcimg->height)
+	{
+		copy_rect_slow(srcimg, dstimg, srcxpos, srcypos, width, height,
+			dstxpos, dstypos, flags);
+		return;
+	}
+
+	sbypp = srcimg->bytes_per_pixel;
+	dbypp = dstimg->bytes_per_pixel;
+	// Merging only matters if the source has an alpha channel.
+	merge = (flags&DE_BITMAPFLAG_MERGE) && (sbypp==2 || sbypp==4);
+	if(srcimg->is_indexed) {
+		make_pixel_lut(sbypp, srcimg->pal, (i64)1<<srcimg->idx_bitdepth, lut);
+	}
+
+	for(j=y0; j<y1; j++) {
+		const u8 *srow = NULL;
+		u8 *drow = &dstimg->bitmap[(dstimg->width*dbypp)*(dstypos+j) +
+			dbypp*(dstxpos+x0)];
+
+		if(!srcimg->is_indexed) {
+			srow = &srcimg->bitmap[(srcimg->width*sbypp)*(srcypos+j) +
+				sbypp*(srcxpos+x0)];
+			if(!merge) {
+				convert_pixels(srow, sbypp, drow, dbypp, x1-x0);
+				continue;
+			}
+		}
+
+		for(i=0; i<x1-x0; i+=DE_ROWCHUNK_PIXELS) {
+			i64 n = de_min_int(x1-x0-i, DE_ROWCHUNK_PIXELS);
+			const u8 *s;
+
+			if(srcimg->is_indexed) {
+				expand_indexed_pixels(srcimg, srcypos+j, srcxpos+x0+i, n, srcbuf, lut);
+				s = srcbuf;
+				if(!merge) {
+					convert_pixels(s, sbypp, &drow[i*dbypp], dbypp, n);
+					continue;
+				}
+			}
+			else {
+				s = &srow[i*sbypp];
+			}
+
+			if(sbypp!=dbypp) {
+				convert_pixels(s, sbypp, tmpbuf, dbypp, n);
+				merge_pixels(tmpbuf, &s[sbypp-1], sbypp, &drow[i*dbypp], dbypp, n);
+			}
+			else {
+				merge_pixels(s, &s[sbypp-1], sbypp, &drow[i*dbypp], dbypp, n);
+			}
+		}
+	}
+}
+
+// Set the alpha channel of n pixels of an image with an alpha channel
+// (bypp 2 or 4) from the values in a.
+static void set_alpha_channel(u8 *dst, int bypp, const u8 *a, i64 n)
+{
+	i64 i = 0;
+
+#ifdef DE_BITMAP_SSE2
+	{
+		const __m128i zero = _mm_setzero_si128();
+
+		if(bypp==4) {
+			const __m128i rgbmask = _mm_set1_epi32(0x00ffffff);
+
+			for(; i+16<=n; i+=16) {
+				__m128i av = _mm_loadu_si128((const __m128i*)&a[i]);
+				__m128i a_lo = _mm_unpacklo_epi8(zero, av);
+				__m128i a_hi = _mm_unpackhi_epi8(zero, av);
+				__m128i a32[4];
+				int k;
+
+				a32[0] = _mm_unpacklo_epi16(zero, a_lo);
+				a32[1] = _mm_unpackhi_epi16(zero, a_lo);
+				a32[2] = _mm_unpacklo_epi16(zero, a_hi);
+				a32[3] = _mm_unpackhi_epi16(zero, a_hi);
+				for(k=0; k<4; k++) {
+					__m128i *p = (__m128i*)&dst[i*4 + k*16];
+					__m128i v = _mm_loadu_si128(p);
+
+					_mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(v, rgbmask), a32[k]));
+				}
+			}
+		}
+		else if(bypp==2) {
+			const __m128i gmask = _mm_set1_epi16(0x00ff);
+
+			for(; i+16<=n; i+=16) {
+				__m128i av = _mm_loadu_si128((const __m128i*)&a[i]);
+				__m128i *p0 = (__m128i*)&dst[i*2];
+				__m128i *p1 = (__m128i*)&dst[i*2+16];
+
+				_mm_storeu_si128(p0, _mm_or_si128(_mm_and_si128(_mm_loadu_si128(p0), gmask),
+					_mm_unpacklo_epi8(zero, av)));
+				_mm_storeu_si128(p1, _mm_or_si128(_mm_and_si128(_mm_loadu_si128(p1), gmask),
+					_mm_unpackhi_epi8(zero, av)));
+			}
+		}
+	}
+#endif
+
+	for(; i<n; i++) {
+		dst[i*bypp + bypp-1] = a[i];
+	}
+}
+
 void de_bitmap_apply_mask(de_bitmap *fg, de_bitmap *mask,
 	unsigned int flags)
 {
-	i64 i, j;
-	u32 clr;
-	u8 a;
+	u8 abuf[DE_ROWCHUNK_PIXELS];
+	u8 mbuf[DE_ROWCHUNK_PIXELS*4];
+	u8 lut[256*4];
+	i64 w, h;
+	i64 i, j, k;
+	int fbypp, mbypp;
+
+	if(fg->width<=0 || fg->height<=0 || mask->width<=0 || mask->height<=0) return;
+	if(fg->is_indexed) bitmap_make_direct(fg);
+	if(!fg->bitmap) de_bitmap_alloc_pixels(fg);
+	if(mask->is_indexed && !mask->bitmap) de_bitmap_alloc_pixels(mask);
+	fbypp = fg->bytes_per_pixel;
+	mbypp = mask->bytes_per_pixel;
+	if(fbypp!=2 && fbypp!=4) return; // No alpha channel to set
+
+	w = de_min_int(fg->width, mask->width);
+	h = de_min_int(fg->height, mask->height);
+	if(mask->is_indexed) {
+		make_pixel_lut(mbypp, mask->pal, (i64)1<<mask->idx_bitdepth, lut);
+	}
+
+	for(j=0; j<h; j++) {
+		u8 *frow = &fg->bitmap[(fg->width*fbypp)*j];
+		const u8 *mrow = NULL;
+
+		if(mask->bitmap && !mask->is_indexed) {
+			mrow = &mask->bitmap[(mask->width*mbypp)*j];
+		}
+
+		for(i=0; i<w; i+=DE_ROWCHUNK_PIXELS) {
+			i64 n = de_min_int(w-i, DE_ROWCHUNK_PIXELS);
+
+			// The mask's gray value is the first sample of each pixel.
+			if(mask->bitmap && mask->is_indexed) {
+				expand_indexed_pixels(mask, j, i, n, mbuf, lut);
+				for(k=0; k<n; k++) {
+					abuf[k] = mbuf[k*mbypp];
+				}
+			}
+			else if(!mrow) {
+				de_zeromem(abuf, (size_t)n);
+			}
+			else if(mbypp==1) {
+				de_memcpy(abuf, &mrow[i], (size_t)n);
+			}
+			else {
+				for(k=0; k<n; k++) {
+					abuf[k] = mrow[(i+k)*mbypp];
+				}
+			}
+
+			if(flags&DE_BITMAPFLAG_WHITEISTRNS) {
+				for(k=0; k<n; k++) {
+					abuf[k] = 0xff - abuf[k];
+				}
+			}
 
-	for(j=0; j<fg->height && j<mask->height; j++) {
-		for(i=0; i<fg->width && i<mask->width; i++) {
-			clr = de_bitmap_getpixel(mask, i, j);
-			a = DE_COLOR_K(clr);
-			if(flags&DE_BITMAPFLAG_WHITEISTRNS)
-				a = 0xff-a;
-			de_bitmap_setsample(fg, i, j, 3, a);
+			set_alpha_channel(&frow[i*fbypp], fbypp, abuf, n);
 		}
 	}
 }
@@ -656,6 +1640,12 @@ void de_optimize_image_alpha(de_bitmap *img, unsigned int flags)
 	// No meaningful transparency found.
 	de_dbg3(img->c, "Removing alpha channel from image");
 
+	if(img->is_indexed) {
+		// Only the interpretation of the palette changes.
+		img->bytes_per_pixel--;
+		return;
+	}
+
 	// Note that the format conversion is done in-place. The extra memory used
 	// by the alpha channel is not de-allocated.
 	for(j=0; j<img->height; j++) {
@@ -7,6 +7,7 @@
 #define DE_NOT_IN_MODULE
 #include "deark-config.h"
 #include "deark-user.h"
+#include <setjmp.h>
 
 #ifdef DE_WINDOWS
 #include <fcntl.h>
@@ -15,6 +16,30 @@
 
 struct cmdctx {
 	const char *input_filename;
+
+	// Batch mode: If there is more than one input file, they're all listed
+	// here (including input_filename).
+	int num_input_files;
+	int input_files_alloc;
+	const char **input_files;
+	const char *batch_list_filename;
+	char **batch_list; // Names read from batch_list_filename
+	int batch_list_count;
+	int num_jobs_req; // -j option. 0 = auto.
+	int num_jobs_req_set;
+
+	// Used by the worker threads, if -j is used (see run_batch_parallel()).
+	int is_worker;
+	struct strbuf_struct *job_msgs; // Messages are collected here
+	struct strbuf_struct *job_extrlist; // Extracted filenames are collected here
+	struct parallel_ctx_struct *pctx;
+	// Set while a worker is running a job. A fatal error that de_run() can't
+	// recover from jumps here, so that only that job is abandoned.
+	jmp_buf *job_recovery_point;
+
+	int server_mode; // -server option
+	int is_server_request; // This cmdctx is for one request (see run_server())
+
 	int error_flag;
 	int show_usage_message;
 	int special_command_flag;
@@ -46,6 +71,45 @@ struct cmdctx {
 	char msgbuf[1000];
 };
 
+// A simple growable string.
+struct strbuf_struct {
+	char *s;
+	size_t len;
+	size_t alloc;
+};
+
+static void strbuf_append(struct strbuf_struct *sb, const char *s)
+{
+	size_t n = strlen(s);
+
+	if(sb->len + n + 1 > sb->alloc) {
+		size_t new_alloc = sb->alloc ? sb->alloc*2 : 1024;
+
+		while(new_alloc < sb->len + n + 1) new_alloc *= 2;
+		sb->s = de_realloc(NULL, sb->s, (i64)sb->alloc, (i64)new_alloc);
+		sb->alloc = new_alloc;
+	}
+	memcpy(&sb->s[sb->len], s, n+1);
+	sb->len += n;
+}
+
+// Append s as a JSON string, with quotes.
+static void strbuf_append_json_string(struct strbuf_struct *sb, const char *s)
+{
+	char *q;
+
+	q = de_json_quote_string(NULL, s);
+	strbuf_append(sb, q);
+	de_free(NULL, q);
+}
+
+static void strbuf_destroy(struct strbuf_struct *sb)
+{
+	if(!sb) return;
+	de_free(NULL, sb->s);
+	de_free(NULL, sb);
+}
+
 static void show_version(deark *c, int verbose)
 {
 	char vbuf[80];
@@ -82,6 +146,8 @@ static void show_help(deark *c)
 	de_puts(c, DE_MSGTYPE_MESSAGE,
 		"A utility for extracting data from various file formats\n\n");
 	show_usage_preamble(c);
+	de_puts(c, DE_MSGTYPE_MESSAGE,
+		"       deark [options] -batch <listfile> | <input-file> <input-file>...\n");
 	de_puts(c, DE_MSGTYPE_MESSAGE,
 		"\nCommonly used options:\n"
 		" -l: Instead of extracting, list the files that would be extracted.\n"
@@ -90,6 +156,7 @@ static void show_help(deark *c)
 		" -o <base-filename>: Start output filenames with this string.\n"
 		" -zip: Write output files to a .zip file.\n"
 		" -a: Extract more data than usual.\n"
+		" -r: Also decode the files that are extracted.\n"
 		" -main: Extract less data than usual.\n"
 		" -get <n>: Extract only file number <n>.\n"
 		" -d, -d2, -d3: Print additional information about the file.\n"
@@ -152,6 +219,7 @@ static void our_specialmsgfn(deark *c, unsigned int flags, unsigned int code,
 	struct cmdctx *cc;
 
 	cc = de_get_userdata(c);
+	if(cc->job_msgs) return;
 	if(!cc->color_method) return;
 
 	if(!cc->have_initialized_output_stream) {
@@ -200,6 +268,25 @@ static void our_specialmsgfn(deark *c, unsigned int flags, unsigned int code,
 	}
 }
 
+// Print a string that has already been converted to the right encoding.
+static void print_converted_msg(deark *c, struct cmdctx *cc, const char *s)
+{
+	if(!cc->have_initialized_output_stream) {
+		initialize_output_stream(cc);
+	}
+
+#ifdef DE_WINDOWS
+	if(cc->use_fwputs) {
+		de_utf8_to_utf16_to_FILE(c, s, cc->msgs_FILE);
+	}
+	else {
+		fputs(s, cc->msgs_FILE);
+	}
+#else
+	fputs(s, cc->msgs_FILE);
+#endif
+}
+
 static void our_msgfn(deark *c, unsigned int flags, const char *s1)
 {
 	struct cmdctx *cc;
@@ -234,24 +321,36 @@ static void our_msgfn(deark *c, unsigned int flags, const char *s1)
 		s = s1;
 	}
 
-#ifdef DE_WINDOWS
-	if(cc->use_fwputs) {
-		de_utf8_to_utf16_to_FILE(c, s, cc->msgs_FILE);
-	}
-	else {
-		fputs(s, cc->msgs_FILE);
+	if(cc->job_msgs) {
+		strbuf_append(cc->job_msgs, s);
+		return;
 	}
-#else
-	fputs(s, cc->msgs_FILE);
-#endif
+
+	print_converted_msg(c, cc, s);
 }
 
 static void our_fatalerrorfn(deark *c)
 {
+	struct cmdctx *cc;
+
+	cc = de_get_userdata(c);
+	if(cc->job_recovery_point) {
+		longjmp(*cc->job_recovery_point, 1);
+	}
 	de_puts(c, DE_MSGTYPE_MESSAGE, "Exiting\n");
 	de_exitprocess();
 }
 
+static void our_extrlistfn(deark *c, const char *fn)
+{
+	struct cmdctx *cc;
+
+	cc = de_get_userdata(c);
+	if(!cc->job_extrlist) return;
+	strbuf_append(cc->job_extrlist, fn);
+	strbuf_append(cc->job_extrlist, "\n");
+}
+
 static void set_ext_option(deark *c, struct cmdctx *cc, const char *optionstring)
 {
 	char *tmp;
@@ -304,7 +403,8 @@ enum opt_id_enum {
  DE_OPT_K, DE_OPT_K2, DE_OPT_K3,
  DE_OPT_ARCFN, DE_OPT_GET, DE_OPT_FIRSTFILE, DE_OPT_MAXFILES, DE_OPT_MAXIMGDIM,
  DE_OPT_PRINTMODULES, DE_OPT_DPREFIX, DE_OPT_EXTRLIST,
- DE_OPT_ONLYMODS, DE_OPT_DISABLEMODS, DE_OPT_ONLYDETECT, DE_OPT_NODETECT
+ DE_OPT_ONLYMODS, DE_OPT_DISABLEMODS, DE_OPT_ONLYDETECT, DE_OPT_NODETECT,
+ DE_OPT_BATCH, DE_OPT_R, DE_OPT_J, DE_OPT_SERVER
 };
 
 struct opt_struct {
@@ -318,6 +418,7 @@ struct opt_struct option_array[] = {
 	{ "d2",           DE_OPT_D2,           0 },
 	{ "d3",           DE_OPT_D3,           0 },
 	{ "l",            DE_OPT_L,            0 },
+	{ "r",            DE_OPT_R,            0 },
 	{ "noinfo",       DE_OPT_NOINFO,       0 },
 	{ "nowarn",       DE_OPT_NOWARN,       0 },
 	{ "nobom",        DE_OPT_NOBOM,        0 },
@@ -368,6 +469,9 @@ struct opt_struct option_array[] = {
 	{ "disablemods",  DE_OPT_DISABLEMODS,  1 },
 	{ "onlydetect",   DE_OPT_ONLYDETECT,   1 },
 	{ "nodetect",     DE_OPT_NODETECT,     1 },
+	{ "batch",        DE_OPT_BATCH,        1 },
+	{ "j",            DE_OPT_J,            1 },
+	{ "server",       DE_OPT_SERVER,       0 },
 	{ NULL,           DE_OPT_NULL,         0 }
 };
 
@@ -393,6 +497,61 @@ static void send_msgs_to_stderr(deark *c, struct cmdctx *cc)
 #endif
 }
 
+static void add_input_file(deark *c, struct cmdctx *cc, const char *fn)
+{
+	if(cc->num_input_files >= cc->input_files_alloc) {
+		int new_alloc = cc->input_files_alloc ? cc->input_files_alloc*2 : 8;
+
+		cc->input_files = de_reallocarray(c, (void*)cc->input_files,
+			cc->input_files_alloc, sizeof(const char*), new_alloc);
+		cc->input_files_alloc = new_alloc;
+	}
+	cc->input_files[cc->num_input_files++] = fn;
+
+	if(!cc->input_filename) {
+		cc->input_filename = fn;
+		de_set_input_filename(c, fn);
+	}
+}
+
+// Set the base output filename for the input file we're about to process.
+// batch_idx is -1 if not in batch mode.
+static void set_base_output_filename(deark *c, struct cmdctx *cc, int batch_idx)
+{
+	char tmpfn[1024];
+
+	if(batch_idx>=0) {
+		// Output files from different input files must not have the same
+		// names. If -k wasn't used, add a sequence number to the base name.
+		if(cc->base_output_filename || !cc->option_k_level) {
+			de_snprintf(tmpfn, sizeof(tmpfn), "%s.%03d",
+				cc->base_output_filename ? cc->base_output_filename : "output",
+				batch_idx);
+			de_set_base_output_filename(c, tmpfn, 0);
+			return;
+		}
+	}
+
+	if(cc->option_k_level && cc->input_filename) {
+		if(cc->option_k_level==1) {
+			// Use base input filename in output filenames.
+			de_set_base_output_filename(c, cc->input_filename, 0x1);
+		}
+		else if(cc->option_k_level==2) {
+			// Use full input filename path, but not as an actual path.
+			de_set_base_output_filename(c, cc->input_filename, 0x2);
+		}
+		else if(cc->option_k_level==3) {
+			// Use full input filename path, as-is.
+			de_set_base_output_filename(c, cc->input_filename, 0x0);
+		}
+	}
+
+	if(cc->base_output_filename) {
+		de_set_base_output_filename(c, cc->base_output_filename, 0);
+	}
+}
+
 static void parse_cmdline(deark *c, struct cmdctx *cc, int argc, char **argv)
 {
 	int i;
@@ -440,6 +599,9 @@ static void parse_cmdline(deark *c, struct cmdctx *cc, int argc, char **argv)
 			case DE_OPT_L:
 				de_set_listmode(c, 1);
 				break;
+			case DE_OPT_R:
+				de_set_recursion(c, 1);
+				break;
 			case DE_OPT_NOINFO:
 				de_set_messages(c, 0);
 				break;
@@ -528,8 +690,7 @@ static void parse_cmdline(deark *c, struct cmdctx *cc, int argc, char **argv)
 				set_ext_option(c, cc, argv[i+1]);
 				break;
 			case DE_OPT_FILE:
-				cc->input_filename = argv[i+1];
-				de_set_input_filename(c, cc->input_filename);
+				add_input_file(c, cc, argv[i+1]);
 				break;
 			case DE_OPT_FILE2:
 				de_set_ext_option(c, "file2", argv[i+1]);
@@ -596,6 +757,16 @@ static void parse_cmdline(deark *c, struct cmdctx *cc, int argc, char **argv)
 			case DE_OPT_NODETECT:
 				de_set_disable_moddetect(c, argv[i+1], 0);
 				break;
+			case DE_OPT_BATCH:
+				cc->batch_list_filename = argv[i+1];
+				break;
+			case DE_OPT_J:
+				cc->num_jobs_req = de_atoi(argv[i+1]);
+				cc->num_jobs_req_set = 1;
+				break;
+			case DE_OPT_SERVER:
+				cc->server_mode = 1;
+				break;
 			default:
 				de_printf(c, DE_MSGTYPE_MESSAGE, "Unrecognized option: %s\n", argv[i]);
 				cc->error_flag = 1;
@@ -606,13 +777,63 @@ static void parse_cmdline(deark *c, struct cmdctx *cc, int argc, char **argv)
 			i += opt->extra_args;
 		}
 		else {
-			if(cc->input_filename) {
-				cc->error_flag = 1;
-				cc->show_usage_message = 1;
-				return;
-			}
-			cc->input_filename = argv[i];
-			de_set_input_filename(c, cc->input_filename);
+			add_input_file(c, cc, argv[i]);
+		}
+	}
+
+	// A worker only needs the options. The main thread has already checked
+	// everything else.
+	if(cc->is_worker) return;
+
+	if(cc->server_mode) {
+		if(cc->is_server_request) {
+			de_puts(c, DE_MSGTYPE_MESSAGE,
+				"Error: -server can't be used in a request\n");
+			cc->error_flag = 1;
+		}
+		else if(cc->num_input_files>0 || cc->batch_list_filename) {
+			de_puts(c, DE_MSGTYPE_MESSAGE,
+				"Error: Input files can't be given on the command line with -server\n");
+			cc->error_flag = 1;
+		}
+		return;
+	}
+
+	if(cc->is_server_request && (cc->from_stdin || cc->to_stdout)) {
+		// stdin and stdout are used to talk to the client.
+		de_puts(c, DE_MSGTYPE_MESSAGE,
+			"Error: -fromstdin and -tostdout can't be used with -server\n");
+		cc->error_flag = 1;
+		return;
+	}
+
+	if(cc->batch_list_filename && !help_flag && !cc->special_command_flag) {
+		int k;
+
+		cc->batch_list = de_read_filename_list(c, cc->batch_list_filename,
+			&cc->batch_list_count);
+		if(!cc->batch_list) {
+			cc->error_flag = 1;
+			return;
+		}
+		for(k=0; k<cc->batch_list_count; k++) {
+			add_input_file(c, cc, cc->batch_list[k]);
+		}
+	}
+
+	if(cc->num_input_files>1) {
+		if(cc->from_stdin) {
+			de_puts(c, DE_MSGTYPE_MESSAGE,
+				"Error: -fromstdin can't be used with multiple input files\n");
+			cc->error_flag = 1;
+			return;
+		}
+		if(cc->to_stdout && !cc->to_zip) {
+			de_puts(c, DE_MSGTYPE_MESSAGE,
+				"Error: -tostdout can't be used with multiple input files, "
+				"unless -zip is also used\n");
+			cc->error_flag = 1;
+			return;
 		}
 	}
 
@@ -644,23 +865,440 @@ static void parse_cmdline(deark *c, struct cmdctx *cc, int argc, char **argv)
 		}
 	}
 
-	if(cc->option_k_level && cc->input_filename) {
-		if(cc->option_k_level==1) {
-			// Use base input filename in output filenames.
-			de_set_base_output_filename(c, cc->input_filename, 0x1);
+	if(cc->num_input_files<=1) {
+		set_base_output_filename(c, cc, -1);
+	}
+}
+
+// Process each of the input files, reusing the same deark object (and the
+// same module registry, -extrlist file, -zip file, etc.).
+static void run_batch(deark *c, struct cmdctx *cc)
+{
+	int k;
+
+	de_set_batch_mode(c, 1);
+	for(k=0; k<cc->num_input_files; k++) {
+		cc->input_filename = cc->input_files[k];
+		de_set_input_filename(c, cc->input_filename);
+		set_base_output_filename(c, cc, k);
+		de_run(c);
+	}
+}
+
+// Parallel batch mode (-j).
+// Each worker thread has its own deark object, and processes one input file
+// (a "job") at a time. The input files are initially divided into
+// contiguous ranges, one per worker. A worker takes jobs from the front of
+// its own range, and when that is empty, steals the back half of another
+// worker's range.
+// The output filenames don't depend on which worker processes a job. The
+// messages and -extrlist lines for each job are collected in memory, and
+// printed in the original order of the input files.
+
+struct pjob_struct {
+	struct strbuf_struct *msgs;
+	struct strbuf_struct *extrlist;
+	int done;
+};
+
+struct pworker_struct {
+	struct parallel_ctx_struct *pctx;
+	int worker_idx;
+	de_thread *thread;
+	deark *c;
+	struct cmdctx *cc;
+	de_mutex *mutex; // Protects lo and hi
+	int lo, hi; // This worker's remaining jobs are [lo, hi)
+};
+
+struct parallel_ctx_struct {
+	deark *main_c;
+	struct cmdctx *main_cc;
+	int num_workers;
+	struct pworker_struct *workers;
+	struct pjob_struct *jobs;
+	de_mutex *output_mutex; // Protects jobs[].done, next_job_to_print
+	int next_job_to_print;
+};
+
+// Print a finished job's messages, and write its -extrlist lines.
+// Caller must lock pctx->output_mutex.
+static void print_job_output(struct parallel_ctx_struct *pctx, struct pjob_struct *job)
+{
+	if(job->msgs && job->msgs->len>0) {
+		print_converted_msg(pctx->main_c, pctx->main_cc, job->msgs->s);
+	}
+	if(job->extrlist && job->extrlist->len>0) {
+		de_write_to_extrlist(pctx->main_c, job->extrlist->s);
+	}
+	strbuf_destroy(job->msgs);
+	job->msgs = NULL;
+	strbuf_destroy(job->extrlist);
+	job->extrlist = NULL;
+}
+
+// Caller must lock pctx->output_mutex.
+static void flush_completed_jobs(struct parallel_ctx_struct *pctx)
+{
+	while(pctx->next_job_to_print < pctx->main_cc->num_input_files &&
+		pctx->jobs[pctx->next_job_to_print].done)
+	{
+		print_job_output(pctx, &pctx->jobs[pctx->next_job_to_print]);
+		pctx->next_job_to_print++;
+	}
+}
+
+static void run_job(struct pworker_struct *w, int idx)
+{
+	struct parallel_ctx_struct *pctx = w->pctx;
+	struct pjob_struct *job = &pctx->jobs[idx];
+	jmp_buf job_recovery_point;
+
+	job->msgs = de_malloc(NULL, sizeof(struct strbuf_struct));
+	job->extrlist = de_malloc(NULL, sizeof(struct strbuf_struct));
+	w->cc->job_msgs = job->msgs;
+	w->cc->job_extrlist = job->extrlist;
+
+	w->cc->input_filename = pctx->main_cc->input_files[idx];
+	de_set_input_filename(w->c, w->cc->input_filename);
+	set_base_output_filename(w->c, w->cc, idx);
+	if(setjmp(job_recovery_point)) {
+		// A fatal error happened outside of de_run()'s own recovery (see
+		// our_fatalerrorfn()). The error has been recorded in the job's
+		// messages. Give up on this job, and go on to the next one.
+		strbuf_append(job->msgs, "Abandoning this input file\n");
+	}
+	else {
+		w->cc->job_recovery_point = &job_recovery_point;
+		de_run(w->c);
+	}
+	w->cc->job_recovery_point = NULL;
+
+	w->cc->job_msgs = NULL;
+	w->cc->job_extrlist = NULL;
+
+	de_mutex_lock(pctx->output_mutex);
+	job->done = 1;
+	flush_completed_jobs(pctx);
+	de_mutex_unlock(pctx->output_mutex);
+}
+
+// Returns the index of the next job in this worker's range, or -1 if none.
+static int worker_take_job(struct pworker_struct *w)
+{
+	int idx = -1;
+
+	de_mutex_lock(w->mutex);
+	if(w->lo < w->hi) {
+		idx = w->lo;
+		w->lo++;
+	}
+	de_mutex_unlock(w->mutex);
+	return idx;
+}
+
+// Steal the back half of another worker's range.
+// Returns 0 if there was nothing left to steal.
+static int worker_steal_jobs(struct pworker_struct *w)
+{
+	struct parallel_ctx_struct *pctx = w->pctx;
+	int k;
+
+	for(k=1; k<pctx->num_workers; k++) {
+		struct pworker_struct *victim;
+		int lo = 0, hi = 0;
+
+		victim = &pctx->workers[(w->worker_idx + k) % pctx->num_workers];
+		de_mutex_lock(victim->mutex);
+		if(victim->lo < victim->hi) {
+			hi = victim->hi;
+			lo = hi - (victim->hi - victim->lo + 1)/2;
+			victim->hi = lo;
 		}
-		else if(cc->option_k_level==2) {
-			// Use full input filename path, but not as an actual path.
-			de_set_base_output_filename(c, cc->input_filename, 0x2);
+		de_mutex_unlock(victim->mutex);
+
+		if(lo < hi) {
+			de_mutex_lock(w->mutex);
+			w->lo = lo;
+			w->hi = hi;
+			de_mutex_unlock(w->mutex);
+			return 1;
 		}
-		else if(cc->option_k_level==3) {
-			// Use full input filename path, as-is.
-			de_set_base_output_filename(c, cc->input_filename, 0x0);
+	}
+	return 0;
+}
+
+static void worker_main(void *userdata)
+{
+	struct pworker_struct *w = (struct pworker_struct*)userdata;
+	int idx;
+
+	while(1) {
+		idx = worker_take_job(w);
+		if(idx<0) {
+			if(!worker_steal_jobs(w)) break;
+			continue;
 		}
+		run_job(w, idx);
 	}
+}
 
-	if(cc->base_output_filename) {
-		de_set_base_output_filename(c, cc->base_output_filename, 0);
+static void create_worker(struct parallel_ctx_struct *pctx, int worker_idx,
+	int argc, char **argv)
+{
+	struct pworker_struct *w = &pctx->workers[worker_idx];
+	i64 num_jobs = (i64)pctx->main_cc->num_input_files;
+
+	w->pctx = pctx;
+	w->worker_idx = worker_idx;
+	w->cc = de_malloc(NULL, sizeof(struct cmdctx));
+	w->cc->is_worker = 1;
+	w->cc->pctx = pctx;
+
+	// Configure the worker's deark object by parsing the command line
+	// again. The main thread has already checked it for errors.
+	w->c = de_create();
+	de_set_userdata(w->c, (void*)w->cc);
+	de_set_fatalerror_callback(w->c, our_fatalerrorfn);
+	de_set_messages_callback(w->c, our_msgfn);
+	de_set_special_messages_callback(w->c, our_specialmsgfn);
+	parse_cmdline(w->c, w->cc, argc, argv);
+	de_set_extrlist_filename(w->c, NULL);
+	de_set_extrlist_callback(w->c, our_extrlistfn);
+	de_set_batch_mode(w->c, 1);
+
+	w->mutex = de_mutex_create(w->c);
+	w->lo = (int)((num_jobs * worker_idx) / pctx->num_workers);
+	w->hi = (int)((num_jobs * (worker_idx+1)) / pctx->num_workers);
+}
+
+static void destroy_worker(struct pworker_struct *w)
+{
+	de_mutex_destroy(w->mutex);
+	de_destroy(w->c);
+	de_free(NULL, (void*)w->cc->input_files);
+	de_free(NULL, w->cc);
+}
+
+static void run_batch_parallel(deark *c, struct cmdctx *cc, int argc, char **argv,
+	int num_workers)
+{
+	struct parallel_ctx_struct *pctx = NULL;
+	int k;
+
+	if(num_workers > cc->num_input_files) num_workers = cc->num_input_files;
+
+	pctx = de_malloc(NULL, sizeof(struct parallel_ctx_struct));
+	pctx->main_c = c;
+	pctx->main_cc = cc;
+	pctx->num_workers = num_workers;
+	pctx->workers = de_mallocarray(NULL, num_workers, sizeof(struct pworker_struct));
+	pctx->jobs = de_mallocarray(NULL, cc->num_input_files, sizeof(struct pjob_struct));
+	pctx->output_mutex = de_mutex_create(c);
+
+	// Create the -extrlist file now, even if no files get extracted.
+	de_write_to_extrlist(c, "");
+
+	for(k=0; k<num_workers; k++) {
+		create_worker(pctx, k, argc, argv);
+	}
+
+	// The main thread is worker #0. If we fail to start some of the other
+	// threads, their jobs will be stolen by the workers that did start.
+	for(k=1; k<num_workers; k++) {
+		pctx->workers[k].thread = de_thread_create(c, worker_main,
+			(void*)&pctx->workers[k]);
+	}
+	worker_main((void*)&pctx->workers[0]);
+
+	for(k=1; k<num_workers; k++) {
+		if(pctx->workers[k].thread) {
+			de_thread_join(pctx->workers[k].thread);
+		}
+	}
+
+	for(k=0; k<num_workers; k++) {
+		destroy_worker(&pctx->workers[k]);
+	}
+	de_mutex_destroy(pctx->output_mutex);
+	de_free(NULL, pctx->jobs);
+	de_free(NULL, pctx->workers);
+	de_free(NULL, pctx);
+}
+
+// Server mode (-server).
+// Requests are read from stdin, one per line. A request is a list of
+// command-line arguments, separated by tab characters, e.g.
+//   "-o<TAB>/tmp/out/x<TAB>-opt<TAB>gif:dumpplaintext<TAB>/tmp/in/x.gif".
+// Any options given on the server's command line are prepended to each
+// request's arguments.
+// For each request, one line containing a JSON object is written to stdout.
+// The server exits at the end of its input.
+
+// Returns NULL at end of input. Caller must free the returned string.
+static char *server_read_request(void)
+{
+	struct strbuf_struct sb;
+	char buf[1024];
+	size_t n;
+
+	memset(&sb, 0, sizeof(struct strbuf_struct));
+	while(fgets(buf, (int)sizeof(buf), stdin)) {
+		strbuf_append(&sb, buf);
+		if(sb.len>0 && sb.s[sb.len-1]=='\n') break;
+	}
+	if(!sb.s) return NULL;
+
+	// Remove the line terminator
+	n = sb.len;
+	while(n>0 && (sb.s[n-1]=='\n' || sb.s[n-1]=='\r')) {
+		n--;
+	}
+	sb.s[n] = '\0';
+	return sb.s;
+}
+
+static void server_write_response(struct cmdctx *cc, i64 request_id, deark *c,
+	int request_ok)
+{
+	struct strbuf_struct *rsp;
+	char tmps[80];
+	const char *modid;
+	const char *p;
+
+	rsp = de_malloc(NULL, sizeof(struct strbuf_struct));
+	de_snprintf(tmps, sizeof(tmps), "{\"id\":%" I64_FMT ",\"status\":\"%s\"",
+		request_id, request_ok ? "ok" : "error");
+	strbuf_append(rsp, tmps);
+
+	modid = request_ok ? de_get_module_id_used(c) : NULL;
+	if(modid) {
+		strbuf_append(rsp, ",\"module\":");
+		strbuf_append_json_string(rsp, modid);
+	}
+
+	// The extracted filenames were collected one per line.
+	strbuf_append(rsp, ",\"files\":[");
+	p = cc->job_extrlist->s;
+	while(p && *p) {
+		const char *nl = strchr(p, '\n');
+		char *fn;
+
+		if(!nl) break;
+		fn = de_malloc(NULL, (i64)(nl-p)+1);
+		memcpy(fn, p, (size_t)(nl-p));
+		if(p != cc->job_extrlist->s) strbuf_append(rsp, ",");
+		strbuf_append_json_string(rsp, fn);
+		de_free(NULL, fn);
+		p = nl+1;
+	}
+	strbuf_append(rsp, "]");
+
+	if(request_ok) {
+		de_snprintf(tmps, sizeof(tmps), ",\"errors\":%d,\"warnings\":%d",
+			de_get_error_count(c), de_get_warning_count(c));
+		strbuf_append(rsp, tmps);
+	}
+
+	strbuf_append(rsp, ",\"log\":");
+	strbuf_append_json_string(rsp, cc->job_msgs->s ? cc->job_msgs->s : "");
+	strbuf_append(rsp, "}\n");
+
+	fputs(rsp->s, stdout);
+	fflush(stdout);
+	strbuf_destroy(rsp);
+}
+
+static void server_handle_request(int server_argc, char **server_argv,
+	char *line, i64 request_id)
+{
+	deark *c = NULL;
+	struct cmdctx *cc = NULL;
+	char **argv = NULL;
+	int argc = 0;
+	int max_args;
+	int request_ok = 0;
+	int k;
+	char *p;
+
+	// Build the argument list: argv[0], the server's options, then the
+	// request's arguments.
+	max_args = server_argc + 1;
+	for(p=line; *p; p++) {
+		if(*p=='\t') max_args++;
+	}
+	argv = de_mallocarray(NULL, max_args, sizeof(char*));
+	argv[argc++] = server_argv[0];
+	for(k=1; k<server_argc; k++) {
+		if(!strcmp(server_argv[k], "-server") || !strcmp(server_argv[k], "--server")) {
+			continue;
+		}
+		argv[argc++] = server_argv[k];
+	}
+	p = line;
+	while(1) {
+		char *tab = strchr(p, '\t');
+
+		if(tab) *tab = '\0';
+		if(*p) argv[argc++] = p;
+		if(!tab) break;
+		p = tab+1;
+	}
+
+	cc = de_malloc(NULL, sizeof(struct cmdctx));
+	cc->is_server_request = 1;
+	cc->job_msgs = de_malloc(NULL, sizeof(struct strbuf_struct));
+	cc->job_extrlist = de_malloc(NULL, sizeof(struct strbuf_struct));
+
+	c = de_create();
+	de_set_userdata(c, (void*)cc);
+	de_set_fatalerror_callback(c, our_fatalerrorfn);
+	de_set_messages_callback(c, our_msgfn);
+	de_set_special_messages_callback(c, our_specialmsgfn);
+	de_set_extrlist_callback(c, our_extrlistfn);
+
+	parse_cmdline(c, cc, argc, argv);
+	if(cc->error_flag) {
+		goto done;
+	}
+	request_ok = 1;
+
+	if(cc->special_command_flag) {
+		if(cc->special_command_code==CMD_PRINTMODULES) {
+			print_modules(c);
+		}
+	}
+	else if(cc->num_input_files>1) {
+		run_batch(c, cc);
+	}
+	else {
+		de_run(c);
+	}
+
+done:
+	server_write_response(cc, request_id, c, request_ok);
+	de_destroy(c);
+	de_free_filename_list(NULL, cc->batch_list, cc->batch_list_count);
+	de_free(NULL, (void*)cc->input_files);
+	strbuf_destroy(cc->job_msgs);
+	strbuf_destroy(cc->job_extrlist);
+	de_free(NULL, cc);
+	de_free(NULL, argv);
+}
+
+static void run_server(int argc, char **argv)
+{
+	char *line;
+	i64 request_id = 0;
+
+	while(1) {
+		line = server_read_request();
+		if(!line) break;
+		if(line[0]) {
+			request_id++;
+			server_handle_request(argc, argv, line, request_id);
+		}
+		de_free(NULL, line);
 	}
 }
 
@@ -700,6 +1338,11 @@ static void main2(int argc, char **argv)
 		goto done;
 	}
 
+	if(cc->server_mode) {
+		run_server(argc, argv);
+		goto done;
+	}
+
 #ifdef DE_WINDOWS
 	if(cc->to_stdout) {
 		_setmode(_fileno(stdout), _O_BINARY);
@@ -709,11 +1352,35 @@ static void main2(int argc, char **argv)
 	}
 #endif
 
-	de_run(c);
+	if(cc->num_input_files>1) {
+		int num_workers = 1;
+
+		if(cc->num_jobs_req_set) {
+			num_workers = cc->num_jobs_req;
+			if(num_workers<1) num_workers = de_get_cpu_count();
+		}
+		if(num_workers>1 && cc->to_zip) {
+			de_puts(c, DE_MSGTYPE_MESSAGE,
+				"Note: -j is not supported with -zip. Using one thread.\n");
+			num_workers = 1;
+		}
+
+		if(num_workers>1) {
+			run_batch_parallel(c, cc, argc, argv, num_workers);
+		}
+		else {
+			run_batch(c, cc);
+		}
+	}
+	else {
+		de_run(c);
+	}
 
 done:
 	de_destroy(c);
 
+	de_free_filename_list(NULL, cc->batch_list, cc->batch_list_count);
+	de_free(NULL, (void*)cc->input_files);
 	de_free(NULL, cc);
 }
 
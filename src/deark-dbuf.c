@@ -80,6 +80,70 @@ static void populate_cache_from_pipe(dbuf *f)
 	f->len = f->cache_bytes_used;
 }
 
+// For "-opt dedup". Output files up to this size are held in memory until
+// they are closed.
+#define DE_DEDUP_MAX_PENDING   4194304
+
+#define DE_STREAM_WINDOW_SIZE  1048576
+#define DE_STREAM_LOOKBEHIND   65536
+#define DE_STREAM_MAX_LEN      0x1000000000000000LL
+
+// For DBUF_TYPE_STREAM. Pull data from the stream until the window contains
+// the range [pos, pos+len), or the stream ends. Old data is discarded to make
+// room, except that we try to keep some bytes before pos, since formats tend
+// to look back a little.
+static void stream_fill_window(dbuf *f, i64 pos, i64 len)
+{
+	deark *c = f->c;
+	i64 n;
+
+	if(pos < f->cache_start_pos) {
+		// The data is gone, and silently returning zeroes could produce
+		// corrupt output, so treat this like any other internal error.
+		de_err(c, "Internal: Can't seek backward in a stream (%"I64_FMT")", pos);
+		de_fatalerror(c);
+		return;
+	}
+
+	while(!f->stream_eof && pos+len > f->cache_start_pos+f->cache_bytes_used) {
+		if(f->cache_bytes_used >= f->stream_window_alloc) {
+			i64 keep_from;
+
+			keep_from = pos - DE_STREAM_LOOKBEHIND;
+			if(keep_from > f->cache_start_pos+f->cache_bytes_used) {
+				keep_from = f->cache_start_pos+f->cache_bytes_used;
+			}
+
+			if(keep_from > f->cache_start_pos) {
+				i64 ndiscard = keep_from - f->cache_start_pos;
+
+				de_memmove(f->cache, &f->cache[ndiscard],
+					(size_t)(f->cache_bytes_used - ndiscard));
+				f->cache_bytes_used -= ndiscard;
+				f->cache_start_pos = keep_from;
+			}
+			else {
+				// The request doesn't fit in the window. Make it bigger.
+				f->cache = de_realloc(c, f->cache, f->stream_window_alloc,
+					f->stream_window_alloc*2);
+				f->stream_window_alloc *= 2;
+			}
+		}
+
+		n = f->streamreadfn(f, &f->cache[f->cache_bytes_used],
+			f->stream_window_alloc - f->cache_bytes_used);
+		if(n<1 || n>f->stream_window_alloc - f->cache_bytes_used) {
+			f->stream_eof = 1;
+			// If the stream was shorter than advertised, the file ends here.
+			if(f->cache_start_pos+f->cache_bytes_used < f->len) {
+				f->len = f->cache_start_pos+f->cache_bytes_used;
+			}
+			break;
+		}
+		f->cache_bytes_used += n;
+	}
+}
+
 // Read len bytes, starting at file position pos, into buf.
 // Unread bytes will be set to 0.
 void dbuf_read(dbuf *f, u8 *buf, i64 pos, i64 len)
@@ -149,6 +213,17 @@ void dbuf_read(dbuf *f, u8 *buf, i64 pos, i64 len)
 		bytes_read = bytes_to_read;
 		break;
 
+	case DBUF_TYPE_STREAM:
+		stream_fill_window(f, pos, bytes_to_read);
+		if(pos >= f->cache_start_pos &&
+			pos < f->cache_start_pos + f->cache_bytes_used)
+		{
+			bytes_read = f->cache_start_pos + f->cache_bytes_used - pos;
+			if(bytes_read > bytes_to_read) bytes_read = bytes_to_read;
+			de_memcpy(buf, &f->cache[pos - f->cache_start_pos], (size_t)bytes_read);
+		}
+		break;
+
 	default:
 		de_err(c, "Internal: getbytes from this I/O type not implemented");
 		de_fatalerror(c);
@@ -834,11 +909,38 @@ int dbuf_create_file_from_slice(dbuf *inf, i64 pos, i64 data_size,
 	dbuf *f;
 	f = dbuf_create_output_file(inf->c, ext, fi, createflags);
 	if(!f) return 0;
-	dbuf_copy(inf, pos, data_size, f);
+	if(!dbuf_is_discarded(f)) {
+		dbuf_copy(inf, pos, data_size, f);
+	}
 	dbuf_close(f);
 	return 1;
 }
 
+// Returns nonzero if no more output files can be extracted, because the
+// -maxfiles (or -get) limit has been reached. A format module that processes
+// a sequence of members can stop as soon as this is true, instead of parsing
+// (and skipping) every remaining member.
+int de_output_file_limit_reached(deark *c)
+{
+	if(c->max_output_files<0) return 0;
+	if(c->file_count >= c->first_output_file + c->max_output_files) return 1;
+	return 0;
+}
+
+// Returns nonzero if anything written to f will be thrown away. This is the
+// case for files that are only being listed (-l), and files not selected by
+// -get, -firstfile, -maxfiles, etc.
+// A module can use this, right after creating an output file, to skip the
+// work of decompressing or rendering the file's contents. It should still
+// close the file in the usual way.
+int dbuf_is_discarded(dbuf *f)
+{
+	if(f->btype!=DBUF_TYPE_NULL) return 0;
+	if(f->recursion_copy) return 0; // We need the contents, for -r.
+	if(f->crco_for_json) return 0;
+	return 1;
+}
+
 static void finfo_shallow_copy(deark *c, de_finfo *src, de_finfo *dst)
 {
 	dst->mode_flags = src->mode_flags;
@@ -847,6 +949,60 @@ static void finfo_shallow_copy(deark *c, de_finfo *src, de_finfo *dst)
 	dst->density = src->density;
 }
 
+// If we're in a context where a fatal error can be recovered from, remember
+// that f has an open file, so that it can be closed.
+static void register_open_file(dbuf *f)
+{
+	deark *c = f->c;
+
+	if(!c->memtracker) return;
+	if(f->openfile_registered) return;
+	f->openfile_prev = NULL;
+	f->openfile_next = c->open_files;
+	if(c->open_files) c->open_files->openfile_prev = f;
+	c->open_files = f;
+	f->openfile_registered = 1;
+}
+
+static void unregister_open_file(dbuf *f)
+{
+	deark *c = f->c;
+
+	if(!f->openfile_registered) return;
+	if(f->openfile_prev) f->openfile_prev->openfile_next = f->openfile_next;
+	else c->open_files = f->openfile_next;
+	if(f->openfile_next) f->openfile_next->openfile_prev = f->openfile_prev;
+	f->openfile_prev = NULL;
+	f->openfile_next = NULL;
+	f->openfile_registered = 0;
+}
+
+// Called after a fatal error. Close the files that are still open, but
+// don't free anything (see de_memtracker_end()).
+void dbuf_abandon_open_files(deark *c)
+{
+	while(c->open_files) {
+		dbuf *f = c->open_files;
+
+		unregister_open_file(f);
+		if(f->asyncfile) {
+			de_asyncwriter_close_file(f);
+		}
+		else if(f->fp && f->btype!=DBUF_TYPE_STDOUT) {
+			de_fclose(f->fp);
+		}
+		f->fp = NULL;
+	}
+}
+
+// Called when we no longer need to close files after a fatal error.
+void dbuf_forget_open_files(deark *c)
+{
+	while(c->open_files) {
+		unregister_open_file(c->open_files);
+	}
+}
+
 // Create or open a file for writing, that is *not* one of the usual
 // "output.000.ext" files we extract from the input file.
 //
@@ -872,15 +1028,46 @@ dbuf *dbuf_create_unmanaged_file(deark *c, const char *fname, int overwrite_mode
 		de_err(c, "Failed to write %s: %s", f->name, msgbuf);
 		f->btype = DBUF_TYPE_NULL;
 	}
+	else {
+		register_open_file(f);
+	}
 
 	return f;
 }
 
+// Open (or queue the opening of) the real file for a DBUF_TYPE_OFILE
+// output file.
+static void open_output_file(dbuf *f)
+{
+	deark *c = f->c;
+	char msgbuf[200];
+
+	f->btype = DBUF_TYPE_OFILE;
+
+	if(c->asyncwriter_data) {
+		de_asyncwriter_open_file(c, f);
+		register_open_file(f);
+		return;
+	}
+
+	// With "-opt dedup", an existing file may be a hard link to another
+	// output file, so replace it instead of overwriting it.
+	f->fp = de_fopen_for_write(c, f->name, msgbuf, sizeof(msgbuf),
+		c->overwrite_mode, c->dedup_data ? 0x4 : 0);
+
+	if(!f->fp) {
+		de_err(c, "Failed to write %s: %s", f->name, msgbuf);
+		f->btype = DBUF_TYPE_NULL;
+	}
+	else {
+		register_open_file(f);
+	}
+}
+
 dbuf *dbuf_create_output_file(deark *c, const char *ext, de_finfo *fi,
 	unsigned int createflags)
 {
 	char nbuf[500];
-	char msgbuf[200];
 	dbuf *f;
 	const char *basefn;
 	int file_index;
@@ -987,12 +1174,35 @@ dbuf *dbuf_create_output_file(deark *c, const char *ext, de_finfo *fi,
 	}
 
 	c->num_files_extracted++;
+	f->file_index = file_index;
+
+	if(c->index_wfile) {
+		f->report_to_index = 1;
+	}
+
+	if(c->json_output) {
+		f->report_as_json = 1;
+		f->module_id = c->cur_module_id;
+		if(!c->list_mode) {
+			f->crco_for_json = de_crcobj_create(c, DE_CRCOBJ_CRC32_IEEE);
+		}
+	}
 
-	if(c->extrlist_dbuf) {
+	if(c->extrlistfn) {
+		c->extrlistfn(c, f->name);
+	}
+	else if(c->extrlist_dbuf) {
 		dbuf_printf(c->extrlist_dbuf, "%s\n", f->name);
 		dbuf_flush(c->extrlist_dbuf);
 	}
 
+	if(c->recurse_mode && !(createflags&DE_CREATEFLAG_NORECURSE) &&
+		c->recursion_level < c->recurse_maxdepth)
+	{
+		de_snprintf(nbuf, sizeof(nbuf), "%s.%03d", basefn, file_index);
+		f->recursion_basefn = de_strdup(c, nbuf);
+	}
+
 	if(c->list_mode) {
 		f->btype = DBUF_TYPE_NULL;
 		de_msg(c, "%s", f->name);
@@ -1011,19 +1221,22 @@ dbuf *dbuf_create_output_file(deark *c, const char *ext, de_finfo *fi,
 		f->btype = DBUF_TYPE_STDOUT;
 		f->fp = stdout;
 	}
+	else if(c->dedup_data) {
+		// Keep the file in memory for now, so that if it turns out to be a
+		// duplicate, it doesn't have to be written. (See deark-dedup.c.)
+		de_msg(c, "Writing %s", f->name);
+		f->btype = DBUF_TYPE_MEMBUF;
+		f->dedup_pending = 1;
+	}
 	else {
 		de_msg(c, "Writing %s", f->name);
-		f->btype = DBUF_TYPE_OFILE;
-		f->fp = de_fopen_for_write(c, f->name, msgbuf, sizeof(msgbuf),
-			c->overwrite_mode, 0);
-
-		if(!f->fp) {
-			de_err(c, "Failed to write %s: %s", f->name, msgbuf);
-			f->btype = DBUF_TYPE_NULL;
-		}
+		open_output_file(f);
 	}
 
 done:
+	if(f->recursion_basefn && (f->btype!=DBUF_TYPE_MEMBUF || f->dedup_pending)) {
+		f->recursion_copy = dbuf_create_membuf(c, 0, 0);
+	}
 	de_free(c, name_from_finfo);
 	return f;
 }
@@ -1073,17 +1286,32 @@ static void membuf_append(dbuf *f, const u8 *m, i64 mlen)
 	f->len += mlen;
 }
 
-void dbuf_write(dbuf *f, const u8 *m, i64 len)
+static void write_to_recursion_copy(dbuf *f, const u8 *m, i64 len)
 {
-	if(f->writecallback_fn) {
-		f->writecallback_fn(f, m, len);
+	if(f->recursion_copy->len + len > f->c->recurse_maxsize) {
+		de_dbg(f->c, "[not decoding %s: file too large]", f->name);
+		dbuf_close(f->recursion_copy);
+		f->recursion_copy = NULL;
+		de_free(f->c, f->recursion_basefn);
+		f->recursion_basefn = NULL;
+		return;
 	}
+	dbuf_write(f->recursion_copy, m, len);
+}
 
+// Write to the file's underlying storage, ignoring callbacks, etc.
+static void write_to_storage(dbuf *f, const u8 *m, i64 len)
+{
 	if(f->btype==DBUF_TYPE_NULL) {
 		f->len += len;
 		return;
 	}
 	else if(f->btype==DBUF_TYPE_OFILE || f->btype==DBUF_TYPE_STDOUT) {
+		if(f->asyncfile) {
+			de_asyncwriter_write(f, m, len);
+			f->len += len;
+			return;
+		}
 		if(!f->fp) return;
 		if(f->c->debug_level>=3) {
 			de_dbg3(f->c, "writing %d bytes to %s", (int)len, f->name);
@@ -1103,6 +1331,52 @@ void dbuf_write(dbuf *f, const u8 *m, i64 len)
 	de_err(f->c, "Internal: Invalid output file type (%d)", f->btype);
 }
 
+// For "-opt dedup". Write a file that has been held in memory to disk, and
+// from now on, write to it directly. Its CRC is then calculated as it is
+// written, so that it can still be deduplicated when it's closed.
+static void dedup_spill_to_disk(dbuf *f)
+{
+	u8 *buf = f->membuf_buf;
+	i64 buf_len = f->len;
+
+	f->dedup_pending = 0;
+	f->membuf_buf = NULL;
+	f->membuf_alloc = 0;
+	f->len = 0;
+	open_output_file(f);
+	if(f->btype==DBUF_TYPE_OFILE) {
+		f->crco_for_dedup = de_crcobj_create(f->c, DE_CRCOBJ_CRC32_IEEE);
+		de_crcobj_addbuf(f->crco_for_dedup, buf, buf_len);
+	}
+	write_to_storage(f, buf, buf_len);
+	de_free(f->c, buf);
+}
+
+void dbuf_write(dbuf *f, const u8 *m, i64 len)
+{
+	if(f->dedup_pending && f->len + len > DE_DEDUP_MAX_PENDING) {
+		dedup_spill_to_disk(f);
+	}
+
+	if(f->writecallback_fn) {
+		f->writecallback_fn(f, m, len);
+	}
+
+	if(f->recursion_copy) {
+		write_to_recursion_copy(f, m, len);
+	}
+
+	if(f->crco_for_json) {
+		de_crcobj_addbuf(f->crco_for_json, m, len);
+	}
+
+	if(f->crco_for_dedup) {
+		de_crcobj_addbuf(f->crco_for_dedup, m, len);
+	}
+
+	write_to_storage(f, m, len);
+}
+
 void dbuf_writebyte(dbuf *f, u8 n)
 {
 	dbuf_write(f, &n, 1);
@@ -1300,7 +1574,7 @@ void dbuf_printf(dbuf *f, const char *fmt, ...)
 
 void dbuf_flush(dbuf *f)
 {
-	if(f->btype==DBUF_TYPE_OFILE) {
+	if(f->btype==DBUF_TYPE_OFILE && f->fp) {
 		fflush(f->fp);
 	}
 }
@@ -1324,6 +1598,7 @@ dbuf *dbuf_open_input_file(deark *c, const char *fn)
 		de_free(c, f);
 		return NULL;
 	}
+	register_open_file(f);
 
 	if(returned_flags & 0x1) {
 		// This "file" is actually a pipe.
@@ -1366,12 +1641,101 @@ dbuf *dbuf_open_input_subfile(dbuf *parent, i64 offset, i64 size)
 	return f;
 }
 
+// Create a read-only dbuf whose contents are produced on demand by fn, e.g.
+// by a decompressor. Only a window of recent data is retained, so it should
+// be read more or less sequentially. len is the expected length, or -1 if
+// unknown. Either way, if the stream ends early, f->len will be reduced when
+// that is discovered.
+// The caller must keep userdata valid until the dbuf is closed.
+dbuf *dbuf_open_input_stream(deark *c, i64 len, de_streamread_fn fn, void *userdata)
+{
+	dbuf *f;
+
+	f = de_malloc(c, sizeof(dbuf));
+	f->btype = DBUF_TYPE_STREAM;
+	f->c = c;
+	// An unknown length is treated as "very large". It's small enough that
+	// modules can add offsets to it without overflow.
+	f->len = (len>=0) ? len : DE_STREAM_MAX_LEN;
+	f->streamreadfn = fn;
+	f->userdata = userdata;
+	f->stream_window_alloc = DE_STREAM_WINDOW_SIZE;
+	f->cache = de_malloc(c, f->stream_window_alloc);
+	return f;
+}
+
+// For "-opt dedup". f is a complete output file that is still in memory.
+// If it's identical to an earlier file, create it as a hard link to that file.
+// Otherwise, write it in the usual way. Either way, f is then an ordinary
+// output file, ready to be closed.
+static void dedup_finish_pending(dbuf *f)
+{
+	deark *c = f->c;
+	struct de_crcobj *crco;
+	const char *existing_fn;
+	u8 *buf;
+	i64 buf_len;
+	u32 crc;
+	char msgbuf[200];
+
+	crco = de_crcobj_create(c, DE_CRCOBJ_CRC32_IEEE);
+	de_crcobj_addbuf(crco, f->membuf_buf, f->len);
+	crc = de_crcobj_getval(crco);
+	de_crcobj_destroy(crco);
+
+	existing_fn = de_dedup_find_identical(f, crc);
+
+	buf = f->membuf_buf;
+	buf_len = f->len;
+	f->dedup_pending = 0;
+	f->membuf_buf = NULL;
+	f->membuf_alloc = 0;
+	f->len = 0;
+
+	// Open the file even if it's going to be a link, so that the usual rules
+	// about overwriting existing files apply.
+	open_output_file(f);
+	if(f->btype!=DBUF_TYPE_OFILE) goto done;
+
+	if(existing_fn) {
+		// (Some systems can't replace a file that is open.)
+		de_fclose(f->fp);
+		f->fp = NULL;
+		if(de_replace_with_hard_link(c, existing_fn, f->name, msgbuf, sizeof(msgbuf))) {
+			de_dbg(c, "%s is identical to %s; made a hard link", f->name, existing_fn);
+			f->len = buf_len;
+			goto done;
+		}
+		de_dbg(c, "[failed to link %s to %s: %s]", f->name, existing_fn, msgbuf);
+
+		f->fp = de_fopen_for_write(c, f->name, msgbuf, sizeof(msgbuf),
+			DE_OVERWRITEMODE_STANDARD, 0);
+		if(!f->fp) {
+			de_err(c, "Failed to write %s: %s", f->name, msgbuf);
+			f->btype = DBUF_TYPE_NULL;
+			goto done;
+		}
+	}
+
+	write_to_storage(f, buf, buf_len);
+	de_dedup_record_file(f, crc);
+
+done:
+	de_free(c, buf);
+}
+
 void dbuf_close(dbuf *f)
 {
 	deark *c;
 	if(!f) return;
 	c = f->c;
 
+	if(f->dedup_pending) {
+		dedup_finish_pending(f);
+	}
+
+	unregister_open_file(f);
+
 	if(f->btype==DBUF_TYPE_MEMBUF && f->write_memfile_to_zip_archive) {
 		de_zip_add_file_to_archive(c, f);
 		if(f->name) {
@@ -1379,11 +1743,17 @@ void dbuf_close(dbuf *f)
 		}
 	}
 
-	if(f->btype==DBUF_TYPE_IFILE || f->btype==DBUF_TYPE_OFILE) {
+	if(f->btype==DBUF_TYPE_OFILE && f->asyncfile) {
+		if(f->name) {
+			de_dbg3(c, "closing file %s (async)", f->name);
+		}
+		de_asyncwriter_close_file(f);
+	}
+	else if(f->btype==DBUF_TYPE_IFILE || f->btype==DBUF_TYPE_OFILE) {
 		if(f->name) {
 			de_dbg3(c, "closing file %s", f->name);
 		}
-		de_fclose(f->fp);
+		if(f->fp) de_fclose(f->fp);
 		f->fp = NULL;
 
 		if(f->btype==DBUF_TYPE_OFILE && f->is_managed) {
@@ -1393,6 +1763,10 @@ void dbuf_close(dbuf *f)
 		if(f->btype==DBUF_TYPE_OFILE && f->is_managed && c->preserve_file_times) {
 			de_update_file_time(f);
 		}
+
+		if(f->crco_for_dedup) {
+			de_dedup_link_file(f);
+		}
 	}
 	else if(f->btype==DBUF_TYPE_FIFO) {
 		de_fclose(f->fp);
@@ -1410,12 +1784,31 @@ void dbuf_close(dbuf *f)
 	}
 	else if(f->btype==DBUF_TYPE_STDIN) {
 	}
+	else if(f->btype==DBUF_TYPE_STREAM) {
+	}
 	else if(f->btype==DBUF_TYPE_NULL) {
 	}
 	else {
 		de_err(c, "Internal: Don't know how to close this type of file (%d)", f->btype);
 	}
 
+	if(f->report_as_json) {
+		de_json_report_file(f);
+	}
+	if(f->report_to_index) {
+		de_index_file(f);
+	}
+	if(f->crco_for_json) de_crcobj_destroy(f->crco_for_json);
+	if(f->crco_for_dedup) de_crcobj_destroy(f->crco_for_dedup);
+
+	if(f->recursion_basefn) {
+		// The file has been written. Now decode it.
+		de_recurse_into_file(c, f->recursion_copy ? f->recursion_copy : f,
+			f->name, f->recursion_basefn);
+		de_free(c, f->recursion_basefn);
+	}
+	if(f->recursion_copy) dbuf_close(f->recursion_copy);
+
 	de_free(c, f->membuf_buf);
 	de_free(c, f->name);
 	de_free(c, f->cache);
@@ -0,0 +1,276 @@
+// This file is part of Deark.
+// Copyright (C) 2019 Jason Summers
+// See the file COPYING for terms of use.
+
+// deark-dedup.c
+//
+// Deduplication of output files ("-opt dedup").
+//
+// When an output file turns out to have the same contents as an earlier
+// output file, only one copy of the contents is kept.
+// With direct output, a new file is held in memory until it is closed (see
+// dbuf_write()). If an earlier file has the same contents, permissions, and
+// modification time, the new file is created as a hard link to it, and its
+// contents are never written. A file that gets too large to hold in memory
+// is written in the usual way, and its CRC is calculated as it is written.
+// When it is closed, if it matches an earlier file, it is replaced by a hard
+// link. With -zip, its ZIP member reuses the earlier member's compressed
+// data (see deark-miniz.c).
+//
+// Files are matched by size and CRC-32, and then by comparing the actual
+// contents.
+//
+// This information is shared by all the input files (in batch mode), so it's
+// allocated without a deark object, so that it's not subject to memory
+// tracking (see de_run()).
+
+#define DE_NOT_IN_MODULE
+#include "deark-config.h"
+#include "deark-private.h"
+
+#define DEDUP_HASH_SIZE 1024
+
+struct dedup_struct {
+	struct de_dedup_item *buckets[DEDUP_HASH_SIZE];
+};
+
+void de_dedup_start(deark *c)
+{
+	if(c->dedup_data) return;
+	c->dedup_data = de_malloc(NULL, sizeof(struct dedup_struct));
+}
+
+void de_dedup_destroy(deark *c)
+{
+	struct dedup_struct *dd = (struct dedup_struct*)c->dedup_data;
+	size_t k;
+
+	if(!dd) return;
+	for(k=0; k<DEDUP_HASH_SIZE; k++) {
+		struct de_dedup_item *item = dd->buckets[k];
+
+		while(item) {
+			struct de_dedup_item *next = item->next;
+
+			de_free(NULL, item->name);
+			de_free(NULL, item);
+			item = next;
+		}
+	}
+	de_free(NULL, dd);
+	c->dedup_data = NULL;
+}
+
+// Returns the next earlier file (after 'prev', or the first if prev is NULL)
+// that might have the same contents.
+struct de_dedup_item *de_dedup_find(deark *c, u32 crc, i64 len,
+	struct de_dedup_item *prev)
+{
+	struct dedup_struct *dd = (struct dedup_struct*)c->dedup_data;
+	struct de_dedup_item *item;
+
+	if(!dd) return NULL;
+	item = prev ? prev->next : dd->buckets[crc%DEDUP_HASH_SIZE];
+	while(item) {
+		if(item->crc==crc && item->len==len) return item;
+		item = item->next;
+	}
+	return NULL;
+}
+
+// Remember a file that has been written. For direct output, name is the
+// filename. For -zip, zip_file_index is the index of the ZIP member.
+// Returns the new item, or NULL.
+static struct de_dedup_item *record_item(deark *c, u32 crc, i64 len,
+	const char *name, i64 zip_file_index)
+{
+	struct dedup_struct *dd = (struct dedup_struct*)c->dedup_data;
+	struct de_dedup_item *item;
+	struct de_dedup_item **pnext;
+
+	if(!dd) return NULL;
+	item = de_malloc(NULL, sizeof(struct de_dedup_item));
+	item->crc = crc;
+	item->len = len;
+	if(name) item->name = de_strdup(NULL, name);
+	item->zip_file_index = zip_file_index;
+
+	// Add to the end of the list, so that the oldest file is found first.
+	pnext = &dd->buckets[crc%DEDUP_HASH_SIZE];
+	while(*pnext) {
+		pnext = &(*pnext)->next;
+	}
+	*pnext = item;
+	return item;
+}
+
+void de_dedup_record(deark *c, u32 crc, i64 len, const char *name,
+	i64 zip_file_index)
+{
+	(void)record_item(c, crc, len, name, zip_file_index);
+}
+
+static int timestamps_equal(const struct de_timestamp *ts1,
+	const struct de_timestamp *ts2)
+{
+	if(!ts1->is_valid || !ts2->is_valid) {
+		return (ts1->is_valid == ts2->is_valid);
+	}
+	return (ts1->ts_FILETIME==ts2->ts_FILETIME && ts1->precision==ts2->precision);
+}
+
+// The attributes that a hard link to f would share with f.
+static void get_file_attribs(dbuf *f, unsigned int *mode_flags,
+	struct de_timestamp *mod_time)
+{
+	*mode_flags = 0;
+	de_zeromem(mod_time, sizeof(struct de_timestamp));
+	if(f->fi_copy) {
+		*mode_flags = f->fi_copy->mode_flags;
+		if(f->c->preserve_file_times) {
+			*mod_time = f->fi_copy->mod_time;
+		}
+	}
+}
+
+// Returns 1 if the file named fn has the same contents as buf[0..len-1].
+static int file_equals_mem(deark *c, const char *fn, const u8 *buf, i64 len)
+{
+	FILE *fp = NULL;
+	i64 flen = 0;
+	i64 pos;
+	unsigned int returned_flags = 0;
+	char msgbuf[200];
+	u8 fbuf[4096];
+	int retval = 0;
+
+	fp = de_fopen_for_read(c, fn, &flen, msgbuf, sizeof(msgbuf), &returned_flags);
+	if(!fp) goto done;
+	if(flen!=len || (returned_flags&0x1)) goto done;
+
+	for(pos=0; pos<len; pos+=(i64)sizeof(fbuf)) {
+		size_t n;
+
+		n = (size_t)de_min_int((i64)sizeof(fbuf), len-pos);
+		if(fread(fbuf, 1, n, fp)!=n) goto done;
+		if(de_memcmp(fbuf, &buf[pos], n)) goto done;
+	}
+	retval = 1;
+
+done:
+	if(fp) de_fclose(fp);
+	return retval;
+}
+
+// Returns 1 if the files named fn1 and fn2 both have length len, and the
+// same contents.
+static int files_equal(deark *c, const char *fn1, const char *fn2, i64 len)
+{
+	FILE *fp1 = NULL;
+	FILE *fp2 = NULL;
+	i64 len1 = 0, len2 = 0;
+	i64 pos;
+	unsigned int returned_flags1 = 0, returned_flags2 = 0;
+	char msgbuf[200];
+	u8 buf1[4096];
+	u8 buf2[4096];
+	int retval = 0;
+
+	fp1 = de_fopen_for_read(c, fn1, &len1, msgbuf, sizeof(msgbuf), &returned_flags1);
+	if(!fp1) goto done;
+	fp2 = de_fopen_for_read(c, fn2, &len2, msgbuf, sizeof(msgbuf), &returned_flags2);
+	if(!fp2) goto done;
+	if(len1!=len || len2!=len) goto done;
+	if((returned_flags1&0x1) || (returned_flags2&0x1)) goto done;
+
+	for(pos=0; pos<len; pos+=(i64)sizeof(buf1)) {
+		size_t n;
+
+		n = (size_t)de_min_int((i64)sizeof(buf1), len-pos);
+		if(fread(buf1, 1, n, fp1)!=n) goto done;
+		if(fread(buf2, 1, n, fp2)!=n) goto done;
+		if(de_memcmp(buf1, buf2, n)) goto done;
+	}
+	retval = 1;
+
+done:
+	if(fp1) de_fclose(fp1);
+	if(fp2) de_fclose(fp2);
+	return retval;
+}
+
+// For direct output. Remember f, which has been written to disk, so that
+// later files can be linked to it.
+void de_dedup_record_file(dbuf *f, u32 crc)
+{
+	struct de_dedup_item *item;
+
+	if(!f->name) return;
+	item = record_item(f->c, crc, f->len, f->name, -1);
+	if(item) {
+		get_file_attribs(f, &item->mode_flags, &item->mod_time);
+	}
+}
+
+// For direct output. f is an output file whose CRC was calculated as it was
+// written. Call this after it has been closed, and its permissions and
+// timestamp have been set.
+// If an identical earlier file (including its permissions and timestamp, which
+// a hard link would share) exists, replace f with a hard link to it.
+// Otherwise, remember f, so later files can be linked to it.
+void de_dedup_link_file(dbuf *f)
+{
+	deark *c = f->c;
+	struct de_dedup_item *item = NULL;
+	unsigned int mode_flags;
+	struct de_timestamp mod_time;
+	u32 crc;
+	char msgbuf[200];
+
+	if(!f->crco_for_dedup || !f->name) return;
+	crc = de_crcobj_getval(f->crco_for_dedup);
+	get_file_attribs(f, &mode_flags, &mod_time);
+
+	while(1) {
+		item = de_dedup_find(c, crc, f->len, item);
+		if(!item) break;
+		if(!item->name) continue;
+		if(item->mode_flags!=mode_flags) continue;
+		if(!timestamps_equal(&item->mod_time, &mod_time)) continue;
+		if(!files_equal(c, item->name, f->name, f->len)) continue;
+
+		if(!de_replace_with_hard_link(c, item->name, f->name, msgbuf, sizeof(msgbuf))) {
+			de_dbg(c, "[failed to link %s to %s: %s]", f->name, item->name, msgbuf);
+			break;
+		}
+		de_dbg(c, "%s is identical to %s; made a hard link", f->name, item->name);
+		return;
+	}
+
+	de_dedup_record_file(f, crc);
+}
+
+// For direct output. f is a complete output file whose contents are still in
+// f->membuf_buf, and crc is their CRC.
+// Returns the name of an identical earlier file (including its permissions
+// and timestamp), or NULL if there isn't one.
+const char *de_dedup_find_identical(dbuf *f, u32 crc)
+{
+	deark *c = f->c;
+	struct de_dedup_item *item = NULL;
+	unsigned int mode_flags;
+	struct de_timestamp mod_time;
+
+	get_file_attribs(f, &mode_flags, &mod_time);
+	while(1) {
+		item = de_dedup_find(c, crc, f->len, item);
+		if(!item) break;
+		if(!item->name) continue;
+		if(item->mode_flags!=mode_flags) continue;
+		if(!timestamps_equal(&item->mod_time, &mod_time)) continue;
+		if(file_equals_mem(c, item->name, f->membuf_buf, f->len)) {
+			return item->name;
+		}
+	}
+	return NULL;
+}
@@ -9,6 +9,13 @@
 #include <deark-private.h>
 #include <deark-fmtutil.h>
 
+#ifndef DE_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#define DE_FMTUTIL_SSE2
+#include <emmintrin.h>
+#endif
+#endif
+
 void de_fmtutil_get_bmp_compression_name(u32 code, char *s, size_t s_len,
 	int is_os2v2)
 {
@@ -379,36 +386,119 @@ void de_fmtutil_handle_plist(deark *c, dbuf *f, i64 pos, i64 len,
 	de_run_module_by_id_on_slice(c, "plist", NULL, f, pos, len);
 }
 
+// Helpers for the decompressors below, so that they can read their input,
+// and write their output, in blocks instead of one byte at a time.
+
+#define FMTUTIL_INBUF_SIZE  4096
+#define FMTUTIL_OUTBUF_SIZE 8192
+
+struct fmtutil_reader {
+	dbuf *f;
+	i64 buf_pos; // Position in f of buf[0]
+	i64 buf_len;
+	u8 buf[FMTUTIL_INBUF_SIZE];
+};
+
+struct fmtutil_writer {
+	dbuf *outf;
+	i64 nbuffered;
+	u8 buf[FMTUTIL_OUTBUF_SIZE];
+};
+
+static void fmtutil_reader_init(struct fmtutil_reader *rd, dbuf *f)
+{
+	rd->f = f;
+	rd->buf_pos = 0;
+	rd->buf_len = 0;
+}
+
+// Returns a pointer to n bytes (n <= FMTUTIL_INBUF_SIZE/2) at file position pos.
+// Like dbuf_getbyte(), bytes past the end of the file read as 0.
+static const u8 *fmtutil_getbytes(struct fmtutil_reader *rd, i64 pos, i64 n)
+{
+	if(pos < rd->buf_pos || pos+n > rd->buf_pos+rd->buf_len) {
+		rd->buf_pos = pos;
+		rd->buf_len = FMTUTIL_INBUF_SIZE;
+		dbuf_read(rd->f, rd->buf, rd->buf_pos, rd->buf_len);
+	}
+	return &rd->buf[pos - rd->buf_pos];
+}
+
+// The number of bytes at pos that are already in the buffer (at most n).
+static i64 fmtutil_bytes_in_buf(struct fmtutil_reader *rd, i64 pos, i64 n)
+{
+	i64 avail = rd->buf_pos + rd->buf_len - pos;
+
+	if(pos < rd->buf_pos || avail<1) return 0;
+	return (avail<n) ? avail : n;
+}
+
+static void fmtutil_writer_init(struct fmtutil_writer *wr, dbuf *outf)
+{
+	wr->outf = outf;
+	wr->nbuffered = 0;
+}
+
+static void fmtutil_flush(struct fmtutil_writer *wr)
+{
+	if(wr->nbuffered<1) return;
+	dbuf_write(wr->outf, wr->buf, wr->nbuffered);
+	wr->nbuffered = 0;
+}
+
+// Returns a pointer to which the caller will write n bytes (n <=
+// FMTUTIL_OUTBUF_SIZE). The caller must then add n to wr->nbuffered.
+static u8 *fmtutil_reserve(struct fmtutil_writer *wr, i64 n)
+{
+	if(wr->nbuffered + n > FMTUTIL_OUTBUF_SIZE) {
+		fmtutil_flush(wr);
+	}
+	return &wr->buf[wr->nbuffered];
+}
+
+// The number of bytes written so far, including buffered bytes.
+// (For checking against a membuf's max_len, before the bytes are truncated.)
+#define FMTUTIL_WRITER_LEN(wr) ((wr)->outf->len + (wr)->nbuffered)
+
 // Returns 0 on failure (currently impossible).
 int de_fmtutil_uncompress_packbits(dbuf *f, i64 pos1, i64 len,
 	dbuf *unc_pixels, i64 *cmpr_bytes_consumed)
 {
 	i64 pos;
-	u8 b, b2;
+	u8 b;
 	i64 count;
 	i64 endpos;
+	const u8 *p;
+	struct fmtutil_reader rd;
+	struct fmtutil_writer wr;
 
 	pos = pos1;
 	endpos = pos1+len;
+	fmtutil_reader_init(&rd, f);
+	fmtutil_writer_init(&wr, unc_pixels);
 
 	while(1) {
-		if(unc_pixels->max_len>0 && unc_pixels->len>=unc_pixels->max_len) {
+		if(unc_pixels->max_len>0 && FMTUTIL_WRITER_LEN(&wr)>=unc_pixels->max_len) {
 			break; // Decompressed the requested amount of dst data.
 		}
 
 		if(pos>=endpos) {
 			break; // Reached the end of source data
 		}
-		b = dbuf_getbyte(f, pos++);
+		p = fmtutil_getbytes(&rd, pos, 129);
+		b = p[0];
+		pos++;
 
 		if(b>128) { // A compressed run
 			count = 257 - (i64)b;
-			b2 = dbuf_getbyte(f, pos++);
-			dbuf_write_run(unc_pixels, b2, count);
+			de_memset(fmtutil_reserve(&wr, count), p[1], (size_t)count);
+			wr.nbuffered += count;
+			pos++;
 		}
 		else if(b<128) { // An uncompressed run
 			count = 1 + (i64)b;
-			dbuf_copy(f, pos, count, unc_pixels);
+			de_memcpy(fmtutil_reserve(&wr, count), &p[1], (size_t)count);
+			wr.nbuffered += count;
 			pos += count;
 		}
 		// Else b==128. No-op.
@@ -417,6 +507,7 @@ int de_fmtutil_uncompress_packbits(dbuf *f, i64 pos1, i64 len,
 		// tell us what to do when code 128 is encountered.
 	}
 
+	fmtutil_flush(&wr);
 	if(cmpr_bytes_consumed) *cmpr_bytes_consumed = pos - pos1;
 	return 1;
 }
@@ -426,41 +517,55 @@ int de_fmtutil_uncompress_packbits16(dbuf *f, i64 pos1, i64 len,
 	dbuf *unc_pixels, i64 *cmpr_bytes_consumed)
 {
 	i64 pos;
-	u8 b, b1, b2;
-	i64 k;
+	u8 b;
 	i64 count;
 	i64 endpos;
+	const u8 *p;
+	u8 *q;
+	struct fmtutil_reader rd;
+	struct fmtutil_writer wr;
 
 	pos = pos1;
 	endpos = pos1+len;
+	fmtutil_reader_init(&rd, f);
+	fmtutil_writer_init(&wr, unc_pixels);
 
 	while(1) {
-		if(unc_pixels->max_len>0 && unc_pixels->len>=unc_pixels->max_len) {
+		if(unc_pixels->max_len>0 && FMTUTIL_WRITER_LEN(&wr)>=unc_pixels->max_len) {
 			break; // Decompressed the requested amount of dst data.
 		}
 
 		if(pos>=endpos) {
 			break; // Reached the end of source data
 		}
-		b = dbuf_getbyte(f, pos++);
+		p = fmtutil_getbytes(&rd, pos, 257);
+		b = p[0];
+		pos++;
 
 		if(b>128) { // A compressed run
+			i64 nfilled;
+
 			count = 257 - (i64)b;
-			b1 = dbuf_getbyte(f, pos++);
-			b2 = dbuf_getbyte(f, pos++);
-			for(k=0; k<count; k++) {
-				dbuf_writebyte(unc_pixels, b1);
-				dbuf_writebyte(unc_pixels, b2);
+			q = fmtutil_reserve(&wr, count*2);
+			q[0] = p[1];
+			q[1] = p[2];
+			// Fill the rest by repeatedly doubling the filled part.
+			for(nfilled=2; nfilled<count*2; nfilled*=2) {
+				de_memcpy(&q[nfilled], q, (size_t)de_min_int(nfilled, count*2-nfilled));
 			}
+			wr.nbuffered += count*2;
+			pos += 2;
 		}
 		else if(b<128) { // An uncompressed run
 			count = 1 + (i64)b;
-			dbuf_copy(f, pos, count*2, unc_pixels);
+			de_memcpy(fmtutil_reserve(&wr, count*2), &p[1], (size_t)(count*2));
+			wr.nbuffered += count*2;
 			pos += count*2;
 		}
 		// Else b==128. No-op.
 	}
 
+	fmtutil_flush(&wr);
 	if(cmpr_bytes_consumed) *cmpr_bytes_consumed = pos - pos1;
 	return 1;
 }
@@ -471,31 +576,50 @@ int de_fmtutil_decompress_rle90(dbuf *inf, i64 pos1, i64 len,
 	dbuf *outf, unsigned int has_maxlen, i64 max_out_len, unsigned int flags)
 {
 	i64 pos = pos1;
-	u8 b;
+	i64 endpos = pos1+len;
+	const u8 *p;
+	const u8 *p90;
 	u8 lastbyte = 0x00;
 	u8 countcode;
 	i64 count;
 	i64 nbytes_written = 0;
+	struct fmtutil_reader rd;
+	struct fmtutil_writer wr;
+
+	fmtutil_reader_init(&rd, inf);
+	fmtutil_writer_init(&wr, outf);
 
-	while(pos < pos1+len) {
+	while(pos < endpos) {
 		if(has_maxlen && nbytes_written>=max_out_len) break;
 
-		b = dbuf_getbyte(inf, pos);
-		pos++;
-		if(b!=0x90) {
-			dbuf_writebyte(outf, b);
-			nbytes_written++;
-			lastbyte = b;
+		p = fmtutil_getbytes(&rd, pos, 2);
+		if(p[0]!=0x90) {
+			// Copy all the bytes up to the next 0x90 code (or the end of the
+			// buffered input) at once.
+			count = fmtutil_bytes_in_buf(&rd, pos, endpos-pos);
+			if(count > FMTUTIL_OUTBUF_SIZE) count = FMTUTIL_OUTBUF_SIZE;
+			if(has_maxlen && count > max_out_len-nbytes_written) {
+				count = max_out_len-nbytes_written;
+			}
+			p90 = (const u8*)memchr(p, 0x90, (size_t)count);
+			if(p90) count = (i64)(p90-p);
+
+			de_memcpy(fmtutil_reserve(&wr, count), p, (size_t)count);
+			wr.nbuffered += count;
+			nbytes_written += count;
+			lastbyte = p[count-1];
+			pos += count;
 			continue;
 		}
 
 		// b = 0x90, which is a special code.
-		countcode = dbuf_getbyte(inf, pos);
-		pos++;
+		countcode = p[1];
+		pos += 2;
 
 		if(countcode==0x00) {
 			// Not RLE, just an escaped 0x90 byte.
-			dbuf_writebyte(outf, 0x90);
+			*fmtutil_reserve(&wr, 1) = 0x90;
+			wr.nbuffered++;
 			nbytes_written++;
 
 			// Here there is an inconsistency between different RLE90
@@ -518,13 +642,408 @@ int de_fmtutil_decompress_rle90(dbuf *inf, i64 pos1, i64 len,
 		if(has_maxlen && (nbytes_written+count > max_out_len)) {
 			count = max_out_len - nbytes_written;
 		}
-		dbuf_write_run(outf, lastbyte, count);
+		if(count>0) {
+			de_memset(fmtutil_reserve(&wr, count), lastbyte, (size_t)count);
+			wr.nbuffered += count;
+		}
 		nbytes_written += count;
 	}
 
+	fmtutil_flush(&wr);
+	return 1;
+}
+
+struct lzss_ctx {
+	dbuf *outf;
+	u8 *window;
+	unsigned int wmask;
+	unsigned int wpos;
+	unsigned int npending; // Bytes before wpos that haven't been written to outf
+};
+
+static void lzss_flush(struct lzss_ctx *lz)
+{
+	unsigned int start;
+
+	if(lz->npending<1) return;
+	start = (lz->wpos - lz->npending) & lz->wmask;
+	if(start + lz->npending > lz->wmask+1) {
+		// The pending bytes wrap around the end of the window
+		dbuf_write(lz->outf, &lz->window[start], (i64)(lz->wmask+1-start));
+		dbuf_write(lz->outf, lz->window, (i64)lz->wpos);
+	}
+	else {
+		dbuf_write(lz->outf, &lz->window[start], (i64)lz->npending);
+	}
+	lz->npending = 0;
+}
+
+// Decompress the common "LZSS" format popularized by Haruhiko Okumura's
+// LZSS.C, as used by (for example) MS-DOS SZDD files.
+// Each control byte is followed by 8 items, low bit first. A 1 bit means a
+// literal byte. A 0 bit means a match: 2 bytes, with a 12-bit window position
+// and a 4-bit length (+3).
+// The window is a ring buffer, and the output is written directly from it.
+int de_fmtutil_decompress_lzss1(dbuf *inf, i64 pos1, i64 len, dbuf *outf,
+	const struct de_lzss_params *lzp, i64 *bytes_consumed)
+{
+	struct lzss_ctx lz;
+	struct fmtutil_reader rd;
+	i64 pos = pos1;
+	i64 endpos = pos1+len;
+	i64 nbytes_written = 0;
+	i64 max_output_len;
+	u8 *window = NULL;
+
+	de_zeromem(&lz, sizeof(struct lzss_ctx));
+	window = de_malloc(inf->c, (i64)lzp->window_size);
+	de_memset(window, lzp->fill_byte, lzp->window_size);
+	lz.outf = outf;
+	lz.window = window;
+	lz.wmask = lzp->window_size-1;
+	lz.wpos = lzp->initial_wpos & lz.wmask;
+	max_output_len = lzp->has_max_output_len ? lzp->max_output_len : -1;
+	fmtutil_reader_init(&rd, inf);
+
+	while(1) {
+		unsigned int control;
+		unsigned int cbit;
+		const u8 *p;
+
+		if(pos >= endpos) break; // Out of input data
+		if(max_output_len>=0 && nbytes_written>=max_output_len) break;
+
+		// The most bytes a control byte and its items can use is 1+8*2.
+		p = fmtutil_getbytes(&rd, pos, 17);
+		control = (unsigned int)*p++;
+		pos++;
+
+		for(cbit=0x01; cbit&0xff; cbit<<=1) {
+			if(control & cbit) { // literal
+				window[lz.wpos] = *p++;
+				pos++;
+				lz.wpos = (lz.wpos+1) & lz.wmask;
+				lz.npending++;
+				nbytes_written++;
+			}
+			else { // match
+				unsigned int matchpos;
+				unsigned int matchlen;
+
+				matchpos = (unsigned int)p[0] | (((unsigned int)p[1] & 0xf0) << 4);
+				matchpos &= lz.wmask;
+				matchlen = ((unsigned int)p[1] & 0x0f) + 3;
+				p += 2;
+				pos += 2;
+				if(max_output_len>=0 && (i64)matchlen > max_output_len-nbytes_written) {
+					matchlen = (unsigned int)(max_output_len-nbytes_written);
+				}
+
+				if(matchpos+matchlen <= lz.wmask+1 && lz.wpos+matchlen <= lz.wmask+1 &&
+					(matchpos+matchlen <= lz.wpos || lz.wpos+matchlen <= matchpos))
+				{
+					// Neither the source nor the destination wraps, and they
+					// don't overlap.
+					de_memcpy(&window[lz.wpos], &window[matchpos], matchlen);
+					lz.wpos = (lz.wpos+matchlen) & lz.wmask;
+				}
+				else {
+					unsigned int k;
+
+					for(k=0; k<matchlen; k++) {
+						window[lz.wpos] = window[matchpos];
+						lz.wpos = (lz.wpos+1) & lz.wmask;
+						matchpos = (matchpos+1) & lz.wmask;
+					}
+				}
+				lz.npending += matchlen;
+				nbytes_written += matchlen;
+			}
+
+			if(max_output_len>=0 && nbytes_written>=max_output_len) goto done;
+			if(lz.npending >= lzp->window_size/2) {
+				lzss_flush(&lz);
+			}
+		}
+	}
+
+done:
+	lzss_flush(&lz);
+	if(bytes_consumed) *bytes_consumed = pos - pos1;
+	de_free(inf->c, window);
 	return 1;
 }
 
+struct lzw_tableentry {
+	i64 pos; // Where this code's string was written to the output (if not a root code)
+	u16 length;
+	u8 firstchar;
+	u8 value; // The byte value (if a root code)
+};
+
+struct de_lzwdecoder {
+	deark *c;
+	unsigned int flags;
+	u8 *outbuf;
+	i64 outbuf_size;
+	i64 outpos; // Total bytes decoded, including any that didn't fit in outbuf
+	i64 last_emit_pos; // Where the most recent code's string was written
+
+	unsigned int root_codesize;
+	unsigned int current_codesize;
+	unsigned int num_root_codes;
+	unsigned int clear_code;
+	unsigned int eoi_code;
+	int eoi_flag;
+	int ncodes_since_clear;
+	unsigned int oldcode;
+	unsigned int last_code_added;
+
+	u32 bitbuf;
+	unsigned int nbits_in_bitbuf;
+
+	unsigned int ct_used; // Number of items used in the code table
+	struct lzw_tableentry ct[4096]; // Code table
+};
+
+static void lzwdec_clear(struct de_lzwdecoder *lz)
+{
+	lz->ct_used = lz->num_root_codes+2;
+	lz->current_codesize = lz->root_codesize+1;
+	lz->ncodes_since_clear = 0;
+	lz->oldcode = 0;
+}
+
+// Write the string for a code to the output buffer.
+// A non-root code's string is the string of its parent code plus one byte,
+// and is already present in the output, at the position recorded when the
+// code was added. So it can be copied all at once, instead of by walking
+// the chain of parent codes.
+static void lzwdec_emit_code(struct de_lzwdecoder *lz, unsigned int code)
+{
+	const struct lzw_tableentry *e = &lz->ct[code];
+	i64 dpos = lz->outpos;
+	i64 n;
+
+	lz->last_emit_pos = dpos;
+	lz->outpos += (i64)e->length;
+	if(dpos >= lz->outbuf_size) return;
+
+	if(e->length==1) {
+		lz->outbuf[dpos] = e->value;
+		return;
+	}
+
+	n = (i64)e->length;
+	if(n > lz->outbuf_size-dpos) n = lz->outbuf_size-dpos;
+
+	if(e->pos + (i64)e->length <= dpos) {
+		de_memcpy(&lz->outbuf[dpos], &lz->outbuf[e->pos], (size_t)n);
+	}
+	else {
+		// This is the "KwKwK" case: the string ends with the byte we are
+		// about to write, which is the same as its first byte.
+		if(n == (i64)e->length) {
+			de_memcpy(&lz->outbuf[dpos], &lz->outbuf[e->pos], (size_t)(n-1));
+			lz->outbuf[dpos+n-1] = e->firstchar;
+		}
+		else {
+			de_memcpy(&lz->outbuf[dpos], &lz->outbuf[e->pos], (size_t)n);
+		}
+	}
+}
+
+// Add <oldcode>val to the dictionary. oldcode_pos is where oldcode's
+// string was written.
+// Returns 1 if successful, 2 if table is full, 0 on error.
+static int lzwdec_add_to_dict(struct de_lzwdecoder *lz, unsigned int oldcode,
+	i64 oldcode_pos, u8 val)
+{
+	static const unsigned int last_code_of_size[] = {
+		// The first 3 values are unused.
+		0,0,0,7,15,31,63,127,255,511,1023,2047,4095
+	};
+	unsigned int newpos;
+	unsigned int early;
+
+	if(lz->ct_used>=4096) {
+		lz->last_code_added = 0;
+		return 2;
+	}
+
+	newpos = lz->ct_used;
+	if(oldcode >= newpos) return 0;
+	lz->ct_used++;
+
+	lz->ct[newpos].pos = oldcode_pos;
+	lz->ct[newpos].length = lz->ct[oldcode].length + 1;
+	lz->ct[newpos].firstchar = lz->ct[oldcode].firstchar;
+	lz->ct[newpos].value = val;
+
+	// If we've used the last code of this size, we need to increase the codesize.
+	early = (lz->flags & DE_LZWFLAG_EARLYCHANGE) ? 1 : 0;
+	if(newpos + early == last_code_of_size[lz->current_codesize]) {
+		if(lz->current_codesize<12) {
+			lz->current_codesize++;
+		}
+	}
+
+	lz->last_code_added = newpos;
+	return 1;
+}
+
+static int lzwdec_process_code(struct de_lzwdecoder *lz, unsigned int code)
+{
+	i64 oldcode_pos;
+	int ret;
+
+	if(code==lz->eoi_code) {
+		lz->eoi_flag = 1;
+		return 1;
+	}
+
+	if(code==lz->clear_code) {
+		lzwdec_clear(lz);
+		return 1;
+	}
+
+	lz->ncodes_since_clear++;
+
+	if(lz->ncodes_since_clear==1) {
+		// Special case for the first code. Only root codes are valid here.
+		// (Codes above them may still have entries left from before the
+		// clear code, so checking their length isn't enough.)
+		if(code >= lz->ct_used) return 0;
+		lzwdec_emit_code(lz, code);
+		lz->oldcode = code;
+		return 1;
+	}
+
+	oldcode_pos = lz->last_emit_pos;
+
+	if(code < lz->ct_used) {
+		// Code is in the table.
+		lzwdec_emit_code(lz, code);
+
+		// Let k = the first character of the translation of the code.
+		// Add <oldcode>k to the dictionary.
+		ret = lzwdec_add_to_dict(lz, lz->oldcode, oldcode_pos, lz->ct[code].firstchar);
+		if(ret==0) return 0;
+	}
+	else {
+		// Code is not in the table.
+		if(lz->oldcode>=lz->ct_used) return 0;
+
+		// Let k = the first char of the translation of oldcode.
+		// Add <oldcode>k to the dictionary, and write it to the output.
+		ret = lzwdec_add_to_dict(lz, lz->oldcode, oldcode_pos, lz->ct[lz->oldcode].firstchar);
+		if(ret==0) return 0;
+		if(ret==1) {
+			lzwdec_emit_code(lz, lz->last_code_added);
+		}
+	}
+	lz->oldcode = code;
+	return 1;
+}
+
+// LZW decoder for GIF- and TIFF-style compression, with a clear code and an
+// end-of-information code, and a maximum code size of 12 bits.
+// The decompressed bytes are written to outbuf. Anything that doesn't fit
+// is discarded.
+// Prints an error and returns NULL if root_codesize is invalid.
+struct de_lzwdecoder *de_fmtutil_lzwdec_create(deark *c, unsigned int root_codesize,
+	unsigned int flags, u8 *outbuf, i64 outbuf_size)
+{
+	struct de_lzwdecoder *lz;
+	unsigned int i;
+
+	if(root_codesize<2 || root_codesize>11) {
+		de_err(c, "Invalid LZW root codesize (%u)", root_codesize);
+		return NULL;
+	}
+
+	lz = de_malloc(c, sizeof(struct de_lzwdecoder));
+	lz->c = c;
+	lz->flags = flags;
+	lz->outbuf = outbuf;
+	lz->outbuf_size = outbuf_size;
+	lz->root_codesize = root_codesize;
+	lz->num_root_codes = 1U<<lz->root_codesize;
+	lz->clear_code = lz->num_root_codes;
+	lz->eoi_code = lz->num_root_codes+1;
+	for(i=0; i<lz->num_root_codes; i++) {
+		lz->ct[i].length = 1;
+		lz->ct[i].value = (u8)i;
+		lz->ct[i].firstchar = (u8)i;
+	}
+	lzwdec_clear(lz);
+	return lz;
+}
+
+// Decode as much as possible of the provided LZW-encoded data.
+// Any unfinished business is recorded, to be continued the next time
+// this function is called. Does nothing after the end-of-information code
+// has been seen.
+// Returns 0 if the data is corrupt. It is up to the caller to report it.
+int de_fmtutil_lzwdec_process_bytes(struct de_lzwdecoder *lz, const u8 *data, i64 data_size)
+{
+	i64 i;
+	int msbfirst = (lz->flags & DE_LZWFLAG_MSBFIRST) ? 1 : 0;
+	u32 bitbuf = lz->bitbuf;
+	unsigned int nbits = lz->nbits_in_bitbuf;
+	int retval = 0;
+
+	for(i=0; i<data_size; i++) {
+		if(lz->eoi_flag) break;
+
+		if(msbfirst) {
+			bitbuf = (bitbuf<<8) | (u32)data[i];
+		}
+		else {
+			bitbuf |= (u32)data[i] << nbits;
+		}
+		nbits += 8;
+
+		// The code size can change after any code, so it has to be
+		// re-read each time.
+		while(nbits >= lz->current_codesize) {
+			unsigned int codesize = lz->current_codesize;
+			unsigned int code;
+
+			if(msbfirst) {
+				code = (unsigned int)(bitbuf >> (nbits-codesize)) & ((1U<<codesize)-1);
+			}
+			else {
+				code = (unsigned int)bitbuf & ((1U<<codesize)-1);
+				bitbuf >>= codesize;
+			}
+			nbits -= codesize;
+
+			if(!lzwdec_process_code(lz, code)) goto done;
+			if(lz->eoi_flag) break;
+		}
+	}
+	retval = 1;
+
+done:
+	lz->bitbuf = bitbuf;
+	lz->nbits_in_bitbuf = nbits;
+	return retval;
+}
+
+// Returns the number of bytes decoded so far, including any that didn't fit
+// in the output buffer.
+i64 de_fmtutil_lzwdec_get_nbytes_decoded(struct de_lzwdecoder *lz)
+{
+	return lz->outpos;
+}
+
+void de_fmtutil_lzwdec_destroy(struct de_lzwdecoder *lz)
+{
+	if(!lz) return;
+	de_free(lz->c, lz);
+}
+
 // Caller allocates sdd. It does not need to be initialized.
 // flags: 0x1 = Print a debug message if signature is found.
 int de_fmtutil_detect_SAUCE(deark *c, dbuf *f, struct de_SAUCE_detection_data *sdd,
@@ -805,6 +1324,138 @@ static u8 scale_15_to_255(u8 x)
 	return x*17;
 }
 
+// Gather the bytes for 8 pixels (byte-column k) of planar data into a 64-bit
+// 8x8 bit matrix: byte r is the byte from plane r (or, with
+// DE_PLANARFLAG_FIRSTPLANEHIGH, plane nplanes-1-r).
+static u64 planar_gather_column(const u8 *src, i64 nplanes, i64 planespan,
+	i64 groupspan, i64 k, unsigned int flags)
+{
+	const u8 *s = &src[(k/2)*groupspan + k%2];
+	u64 x = 0;
+	i64 p;
+
+	if(flags & DE_PLANARFLAG_FIRSTPLANEHIGH) {
+		for(p=0; p<nplanes; p++) {
+			x |= (u64)s[p*planespan] << (8*(nplanes-1-p));
+		}
+	}
+	else {
+		for(p=0; p<nplanes; p++) {
+			x |= (u64)s[p*planespan] << (8*p);
+		}
+	}
+	return x;
+}
+
+// Transpose an 8x8 bit matrix, in which bit c of byte r is element (r,c).
+// (The classic three-step swap; see "Hacker's Delight", section 7-3.)
+static u64 transpose8x8(u64 x)
+{
+	u64 t;
+
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+// Convert planar image data to "chunky" pixels, one byte per pixel, in
+// which bit p is taken from plane p.
+// The data is in groups of 16 pixels, with one 2-byte big-endian word per
+// plane, most significant bit first. The word for plane p of group g is at
+// src[g*groupspan + p*planespan]. Common layouts:
+//   Planes stored one after the other (ILBM, PCX):
+//     planespan = bytes per plane, groupspan = 2
+//   Word-interleaved (Atari ST): planespan = 2, groupspan = 2*nplanes
+// Only the bytes needed for npixels pixels are read, so the rows of
+// plane data need not be padded to a multiple of 16 pixels unless the
+// layout requires it.
+// nplanes must be 1 to 8.
+void de_fmtutil_planar_to_chunky(const u8 *src, i64 nplanes, i64 planespan,
+	i64 groupspan, i64 npixels, u8 *dst, unsigned int flags)
+{
+	i64 ncols_full = npixels/8;
+	i64 k = 0;
+	i64 i;
+	u64 x;
+
+	if(nplanes<1 || nplanes>8) return;
+
+#ifdef DE_FMTUTIL_SSE2
+	// Transpose two byte-columns at a time, one in each 64-bit lane.
+	// The result has pixel 0 in the high byte of each lane, so the bytes
+	// are reversed before storing.
+	{
+		const __m128i m1 = _mm_set1_epi64x(0x00aa00aa00aa00aaLL);
+		const __m128i m2 = _mm_set1_epi64x(0x0000cccc0000ccccLL);
+		const __m128i m3 = _mm_set1_epi64x(0x00000000f0f0f0f0LL);
+
+		for(; k+2<=ncols_full; k+=2) {
+			__m128i v, t;
+
+			v = _mm_set_epi64x(
+				(long long)planar_gather_column(src, nplanes, planespan, groupspan, k+1, flags),
+				(long long)planar_gather_column(src, nplanes, planespan, groupspan, k, flags));
+			t = _mm_and_si128(_mm_xor_si128(v, _mm_srli_epi64(v, 7)), m1);
+			v = _mm_xor_si128(_mm_xor_si128(v, t), _mm_slli_epi64(t, 7));
+			t = _mm_and_si128(_mm_xor_si128(v, _mm_srli_epi64(v, 14)), m2);
+			v = _mm_xor_si128(_mm_xor_si128(v, t), _mm_slli_epi64(t, 14));
+			t = _mm_and_si128(_mm_xor_si128(v, _mm_srli_epi64(v, 28)), m3);
+			v = _mm_xor_si128(_mm_xor_si128(v, t), _mm_slli_epi64(t, 28));
+
+			v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0,1,2,3));
+			v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0,1,2,3));
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+			_mm_storeu_si128((__m128i*)&dst[k*8], v);
+		}
+	}
+#endif
+
+	for(; k<ncols_full; k++) {
+		x = transpose8x8(planar_gather_column(src, nplanes, planespan, groupspan, k, flags));
+		for(i=0; i<8; i++) {
+			dst[k*8+i] = (u8)(x >> (8*(7-i)));
+		}
+	}
+
+	if(npixels%8) {
+		x = transpose8x8(planar_gather_column(src, nplanes, planespan, groupspan, k, flags));
+		for(i=0; i<npixels%8; i++) {
+			dst[k*8+i] = (u8)(x >> (8*(7-i)));
+		}
+	}
+}
+
+// Like de_fmtutil_planar_to_chunky(), but reads from a dbuf, for layouts in
+// which each plane's data for the row is contiguous (groupspan = 2).
+// Each plane is read separately, so planespan can be large (e.g. when each
+// plane of the whole image is stored in full, one after the other).
+void de_fmtutil_planar_to_chunky_dbuf(dbuf *f, i64 pos, i64 nplanes,
+	i64 planespan, i64 npixels, u8 *dst, unsigned int flags)
+{
+#define PLANAR_CHUNK_PIXELS 1024
+	u8 buf[8*(PLANAR_CHUNK_PIXELS/8)];
+	i64 i;
+	i64 p;
+
+	if(nplanes<1 || nplanes>8) return;
+
+	for(i=0; i<npixels; i+=PLANAR_CHUNK_PIXELS) {
+		i64 n = de_min_int(npixels-i, PLANAR_CHUNK_PIXELS);
+
+		for(p=0; p<nplanes; p++) {
+			dbuf_read(f, &buf[p*(PLANAR_CHUNK_PIXELS/8)], pos + p*planespan + i/8,
+				(n+7)/8);
+		}
+		de_fmtutil_planar_to_chunky(buf, nplanes, PLANAR_CHUNK_PIXELS/8, 2, n,
+			&dst[i], flags);
+	}
+#undef PLANAR_CHUNK_PIXELS
+}
+
 void de_fmtutil_read_atari_palette(deark *c, dbuf *f, i64 pos,
 	u32 *dstpal, i64 ncolors_to_read, i64 ncolors_used, unsigned int flags)
 {
@@ -941,12 +1592,12 @@ static unsigned int spectrum512_FindIndex(i64 x, unsigned int c)
 static int decode_atari_image_paletted(deark *c, struct atari_img_decode_data *adata)
 {
 	i64 i, j;
-	i64 plane;
 	i64 rowspan;
-	u8 b;
 	u32 v;
 	i64 planespan;
 	i64 ncolors;
+	u8 *rowbuf = NULL;
+	u8 *row_chunky = NULL;
 
 	planespan = 2*((adata->w+15)/16);
 	rowspan = planespan*adata->bpp;
@@ -955,37 +1606,24 @@ static int decode_atari_image_paletted(deark *c, struct atari_img_decode_data *a
 	else
 		ncolors = ((i64)1)<<adata->bpp;
 
+	rowbuf = de_malloc(c, rowspan);
+	row_chunky = de_malloc(c, planespan*8);
+
 	for(j=0; j<adata->h; j++) {
-		for(i=0; i<adata->w; i++) {
-			v = 0;
+		dbuf_read(adata->unc_pixels, rowbuf, j*rowspan, rowspan);
+		if(adata->was_compressed==0) {
+			// Uncompressed images use the native ST screen layout, in which
+			// the planes are interleaved a 16-bit word at a time.
+			de_fmtutil_planar_to_chunky(rowbuf, adata->bpp, 2, 2*adata->bpp,
+				adata->w, row_chunky, 0);
+		}
+		else {
+			de_fmtutil_planar_to_chunky(rowbuf, adata->bpp, planespan, 2,
+				adata->w, row_chunky, 0);
+		}
 
-			for(plane=0; plane<adata->bpp; plane++) {
-				if(adata->was_compressed==0) {
-					// TODO: Simplify this.
-					if(adata->bpp==1) {
-						b = de_get_bits_symbol(adata->unc_pixels, 1, j*rowspan, i);
-					}
-					else if(adata->bpp==2) {
-						b = de_get_bits_symbol(adata->unc_pixels, 1,
-							j*rowspan + 2*plane + (i/16)*2, i);
-					}
-					else if(adata->bpp==4) {
-						b = de_get_bits_symbol(adata->unc_pixels, 1,
-							j*rowspan + 2*plane + (i/2-(i/2)%16)+8*((i%32)/16), i%16);
-					}
-					else if(adata->bpp==8) {
-						b = de_get_bits_symbol(adata->unc_pixels, 1,
-							j*rowspan + 2*plane + (i-i%16), i%16);
-					}
-					else {
-						b = 0;
-					}
-				}
-				else {
-					b = de_get_bits_symbol(adata->unc_pixels, 1, j*rowspan + plane*planespan, i);
-				}
-				if(b) v |= 1<<plane;
-			}
+		for(i=0; i<adata->w; i++) {
+			v = row_chunky[i];
 
 			if(adata->is_spectrum512) {
 				v = spectrum512_FindIndex(i, v);
@@ -998,6 +1636,9 @@ static int decode_atari_image_paletted(deark *c, struct atari_img_decode_data *a
 			de_bitmap_setpixel_rgb(adata->img, i, j, adata->pal[v]);
 		}
 	}
+
+	de_free(c, rowbuf);
+	de_free(c, row_chunky);
 	return 1;
 }
 
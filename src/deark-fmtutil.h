@@ -67,6 +67,26 @@ int de_fmtutil_uncompress_packbits16(dbuf *f, i64 pos1, i64 len,
 int de_fmtutil_decompress_rle90(dbuf *inf, i64 pos1, i64 len,
 	dbuf *outf, unsigned int has_maxlen, i64 max_out_len, unsigned int flags);
 
+struct de_lzss_params {
+	unsigned int window_size; // Must be a power of 2, at least 256. Usually 4096.
+	unsigned int initial_wpos; // Usually window_size-16 or window_size-18.
+	u8 fill_byte; // Initial value of the window bytes
+	u8 has_max_output_len;
+	i64 max_output_len;
+};
+int de_fmtutil_decompress_lzss1(dbuf *inf, i64 pos1, i64 len, dbuf *outf,
+	const struct de_lzss_params *lzp, i64 *bytes_consumed);
+
+// Flags for de_fmtutil_lzwdec_create()
+#define DE_LZWFLAG_MSBFIRST    0x1 // Codes are packed MSB-first (TIFF), not LSB-first (GIF)
+#define DE_LZWFLAG_EARLYCHANGE 0x2 // The code size increases one code early (TIFF)
+struct de_lzwdecoder;
+struct de_lzwdecoder *de_fmtutil_lzwdec_create(deark *c, unsigned int root_codesize,
+	unsigned int flags, u8 *outbuf, i64 outbuf_size);
+int de_fmtutil_lzwdec_process_bytes(struct de_lzwdecoder *lz, const u8 *data, i64 data_size);
+i64 de_fmtutil_lzwdec_get_nbytes_decoded(struct de_lzwdecoder *lz);
+void de_fmtutil_lzwdec_destroy(struct de_lzwdecoder *lz);
+
 struct de_SAUCE_info {
 	int is_valid;
 	de_ucstring *title;
@@ -136,6 +156,13 @@ void de_fmtutil_read_boxes_format(deark *c, struct de_boxesctx *bctx);
 void de_fmtutil_render_uuid(deark *c, const u8 *uuid, char *s, size_t s_len);
 void de_fmtutil_guid_to_uuid(u8 *id);
 
+// Flags for de_fmtutil_planar_to_chunky()
+#define DE_PLANARFLAG_FIRSTPLANEHIGH 0x1 // The first plane is the most significant bit
+void de_fmtutil_planar_to_chunky(const u8 *src, i64 nplanes, i64 planespan,
+	i64 groupspan, i64 npixels, u8 *dst, unsigned int flags);
+void de_fmtutil_planar_to_chunky_dbuf(dbuf *f, i64 pos, i64 nplanes,
+	i64 planespan, i64 npixels, u8 *dst, unsigned int flags);
+
 struct atari_img_decode_data {
 	i64 bpp;
 	i64 ncolors;
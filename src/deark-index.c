@@ -0,0 +1,259 @@
+// This file is part of Deark.
+// Copyright (C) 2019 Jason Summers
+// See the file COPYING for terms of use.
+
+// deark-index.c
+//
+// Archive member index files ("-opt index:write=<file>",
+// "-opt index:read=<file>").
+//
+// While an archive is being processed, the index records where each member
+// starts, and how many output files came before it. When the same archive is
+// processed again with -get or -firstfile, the module can use the index to
+// go straight to the right member, instead of reading all the earlier
+// members' headers.
+//
+// Only modules that process a simple sequence of independent members (tar,
+// cpio, lha) use this. Such a module calls de_index_find_start() to get the
+// position of the first member to read, and de_index_member() at the start
+// of each member. Only the top-level input file is indexed, not files found
+// inside it (by nested modules, or by -r).
+//
+// Index file format (integers are little-endian):
+//  Header:
+//   8 bytes  signature "DEARKIDX"
+//   4 bytes  format version (2)
+//   8 bytes  size of the input file
+//   4 bytes  CRC-32 of the first 64KB of the input file (or all of it)
+//   4 bytes  CRC-32 of the last 64KB of the input file (or all of it)
+//   1 byte   length of the module ID
+//   n bytes  module ID
+//  Followed by any number of records:
+//   'M' (member):
+//     8 bytes  offset of the member
+//     4 bytes  number of output files before this member
+//   'F' (output file, for information only):
+//     4 bytes  file number
+//     8 bytes  file size, or -1 if unknown
+//     2 bytes  length of the filename
+//     n bytes  filename (UTF-8)
+
+#define DE_NOT_IN_MODULE
+#include "deark-config.h"
+#include "deark-private.h"
+
+#define DE_INDEX_SIGNATURE "DEARKIDX"
+#define DE_INDEX_VERSION 2
+#define DE_INDEX_FINGERPRINT_LEN 65536
+
+// Returns 1 if we're processing the top-level input file, and not a nested
+// or recursively-processed file.
+static int index_is_top_level(deark *c)
+{
+	return (c->module_nesting_level==1 && c->recursion_level==0);
+}
+
+// A cheap way to notice that the input file is not the one that was indexed,
+// without reading all of it.
+static void calc_fingerprint(deark *c, dbuf *f, u32 *pcrc_head, u32 *pcrc_tail)
+{
+	struct de_crcobj *crco;
+	i64 n;
+
+	n = de_min_int(f->len, DE_INDEX_FINGERPRINT_LEN);
+	crco = de_crcobj_create(c, DE_CRCOBJ_CRC32_IEEE);
+	de_crcobj_addslice(crco, f, 0, n);
+	*pcrc_head = de_crcobj_getval(crco);
+	de_crcobj_reset(crco);
+	de_crcobj_addslice(crco, f, f->len - n, n);
+	*pcrc_tail = de_crcobj_getval(crco);
+	de_crcobj_destroy(crco);
+}
+
+// Called before the main module runs.
+void de_index_begin(deark *c)
+{
+	const char *fn;
+	const char *module_id;
+	size_t idlen;
+	u32 crc_head, crc_tail;
+
+	if(c->index_wfile) return;
+	fn = de_get_ext_option(c, "index:write");
+	if(!fn || !c->main_module_id || !c->infile) return;
+
+	// Each input file would overwrite the previous file's index.
+	if(c->batch_mode) {
+		de_err(c, "\"-opt index:write\" can't be used with multiple input files");
+		return;
+	}
+
+	c->index_wfile = dbuf_create_unmanaged_file(c, fn, DE_OVERWRITEMODE_STANDARD, 0);
+	if(c->index_wfile->btype==DBUF_TYPE_NULL) {
+		dbuf_close(c->index_wfile);
+		c->index_wfile = NULL;
+		return;
+	}
+
+	module_id = c->main_module_id;
+	idlen = de_strlen(module_id);
+	if(idlen>255) idlen = 255;
+
+	dbuf_write(c->index_wfile, (const u8*)DE_INDEX_SIGNATURE, 8);
+	dbuf_writeu32le(c->index_wfile, DE_INDEX_VERSION);
+	dbuf_writeu64le(c->index_wfile, (u64)c->infile->len);
+	calc_fingerprint(c, c->infile, &crc_head, &crc_tail);
+	dbuf_writeu32le(c->index_wfile, (i64)crc_head);
+	dbuf_writeu32le(c->index_wfile, (i64)crc_tail);
+	dbuf_writebyte(c->index_wfile, (u8)idlen);
+	dbuf_write(c->index_wfile, (const u8*)module_id, (i64)idlen);
+}
+
+// Called after the main module has finished.
+void de_index_end(deark *c)
+{
+	if(!c->index_wfile) return;
+	dbuf_close(c->index_wfile);
+	c->index_wfile = NULL;
+}
+
+// Records that a member starts at offset 'pos' of the input file.
+// Members of nested files are not recorded.
+void de_index_member(deark *c, i64 pos)
+{
+	if(!c->index_wfile) return;
+	if(!index_is_top_level(c)) return;
+
+	dbuf_writebyte(c->index_wfile, 'M');
+	dbuf_writeu64le(c->index_wfile, (u64)pos);
+	dbuf_writeu32le(c->index_wfile, (i64)c->file_count);
+}
+
+// Called when an output file is closed.
+void de_index_file(dbuf *f)
+{
+	deark *c = f->c;
+	i64 namelen;
+	i64 size;
+
+	if(!c->index_wfile) return;
+	// Files extracted by -r are numbered separately.
+	if(c->recursion_level!=0) return;
+
+	namelen = f->name ? (i64)de_strlen(f->name) : 0;
+	if(namelen>0xffff) namelen = 0xffff;
+	size = c->list_mode ? -1 : f->len;
+
+	dbuf_writebyte(c->index_wfile, 'F');
+	dbuf_writeu32le(c->index_wfile, (i64)f->file_index);
+	dbuf_writeu64le(c->index_wfile, (u64)size);
+	dbuf_writeu16le(c->index_wfile, namelen);
+	if(namelen>0) {
+		dbuf_write(c->index_wfile, (const u8*)f->name, namelen);
+	}
+}
+
+// Returns 1 if the index file's header matches the current input file and
+// module.
+static int index_header_ok(deark *c, dbuf *inf, i64 *ppos)
+{
+	i64 pos = 0;
+	i64 idlen;
+	char idbuf[256];
+	u32 crc_head, crc_tail;
+
+	if(dbuf_memcmp(inf, 0, DE_INDEX_SIGNATURE, 8)) return 0;
+	pos += 8;
+	if(dbuf_getu32le_p(inf, &pos) != DE_INDEX_VERSION) return 0;
+	if(dbuf_geti64le(inf, pos) != c->infile->len) return 0;
+	pos += 8;
+	calc_fingerprint(c, c->infile, &crc_head, &crc_tail);
+	if(dbuf_getu32le_p(inf, &pos) != (i64)crc_head) return 0;
+	if(dbuf_getu32le_p(inf, &pos) != (i64)crc_tail) return 0;
+	idlen = (i64)dbuf_getbyte_p(inf, &pos);
+	dbuf_read(inf, (u8*)idbuf, pos, idlen);
+	idbuf[idlen] = '\0';
+	pos += idlen;
+	if(!c->cur_module_id || de_strcmp(idbuf, c->cur_module_id)) return 0;
+
+	*ppos = pos;
+	return 1;
+}
+
+// If an index file is available, and it tells us where to find the first
+// file that was requested (with -get or -firstfile), returns the offset of
+// the member to start at, and updates c->file_count to account for the
+// files that are being skipped.
+// Otherwise, returns pos1, the offset of the first member.
+i64 de_index_find_start(deark *c, i64 pos1)
+{
+	const char *fn;
+	dbuf *inf = NULL;
+	i64 pos;
+	i64 best_pos = pos1;
+	i64 best_count = -1;
+	i64 target;
+
+	if(!index_is_top_level(c)) goto done;
+	if(c->first_output_file<1) goto done;
+	fn = de_get_ext_option(c, "index:read");
+	if(!fn) goto done;
+
+	inf = dbuf_open_input_file(c, fn);
+	if(!inf) goto done;
+
+	if(!index_header_ok(c, inf, &pos)) {
+		de_warn(c, "Index file %s does not match this file. Ignoring it.", fn);
+		goto done;
+	}
+
+	target = (i64)c->first_output_file;
+	while(pos < inf->len) {
+		u8 rectype;
+
+		rectype = dbuf_getbyte_p(inf, &pos);
+		if(rectype=='M') {
+			i64 mpos, count;
+
+			mpos = dbuf_geti64le(inf, pos);
+			pos += 8;
+			count = dbuf_getu32le_p(inf, &pos);
+			if(pos > inf->len) break;
+
+			// Of the members with the most preceding files (up to the target),
+			// use the first one. Any members that don't produce a file, but
+			// affect the next one (e.g. a tar long-filename header), will then
+			// be read as usual.
+			if(count<=target && count>best_count && mpos>=pos1 &&
+				mpos<c->infile->len)
+			{
+				best_pos = mpos;
+				best_count = count;
+			}
+		}
+		else if(rectype=='F') {
+			i64 namelen;
+
+			pos += 12;
+			namelen = dbuf_getu16le_p(inf, &pos);
+			pos += namelen;
+		}
+		else {
+			de_warn(c, "Bad record in index file %s", fn);
+			break;
+		}
+	}
+
+	if(best_count>0) {
+		de_dbg(c, "[using index: starting at member at %"I64_FMT", file %"I64_FMT"]",
+			best_pos, best_count);
+		c->file_count = (int)best_count;
+	}
+	else {
+		best_pos = pos1;
+	}
+
+done:
+	dbuf_close(inf);
+	return best_pos;
+}
@@ -0,0 +1,998 @@
+// This file is part of Deark.
+// Copyright (C) 2019 Jason Summers
+// See the file COPYING for terms of use.
+
+// deark-inflate.c
+//
+// Deflate (and zlib) decompressor. This is used by de_uncompress_deflate()
+// and de_uncompress_zlib(), instead of miniz's decompressor, unless Deark is
+// built with DE_USE_MINIZ_INFLATE defined, or "-opt inflate:engine=miniz" is
+// used.
+//
+// How it's faster than the miniz-based code it replaces:
+// - Up to 64 bits of input are kept in a bit buffer, which is refilled
+//   8 bytes at a time, at most once per symbol.
+// - Huffman codes are decoded with an 11-bit lookup table (and subtables for
+//   longer codes). A table entry can decode two literals at once. Length and
+//   distance entries include the base value and extra bit count, so that
+//   extra bits are read in the same step.
+// - Matches are copied 8 bytes at a time, when the distance allows it.
+// - Output is written to a large buffer that doubles as the history window,
+//   so there is no separate dictionary, and dbuf_write() is called with
+//   large chunks.
+//
+// de_fast_inflate_ex() can also record "checkpoints" (in the manner of
+// zlib's zran.c example) at block boundaries: the bit position, and the
+// last 32K of output. Decoding can later be resumed from a checkpoint, to
+// get at data in the middle of a large stream without decompressing
+// everything before it.
+
+#define DE_NOT_IN_MODULE
+#include "deark-config.h"
+#include "deark-private.h"
+
+#define INFL_LITLEN_TABLEBITS  11
+#define INFL_DIST_TABLEBITS    8
+#define INFL_PRECODE_TABLEBITS 7
+#define INFL_MAX_CODELEN       15
+
+// Room for the primary table, plus one maximum-size subtable per symbol
+#define INFL_LITLEN_TABLESIZE  ((1<<INFL_LITLEN_TABLEBITS) + \
+	288*(1<<(INFL_MAX_CODELEN-INFL_LITLEN_TABLEBITS)))
+#define INFL_DIST_TABLESIZE    ((1<<INFL_DIST_TABLEBITS) + \
+	32*(1<<(INFL_MAX_CODELEN-INFL_DIST_TABLEBITS)))
+#define INFL_PRECODE_TABLESIZE (1<<INFL_PRECODE_TABLEBITS)
+
+#define INFL_WINDOW_SIZE  DE_INFLATE_WINDOW_SIZE
+#define INFL_OUTCHUNK_SIZE 131072
+// Flush the output buffer when its position is past this point. Leave
+// enough room after it for the longest match, plus overrun from 8-byte
+// copies.
+#define INFL_OUTBUF_FLUSHPOS (INFL_WINDOW_SIZE+INFL_OUTCHUNK_SIZE)
+#define INFL_OUTBUF_SIZE  (INFL_OUTBUF_FLUSHPOS+512)
+#define INFL_INBUF_SIZE   65536
+
+// Decode table entry format:
+//  bits 0-4:   Number of bits used by the code (for double literals: by
+//              both codes)
+//  bits 5-7:   Entry type (ENT_*)
+//  bits 8-12:  Number of extra bits (ENT_VALUE), number of bits used by the
+//              first code (ENT_LITERAL2), or number of index bits
+//              (ENT_SUBTABLE)
+//  bits 16-31: Base value (ENT_VALUE), literal(s), subtable position
+//              (ENT_SUBTABLE), or ENTVAL_* (ENT_SPECIAL)
+#define ENT_VALUE    0x00 // Length or distance, or precode symbol
+#define ENT_LITERAL  0x20
+#define ENT_LITERAL2 0x40 // Two literals
+#define ENT_SUBTABLE 0x60
+#define ENT_SPECIAL  0x80
+#define ENT_TYPEMASK 0xe0
+#define ENTVAL_END_OF_BLOCK 0
+#define ENTVAL_INVALID      1
+
+#define ENT_NBITS(e) ((unsigned int)(e) & 0x1f)
+#define ENT_TYPE(e)  ((unsigned int)(e) & ENT_TYPEMASK)
+#define ENT_EXTRA(e) (((unsigned int)(e)>>8) & 0x1f)
+#define ENT_VAL(e)   ((unsigned int)((e)>>16))
+#define MAKE_ENT(type, extra, val) ((u32)(type) | ((u32)(extra)<<8) | ((u32)(val)<<16))
+#define INVALID_ENT MAKE_ENT(ENT_SPECIAL, 0, ENTVAL_INVALID)
+
+#define INFL_OK        1
+#define INFL_ERROR     0
+#define INFL_TRUNCATED 2 // Ran out of input before the end of the stream
+#define INFL_STOPPED   3 // Have all the output that was asked for
+
+static const u16 length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const u8 length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const u16 dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+	16385, 24577 };
+static const u8 dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const u8 precode_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+struct inflctx {
+	deark *c;
+	int is_zlib;
+	const char *errmsg;
+
+	dbuf *inf;
+	i64 in_file_start;
+	i64 in_file_pos; // Next position in inf to read into inbuf
+	i64 in_file_end;
+	u8 *inbuf;
+	size_t in_next, in_end;
+	// Bits in bitbuf above bitcount are either 0, or a copy of the bits that
+	// will be loaded next.
+	u64 bitbuf;
+	unsigned int bitcount;
+	// Number of 0 bytes that have been put into bitbuf after the end of the
+	// input. If we use any of them, the input was truncated.
+	unsigned int overrun;
+
+	dbuf *outf;
+	u8 *outbuf;
+	size_t out_pos;
+	size_t out_flushed; // outbuf[out_flushed..out_pos] hasn't been written to outf
+	// The number of bytes that have been discarded from outbuf. The first
+	// INFL_WINDOW_SIZE bytes discarded weren't part of the output.
+	i64 out_slid;
+	u32 adler_s1, adler_s2;
+	u8 resumed; // Started from a checkpoint, so can't check the Adler-32
+	u8 stop_flag;
+
+	struct de_inflate_params *ip;
+	i64 next_checkpoint_pos;
+	struct de_inflate_checkpoint *cp; // Scratch space for making checkpoints
+
+	u32 litlen_single[1<<INFL_LITLEN_TABLEBITS];
+	u32 litlen_table[INFL_LITLEN_TABLESIZE];
+	u32 dist_table[INFL_DIST_TABLESIZE];
+	u32 precode_table[INFL_PRECODE_TABLESIZE];
+	u32 litlen_ents[288];
+	u32 dist_ents[32];
+	u32 precode_ents[19];
+	u8 lens[288+32+138]; // (+138 for overrun from a repeat code)
+	int fixed_tables_loaded;
+};
+
+static void init_entry_lists(struct inflctx *d)
+{
+	unsigned int k;
+
+	for(k=0; k<288; k++) {
+		if(k<256)
+			d->litlen_ents[k] = MAKE_ENT(ENT_LITERAL, 0, k);
+		else if(k==256)
+			d->litlen_ents[k] = MAKE_ENT(ENT_SPECIAL, 0, ENTVAL_END_OF_BLOCK);
+		else if(k<286)
+			d->litlen_ents[k] = MAKE_ENT(ENT_VALUE, length_extra[k-257], length_base[k-257]);
+		else
+			d->litlen_ents[k] = INVALID_ENT;
+	}
+	for(k=0; k<32; k++) {
+		if(k<30)
+			d->dist_ents[k] = MAKE_ENT(ENT_VALUE, dist_extra[k], dist_base[k]);
+		else
+			d->dist_ents[k] = INVALID_ENT;
+	}
+	for(k=0; k<19; k++) {
+		d->precode_ents[k] = MAKE_ENT(ENT_VALUE, 0, k);
+	}
+}
+
+// Build a decode table from a list of code lengths. The entry (minus the
+// length field) for each symbol is given by ents[].
+// Returns 0 if the lengths don't make a valid code. As with zlib and miniz,
+// an incomplete code is allowed if it has no more than one symbol.
+static int build_decode_table(u32 *table, unsigned int tablebits,
+	size_t table_capacity, const u8 *lens, unsigned int num_syms, const u32 *ents)
+{
+	unsigned int count[INFL_MAX_CODELEN+1];
+	unsigned int next_code[INFL_MAX_CODELEN+1];
+	unsigned int len, sym, maxlen = 0, used = 0;
+	unsigned int subbits;
+	unsigned int code;
+	size_t next_subtable;
+	size_t i;
+	int left;
+
+	de_zeromem(count, sizeof(count));
+	for(sym=0; sym<num_syms; sym++) {
+		count[lens[sym]]++;
+	}
+	count[0] = 0;
+
+	left = 1;
+	for(len=1; len<=INFL_MAX_CODELEN; len++) {
+		left <<= 1;
+		left -= (int)count[len];
+		if(left<0) return 0; // Over-subscribed
+		if(count[len]) maxlen = len;
+		used += count[len];
+	}
+	if(left>0 && used>1) return 0; // Incomplete
+
+	for(i=0; i<((size_t)1<<tablebits); i++) {
+		table[i] = INVALID_ENT;
+	}
+	if(used==0) return 1;
+
+	code = 0;
+	for(len=1; len<=INFL_MAX_CODELEN; len++) {
+		code = (code + count[len-1]) << 1;
+		next_code[len] = code;
+	}
+
+	subbits = (maxlen>tablebits) ? (maxlen-tablebits) : 0;
+	next_subtable = (size_t)1<<tablebits;
+
+	for(sym=0; sym<num_syms; sym++) {
+		unsigned int rev;
+		unsigned int k;
+
+		len = lens[sym];
+		if(len==0) continue;
+
+		// Deflate codes are stored starting with the most significant bit.
+		code = next_code[len]++;
+		rev = 0;
+		for(k=0; k<len; k++) {
+			rev = (rev<<1) | ((code>>k) & 1);
+		}
+
+		if(len<=tablebits) {
+			for(i=rev; i<((size_t)1<<tablebits); i += (size_t)1<<len) {
+				table[i] = ents[sym] | len;
+			}
+		}
+		else {
+			size_t p = rev & (((size_t)1<<tablebits)-1);
+			size_t start;
+
+			if(ENT_TYPE(table[p])!=ENT_SUBTABLE) {
+				if(next_subtable + ((size_t)1<<subbits) > table_capacity) return 0;
+				for(i=0; i<((size_t)1<<subbits); i++) {
+					table[next_subtable+i] = INVALID_ENT;
+				}
+				table[p] = MAKE_ENT(ENT_SUBTABLE, subbits, next_subtable) | tablebits;
+				next_subtable += (size_t)1<<subbits;
+			}
+
+			start = ENT_VAL(table[p]);
+			for(i=(rev>>tablebits); i<((size_t)1<<subbits); i += (size_t)1<<(len-tablebits)) {
+				table[start+i] = ents[sym] | (len-tablebits);
+			}
+		}
+	}
+
+	return 1;
+}
+
+// Where possible, change literal entries in the primary literal/length table
+// into entries that decode two literals.
+static void make_double_literals(struct inflctx *d)
+{
+	size_t i;
+
+	de_memcpy(d->litlen_single, d->litlen_table, sizeof(d->litlen_single));
+	for(i=0; i<((size_t)1<<INFL_LITLEN_TABLEBITS); i++) {
+		u32 e1, e2;
+		unsigned int n1, n2;
+
+		e1 = d->litlen_single[i];
+		if(ENT_TYPE(e1)!=ENT_LITERAL) continue;
+		n1 = ENT_NBITS(e1);
+		if(n1>=INFL_LITLEN_TABLEBITS) continue;
+		// The remaining bits of the index are the start of the next code.
+		e2 = d->litlen_single[i>>n1];
+		if(ENT_TYPE(e2)!=ENT_LITERAL) continue;
+		n2 = ENT_NBITS(e2);
+		if(n1+n2 > INFL_LITLEN_TABLEBITS) continue;
+		d->litlen_table[i] = MAKE_ENT(ENT_LITERAL2, n1, 0) | (n1+n2) |
+			((u32)ENT_VAL(e1)<<16) | ((u32)ENT_VAL(e2)<<24);
+	}
+}
+
+static void fill_inbuf(struct inflctx *d)
+{
+	size_t nkeep;
+	i64 nread;
+
+	if(d->in_file_pos >= d->in_file_end) return;
+
+	nkeep = d->in_end - d->in_next;
+	if(nkeep>0) {
+		de_memmove(d->inbuf, &d->inbuf[d->in_next], nkeep);
+	}
+	d->in_next = 0;
+	d->in_end = nkeep;
+
+	nread = de_min_int((i64)(INFL_INBUF_SIZE-nkeep), d->in_file_end - d->in_file_pos);
+	dbuf_read(d->inf, &d->inbuf[nkeep], d->in_file_pos, nread);
+	d->in_file_pos += nread;
+	d->in_end += (size_t)nread;
+}
+
+// Makes sure bitcount is at least 56. If the input is exhausted, 0 bytes are
+// used.
+static void refill_slow(struct inflctx *d)
+{
+	if(d->in_end - d->in_next < 8) {
+		fill_inbuf(d);
+	}
+
+	while(d->bitcount<56) {
+		u8 b;
+
+		if(d->in_next < d->in_end) {
+			b = d->inbuf[d->in_next++];
+		}
+		else {
+			b = 0;
+			d->overrun++;
+		}
+		d->bitbuf |= (u64)b << d->bitcount;
+		d->bitcount += 8;
+	}
+}
+
+// On platforms known to be little-endian, read 8 bytes at once. (Compilers
+// turn the memcpy into a single instruction.)
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__)
+static u64 load_u64le(const u8 *p)
+{
+	u64 x;
+
+	de_memcpy(&x, p, 8);
+	return x;
+}
+#define LOAD_U64LE(p) load_u64le(p)
+#else
+#define LOAD_U64LE(p) ((u64)(p)[0] | ((u64)(p)[1]<<8) | ((u64)(p)[2]<<16) | \
+	((u64)(p)[3]<<24) | ((u64)(p)[4]<<32) | ((u64)(p)[5]<<40) | \
+	((u64)(p)[6]<<48) | ((u64)(p)[7]<<56))
+#endif
+
+static void refill(struct inflctx *d)
+{
+	if(d->in_end - d->in_next >= 8) {
+		d->bitbuf |= LOAD_U64LE(&d->inbuf[d->in_next]) << d->bitcount;
+		d->in_next += (63 - d->bitcount) >> 3;
+		d->bitcount |= 56;
+	}
+	else {
+		refill_slow(d);
+	}
+}
+
+// n must be 32 or less.
+static u32 getbits(struct inflctx *d, unsigned int n)
+{
+	u32 x;
+
+	if(d->bitcount < n) refill(d);
+	x = (u32)(d->bitbuf & (((u64)1<<n)-1));
+	d->bitbuf >>= n;
+	d->bitcount -= n;
+	return x;
+}
+
+// Returns nonzero if we've used any of the phony bytes past the end of the
+// input.
+#define IS_TRUNCATED(d) ((d)->overrun && (d)->bitcount < (d)->overrun*8)
+
+// Report an error, unless it's really due to the input being truncated.
+static int infl_error(struct inflctx *d, const char *msg)
+{
+	if(IS_TRUNCATED(d)) return INFL_TRUNCATED;
+	d->errmsg = msg;
+	return INFL_ERROR;
+}
+
+static void update_adler32(struct inflctx *d, const u8 *buf, size_t len)
+{
+	u32 s1 = d->adler_s1;
+	u32 s2 = d->adler_s2;
+
+	// 5552 is the most bytes we can process before s2 might overflow.
+	while(len>0) {
+		size_t n = (len<5552) ? len : 5552;
+		size_t i = 0;
+
+		for(; i+8<=n; i+=8) {
+			s1 += buf[i]; s2 += s1;
+			s1 += buf[i+1]; s2 += s1;
+			s1 += buf[i+2]; s2 += s1;
+			s1 += buf[i+3]; s2 += s1;
+			s1 += buf[i+4]; s2 += s1;
+			s1 += buf[i+5]; s2 += s1;
+			s1 += buf[i+6]; s2 += s1;
+			s1 += buf[i+7]; s2 += s1;
+		}
+		for(; i<n; i++) {
+			s1 += buf[i];
+			s2 += s1;
+		}
+		s1 %= 65521;
+		s2 %= 65521;
+		buf += n;
+		len -= n;
+	}
+	d->adler_s1 = s1;
+	d->adler_s2 = s2;
+}
+
+// Write the part of buf that is within the requested output range.
+// buf starts at position pos in the decompressed data.
+static void write_output_range(struct inflctx *d, const u8 *buf, i64 pos, i64 len)
+{
+	i64 range_end = d->ip->out_range_start + d->ip->out_range_len;
+	i64 n;
+
+	if(pos + len >= range_end) {
+		d->stop_flag = 1;
+	}
+	if(pos < d->ip->out_range_start) {
+		n = d->ip->out_range_start - pos;
+		if(n >= len) return;
+		buf += n;
+		pos += n;
+		len -= n;
+	}
+	if(pos + len > range_end) {
+		len = range_end - pos;
+	}
+	if(len>0) {
+		dbuf_write(d->outf, buf, len);
+	}
+}
+
+// Write any pending output, and if the buffer is getting full, discard
+// everything but the history window.
+static void flush_output(struct inflctx *d)
+{
+	if(d->out_pos > d->out_flushed) {
+		if(d->is_zlib && !d->resumed) {
+			update_adler32(d, &d->outbuf[d->out_flushed], d->out_pos - d->out_flushed);
+		}
+		if(d->ip->use_out_range) {
+			write_output_range(d, &d->outbuf[d->out_flushed],
+				d->out_slid + (i64)d->out_flushed - INFL_WINDOW_SIZE,
+				(i64)(d->out_pos - d->out_flushed));
+		}
+		else {
+			dbuf_write(d->outf, &d->outbuf[d->out_flushed], (i64)(d->out_pos - d->out_flushed));
+		}
+		d->out_flushed = d->out_pos;
+	}
+
+	if(d->out_pos > INFL_OUTBUF_FLUSHPOS - INFL_OUTCHUNK_SIZE/2) {
+		size_t ndiscard = d->out_pos - INFL_WINDOW_SIZE;
+
+		de_memmove(d->outbuf, &d->outbuf[ndiscard], INFL_WINDOW_SIZE);
+		d->out_slid += (i64)ndiscard;
+		d->out_pos = INFL_WINDOW_SIZE;
+		d->out_flushed = INFL_WINDOW_SIZE;
+	}
+}
+
+static int load_fixed_tables(struct inflctx *d)
+{
+	unsigned int k;
+
+	if(d->fixed_tables_loaded) return 1;
+
+	for(k=0; k<288; k++) {
+		if(k<144) d->lens[k] = 8;
+		else if(k<256) d->lens[k] = 9;
+		else if(k<280) d->lens[k] = 7;
+		else d->lens[k] = 8;
+	}
+	for(k=0; k<32; k++) {
+		d->lens[288+k] = 5;
+	}
+
+	if(!build_decode_table(d->litlen_table, INFL_LITLEN_TABLEBITS, INFL_LITLEN_TABLESIZE,
+		d->lens, 288, d->litlen_ents))
+	{
+		return 0;
+	}
+	make_double_literals(d);
+	if(!build_decode_table(d->dist_table, INFL_DIST_TABLEBITS, INFL_DIST_TABLESIZE,
+		&d->lens[288], 32, d->dist_ents))
+	{
+		return 0;
+	}
+	d->fixed_tables_loaded = 1;
+	return 1;
+}
+
+static int read_dynamic_tables(struct inflctx *d)
+{
+	unsigned int num_litlen, num_dist, num_precode;
+	unsigned int k;
+	u8 precode_lens[19];
+
+	num_litlen = getbits(d, 5) + 257;
+	num_dist = getbits(d, 5) + 1;
+	num_precode = getbits(d, 4) + 4;
+
+	de_zeromem(precode_lens, sizeof(precode_lens));
+	for(k=0; k<num_precode; k++) {
+		precode_lens[precode_order[k]] = (u8)getbits(d, 3);
+	}
+	if(IS_TRUNCATED(d)) return INFL_TRUNCATED;
+
+	if(!build_decode_table(d->precode_table, INFL_PRECODE_TABLEBITS, INFL_PRECODE_TABLESIZE,
+		precode_lens, 19, d->precode_ents))
+	{
+		return infl_error(d, "Bad code lengths code");
+	}
+
+	k = 0;
+	while(k < num_litlen+num_dist) {
+		u32 e;
+		unsigned int sym;
+		unsigned int rep_count;
+		u8 rep_val;
+
+		refill(d);
+		e = d->precode_table[d->bitbuf & ((1<<INFL_PRECODE_TABLEBITS)-1)];
+		if(ENT_TYPE(e)!=ENT_VALUE) return infl_error(d, "Bad code length");
+		d->bitbuf >>= ENT_NBITS(e);
+		d->bitcount -= ENT_NBITS(e);
+		sym = ENT_VAL(e);
+
+		if(sym<16) {
+			d->lens[k++] = (u8)sym;
+			continue;
+		}
+
+		if(sym==16) {
+			if(k==0) return infl_error(d, "Bad code length");
+			rep_val = d->lens[k-1];
+			rep_count = 3 + getbits(d, 2);
+		}
+		else if(sym==17) {
+			rep_val = 0;
+			rep_count = 3 + getbits(d, 3);
+		}
+		else {
+			rep_val = 0;
+			rep_count = 11 + getbits(d, 7);
+		}
+		if(k+rep_count > num_litlen+num_dist) return infl_error(d, "Bad code length");
+		de_memset(&d->lens[k], rep_val, rep_count);
+		k += rep_count;
+	}
+	if(IS_TRUNCATED(d)) return INFL_TRUNCATED;
+
+	if(d->lens[256]==0) return infl_error(d, "No end-of-block code");
+
+	// Copy the distance code lengths to a consistent place
+	de_memmove(&d->lens[288], &d->lens[num_litlen], num_dist);
+	de_zeromem(&d->lens[num_litlen], 288-num_litlen);
+	de_zeromem(&d->lens[288+num_dist], 32-num_dist);
+
+	if(!build_decode_table(d->litlen_table, INFL_LITLEN_TABLEBITS, INFL_LITLEN_TABLESIZE,
+		d->lens, 288, d->litlen_ents))
+	{
+		return infl_error(d, "Bad literal/length code");
+	}
+	make_double_literals(d);
+	if(!build_decode_table(d->dist_table, INFL_DIST_TABLEBITS, INFL_DIST_TABLESIZE,
+		&d->lens[288], 32, d->dist_ents))
+	{
+		return infl_error(d, "Bad distance code");
+	}
+	d->fixed_tables_loaded = 0;
+	return INFL_OK;
+}
+
+// The main decoding loop, for Huffman-compressed blocks. This is where
+// nearly all the time is spent, so the state is kept in local variables.
+static int decode_huffman_block(struct inflctx *d)
+{
+	u64 bitbuf;
+	unsigned int bitcount;
+	size_t in_next;
+	size_t in_end;
+	unsigned int overrun_bits;
+	size_t out_pos;
+	u8 *outbuf = d->outbuf;
+	const u8 *inbuf = d->inbuf;
+	const u32 *litlen_table = d->litlen_table;
+	const u32 *dist_table = d->dist_table;
+	u32 e;
+	unsigned int n;
+	unsigned int length;
+	unsigned int dist;
+	int retval = INFL_ERROR;
+
+#define SAVE_STATE() do { d->bitbuf = bitbuf; d->bitcount = bitcount; \
+	d->in_next = in_next; d->out_pos = out_pos; } while(0)
+#define LOAD_STATE() do { bitbuf = d->bitbuf; bitcount = d->bitcount; \
+	in_next = d->in_next; in_end = d->in_end; overrun_bits = d->overrun*8; \
+	out_pos = d->out_pos; } while(0)
+#define CONSUME(k) do { bitbuf >>= (k); bitcount -= (k); } while(0)
+#define TRUNCATED_NOW() (bitcount < overrun_bits)
+
+	LOAD_STATE();
+
+	while(1) {
+		if(out_pos > INFL_OUTBUF_FLUSHPOS) {
+			SAVE_STATE();
+			flush_output(d);
+			if(d->stop_flag) return INFL_STOPPED;
+			LOAD_STATE();
+		}
+
+		if(in_end - in_next >= 8) {
+			bitbuf |= LOAD_U64LE(&inbuf[in_next]) << bitcount;
+			in_next += (63 - bitcount) >> 3;
+			bitcount |= 56;
+		}
+		else {
+			SAVE_STATE();
+			refill_slow(d);
+			LOAD_STATE();
+		}
+
+		e = litlen_table[bitbuf & ((1<<INFL_LITLEN_TABLEBITS)-1)];
+		if(ENT_TYPE(e)==ENT_SUBTABLE) {
+			CONSUME(INFL_LITLEN_TABLEBITS);
+			e = litlen_table[ENT_VAL(e) + (bitbuf & (((u64)1<<ENT_EXTRA(e))-1))];
+		}
+		n = ENT_NBITS(e);
+
+		switch(ENT_TYPE(e)) {
+		case ENT_LITERAL2:
+			CONSUME(n);
+			if(TRUNCATED_NOW()) {
+				// Maybe only the second literal is missing.
+				if(bitcount + (n-ENT_EXTRA(e)) >= overrun_bits) {
+					outbuf[out_pos++] = (u8)(e>>16);
+				}
+				retval = INFL_TRUNCATED;
+				goto done;
+			}
+			outbuf[out_pos] = (u8)(e>>16);
+			outbuf[out_pos+1] = (u8)(e>>24);
+			out_pos += 2;
+			continue;
+		case ENT_LITERAL:
+			CONSUME(n);
+			if(TRUNCATED_NOW()) { retval = INFL_TRUNCATED; goto done; }
+			outbuf[out_pos++] = (u8)(e>>16);
+			continue;
+		case ENT_VALUE:
+			break;
+		default:
+			CONSUME(n);
+			if(TRUNCATED_NOW()) { retval = INFL_TRUNCATED; goto done; }
+			if(ENT_VAL(e)==ENTVAL_END_OF_BLOCK) {
+				retval = INFL_OK;
+				goto done;
+			}
+			SAVE_STATE();
+			return infl_error(d, "Bad literal/length code");
+		}
+
+		// A length code, with up to 5 extra bits
+		length = ENT_VAL(e) + (unsigned int)((bitbuf >> n) & (((u64)1<<ENT_EXTRA(e))-1));
+		CONSUME(n + ENT_EXTRA(e));
+
+		// The distance code, with up to 13 extra bits
+		e = dist_table[bitbuf & ((1<<INFL_DIST_TABLEBITS)-1)];
+		if(ENT_TYPE(e)==ENT_SUBTABLE) {
+			CONSUME(INFL_DIST_TABLEBITS);
+			e = dist_table[ENT_VAL(e) + (bitbuf & (((u64)1<<ENT_EXTRA(e))-1))];
+		}
+		n = ENT_NBITS(e);
+		if(ENT_TYPE(e)!=ENT_VALUE) {
+			CONSUME(n);
+			SAVE_STATE();
+			return infl_error(d, "Bad distance code");
+		}
+		dist = ENT_VAL(e) + (unsigned int)((bitbuf >> n) & (((u64)1<<ENT_EXTRA(e))-1));
+		CONSUME(n + ENT_EXTRA(e));
+
+		if(TRUNCATED_NOW()) { retval = INFL_TRUNCATED; goto done; }
+		// Note: The output buffer always contains at least 32K bytes before
+		// out_pos. Like miniz, we allow distances that go back too far, and
+		// treat the nonexistent bytes as 0.
+
+		// Copy the match
+		{
+			u8 *dst = &outbuf[out_pos];
+			const u8 *src = dst - dist;
+			u8 *dst_end = dst + length;
+
+			if(dist>=8) {
+				// Copying 8 bytes at a time is safe, because each chunk of the
+				// source is complete before it is read. We may write up to 7
+				// bytes past the end, but there's room for that.
+				do {
+					de_memcpy(dst, src, 8);
+					dst += 8;
+					src += 8;
+				} while(dst < dst_end);
+			}
+			else if(dist==1) {
+				de_memset(dst, *src, length);
+			}
+			else {
+				while(dst < dst_end) {
+					*dst++ = *src++;
+				}
+			}
+		}
+		out_pos += length;
+	}
+
+done:
+	SAVE_STATE();
+	return retval;
+#undef SAVE_STATE
+#undef LOAD_STATE
+#undef CONSUME
+#undef TRUNCATED_NOW
+}
+
+static int decode_stored_block(struct inflctx *d)
+{
+	unsigned int len, nlen;
+
+	getbits(d, d->bitcount & 7); // Skip to a byte boundary
+	len = getbits(d, 16);
+	nlen = getbits(d, 16);
+	if(IS_TRUNCATED(d)) return INFL_TRUNCATED;
+	if(len != (nlen^0xffff)) return infl_error(d, "Bad stored block length");
+
+	// Use up the whole bytes in the bit buffer
+	while(len>0 && d->bitcount >= 8 + d->overrun*8) {
+		if(d->out_pos > INFL_OUTBUF_FLUSHPOS) {
+			flush_output(d);
+			if(d->stop_flag) return INFL_STOPPED;
+		}
+		d->outbuf[d->out_pos++] = (u8)getbits(d, 8);
+		len--;
+	}
+	if(len==0) return INFL_OK;
+	if(d->overrun) return INFL_TRUNCATED;
+
+	// The bit buffer is now empty. Any bits in it are a copy of bytes we're
+	// about to read from inbuf directly.
+	d->bitbuf = 0;
+
+	while(len>0) {
+		size_t n;
+
+		if(d->out_pos > INFL_OUTBUF_FLUSHPOS) {
+			flush_output(d);
+			if(d->stop_flag) return INFL_STOPPED;
+		}
+		if(d->in_next >= d->in_end) {
+			fill_inbuf(d);
+			if(d->in_next >= d->in_end) return INFL_TRUNCATED;
+		}
+
+		n = d->in_end - d->in_next;
+		if(n > len) n = len;
+		if(n > INFL_OUTBUF_SIZE - d->out_pos) n = INFL_OUTBUF_SIZE - d->out_pos;
+		de_memcpy(&d->outbuf[d->out_pos], &d->inbuf[d->in_next], n);
+		d->out_pos += n;
+		d->in_next += n;
+		len -= (unsigned int)n;
+	}
+	return INFL_OK;
+}
+
+// In a worker thread, a failed allocation must not be a fatal error, so
+// this can return NULL.
+static void *infl_malloc(struct de_inflate_params *ip, deark *c, i64 n)
+{
+	if(ip->from_worker_thread) {
+		return de_malloc_nofatal(n);
+	}
+	return de_malloc(c, n);
+}
+
+// Called at the start of each block. If we've gone far enough since the
+// last checkpoint, make a new one.
+static void maybe_make_checkpoint(struct inflctx *d)
+{
+	i64 curpos;
+
+	curpos = d->out_slid + (i64)d->out_pos - INFL_WINDOW_SIZE;
+	if(curpos < d->next_checkpoint_pos) return;
+	if(d->overrun) return;
+
+	if(!d->cp) {
+		d->cp = infl_malloc(d->ip, d->c, sizeof(struct de_inflate_checkpoint));
+		if(!d->cp) return;
+	}
+	// The number of bits consumed so far: the bytes read from the file,
+	// minus those not yet loaded into bitbuf, minus the unused bits in bitbuf.
+	d->cp->in_bitpos = ((d->in_file_pos - d->in_file_start) -
+		(i64)(d->in_end - d->in_next)) * 8 - (i64)d->bitcount;
+	d->cp->out_pos = curpos;
+	de_memcpy(d->cp->window, &d->outbuf[d->out_pos - INFL_WINDOW_SIZE], INFL_WINDOW_SIZE);
+	d->ip->checkpoint_fn(d->ip, d->cp);
+	d->next_checkpoint_pos = curpos + d->ip->checkpoint_span;
+}
+
+static int inflate_stream(struct inflctx *d)
+{
+	int ret;
+	unsigned int is_final;
+	unsigned int btype;
+
+	if(d->resumed) {
+		// We're positioned at the first block to decode, but maybe not at a
+		// byte boundary.
+		getbits(d, (unsigned int)(d->ip->resume_from->in_bitpos % 8));
+		if(IS_TRUNCATED(d)) return INFL_TRUNCATED;
+	}
+	else if(d->is_zlib) {
+		unsigned int cmf, flg;
+
+		cmf = getbits(d, 8);
+		flg = getbits(d, 8);
+		if(IS_TRUNCATED(d)) return INFL_TRUNCATED;
+		if((cmf*256+flg)%31 != 0 || (cmf&0x0f)!=8 || (cmf>>4)>7 || (flg&0x20)) {
+			return infl_error(d, "Bad zlib header");
+		}
+	}
+
+	do {
+		if(d->ip->checkpoint_fn) {
+			maybe_make_checkpoint(d);
+		}
+		is_final = getbits(d, 1);
+		btype = getbits(d, 2);
+		if(IS_TRUNCATED(d)) return INFL_TRUNCATED;
+
+		if(btype==0) {
+			ret = decode_stored_block(d);
+		}
+		else if(btype==1) {
+			if(!load_fixed_tables(d)) return infl_error(d, "Internal error");
+			ret = decode_huffman_block(d);
+		}
+		else if(btype==2) {
+			ret = read_dynamic_tables(d);
+			if(ret==INFL_OK) {
+				ret = decode_huffman_block(d);
+			}
+		}
+		else {
+			ret = infl_error(d, "Bad block type");
+		}
+		if(ret!=INFL_OK) return ret;
+	} while(!is_final);
+
+	getbits(d, d->bitcount & 7); // Skip to a byte boundary
+	flush_output(d);
+
+	if(d->is_zlib && !d->resumed) {
+		u32 adler;
+
+		adler = getbits(d, 8) << 24;
+		adler |= getbits(d, 8) << 16;
+		adler |= getbits(d, 8) << 8;
+		adler |= getbits(d, 8);
+		if(IS_TRUNCATED(d)) return INFL_TRUNCATED;
+		if(adler != ((d->adler_s2<<16) | d->adler_s1)) {
+			return infl_error(d, "Adler-32 checksum mismatch");
+		}
+	}
+
+	return INFL_OK;
+}
+
+// Decompress Deflate (or, if ip->is_zlib is set, zlib) data, with the
+// extra features described in struct de_inflate_params.
+// Same semantics as the miniz-based code in deark-miniz.c: If the input ends
+// before the end of the stream, this is not an error, and ip->bytes_consumed
+// is set to inputsize.
+int de_fast_inflate_ex(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *outf,
+	struct de_inflate_params *ip)
+{
+	// In a worker thread, we mustn't print anything, or use the deark
+	// object's memory tracker.
+	deark *c = ip->from_worker_thread ? NULL : inf->c;
+	struct inflctx *d = NULL;
+	int ret = INFL_OK;
+	int retval = 0;
+
+	ip->bytes_consumed = 0;
+	ip->errmsg = NULL;
+	if(inputsize<0) {
+		ip->errmsg = "Internal error";
+		goto done;
+	}
+
+	if(c) de_dbg2(c, "inflating up to %d bytes", (int)inputsize);
+
+	d = infl_malloc(ip, c, sizeof(struct inflctx));
+	if(!d) {
+		ip->errmsg = "Out of memory";
+		goto done;
+	}
+	d->c = c;
+	d->ip = ip;
+	d->is_zlib = ip->is_zlib;
+	d->inf = inf;
+	d->in_file_start = inputstart;
+	d->in_file_pos = inputstart;
+	d->in_file_end = inputstart + inputsize;
+	d->inbuf = infl_malloc(ip, c, INFL_INBUF_SIZE);
+	d->outf = outf;
+	d->outbuf = infl_malloc(ip, c, INFL_OUTBUF_SIZE);
+	if(!d->inbuf || !d->outbuf) {
+		ip->errmsg = "Out of memory";
+		goto done;
+	}
+	// Start with a window of 0-valued bytes
+	d->out_pos = INFL_WINDOW_SIZE;
+	d->out_flushed = INFL_WINDOW_SIZE;
+	d->adler_s1 = 1;
+	d->next_checkpoint_pos = ip->checkpoint_span;
+	init_entry_lists(d);
+
+	if(ip->resume_from) {
+		if(ip->resume_from->in_bitpos<0 || ip->resume_from->in_bitpos/8 >= inputsize) {
+			ip->errmsg = "Bad inflate checkpoint";
+			goto done;
+		}
+		if(c) de_dbg2(c, "resuming at bit %"I64_FMT", output position %"I64_FMT,
+			ip->resume_from->in_bitpos, ip->resume_from->out_pos);
+		d->resumed = 1;
+		d->in_file_pos = inputstart + ip->resume_from->in_bitpos/8;
+		de_memcpy(d->outbuf, ip->resume_from->window, INFL_WINDOW_SIZE);
+		d->out_slid = ip->resume_from->out_pos;
+		d->next_checkpoint_pos += ip->resume_from->out_pos;
+	}
+
+	ret = inflate_stream(d);
+	if(ret!=INFL_STOPPED) {
+		flush_output(d);
+	}
+
+	if(ret==INFL_ERROR) {
+		ip->errmsg = d->errmsg ? d->errmsg : "?";
+		goto done;
+	}
+
+	if(ret==INFL_TRUNCATED) {
+		ip->bytes_consumed = inputsize;
+	}
+	else if(ret==INFL_OK) {
+		// Don't count any bytes we've read ahead.
+		ip->bytes_consumed = (d->in_file_pos - d->in_file_start) -
+			(i64)(d->in_end - d->in_next) - (i64)(d->bitcount/8) + (i64)d->overrun;
+		if(c) de_dbg2(c, "inflate finished normally");
+	}
+	if(c) de_dbg2(c, "inflated %"I64_FMT" to %"I64_FMT" bytes", ip->bytes_consumed,
+		d->out_slid + (i64)d->out_pos - INFL_WINDOW_SIZE);
+	retval = 1;
+
+done:
+	if(!retval && c) {
+		if(ret==INFL_ERROR) {
+			de_err(c, "Inflate error: %s", ip->errmsg);
+		}
+		else {
+			de_err(c, "%s", ip->errmsg);
+		}
+	}
+	if(d) {
+		de_free(c, d->inbuf);
+		de_free(c, d->outbuf);
+		de_free(c, d->cp);
+		de_free(c, d);
+	}
+	return retval;
+}
+
+int de_fast_inflate(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *outf,
+	int is_zlib, i64 *bytes_consumed)
+{
+	struct de_inflate_params ip;
+	int retval;
+
+	de_zeromem(&ip, sizeof(struct de_inflate_params));
+	ip.is_zlib = is_zlib;
+	retval = de_fast_inflate_ex(inf, inputstart, inputsize, outf, &ip);
+	*bytes_consumed = ip.bytes_consumed;
+	return retval;
+}
@@ -31,6 +31,21 @@ struct zip_data_struct {
 	mz_zip_archive *pZip;
 };
 
+// Allocation functions for the miniz objects that belong to a single input
+// file, so that the memory is tracked like the rest of deark's memory, and
+// freed if there's a fatal error. 'opaque' is the deark object.
+// (The ZIP writer's objects are shared by all the input files, so they
+// still use miniz's default allocator.)
+static void *my_mz_alloc_func(void *opaque, size_t items, size_t size)
+{
+	return de_mallocarray((deark*)opaque, (i64)items, size);
+}
+
+static void my_mz_free_func(void *opaque, void *address)
+{
+	de_free((deark*)opaque, address);
+}
+
 #define CODE_IDAT 0x49444154U
 #define CODE_IEND 0x49454e44U
 #define CODE_IHDR 0x49484452U
@@ -48,6 +63,7 @@ struct deark_png_encode_info {
 	mz_uint8 phys_units;
 	deark *c;
 	dbuf *outf;
+	de_bitmap *img;
 	struct de_timestamp image_mod_time;
 };
 
@@ -119,56 +135,55 @@ static void write_png_chunk_tIME(struct deark_png_encode_info *pei,
 	write_png_chunk_from_cdbuf(pei->outf, cdbuf, CODE_tIME);
 }
 
-static int write_png_chunk_IDAT(struct deark_png_encode_info *pei, const mz_uint8 *src_pixels)
+// A tdefl_put_buf_func_ptr that appends to a membuf.
+static mz_bool my_tdefl_putter(const void *pBuf, int len, void *pUser)
+{
+	dbuf_write((dbuf*)pUser, (const u8*)pBuf, (i64)len);
+	return MZ_TRUE;
+}
+
+static int write_png_chunk_IDAT(struct deark_png_encode_info *pei, dbuf *cdbuf)
 {
 	tdefl_compressor *pComp = NULL;
-	tdefl_output_buffer out_buf;
-	int bpl = pei->width * pei->num_chans; // bytes per row in src_pixels
+	int bpl = pei->width * pei->num_chans; // bytes per row
 	int y;
 	static const char nulbyte = '\0';
+	u8 *rowbuf = NULL;
 	int retval = 0;
 
-	de_zeromem(&out_buf, sizeof(tdefl_output_buffer));
-
-	pComp = MZ_MALLOC(sizeof(tdefl_compressor));
-	if (!pComp) goto done;
-	de_zeromem(pComp, sizeof(tdefl_compressor));
+	pComp = de_malloc(pei->c, sizeof(tdefl_compressor));
 
-	out_buf.m_expandable = MZ_TRUE;
-	out_buf.m_capacity = 16+MZ_MAX(64, (1+bpl)*pei->height);
-	out_buf.m_pBuf = MZ_MALLOC(out_buf.m_capacity);
-	if (!out_buf.m_pBuf) { goto done; }
+	// Used only for images that aren't stored in this form.
+	rowbuf = de_malloc(pei->c, (i64)bpl);
 
 	// compress image data
-	tdefl_init(pComp, tdefl_output_buffer_putter, &out_buf,
+	tdefl_init(pComp, my_tdefl_putter, cdbuf,
 		s_tdefl_num_probes[MZ_MIN(10, pei->level)] | TDEFL_WRITE_ZLIB_HEADER);
 
 	for (y = 0; y < pei->height; ++y) {
 		tdefl_compress_buffer(pComp, &nulbyte, 1, TDEFL_NO_FLUSH);
-		tdefl_compress_buffer(pComp, &src_pixels[(pei->flip ? (pei->height - 1 - y) : y) * bpl],
+		tdefl_compress_buffer(pComp, de_bitmap_get_row(pei->img,
+			(pei->flip ? (pei->height - 1 - y) : y), rowbuf),
 			bpl, TDEFL_NO_FLUSH);
 	}
 	if (tdefl_compress_buffer(pComp, NULL, 0, TDEFL_FINISH) != TDEFL_STATUS_DONE) { goto done; }
 
-	write_png_chunk_raw(pei->outf, (const u8*)out_buf.m_pBuf, (i64)out_buf.m_size, CODE_IDAT);
+	write_png_chunk_from_cdbuf(pei->outf, cdbuf, CODE_IDAT);
 	retval = 1;
 
 done:
-
-	if(pComp) MZ_FREE(pComp);
-	if(out_buf.m_pBuf) MZ_FREE(out_buf.m_pBuf);
+	de_free(pei->c, pComp);
+	de_free(pei->c, rowbuf);
 	return retval;
 }
 
-static int do_generate_png(struct deark_png_encode_info *pei, const mz_uint8 *src_pixels)
+static int do_generate_png(struct deark_png_encode_info *pei)
 {
 	static const u8 pngsig[8] = { 0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a };
 	dbuf *cdbuf = NULL;
 	int retval = 0;
 
-	// A membuf that we'll use and reuse for each chunk's data...
-	// except for the IDAT chunk. miniz has its own 'tdefl_output_buffer'
-	// resizable memory object, that we have to use with it.
+	// A membuf that we'll use and reuse for each chunk's data.
 	cdbuf = dbuf_create_membuf(pei->c, 64, 0);
 
 	dbuf_write(pei->outf, pngsig, 8);
@@ -187,7 +202,8 @@ static int do_generate_png(struct deark_png_encode_info *pei, const mz_uint8 *sr
 		write_png_chunk_tIME(pei, cdbuf);
 	}
 
-	if(!write_png_chunk_IDAT(pei, src_pixels)) goto done;
+	dbuf_truncate(cdbuf, 0);
+	if(!write_png_chunk_IDAT(pei, cdbuf)) goto done;
 
 	dbuf_truncate(cdbuf, 0);
 	write_png_chunk_from_cdbuf(pei->outf, cdbuf, CODE_IEND);
@@ -245,6 +261,7 @@ int de_write_png(deark *c, de_bitmap *img, dbuf *f)
 
 	pei.c = c;
 	pei.outf = f;
+	pei.img = img;
 	pei.width = (int)img->width;
 	pei.height = (int)img->height;
 	pei.flip = img->flipped;
@@ -255,7 +272,7 @@ int de_write_png(deark *c, de_bitmap *img, dbuf *f)
 		pei.image_mod_time = f->fi_copy->image_mod_time;
 	}
 
-	if(!do_generate_png(&pei, img->bitmap)) {
+	if(!do_generate_png(&pei)) {
 		de_err(c, "PNG write failed");
 		return 0;
 	}
@@ -263,7 +280,7 @@ int de_write_png(deark *c, de_bitmap *img, dbuf *f)
 	return 1;
 }
 
-static int de_inflate_internal(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *outf,
+static int de_inflate_miniz(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *outf,
 	int is_zlib, i64 *bytes_consumed)
 {
 	mz_stream strm;
@@ -295,6 +312,9 @@ static int de_inflate_internal(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *o
 	outbuf = de_malloc(c, DE_DFL_OUTBUF_SIZE);
 
 	de_zeromem(&strm, sizeof(strm));
+	strm.zalloc = my_mz_alloc_func;
+	strm.zfree = my_mz_free_func;
+	strm.opaque = (void*)c;
 	if(is_zlib) {
 		ret = mz_inflateInit(&strm);
 	}
@@ -393,6 +413,21 @@ done:
 	return retval;
 }
 
+static int de_inflate_internal(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *outf,
+	int is_zlib, i64 *bytes_consumed)
+{
+#ifndef DE_USE_MINIZ_INFLATE
+	const char *s;
+
+	// "-opt inflate:engine=miniz" is mainly for testing and benchmarking.
+	s = de_get_ext_option(inf->c, "inflate:engine");
+	if(!s || de_strcmp(s, "miniz")) {
+		return de_fast_inflate(inf, inputstart, inputsize, outf, is_zlib, bytes_consumed);
+	}
+#endif
+	return de_inflate_miniz(inf, inputstart, inputsize, outf, is_zlib, bytes_consumed);
+}
+
 int de_uncompress_zlib(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *outf)
 {
 	i64 bytes_consumed;
@@ -405,6 +440,122 @@ int de_uncompress_deflate(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *outf,
 	return de_inflate_internal(inf, inputstart, inputsize, outf, 0, bytes_consumed);
 }
 
+// A pull-style Deflate decompressor. The caller asks for output bytes as it
+// needs them, so that the decompressed data never has to be stored in full.
+// Suitable for use with dbuf_open_input_stream().
+struct de_inflatestream {
+	deark *c;
+	dbuf *inf;
+	i64 input_cur_pos;
+	i64 input_endpos;
+	mz_stream strm;
+	u8 stream_open_flag;
+	u8 eof_flag;
+	u8 errflag;
+	u8 inbuf[DE_DFL_INBUF_SIZE];
+};
+
+struct de_inflatestream *de_inflatestream_create(dbuf *inf, i64 inputstart,
+	i64 inputsize, int is_zlib)
+{
+	struct de_inflatestream *ifs;
+	deark *c = inf->c;
+	int ret;
+
+	ifs = de_malloc(c, sizeof(struct de_inflatestream));
+	ifs->c = c;
+	ifs->inf = inf;
+	ifs->input_cur_pos = inputstart;
+	ifs->input_endpos = inputstart + (inputsize>0 ? inputsize : 0);
+
+	ifs->strm.zalloc = my_mz_alloc_func;
+	ifs->strm.zfree = my_mz_free_func;
+	ifs->strm.opaque = (void*)c;
+	if(is_zlib) {
+		ret = mz_inflateInit(&ifs->strm);
+	}
+	else {
+		ret = mz_inflateInit2(&ifs->strm, -MZ_DEFAULT_WINDOW_BITS);
+	}
+	if(ret!=MZ_OK) {
+		de_err(c, "Inflate error");
+		ifs->errflag = 1;
+	}
+	else {
+		ifs->stream_open_flag = 1;
+	}
+	return ifs;
+}
+
+// Decompress up to buf_len bytes into buf.
+// Returns the number of bytes produced. A return value of 0 means there is no
+// more data, either because the end of the Deflate stream was reached, or
+// because of an error.
+i64 de_inflatestream_read(struct de_inflatestream *ifs, u8 *buf, i64 buf_len)
+{
+	i64 nproduced = 0;
+
+	while(nproduced<buf_len && !ifs->eof_flag && !ifs->errflag) {
+		unsigned int orig_avail_in, orig_avail_out;
+		int ret;
+
+		if(ifs->strm.avail_in==0 && ifs->input_cur_pos<ifs->input_endpos) {
+			i64 n;
+
+			n = ifs->input_endpos - ifs->input_cur_pos;
+			if(n>DE_DFL_INBUF_SIZE) n = DE_DFL_INBUF_SIZE;
+			dbuf_read(ifs->inf, ifs->inbuf, ifs->input_cur_pos, n);
+			ifs->input_cur_pos += n;
+			ifs->strm.next_in = ifs->inbuf;
+			ifs->strm.avail_in = (unsigned int)n;
+		}
+
+		orig_avail_in = ifs->strm.avail_in;
+		orig_avail_out = (unsigned int)de_min_int(buf_len-nproduced, 0x10000000);
+		ifs->strm.next_out = &buf[nproduced];
+		ifs->strm.avail_out = orig_avail_out;
+
+		ret = mz_inflate(&ifs->strm, MZ_SYNC_FLUSH);
+		nproduced += (i64)(orig_avail_out - ifs->strm.avail_out);
+
+		if(ret==MZ_STREAM_END) {
+			ifs->eof_flag = 1;
+			break;
+		}
+		if(ret!=MZ_OK && ret!=MZ_BUF_ERROR) {
+			de_err(ifs->c, "Inflate error (%d)", (int)ret);
+			ifs->errflag = 1;
+			break;
+		}
+		if(orig_avail_in==ifs->strm.avail_in && orig_avail_out==ifs->strm.avail_out) {
+			// No progress. Presumably the compressed data is truncated.
+			ifs->errflag = 1;
+			break;
+		}
+	}
+
+	return nproduced;
+}
+
+// Returns 1 if the end of the Deflate stream has been reached, 0 otherwise.
+// If it returns 1, sets *bytes_consumed to the size of the compressed data.
+int de_inflatestream_get_status(struct de_inflatestream *ifs, i64 *bytes_consumed)
+{
+	*bytes_consumed = 0;
+	if(!ifs->eof_flag || ifs->errflag) return 0;
+	*bytes_consumed = (i64)ifs->strm.total_in;
+	return 1;
+}
+
+void de_inflatestream_destroy(struct de_inflatestream *ifs)
+{
+	if(!ifs) return;
+	if(ifs->stream_open_flag) {
+		mz_inflateEnd(&ifs->strm);
+	}
+	de_free(ifs->c, ifs);
+}
+
 static size_t my_mz_zip_file_write_func(void *pOpaque, mz_uint64 file_ofs, const void *pBuf, size_t n)
 {
 	struct zip_data_struct *zzz = (struct zip_data_struct*)pOpaque;
@@ -434,7 +585,10 @@ static mz_bool my_mz_zip_writer_init_file(deark *c, struct zip_data_struct *zzz,
     pFile_dbuf = dbuf_create_membuf(c, 4096, 0);
   }
   else{
-    pFile_dbuf = dbuf_create_unmanaged_file(c, zzz->pFilename, c->overwrite_mode, 0);
+    // With "-opt dedup", we may need to read back compressed data that we've
+    // already written.
+    pFile_dbuf = dbuf_create_unmanaged_file(c, zzz->pFilename, c->overwrite_mode,
+      c->dedup_data ? 0x2 : 0);
   }
 
   if (pFile_dbuf->btype==DBUF_TYPE_NULL)
@@ -463,7 +617,7 @@ static void init_reproducible_archive_settings(deark *c)
 	}
 }
 
-int de_zip_create_file(deark *c)
+static int zip_create_file_internal(deark *c)
 {
 	struct zip_data_struct *zzz;
 	mz_bool b;
@@ -505,6 +659,19 @@ int de_zip_create_file(deark *c)
 	return 1;
 }
 
+int de_zip_create_file(deark *c)
+{
+	struct de_memtracker_struct *saved_memtracker;
+	int retval;
+
+	// The zip file is shared by all the input files (in batch mode), so it
+	// must not be freed or closed if there's a fatal error.
+	saved_memtracker = de_memtracker_pause(c);
+	retval = zip_create_file_internal(c);
+	de_memtracker_resume(c, saved_memtracker);
+	return retval;
+}
+
 static i64 de_get_reproducible_unix_timestamp(deark *c)
 {
 	if(c->reproducible_timestamp.is_valid) {
@@ -516,6 +683,123 @@ static i64 de_get_reproducible_unix_timestamp(deark *c)
 	return 1283929565LL;
 }
 
+// Read data that has already been written to the ZIP file.
+static int read_zip_output(struct zip_data_struct *zzz, i64 pos, u8 *buf, i64 len)
+{
+	dbuf *outf = zzz->outf;
+	int retval;
+
+	if(pos<0 || len<0) return 0;
+
+	if(outf->btype==DBUF_TYPE_MEMBUF) {
+		if(pos+len > outf->len) return 0;
+		dbuf_read(outf, buf, pos, len);
+		return 1;
+	}
+
+	// (The file was opened for reading and writing. See
+	// my_mz_zip_writer_init_file().)
+	if(outf->btype!=DBUF_TYPE_OFILE || !outf->fp) return 0;
+	retval = (de_fseek(outf->fp, pos, SEEK_SET)==0 &&
+		fread(buf, 1, (size_t)len, outf->fp)==(size_t)len);
+	de_fseek(outf->fp, 0, SEEK_END);
+	return retval;
+}
+
+// For "-opt dedup". Add f to the archive, using the compressed data of an
+// earlier member that (supposedly) has the same contents. The compressed data
+// is decompressed and compared to f, to make sure.
+// Returns 0 if this could not be done.
+static int zip_add_copy_of_member(deark *c, struct zip_data_struct *zzz,
+	dbuf *f, i64 file_index, u32 crc, struct deark_file_attribs *dfa)
+{
+	mz_zip_internal_state *pState = zzz->pZip->m_pState;
+	const mz_uint8 *cdh;
+	u8 lh[MZ_ZIP_LOCAL_DIR_HEADER_SIZE];
+	i64 lh_pos, cmpr_pos, cmpr_len;
+	dbuf *cmpr_data = NULL;
+	dbuf *uncmpr_data = NULL;
+	i64 bytes_consumed = 0;
+	int retval = 0;
+
+	if(file_index<0 || file_index>=(i64)zzz->pZip->m_total_files) goto done;
+	cdh = &MZ_ZIP_ARRAY_ELEMENT(&pState->m_central_dir, mz_uint8,
+		MZ_ZIP_ARRAY_ELEMENT(&pState->m_central_dir_offsets, mz_uint32, (mz_uint)file_index));
+	if(MZ_READ_LE16(cdh + MZ_ZIP_CDH_METHOD_OFS) != MZ_DEFLATED) goto done;
+	if(MZ_READ_LE32(cdh + MZ_ZIP_CDH_CRC32_OFS) != crc) goto done;
+	if((i64)MZ_READ_LE32(cdh + MZ_ZIP_CDH_DECOMPRESSED_SIZE_OFS) != f->len) goto done;
+	cmpr_len = (i64)MZ_READ_LE32(cdh + MZ_ZIP_CDH_COMPRESSED_SIZE_OFS);
+	lh_pos = (i64)MZ_READ_LE32(cdh + MZ_ZIP_CDH_LOCAL_HEADER_OFS);
+	if(cmpr_len<1) goto done;
+
+	if(!read_zip_output(zzz, lh_pos, lh, (i64)sizeof(lh))) goto done;
+	cmpr_pos = lh_pos + MZ_ZIP_LOCAL_DIR_HEADER_SIZE +
+		MZ_READ_LE16(lh + MZ_ZIP_LDH_FILENAME_LEN_OFS) +
+		MZ_READ_LE16(lh + MZ_ZIP_LDH_EXTRA_LEN_OFS);
+
+	cmpr_data = dbuf_create_membuf(c, cmpr_len, 0x1);
+	if(!read_zip_output(zzz, cmpr_pos, cmpr_data->membuf_buf, cmpr_len)) goto done;
+	cmpr_data->len = cmpr_len;
+
+	uncmpr_data = dbuf_create_membuf(c, f->len, 0x1);
+	if(!de_uncompress_deflate(cmpr_data, 0, cmpr_len, uncmpr_data, &bytes_consumed)) goto done;
+	if(uncmpr_data->len != f->len) goto done;
+	if(de_memcmp(uncmpr_data->membuf_buf, f->membuf_buf, (size_t)f->len)) goto done;
+
+	if(!mz_zip_writer_add_mem_ex(zzz->pZip, f->name, cmpr_data->membuf_buf,
+		(size_t)cmpr_len, NULL, 0, MZ_BEST_COMPRESSION|MZ_ZIP_FLAG_COMPRESSED_DATA,
+		(mz_uint64)f->len, (mz_uint32)crc, dfa))
+	{
+		goto done;
+	}
+	retval = 1;
+
+done:
+	dbuf_close(cmpr_data);
+	dbuf_close(uncmpr_data);
+	return retval;
+}
+
+// f must be a membuf.
+static u32 calc_membuf_crc(dbuf *f)
+{
+	struct de_crcobj *crco;
+	u32 crc;
+
+	crco = de_crcobj_create(f->c, DE_CRCOBJ_CRC32_IEEE);
+	de_crcobj_addbuf(crco, f->membuf_buf, f->len);
+	crc = de_crcobj_getval(crco);
+	de_crcobj_destroy(crco);
+	return crc;
+}
+
+// For "-opt dedup". If an identical file is already in the archive, reuse
+// its compressed data. Otherwise, compress it in the usual way.
+static void zip_add_file_dedup(deark *c, struct zip_data_struct *zzz, dbuf *f,
+	struct deark_file_attribs *dfa)
+{
+	struct de_dedup_item *item = NULL;
+	u32 crc;
+
+	crc = calc_membuf_crc(f);
+
+	while(1) {
+		item = de_dedup_find(c, crc, f->len, item);
+		if(!item) break;
+		if(zip_add_copy_of_member(c, zzz, f, item->zip_file_index, crc, dfa)) {
+			de_dbg(c, "%s is identical to an earlier file; reusing its compressed data",
+				f->name);
+			return;
+		}
+	}
+
+	if(mz_zip_writer_add_mem(zzz->pZip, f->name, f->membuf_buf, (size_t)f->len,
+		MZ_BEST_COMPRESSION, dfa))
+	{
+		de_dedup_record(c, crc, f->len, NULL, (i64)zzz->pZip->m_total_files - 1);
+	}
+}
+
 void de_zip_add_file_to_archive(deark *c, dbuf *f)
 {
 	struct zip_data_struct *zzz;
@@ -625,8 +909,13 @@ void de_zip_add_file_to_archive(deark *c, dbuf *f)
 	dbuf_close(efcentral);
 	efcentral = NULL;
 
-	mz_zip_writer_add_mem(zzz->pZip, f->name, f->membuf_buf, (size_t)f->len,
-		MZ_BEST_COMPRESSION, &dfa);
+	if(c->dedup_data) {
+		zip_add_file_dedup(c, zzz, f, &dfa);
+	}
+	else {
+		mz_zip_writer_add_mem(zzz->pZip, f->name, f->membuf_buf, (size_t)f->len,
+			MZ_BEST_COMPRESSION, &dfa);
+	}
 
 	de_free(c, dfa.extra_data_local);
 	de_free(c, dfa.extra_data_central);
@@ -669,16 +958,3 @@ void de_zip_close_file(deark *c)
 	de_free(c, zzz);
 	c->zip_data = NULL;
 }
-
-// For a one-shot CRC calculations, or the first part of a multi-part
-// calculation.
-// buf can be NULL (in which case buf_len should be 0, but is ignored)
-u32 de_crc32(const void *buf, i64 buf_len)
-{
-	return (u32)mz_crc32(MZ_CRC32_INIT, (const mz_uint8*)buf, (size_t)buf_len);
-}
-
-u32 de_crc32_continue(u32 prev_crc, const void *buf, i64 buf_len)
-{
-	return (u32)mz_crc32(prev_crc, (const mz_uint8*)buf, (size_t)buf_len);
-}
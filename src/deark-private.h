@@ -11,6 +11,7 @@
 
 #ifndef DEARK_H_INC
 #include "deark.h"
+#include <setjmp.h>
 #endif
 
 #define DE_MAX_FILE_SIZE 100000000
@@ -110,6 +111,9 @@ struct de_timestamp {
 };
 
 typedef void (*de_writecallback_fn)(dbuf *f, const u8 *buf, i64 buf_len);
+// Supplies the next bytes of a DBUF_TYPE_STREAM dbuf. Returns the number of
+// bytes written to buf (at most buf_len), or 0 at the end of the stream.
+typedef i64 (*de_streamread_fn)(dbuf *f, u8 *buf, i64 buf_len);
 
 // dbuf is our generalized I/O object. Used for many purposes.
 struct dbuf_struct {
@@ -121,6 +125,7 @@ struct dbuf_struct {
 #define DBUF_TYPE_STDOUT  5
 #define DBUF_TYPE_STDIN   6
 #define DBUF_TYPE_FIFO    7
+#define DBUF_TYPE_STREAM  8 // read-mostly-forward, data produced on demand
 	int btype;
 	u8 is_managed;
 
@@ -140,12 +145,40 @@ struct dbuf_struct {
 	int write_memfile_to_zip_archive; // used for DBUF_TYPE_OFILE, at least
 	char *name; // used for DBUF_TYPE_OFILE (utf-8)
 
+	// Used for DBUF_TYPE_OFILE, if the file is being written by the
+	// background writer thread (see deark-writer.c). ->fp is NULL in that case.
+	struct de_asyncfile_struct *asyncfile;
+
+	// Links in the deark object's list of files that need to be closed if
+	// there's a fatal error (see de_run()).
+	struct dbuf_struct *openfile_prev;
+	struct dbuf_struct *openfile_next;
+	u8 openfile_registered;
+
+	// Used if the file is to be reported in JSON format, or written to the
+	// index file, when it's closed.
+	u8 report_as_json;
+	u8 report_to_index;
+	int file_index;
+	const char *module_id;
+	struct de_crcobj *crco_for_json;
+	// For "-opt dedup", with direct output. While dedup_pending is set, the
+	// file is a membuf that hasn't been written to disk yet.
+	u8 dedup_pending;
+	struct de_crcobj *crco_for_dedup;
+
 	i64 membuf_alloc;
 	u8 *membuf_buf;
 
 	void *userdata;
 	de_writecallback_fn writecallback_fn;
 
+	// Used for DBUF_TYPE_STREAM. The most recently produced bytes are kept in
+	// ->cache, which works as a sliding window.
+	de_streamread_fn streamreadfn;
+	i64 stream_window_alloc;
+	u8 stream_eof;
+
 #define DE_CACHE_POLICY_NONE    0
 #define DE_CACHE_POLICY_ENABLED 1
 	int cache_policy;
@@ -160,6 +193,13 @@ struct dbuf_struct {
 
 	// Things copied from the de_finfo object at file creation
 	de_finfo *fi_copy;
+
+	// Used if this is an output file that will be decoded recursively (-r),
+	// after it is closed. recursion_basefn is the base filename for files
+	// extracted from it.
+	char *recursion_basefn;
+	// A copy of the file's contents. Not used if ->btype is MEMBUF.
+	struct dbuf_struct *recursion_copy;
 };
 
 // Image density (resolution) settings
@@ -201,6 +241,15 @@ struct deark_bitmap_struct {
 	i64 bitmap_size; // bytes allocated for bitmap
 	int orig_colortype; // Optional; can be used by modules
 	int orig_bitdepth; // Optional; can be used by modules
+	// If is_indexed is set, 'bitmap' contains palette indices of idx_bitdepth
+	// (1, 2, 4, or 8) bits, packed MSB-first, idx_rowspan bytes per row, and
+	// 'pal' is the palette. bytes_per_pixel is the format the pixels will have
+	// when the image is converted to the normal form. Functions that change
+	// pixels convert it first, except where noted.
+	int is_indexed;
+	int idx_bitdepth; // 0 if the image was not created as indexed
+	i64 idx_rowspan;
+	u32 *pal; // [256]; Non-NULL if idx_bitdepth is set
 };
 typedef struct deark_bitmap_struct de_bitmap;
 
@@ -293,6 +342,16 @@ struct deark_struct {
 	int num_files_extracted;
 
 	int error_count;
+	int warning_count;
+
+	// The module that was used for the input file (or NULL).
+	const char *main_module_id;
+	// The innermost module that is currently running (or NULL).
+	const char *cur_module_id;
+
+	// "-opt output:json": Report extracted files, errors, and warnings as
+	// JSON objects, instead of the usual messages.
+	u8 json_output;
 
 	const char *input_filename;
 	const char *input_format_req; // Format requested
@@ -310,6 +369,16 @@ struct deark_struct {
 	int extract_policy; // DE_EXTRACTPOLICY_*
 	int extract_level;
 	int list_mode;
+	int batch_mode; // de_run() may be called more than once
+
+	// Recursion (-r): Extracted files are themselves decoded.
+	int recurse_mode;
+	int recursion_level; // 0 = decoding the top-level input file
+	int recurse_maxdepth;
+	i64 recurse_maxsize;
+	i64 recurse_bytes_total; // Total size of the files we've decoded recursively
+	i64 recurse_bytes_limit;
+	u8 recurse_limit_warned;
 	int first_output_file; // first file = 0
 	int max_output_files; // -1 = no limit
 	i64 max_image_dimension;
@@ -333,10 +402,25 @@ struct deark_struct {
 	de_msgfn_type msgfn; // Caller's message output function
 	de_specialmsgfn_type specialmsgfn;
 	de_fatalerrorfn_type fatalerrorfn;
+	de_extrlistfn_type extrlistfn;
 	const char *dprefix;
 
 	void *zip_data;
+	void *asyncwriter_data;
 	dbuf *extrlist_dbuf;
+	dbuf *index_wfile; // "-opt index:write" (see deark-index.c)
+	void *dedup_data; // "-opt dedup" (see deark-dedup.c)
+
+	// If recovery_point is set, a fatal error does a longjmp() to it, instead
+	// of ending the process. Memory allocated and files opened while it is set
+	// are tracked, so that they can be released.
+	jmp_buf *recovery_point;
+	// If set, de_fatalerror() calls this before anything else, so that a
+	// module can stop its worker threads before their memory is freed.
+	void (*fatalerror_cleanup_fn)(deark *c, void *userdata);
+	void *fatalerror_cleanup_userdata;
+	struct de_memtracker_struct *memtracker;
+	dbuf *open_files; // Head of a linked list
 
 	char *base_output_filename;
 	char *output_archive_filename;
@@ -364,6 +448,11 @@ struct deark_struct {
 };
 
 void de_fatalerror(deark *c);
+void de_memtracker_begin(deark *c);
+void de_memtracker_end(deark *c, int free_blocks);
+struct de_memtracker_struct *de_memtracker_pause(deark *c);
+void de_memtracker_resume(deark *c, struct de_memtracker_struct *t);
+void *de_malloc_nofatal(i64 n);
 
 deark *de_create_internal(void);
 int de_run_module(deark *c, struct deark_module_info *mi, de_module_params *mparams, int moddisp);
@@ -374,6 +463,10 @@ void de_run_module_by_id_on_slice2(deark *c, const char *id, const char *codes,
 	dbuf *f, i64 pos, i64 len);
 int de_get_module_idx_by_id(deark *c, const char *module_id);
 struct deark_module_info *de_get_module_by_id(deark *c, const char *module_id);
+struct deark_module_info *de_detect_module_for_file(deark *c, int *errflag);
+void de_recurse_into_file(deark *c, dbuf *f, const char *fn, const char *basefn);
+void de_json_report_file(dbuf *f);
+void de_json_report_summary(deark *c, const char *input_fn, i64 elapsed_usec);
 
 void de_strlcpy(char *dst, const char *src, size_t dstlen);
 char *de_strchr(const char *s, int c);
@@ -393,8 +486,6 @@ char *de_strchr(const char *s, int c);
 #endif
 
 void de_vsnprintf(char *buf, size_t buflen, const char *fmt, va_list ap);
-void de_snprintf(char *buf, size_t buflen, const char *fmt, ...)
-  de_gnuc_attribute ((format (printf, 3, 4)));
 
 // de_dbg*, de_msg, de_warn, de_err: The output is a single line, to which a
 // standard prefix like "Warning: " may be added. A newline will be added
@@ -421,12 +512,50 @@ FILE* de_fopen_for_read(deark *c, const char *fn, i64 *len,
 FILE* de_fopen_for_write(deark *c, const char *fn,
 	char *errmsg, size_t errmsg_len, int overwrite_mode,
 	unsigned int flags);
+int de_replace_with_hard_link(deark *c, const char *existing_fn, const char *new_fn,
+	char *errmsg, size_t errmsg_len);
 int de_fseek(FILE *fp, i64 offs, int whence);
 i64 de_ftell(FILE *fp);
 int de_fclose(FILE *fp);
 
 void de_update_file_perms(dbuf *f);
 void de_update_file_time(dbuf *f);
+void de_update_file_perms_by_name(deark *c, const char *fn,
+	unsigned int mode_flags, unsigned int flags);
+void de_update_file_time_by_name(deark *c, const char *fn,
+	const struct de_timestamp *ts, unsigned int flags);
+
+void de_asyncwriter_start(deark *c);
+void de_asyncwriter_finish(deark *c);
+void de_asyncwriter_report_errors(deark *c);
+void de_asyncwriter_open_file(deark *c, dbuf *f);
+void de_asyncwriter_write(dbuf *f, const u8 *m, i64 len);
+void de_asyncwriter_close_file(dbuf *f);
+
+void de_index_begin(deark *c);
+void de_index_end(deark *c);
+void de_index_member(deark *c, i64 pos);
+void de_index_file(dbuf *f);
+i64 de_index_find_start(deark *c, i64 pos1);
+
+struct de_dedup_item {
+	u32 crc;
+	i64 len;
+	char *name; // For direct output
+	unsigned int mode_flags; // For direct output
+	struct de_timestamp mod_time; // For direct output
+	i64 zip_file_index; // For -zip
+	struct de_dedup_item *next;
+};
+void de_dedup_start(deark *c);
+void de_dedup_destroy(deark *c);
+struct de_dedup_item *de_dedup_find(deark *c, u32 crc, i64 len,
+	struct de_dedup_item *prev);
+void de_dedup_record(deark *c, u32 crc, i64 len, const char *name,
+	i64 zip_file_index);
+void de_dedup_link_file(dbuf *f);
+const char *de_dedup_find_identical(dbuf *f, u32 crc);
+void de_dedup_record_file(dbuf *f, u32 crc);
 
 void de_declare_fmt(deark *c, const char *fmtname);
 void de_declare_fmtf(deark *c, const char *fmt, ...)
@@ -462,6 +591,59 @@ int de_havemodcode(deark *c, de_module_params *mparams, int code);
 int de_uncompress_zlib(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *outf);
 int de_uncompress_deflate(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *outf,
 	i64 *bytes_consumed);
+int de_fast_inflate(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *outf,
+	int is_zlib, i64 *bytes_consumed);
+
+// A saved decoder state, from which Deflate decoding can be resumed.
+#define DE_INFLATE_WINDOW_SIZE 32768
+struct de_inflate_checkpoint {
+	i64 in_bitpos; // Bit position in the compressed data, relative to its start
+	i64 out_pos; // Position in the decompressed data
+	u8 window[DE_INFLATE_WINDOW_SIZE]; // The bytes before out_pos
+};
+
+struct de_inflate_params;
+typedef void (*de_inflate_checkpoint_fn)(struct de_inflate_params *ip,
+	const struct de_inflate_checkpoint *cp);
+
+struct de_inflate_params {
+	int is_zlib;
+
+	// If checkpoint_fn is set, it is called at the start of each block that
+	// begins at least checkpoint_span bytes after the previous checkpoint
+	// (or the start of the data). The checkpoint is only valid during the call.
+	de_inflate_checkpoint_fn checkpoint_fn;
+	i64 checkpoint_span;
+	void *userdata;
+
+	// If set, start decoding from this checkpoint. For zlib, the Adler-32
+	// checksum is not checked.
+	const struct de_inflate_checkpoint *resume_from;
+
+	// If use_out_range is set, only this range of the decompressed data is
+	// written, and decoding stops soon after the end of it.
+	u8 use_out_range;
+	i64 out_range_start;
+	i64 out_range_len;
+
+	// Set this if calling from a thread other than the main thread. Nothing
+	// will be printed; on failure, see errmsg.
+	u8 from_worker_thread;
+
+	// [out] Size of the compressed data, if decoding reached the end of it.
+	i64 bytes_consumed;
+	// [out] The reason for failure, if de_fast_inflate_ex() returned 0.
+	const char *errmsg;
+};
+int de_fast_inflate_ex(dbuf *inf, i64 inputstart, i64 inputsize, dbuf *outf,
+	struct de_inflate_params *ip);
+
+struct de_inflatestream;
+struct de_inflatestream *de_inflatestream_create(dbuf *inf, i64 inputstart,
+	i64 inputsize, int is_zlib);
+i64 de_inflatestream_read(struct de_inflatestream *ifs, u8 *buf, i64 buf_len);
+int de_inflatestream_get_status(struct de_inflatestream *ifs, i64 *bytes_consumed);
+void de_inflatestream_destroy(struct de_inflatestream *ifs);
 
 int de_zip_create_file(deark *c);
 void de_zip_add_file_to_archive(deark *c, dbuf *f);
@@ -579,6 +761,7 @@ void dbuf_read_to_ucstring_n(dbuf *f, i64 pos, i64 len, i64 max_len,
 // At least one of 'ext' or 'fi' should be non-NULL.
 #define DE_CREATEFLAG_IS_AUX   0x1
 #define DE_CREATEFLAG_OPT_IMAGE 0x2
+#define DE_CREATEFLAG_NORECURSE 0x4 // Don't try to decode this file, if -r is used
 dbuf *dbuf_create_output_file(deark *c, const char *ext, de_finfo *fi, unsigned int createflags);
 
 dbuf *dbuf_create_unmanaged_file(deark *c, const char *fname, int overwrite_mode, unsigned int flags);
@@ -587,6 +770,7 @@ dbuf *dbuf_open_input_file(deark *c, const char *fn);
 dbuf *dbuf_open_input_stdin(deark *c);
 
 dbuf *dbuf_open_input_subfile(dbuf *parent, i64 offset, i64 size);
+dbuf *dbuf_open_input_stream(deark *c, i64 len, de_streamread_fn fn, void *userdata);
 
 // Flag:
 //  0x1: Set the maximum size to the 'initialsize'
@@ -594,6 +778,10 @@ dbuf *dbuf_create_membuf(deark *c, i64 initialsize, unsigned int flags);
 
 // If f is NULL, this is a no-op.
 void dbuf_close(dbuf *f);
+int dbuf_is_discarded(dbuf *f);
+int de_output_file_limit_reached(deark *c);
+void dbuf_abandon_open_files(deark *c);
+void dbuf_forget_open_files(deark *c);
 
 void dbuf_write(dbuf *f, const u8 *m, i64 len);
 void dbuf_write_at(dbuf *f, i64 pos, const u8 *m, i64 len);
@@ -714,10 +902,18 @@ void de_bitmap_setpixel_rgb(de_bitmap *img, i64 x, i64 y,
 void de_bitmap_setpixel_rgba(de_bitmap *img, i64 x, i64 y,
 	u32 color);
 
+void de_bitmap_setrow_paletted(de_bitmap *img, i64 y, const u8 *src,
+	i64 npixels, const u32 *pal);
+
 u32 de_bitmap_getpixel(de_bitmap *img, i64 x, i64 y);
 
 de_bitmap *de_bitmap_create_noinit(deark *c);
 de_bitmap *de_bitmap_create(deark *c, i64 width, i64 height, int bypp);
+de_bitmap *de_bitmap_create_indexed(deark *c, i64 width, i64 height, int bypp,
+	int bitdepth, const u32 *pal, i64 num_entries);
+de_bitmap *de_bitmap_create_bilevel(deark *c, i64 width, i64 height);
+
+const u8 *de_bitmap_get_row(de_bitmap *img, i64 y, u8 *rowbuf);
 
 void de_bitmap_destroy(de_bitmap *b);
 
@@ -1086,3 +1282,5 @@ void de_timestamp_to_string(const struct de_timestamp *ts,
 	char *buf, size_t buf_len, unsigned int flags);
 void de_gmtime(const struct de_timestamp *ts, struct de_struct_tm *tm2);
 void de_current_time_to_timestamp(struct de_timestamp *ts);
+// For measuring elapsed time. Microseconds since an arbitrary starting point.
+i64 de_get_clock_usec(void);
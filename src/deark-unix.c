@@ -23,6 +23,7 @@
 #include <time.h>
 #include <utime.h>
 #include <errno.h>
+#include <pthread.h>
 
 int de_strcasecmp(const char *a, const char *b)
 {
@@ -38,13 +39,12 @@ void de_vsnprintf(char *buf, size_t buflen, const char *fmt, va_list ap)
 char *de_strdup(deark *c, const char *s)
 {
 	char *s2;
+	size_t len;
 
-	s2 = strdup(s);
-	if(!s2) {
-		de_err(c, "Memory allocation failed");
-		de_fatalerror(c);
-		return NULL;
-	}
+	// Use de_malloc(), so that the memory can be freed with de_free().
+	len = de_strlen(s);
+	s2 = de_malloc(c, (i64)len+1);
+	de_memcpy(s2, s, len+1);
 	return s2;
 }
 
@@ -117,14 +117,19 @@ FILE* de_fopen_for_read(deark *c, const char *fn, i64 *len,
 	return f;
 }
 
-// flags: 0x1 = append instead of overwriting
+// c can be NULL, in which case this is safe to call from a worker thread.
+// flags:
+//  0x1 = append instead of overwriting
+//  0x2 = also open for reading
+//  0x4 = if fn is an existing regular file, delete it first, instead of
+//        overwriting it (so that any other hard links to it are not changed)
 FILE* de_fopen_for_write(deark *c, const char *fn,
 	char *errmsg, size_t errmsg_len, int overwrite_mode,
 	unsigned int flags)
 {
 	const char *mode;
 
-	if(overwrite_mode!=DE_OVERWRITEMODE_STANDARD) {
+	if(overwrite_mode!=DE_OVERWRITEMODE_STANDARD || (flags&0x4)) {
 		// Check if the file already exists.
 		struct stat stbuf;
 		int s_ret;
@@ -144,12 +149,50 @@ FILE* de_fopen_for_write(deark *c, const char *fn,
 				return NULL;
 			}
 		}
+
+		if(s_ret==0 && (flags&0x4) && (stbuf.st_mode & S_IFMT) == S_IFREG) {
+			unlink(fn);
+		}
 	}
 
-	mode = (flags&0x1) ? "ab" : "wb";
+	if(flags&0x1)
+		mode = (flags&0x2) ? "a+b" : "ab";
+	else
+		mode = (flags&0x2) ? "w+b" : "wb";
 	return de_fopen(c, fn, mode, errmsg, errmsg_len);
 }
 
+// Replace the existing file new_fn with a hard link to the existing file
+// existing_fn. The link is made under a temporary name, then renamed, so
+// that new_fn is never missing.
+// On failure, returns 0 and sets errmsg, and new_fn is unchanged.
+int de_replace_with_hard_link(deark *c, const char *existing_fn, const char *new_fn,
+	char *errmsg, size_t errmsg_len)
+{
+	char *tmp_fn;
+	size_t tmp_fn_len;
+	int retval = 0;
+
+	tmp_fn_len = de_strlen(new_fn) + 16;
+	tmp_fn = de_malloc(c, (i64)tmp_fn_len);
+	de_snprintf(tmp_fn, tmp_fn_len, "%s.dedup-tmp", new_fn);
+
+	if(link(existing_fn, tmp_fn)!=0) {
+		de_strlcpy(errmsg, strerror(errno), errmsg_len);
+		goto done;
+	}
+	if(rename(tmp_fn, new_fn)!=0) {
+		de_strlcpy(errmsg, strerror(errno), errmsg_len);
+		unlink(tmp_fn);
+		goto done;
+	}
+	retval = 1;
+
+done:
+	de_free(c, tmp_fn);
+	return retval;
+}
+
 int de_fseek(FILE *fp, i64 offs, int whence)
 {
 	int ret;
@@ -179,20 +222,20 @@ int de_fclose(FILE *fp)
 	return fclose(fp);
 }
 
-// If, based on f->mode_flags, we know that the file should be executable or
+// If, based on mode_flags, we know that the file should be executable or
 // non-executable, make it so.
-void de_update_file_perms(dbuf *f)
+// flags: 0x1 = Don't print anything. (This makes the function safe to call
+// from a worker thread, with c=NULL.)
+void de_update_file_perms_by_name(deark *c, const char *fn,
+	unsigned int mode_flags, unsigned int flags)
 {
 	struct stat stbuf;
 	mode_t oldmode, newmode;
 
-	if(f->btype!=DBUF_TYPE_OFILE) return;
-	if(!f->fi_copy) return;
-	if(!f->name) return;
-	if(!(f->fi_copy->mode_flags&DE_MODEFLAG_NONEXE) &&!(f->fi_copy->mode_flags&DE_MODEFLAG_EXE)) return;
+	if(!(mode_flags&DE_MODEFLAG_NONEXE) && !(mode_flags&DE_MODEFLAG_EXE)) return;
 
 	de_zeromem(&stbuf, sizeof(struct stat));
-	if(0 != stat(f->name, &stbuf)) {
+	if(0 != stat(fn, &stbuf)) {
 		return;
 	}
 
@@ -202,7 +245,7 @@ void de_update_file_perms(dbuf *f)
 	// Start by turning off the executable bits in the tentative new mode.
 	newmode &= ~(S_IXUSR|S_IXGRP|S_IXOTH);
 
-	if(f->fi_copy->mode_flags&DE_MODEFLAG_EXE) {
+	if(mode_flags&DE_MODEFLAG_EXE) {
 		// Set an Executable bit if its corresponding Read bit is set.
 		if(oldmode & S_IRUSR) newmode |= S_IXUSR;
 		if(oldmode & S_IRGRP) newmode |= S_IXGRP;
@@ -210,22 +253,29 @@ void de_update_file_perms(dbuf *f)
 	}
 
 	if(newmode != oldmode) {
-		de_dbg2(f->c, "changing file mode from %03o to %03o",
-			(unsigned int)oldmode, (unsigned int)newmode);
-		chmod(f->name, newmode);
+		if(!(flags&0x1)) {
+			de_dbg2(c, "changing file mode from %03o to %03o",
+				(unsigned int)oldmode, (unsigned int)newmode);
+		}
+		chmod(fn, newmode);
 	}
 }
 
-void de_update_file_time(dbuf *f)
+void de_update_file_perms(dbuf *f)
 {
-	const struct de_timestamp *ts;
-	struct timeval times[2];
-
 	if(f->btype!=DBUF_TYPE_OFILE) return;
 	if(!f->fi_copy) return;
-	ts = &f->fi_copy->mod_time;
-	if(!ts->is_valid) return;
 	if(!f->name) return;
+	de_update_file_perms_by_name(f->c, f->name, f->fi_copy->mode_flags, 0);
+}
+
+// flags: Same as for de_update_file_perms_by_name().
+void de_update_file_time_by_name(deark *c, const char *fn,
+	const struct de_timestamp *ts, unsigned int flags)
+{
+	struct timeval times[2];
+
+	if(!ts->is_valid) return;
 
 	// I know that this code is not Y2038-compliant, if sizeof(time_t)==4.
 	// But it's not likely to be a serious problem, and I'd rather not replace
@@ -239,7 +289,15 @@ void de_update_file_time(dbuf *f)
 	}
 	// times[1] = mod time
 	times[1] = times[0];
-	utimes(f->name, times);
+	utimes(fn, times);
+}
+
+void de_update_file_time(dbuf *f)
+{
+	if(f->btype!=DBUF_TYPE_OFILE) return;
+	if(!f->fi_copy) return;
+	if(!f->name) return;
+	de_update_file_time_by_name(f->c, f->name, &f->fi_copy->mod_time, 0);
 }
 
 // Note: Need to keep this function in sync with the implementation in deark-win.c.
@@ -249,6 +307,7 @@ void de_gmtime(const struct de_timestamp *ts, struct de_struct_tm *tm2)
 {
 	i64 tmpt_int64;
 	time_t tmpt;
+	struct tm tm1buf;
 	struct tm *tm1;
 
 	de_zeromem(tm2, sizeof(struct de_struct_tm));
@@ -266,7 +325,8 @@ void de_gmtime(const struct de_timestamp *ts, struct de_struct_tm *tm2)
 	}
 
 	tmpt = (time_t)tmpt_int64;
-	tm1 = gmtime(&tmpt);
+	// Use gmtime_r, because we might not be the only thread.
+	tm1 = gmtime_r(&tmpt, &tm1buf);
 	if(!tm1) return;
 
 	tm2->is_valid = 1;
@@ -298,9 +358,129 @@ void de_current_time_to_timestamp(struct de_timestamp *ts)
 	de_timestamp_set_subsec(ts, ((double)tv.tv_usec)/1000000.0);
 }
 
+i64 de_get_clock_usec(void)
+{
+	struct timespec ts;
+
+	if(clock_gettime(CLOCK_MONOTONIC, &ts)!=0) return 0;
+	return (i64)ts.tv_sec*1000000 + (i64)(ts.tv_nsec/1000);
+}
+
 void de_exitprocess(void)
 {
 	exit(1);
 }
 
+// Returns the number of processors available, or 1 if unknown.
+int de_get_cpu_count(void)
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n<1) return 1;
+	if(n>1024) return 1024;
+	return (int)n;
+}
+
+// Threads and synchronization objects, used by a few optional features.
+// These are thin wrappers around pthreads.
+
+struct de_thread_struct {
+	pthread_t thr;
+	de_thread_fn fn;
+	void *userdata;
+};
+
+struct de_mutex_struct {
+	pthread_mutex_t mtx;
+};
+
+struct de_cond_struct {
+	pthread_cond_t cnd;
+};
+
+static void *thread_start_routine(void *arg)
+{
+	de_thread *t = (de_thread*)arg;
+
+	t->fn(t->userdata);
+	return NULL;
+}
+
+// Returns NULL if the thread could not be started. The caller should then
+// do the work some other way.
+de_thread *de_thread_create(deark *c, de_thread_fn fn, void *userdata)
+{
+	de_thread *t;
+
+	t = de_malloc(c, sizeof(de_thread));
+	t->fn = fn;
+	t->userdata = userdata;
+	if(0 != pthread_create(&t->thr, NULL, thread_start_routine, (void*)t)) {
+		de_free(c, t);
+		return NULL;
+	}
+	return t;
+}
+
+// Wait for the thread to finish, and free the de_thread object.
+void de_thread_join(de_thread *t)
+{
+	if(!t) return;
+	pthread_join(t->thr, NULL);
+	de_free(NULL, t);
+}
+
+de_mutex *de_mutex_create(deark *c)
+{
+	de_mutex *m;
+
+	m = de_malloc(c, sizeof(de_mutex));
+	pthread_mutex_init(&m->mtx, NULL);
+	return m;
+}
+
+void de_mutex_destroy(de_mutex *m)
+{
+	if(!m) return;
+	pthread_mutex_destroy(&m->mtx);
+	de_free(NULL, m);
+}
+
+void de_mutex_lock(de_mutex *m)
+{
+	pthread_mutex_lock(&m->mtx);
+}
+
+void de_mutex_unlock(de_mutex *m)
+{
+	pthread_mutex_unlock(&m->mtx);
+}
+
+de_cond *de_cond_create(deark *c)
+{
+	de_cond *cv;
+
+	cv = de_malloc(c, sizeof(de_cond));
+	pthread_cond_init(&cv->cnd, NULL);
+	return cv;
+}
+
+void de_cond_destroy(de_cond *cv)
+{
+	if(!cv) return;
+	pthread_cond_destroy(&cv->cnd);
+	de_free(NULL, cv);
+}
+
+void de_cond_wait(de_cond *cv, de_mutex *m)
+{
+	pthread_cond_wait(&cv->cnd, &m->mtx);
+}
+
+void de_cond_broadcast(de_cond *cv)
+{
+	pthread_cond_broadcast(&cv->cnd);
+}
+
 #endif // DE_UNIX
@@ -12,60 +12,6 @@
 #include "deark-private.h"
 #include "deark-user.h"
 
-// Returns the best module to use, by looking at the file contents, etc.
-static struct deark_module_info *detect_module_for_file(deark *c, int *errflag)
-{
-	int i;
-	int result;
-	int best_result = 0;
-	int orig_errcount;
-	struct deark_module_info *best_module = NULL;
-
-	*errflag = 0;
-
-	// Check for a UTF-8 BOM just once. Any module can use this flag.
-	if(dbuf_has_utf8_bom(c->infile, 0)) {
-		c->detection_data.has_utf8_bom = 1;
-	}
-
-	orig_errcount = c->error_count;
-	for(i=0; i<c->num_modules; i++) {
-		if(c->module_info[i].identify_fn==NULL) continue;
-
-		// If autodetect is disabled for this module, and its autodetect routine
-		// doesn't do anything that may be needed by other modules, don't bother
-		// to run this module's autodetection.
-		if((c->module_info[i].flags & DE_MODFLAG_DISABLEDETECT) &&
-			!(c->module_info[i].flags & DE_MODFLAG_SHAREDDETECTION))
-		{
-			continue;
-		}
-
-		result = c->module_info[i].identify_fn(c);
-
-		if(c->error_count > orig_errcount) {
-			// Detection routines don't normally produce errors. If one does,
-			// it's probably an internal error, or other serious problem.
-			*errflag = 1;
-			return NULL;
-		}
-
-		if(c->module_info[i].flags & DE_MODFLAG_DISABLEDETECT) {
-			// Ignore results of autodetection.
-			continue;
-		}
-
-		if(result <= best_result) continue;
-
-		// This is the best result so far.
-		best_result = result;
-		best_module = &c->module_info[i];
-		if(best_result>=100) break;
-	}
-
-	return best_module;
-}
-
 struct sort_data_struct {
 	deark *c;
 	int module_index;
@@ -199,61 +145,15 @@ static void open_extrlist(deark *c)
 		DE_OVERWRITEMODE_STANDARD, flags);
 }
 
-void de_run(deark *c)
+// Open the input file, detect the format if necessary, and run the module.
+static void run_main_module(deark *c, struct deark_module_info *module_to_use)
 {
 	dbuf *orig_ifile = NULL;
 	dbuf *subfile = NULL;
 	i64 subfile_size;
-	struct deark_module_info *module_to_use = NULL;
 	int module_was_autodetected = 0;
 	int moddisp;
 	de_module_params *mparams = NULL;
-	de_ucstring *friendly_infn = NULL;
-
-	if(c->modhelp_req && c->input_format_req) {
-		do_modhelp(c);
-		goto done;
-	}
-
-	if(c->extrlist_filename) {
-		open_extrlist(c);
-	}
-
-	friendly_infn = ucstring_create(c);
-
-	if(c->input_style==DE_INPUTSTYLE_STDIN) {
-		ucstring_append_sz(friendly_infn, "[stdin]", DE_ENCODING_LATIN1);
-	}
-	else {
-		if(!c->input_filename) {
-			de_err(c, "Internal: Input file not set");
-			de_fatalerror(c);
-			return;
-		}
-		ucstring_append_sz(friendly_infn, c->input_filename, DE_ENCODING_UTF8);
-	}
-
-	de_register_modules(c);
-
-	if(c->input_format_req) {
-		module_to_use = de_get_module_by_id(c, c->input_format_req);
-		if(!module_to_use) {
-			de_err(c, "Unknown module \"%s\"", c->input_format_req);
-			goto done;
-		}
-	}
-
-	if(c->slice_size_req_valid) {
-		de_dbg(c, "Input file: %s[%d,%d]", ucstring_getpsz_d(friendly_infn),
-			(int)c->slice_start_req, (int)c->slice_size_req);
-	}
-	else if(c->slice_start_req) {
-		de_dbg(c, "Input file: %s[%d]", ucstring_getpsz_d(friendly_infn),
-			(int)c->slice_start_req);
-	}
-	else {
-		de_dbg(c, "Input file: %s", ucstring_getpsz_d(friendly_infn));
-	}
 
 	if(c->input_style==DE_INPUTSTYLE_STDIN) {
 		orig_ifile = dbuf_open_input_stdin(c);
@@ -269,7 +169,7 @@ void de_run(deark *c)
 		}
 	}
 	if(!orig_ifile) {
-		goto done;
+		return;
 	}
 
 	c->infile = orig_ifile;
@@ -285,10 +185,29 @@ void de_run(deark *c)
 		c->infile = subfile;
 	}
 
+	if(c->recurse_mode) {
+		const char *s;
+		i64 maxratio = 1000;
+
+		c->recurse_maxdepth = 10;
+		s = de_get_ext_option(c, "recurse:maxdepth");
+		if(s) c->recurse_maxdepth = de_atoi(s);
+		c->recurse_maxsize = 256*1048576;
+		s = de_get_ext_option(c, "recurse:maxsize");
+		if(s) c->recurse_maxsize = de_atoi64(s);
+		s = de_get_ext_option(c, "recurse:maxratio");
+		if(s) maxratio = de_atoi64(s);
+		// The limit on the total size of the files we'll decode recursively.
+		// It's relative to the input file size, but not less than 1MB.
+		c->recurse_bytes_limit = maxratio * de_max_int(c->infile->len, 1048576);
+		c->recurse_bytes_total = 0;
+		c->recurse_limit_warned = 0;
+	}
+
 	if(!module_to_use) {
 		int errflag;
 
-		module_to_use = detect_module_for_file(c, &errflag);
+		module_to_use = de_detect_module_for_file(c, &errflag);
 		if(errflag) goto done;
 		module_was_autodetected = 1;
 	}
@@ -309,6 +228,7 @@ void de_run(deark *c)
 	}
 
 	de_msg(c, "Module: %s", module_to_use->id);
+	c->main_module_id = module_to_use->id;
 
 	if(module_was_autodetected && (module_to_use->flags&DE_MODFLAG_SECURITYWARNING)) {
 		de_err(c, "The %s module has not been audited for security. There is a "
@@ -359,6 +279,8 @@ void de_run(deark *c)
 	else
 		moddisp = DE_MODDISP_EXPLICIT;
 
+	de_index_begin(c);
+
 	if(!de_run_module(c, module_to_use, mparams, moddisp)) {
 		goto done;
 	}
@@ -372,13 +294,168 @@ void de_run(deark *c)
 	}
 
 done:
-	if(c->extrlist_dbuf) { dbuf_close(c->extrlist_dbuf); c->extrlist_dbuf=NULL; }
-	ucstring_destroy(friendly_infn);
+	de_index_end(c);
+	c->infile = NULL;
 	if(subfile) dbuf_close(subfile);
 	if(orig_ifile) dbuf_close(orig_ifile);
 	de_free(c, mparams);
 }
 
+// Like run_main_module(), but if there's a fatal error, only the current
+// input file is abandoned. Its memory is freed, its open files are closed,
+// and we return normally.
+static void run_main_module_with_recovery(deark *c,
+	struct deark_module_info *module_to_use)
+{
+	jmp_buf recovery_point;
+	struct de_memtracker_struct *memtracker;
+	dbuf *saved_infile;
+	const char *saved_input_filename;
+	char *saved_base_output_filename;
+	int saved_first_output_file, saved_max_output_files;
+
+	saved_infile = c->infile;
+	saved_input_filename = c->input_filename;
+	saved_base_output_filename = c->base_output_filename;
+	saved_first_output_file = c->first_output_file;
+	saved_max_output_files = c->max_output_files;
+
+	de_memtracker_begin(c);
+	memtracker = c->memtracker;
+	if(setjmp(recovery_point)) {
+		// We get here if de_fatalerror() was called.
+		c->recovery_point = NULL;
+		// (In case the error happened while tracking was paused.)
+		de_memtracker_resume(c, memtracker);
+		dbuf_abandon_open_files(c);
+		de_memtracker_end(c, 1);
+
+		// Undo whatever nested modules and recursion may have changed.
+		c->infile = saved_infile;
+		c->input_filename = saved_input_filename;
+		c->base_output_filename = saved_base_output_filename;
+		c->first_output_file = saved_first_output_file;
+		c->max_output_files = saved_max_output_files;
+		c->index_wfile = NULL; // (It was closed by dbuf_abandon_open_files().)
+		c->module_nesting_level = 0;
+		c->recursion_level = 0;
+		c->dbg_indent_amount = 0;
+		return;
+	}
+	c->recovery_point = &recovery_point;
+
+	run_main_module(c, module_to_use);
+
+	c->recovery_point = NULL;
+	dbuf_forget_open_files(c);
+	de_memtracker_end(c, 0);
+}
+
+void de_run(deark *c)
+{
+	struct deark_module_info *module_to_use = NULL;
+	de_ucstring *friendly_infn = NULL;
+	i64 start_time;
+
+	start_time = de_get_clock_usec();
+
+	// Reset the state that applies to a single input file, in case this
+	// isn't the first time de_run() has been called (batch mode).
+	c->infile = NULL;
+	c->file_count = 0;
+	c->num_files_extracted = 0;
+	c->error_count = 0;
+	c->warning_count = 0;
+	c->main_module_id = NULL;
+	c->cur_module_id = NULL;
+	c->format_declared = 0;
+	c->module_disposition = DE_MODDISP_NONE;
+	c->suppress_detection_by_filename = 0;
+	de_zeromem(&c->detection_data, sizeof(struct de_detection_data_struct));
+
+	if(c->modhelp_req && c->input_format_req) {
+		do_modhelp(c);
+		goto done;
+	}
+
+	c->json_output = (u8)de_get_ext_option_bool(c, "output:json", 0);
+
+	if(c->extrlist_filename) {
+		open_extrlist(c);
+	}
+
+	friendly_infn = ucstring_create(c);
+
+	if(c->input_style==DE_INPUTSTYLE_STDIN) {
+		ucstring_append_sz(friendly_infn, "[stdin]", DE_ENCODING_LATIN1);
+	}
+	else {
+		if(!c->input_filename) {
+			de_err(c, "Internal: Input file not set");
+			de_fatalerror(c);
+			return;
+		}
+		ucstring_append_sz(friendly_infn, c->input_filename, DE_ENCODING_UTF8);
+	}
+
+	de_register_modules(c);
+
+	if(c->batch_mode && c->debug_level<1) {
+		de_msg(c, "Input file: %s", ucstring_getpsz_d(friendly_infn));
+	}
+
+	if(c->input_format_req) {
+		module_to_use = de_get_module_by_id(c, c->input_format_req);
+		if(!module_to_use) {
+			de_err(c, "Unknown module \"%s\"", c->input_format_req);
+			goto done;
+		}
+	}
+
+	if(c->slice_size_req_valid) {
+		de_dbg(c, "Input file: %s[%d,%d]", ucstring_getpsz_d(friendly_infn),
+			(int)c->slice_start_req, (int)c->slice_size_req);
+	}
+	else if(c->slice_start_req) {
+		de_dbg(c, "Input file: %s[%d]", ucstring_getpsz_d(friendly_infn),
+			(int)c->slice_start_req);
+	}
+	else {
+		de_dbg(c, "Input file: %s", ucstring_getpsz_d(friendly_infn));
+	}
+
+	// The writer thread and the deduplication data are shared by all the input
+	// files, so set them up before memory tracking begins.
+	if((c->output_style==DE_OUTPUTSTYLE_DIRECT || c->output_style==DE_OUTPUTSTYLE_ZIP) &&
+		!c->list_mode && de_get_ext_option_bool(c, "dedup", 0))
+	{
+		de_dedup_start(c);
+	}
+	if(c->output_style==DE_OUTPUTSTYLE_DIRECT && !c->list_mode && !c->dedup_data) {
+		if(de_get_ext_option_bool(c, "output:async", 0)) {
+			de_asyncwriter_start(c);
+		}
+	}
+
+	run_main_module_with_recovery(c, module_to_use);
+
+	if(c->json_output) {
+		de_json_report_summary(c,
+			(c->input_style==DE_INPUTSTYLE_STDIN) ? "[stdin]" : c->input_filename,
+			de_get_clock_usec() - start_time);
+	}
+
+done:
+	// In batch mode, these are shared by all the input files, and will be
+	// closed by de_destroy().
+	if(!c->batch_mode) {
+		if(c->asyncwriter_data) { de_asyncwriter_finish(c); }
+		if(c->extrlist_dbuf) { dbuf_close(c->extrlist_dbuf); c->extrlist_dbuf=NULL; }
+		if(c->dedup_data) { de_dedup_destroy(c); }
+	}
+	ucstring_destroy(friendly_infn);
+}
+
 deark *de_create_internal(void)
 {
 	deark *c;
@@ -403,12 +480,14 @@ void de_destroy(deark *c)
 	i64 i;
 
 	if(!c) return;
+	if(c->asyncwriter_data) { de_asyncwriter_finish(c); }
 	if(c->extrlist_dbuf) { dbuf_close(c->extrlist_dbuf); }
 	for(i=0; i<c->num_ext_options; i++) {
 		de_free(c, c->ext_option[i].name);
 		de_free(c, c->ext_option[i].val);
 	}
 	if(c->zip_data) { de_zip_close_file(c); }
+	if(c->dedup_data) { de_dedup_destroy(c); }
 	if(c->base_output_filename) { de_free(c, c->base_output_filename); }
 	if(c->output_archive_filename) { de_free(c, c->output_archive_filename); }
 	if(c->extrlist_filename) { de_free(c, c->extrlist_filename); }
@@ -515,6 +594,19 @@ void de_set_extrlist_filename(deark *c, const char *fn)
 	}
 }
 
+void de_set_extrlist_callback(deark *c, de_extrlistfn_type fn)
+{
+	c->extrlistfn = fn;
+}
+
+void de_write_to_extrlist(deark *c, const char *s)
+{
+	open_extrlist(c);
+	if(!c->extrlist_dbuf) return;
+	dbuf_puts(c->extrlist_dbuf, s);
+	dbuf_flush(c->extrlist_dbuf);
+}
+
 void de_set_input_style(deark *c, int x)
 {
 	c->input_style = x;
@@ -585,6 +677,90 @@ void de_set_listmode(deark *c, int x)
 	c->list_mode = x;
 }
 
+void de_set_recursion(deark *c, int x)
+{
+	c->recurse_mode = x;
+}
+
+void de_set_batch_mode(deark *c, int x)
+{
+	c->batch_mode = x;
+}
+
+const char *de_get_module_id_used(deark *c)
+{
+	return c->main_module_id;
+}
+
+int de_get_error_count(deark *c)
+{
+	return c->error_count;
+}
+
+int de_get_warning_count(deark *c)
+{
+	return c->warning_count;
+}
+
+// Reads a list of filenames from a text file: UTF-8, one name per line.
+// Empty lines are ignored.
+// On success, returns an array of *pnum_names strings, which the caller must
+// free with de_free_filename_list(). On failure, reports an error and
+// returns NULL.
+char **de_read_filename_list(deark *c, const char *listfn, int *pnum_names)
+{
+	dbuf *f = NULL;
+	char **names = NULL;
+	i64 num_names = 0;
+	i64 num_alloc = 0;
+	i64 pos = 0;
+	i64 content_len, total_len;
+
+	*pnum_names = 0;
+	f = dbuf_open_input_file(c, listfn);
+	if(!f) goto done;
+
+	while(dbuf_find_line(f, pos, &content_len, &total_len)) {
+		if(content_len>0) {
+			if(num_names >= num_alloc) {
+				i64 new_alloc = num_alloc ? num_alloc*2 : 64;
+
+				names = de_reallocarray(c, names, num_alloc, sizeof(char*), new_alloc);
+				num_alloc = new_alloc;
+			}
+			names[num_names] = de_malloc(c, content_len+1);
+			dbuf_read(f, (u8*)names[num_names], pos, content_len);
+			num_names++;
+		}
+		pos += total_len;
+	}
+
+	if(num_names<1) {
+		de_err(c, "No filenames found in %s", listfn);
+		goto done;
+	}
+	*pnum_names = (int)num_names;
+
+done:
+	if(f) dbuf_close(f);
+	if(*pnum_names<1 && names) {
+		de_free_filename_list(c, names, (int)num_names);
+		names = NULL;
+	}
+	return names;
+}
+
+void de_free_filename_list(deark *c, char **names, int num_names)
+{
+	int i;
+
+	if(!names) return;
+	for(i=0; i<num_names; i++) {
+		de_free(c, names[i]);
+	}
+	de_free(c, names);
+}
+
 void de_set_want_modhelp(deark *c, int x)
 {
 	c->modhelp_req = x;
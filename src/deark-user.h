@@ -27,6 +27,19 @@ void de_set_input_file_slice_size(deark *c, i64 n);
 
 void de_run(deark *c);
 
+// Set this if de_run() will be called more than once, for different input
+// files. Some resources (the -extrlist file, etc.) will then be kept open
+// until de_destroy() is called.
+void de_set_batch_mode(deark *c, int x);
+
+// Information about the most recent call to de_run().
+// de_get_module_id_used() returns NULL if no module was run.
+const char *de_get_module_id_used(deark *c);
+int de_get_error_count(deark *c);
+int de_get_warning_count(deark *c);
+char **de_read_filename_list(deark *c, const char *listfn, int *pnum_names);
+void de_free_filename_list(deark *c, char **names, int num_names);
+
 void de_print_module_list(deark *c);
 
 void de_set_userdata(deark *c, void *x);
@@ -43,6 +56,7 @@ void de_set_extract_policy(deark *c, int x);
 void de_set_extract_level(deark *c, int x);
 
 void de_set_listmode(deark *c, int x);
+void de_set_recursion(deark *c, int x);
 void de_set_want_modhelp(deark *c, int x);
 void de_set_first_output_file(deark *c, int x);
 void de_set_max_output_files(deark *c, int n);
@@ -87,6 +101,11 @@ void de_set_base_output_filename(deark *c, const char *fn,
 void de_set_output_archive_filename(deark *c, const char *fn, unsigned int flags);
 
 void de_set_extrlist_filename(deark *c, const char *fn);
+// If set, the names of extracted files are sent to this function, instead of
+// being written to the -extrlist file.
+void de_set_extrlist_callback(deark *c, de_extrlistfn_type fn);
+// Append text to the -extrlist file, opening it if necessary.
+void de_write_to_extrlist(deark *c, const char *s);
 
 void de_set_disable_mods(deark *c, const char *s, int invert);
 void de_set_disable_moddetect(deark *c, const char *s, int invert);
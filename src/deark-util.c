@@ -537,10 +537,17 @@ void de_dbg_pal_entry(deark *c, i64 idx, u32 clr)
 	de_dbg_pal_entry2(c, idx, clr, NULL, NULL, NULL);
 }
 
+static void json_report_message(deark *c, const char *type, const char *fmt,
+	va_list ap);
+
 void de_verr(deark *c, const char *fmt, va_list ap)
 {
 	if(c) {
 		c->error_count++;
+		if(c->json_output) {
+			json_report_message(c, "error", fmt, ap);
+			return;
+		}
 	}
 
 	de_puts(c, DE_MSGTYPE_ERROR, "Error: ");
@@ -560,7 +567,12 @@ void de_err(deark *c, const char *fmt, ...)
 
 void de_vwarn(deark *c, const char *fmt, va_list ap)
 {
+	c->warning_count++;
 	if(!c->show_warnings) return;
+	if(c->json_output) {
+		json_report_message(c, "warning", fmt, ap);
+		return;
+	}
 	de_puts(c, DE_MSGTYPE_WARNING, "Warning: ");
 	de_vprintf(c, DE_MSGTYPE_WARNING, fmt, ap);
 	de_puts(c, DE_MSGTYPE_WARNING, "\n");
@@ -570,32 +582,262 @@ void de_warn(deark *c, const char *fmt, ...)
 {
 	va_list ap;
 
-	if(!c->show_warnings) return;
 	va_start(ap, fmt);
 	de_vwarn(c, fmt, ap);
 	va_end(ap);
 }
 
+// In JSON mode, these messages are not printed. The important information
+// is in the JSON objects.
 void de_msg(deark *c, const char *fmt, ...)
 {
 	va_list ap;
 
 	if(!c->show_messages) return;
+	if(c->json_output) return;
 	va_start(ap, fmt);
 	de_vprintf(c, DE_MSGTYPE_MESSAGE, fmt, ap);
 	va_end(ap);
 	de_puts(c, DE_MSGTYPE_MESSAGE, "\n");
 }
 
+// JSON output ("-opt output:json").
+// Each JSON object is printed as a single line, as an ordinary message.
+
+// Returns a new string containing s as a JSON string, with quotes. This is
+// the only JSON string escaper; the server mode in deark-cmd.c uses it too.
+// c can be NULL. The caller must de_free() the result.
+char *de_json_quote_string(deark *c, const char *s)
+{
+	const u8 *p;
+	char *q;
+	size_t k = 0;
+
+	// Each byte becomes at most 6 bytes ("\u001f").
+	q = de_malloc(c, (i64)de_strlen(s)*6 + 3);
+	q[k++] = '"';
+	for(p=(const u8*)s; *p; p++) {
+		if(*p=='"' || *p=='\\') {
+			q[k++] = '\\';
+			q[k++] = (char)*p;
+		}
+		else if(*p=='\n') {
+			q[k++] = '\\';
+			q[k++] = 'n';
+		}
+		else if(*p<0x20) {
+			de_snprintf(&q[k], 7, "\\u%04x", (unsigned int)*p);
+			k += 6;
+		}
+		else {
+			q[k++] = (char)*p;
+		}
+	}
+	q[k++] = '"';
+	q[k] = '\0';
+	return q;
+}
+
+static void json_append_string(dbuf *f, const char *s)
+{
+	char *q;
+
+	q = de_json_quote_string(f->c, s);
+	dbuf_puts(f, q);
+	de_free(f->c, q);
+}
+
+static void json_emit(deark *c, dbuf *f)
+{
+	dbuf_write(f, (const u8*)"}\n", 3); // Includes the terminating NUL
+	de_puts(c, DE_MSGTYPE_MESSAGE, (const char*)f->membuf_buf);
+	dbuf_close(f);
+}
+
+static void json_report_message(deark *c, const char *type, const char *fmt,
+	va_list ap)
+{
+	char buf[1024];
+	dbuf *f;
+
+	de_vsnprintf(buf, sizeof(buf), fmt, ap);
+	f = dbuf_create_membuf(c, 0, 0);
+	dbuf_puts(f, "{\"type\":");
+	json_append_string(f, type);
+	dbuf_puts(f, ",\"message\":");
+	json_append_string(f, buf);
+	json_emit(c, f);
+}
+
+// Called when an extracted file is closed.
+void de_json_report_file(dbuf *outf)
+{
+	deark *c = outf->c;
+	dbuf *f;
+
+	f = dbuf_create_membuf(c, 0, 0);
+	dbuf_printf(f, "{\"type\":\"file\",\"index\":%d,\"name\":", outf->file_index);
+	json_append_string(f, outf->name);
+	if(outf->module_id) {
+		dbuf_puts(f, ",\"module\":");
+		json_append_string(f, outf->module_id);
+	}
+	if(!c->list_mode) {
+		dbuf_printf(f, ",\"size\":%"I64_FMT, outf->len);
+	}
+	if(outf->crco_for_json) {
+		dbuf_printf(f, ",\"crc32\":\"%08x\"",
+			(unsigned int)de_crcobj_getval(outf->crco_for_json));
+	}
+	if(outf->fi_copy && outf->fi_copy->mod_time.is_valid) {
+		struct de_struct_tm tm2;
+
+		de_gmtime(&outf->fi_copy->mod_time, &tm2);
+		if(tm2.is_valid) {
+			dbuf_printf(f, ",\"mtime\":\"%04d-%02d-%02dT%02d:%02d:%02d%s\"",
+				tm2.tm_fullyear, 1+tm2.tm_mon, tm2.tm_mday,
+				tm2.tm_hour, tm2.tm_min, tm2.tm_sec,
+				(outf->fi_copy->mod_time.tzcode==DE_TZCODE_LOCAL)?"":"Z");
+		}
+	}
+	json_emit(c, f);
+}
+
+// Called when we're done with an input file.
+void de_json_report_summary(deark *c, const char *input_fn, i64 elapsed_usec)
+{
+	dbuf *f;
+
+	f = dbuf_create_membuf(c, 0, 0);
+	dbuf_puts(f, "{\"type\":\"summary\"");
+	if(input_fn) {
+		dbuf_puts(f, ",\"input\":");
+		json_append_string(f, input_fn);
+	}
+	if(c->main_module_id) {
+		dbuf_puts(f, ",\"module\":");
+		json_append_string(f, c->main_module_id);
+	}
+	dbuf_printf(f, ",\"files\":%d,\"errors\":%d,\"warnings\":%d,\"seconds\":%.6f",
+		c->num_files_extracted, c->error_count, c->warning_count,
+		(double)elapsed_usec/1000000.0);
+	json_emit(c, f);
+}
+
 // c can be NULL.
+// If a recovery point has been set (see de_run()), this returns to it, and
+// only the current input file is abandoned. Otherwise, it ends the process.
 void de_fatalerror(deark *c)
 {
+	if(c && c->fatalerror_cleanup_fn) {
+		void (*fn)(deark *c, void *userdata) = c->fatalerror_cleanup_fn;
+
+		c->fatalerror_cleanup_fn = NULL;
+		fn(c, c->fatalerror_cleanup_userdata);
+	}
+	if(c && c->recovery_point) {
+		longjmp(*c->recovery_point, 1);
+	}
 	if(c && c->fatalerrorfn) {
 		c->fatalerrorfn(c);
 	}
 	exit(1);
 }
 
+// Every block of memory allocated by de_malloc(), etc., starts with a
+// header. If the block was allocated while memory tracking was active, the
+// header links it into the tracker's list, so that it can be freed after a
+// fatal error.
+struct de_memblk_struct {
+	struct de_memblk_struct *prev;
+	struct de_memblk_struct *next;
+	struct de_memtracker_struct *tracker; // NULL if not tracked
+};
+
+// The union makes the header size a multiple of the alignment that malloc
+// would give us.
+union de_memhdr_union {
+	struct de_memblk_struct blk;
+	u8 padding[32];
+};
+#define DE_MEMHDR_SIZE ((i64)sizeof(union de_memhdr_union))
+
+#define MEM_TO_BLK(m) ((struct de_memblk_struct*)(((u8*)(m)) - DE_MEMHDR_SIZE))
+#define BLK_TO_MEM(b) ((void*)(((u8*)(b)) + DE_MEMHDR_SIZE))
+
+struct de_memtracker_struct {
+	struct de_memblk_struct *head;
+};
+
+static void memblk_track(struct de_memtracker_struct *t, struct de_memblk_struct *b)
+{
+	b->tracker = t;
+	b->prev = NULL;
+	b->next = NULL;
+	if(!t) return;
+	b->next = t->head;
+	if(t->head) t->head->prev = b;
+	t->head = b;
+}
+
+static void memblk_untrack(struct de_memblk_struct *b)
+{
+	if(!b->tracker) return;
+	if(b->prev) b->prev->next = b->next;
+	else b->tracker->head = b->next;
+	if(b->next) b->next->prev = b->prev;
+	b->tracker = NULL;
+	b->prev = NULL;
+	b->next = NULL;
+}
+
+// Start tracking the memory allocated with this deark object.
+void de_memtracker_begin(deark *c)
+{
+	if(c->memtracker) return;
+	c->memtracker = calloc(1, sizeof(struct de_memtracker_struct));
+	if(!c->memtracker) {
+		de_err(c, "Memory allocation failed");
+		de_fatalerror(c);
+	}
+}
+
+// Stop tracking memory. If free_blocks is set, free all the memory that has
+// been allocated (and not freed) since de_memtracker_begin().
+void de_memtracker_end(deark *c, int free_blocks)
+{
+	struct de_memtracker_struct *t = c->memtracker;
+
+	if(!t) return;
+	c->memtracker = NULL;
+
+	while(t->head) {
+		struct de_memblk_struct *b = t->head;
+
+		memblk_untrack(b);
+		if(free_blocks) {
+			free(b);
+		}
+	}
+	free(t);
+}
+
+// Temporarily stop tracking memory and open files, for objects that have to
+// outlive the current input file even if there is a fatal error.
+// Returns a value to pass to de_memtracker_resume().
+struct de_memtracker_struct *de_memtracker_pause(deark *c)
+{
+	struct de_memtracker_struct *t = c->memtracker;
+
+	c->memtracker = NULL;
+	return t;
+}
+
+void de_memtracker_resume(deark *c, struct de_memtracker_struct *t)
+{
+	c->memtracker = t;
+}
+
 // TODO: Make de_malloc use de_mallocarray internally, instead of vice versa.
 void *de_mallocarray(deark *c, i64 nmemb, size_t membsize)
 {
@@ -613,7 +855,7 @@ void *de_mallocarray(deark *c, i64 nmemb, size_t membsize)
 // Always succeeds; never returns NULL.
 void *de_malloc(deark *c, i64 n)
 {
-	void *m;
+	struct de_memblk_struct *b;
 	if(n==0) n=1;
 	if(n<0 || n>500000000) {
 		de_err(c, "Out of memory (%d bytes requested)",(int)n);
@@ -621,13 +863,29 @@ void *de_malloc(deark *c, i64 n)
 		return NULL;
 	}
 
-	m = calloc((size_t)n,1);
-	if(!m) {
+	b = calloc((size_t)(n+DE_MEMHDR_SIZE),1);
+	if(!b) {
 		de_err(c, "Memory allocation failed (%d bytes)",(int)n);
 		de_fatalerror(c);
 		return NULL;
 	}
-	return m;
+	memblk_track(c ? c->memtracker : NULL, b);
+	return BLK_TO_MEM(b);
+}
+
+// Like de_malloc(NULL, n), but returns NULL if the memory can't be
+// allocated, instead of reporting a fatal error. Worker threads must use
+// this, since they can't call de_fatalerror().
+void *de_malloc_nofatal(i64 n)
+{
+	struct de_memblk_struct *b;
+
+	if(n==0) n=1;
+	if(n<0 || n>500000000) return NULL;
+	b = calloc((size_t)(n+DE_MEMHDR_SIZE),1);
+	if(!b) return NULL;
+	memblk_track(NULL, b);
+	return BLK_TO_MEM(b);
 }
 
 // TODO: Make de_realloc use de_reallocarray internally, instead of vice versa.
@@ -652,18 +910,35 @@ void *de_reallocarray(deark *c, void *m, i64 oldnmemb, size_t membsize,
 void *de_realloc(deark *c, void *oldmem, i64 oldsize, i64 newsize)
 {
 	void *newmem;
+	struct de_memblk_struct *b;
+	struct de_memtracker_struct *tracker;
 
 	if(!oldmem) {
 		return de_malloc(c, newsize);
 	}
 
-	newmem = realloc(oldmem, (size_t)newsize);
-	if(!newmem) {
+	if(newsize<0 || newsize>500000000) {
+		de_err(c, "Out of memory (%d bytes requested)",(int)newsize);
+		de_free(c, oldmem);
+		de_fatalerror(c);
+		return NULL;
+	}
+
+	// The block may move, so remove it from its tracker's list, and put it
+	// back afterward.
+	b = MEM_TO_BLK(oldmem);
+	tracker = b->tracker;
+	memblk_untrack(b);
+
+	b = realloc(b, (size_t)(newsize+DE_MEMHDR_SIZE));
+	if(!b) {
 		de_err(c, "Memory reallocation failed (%d bytes)",(int)newsize);
-		free(oldmem);
+		free(MEM_TO_BLK(oldmem));
 		de_fatalerror(c);
 		return NULL;
 	}
+	memblk_track(tracker, b);
+	newmem = BLK_TO_MEM(b);
 
 	if(oldsize<newsize) {
 		// zero out any newly-allocated bytes
@@ -675,7 +950,12 @@ void *de_realloc(deark *c, void *oldmem, i64 oldsize, i64 newsize)
 
 void de_free(deark *c, void *m)
 {
-	free(m);
+	struct de_memblk_struct *b;
+
+	if(!m) return;
+	b = MEM_TO_BLK(m);
+	memblk_untrack(b);
+	free(b);
 }
 
 // Returns the index into c->module_info[], or -1 if no found.
@@ -712,10 +992,13 @@ struct deark_module_info *de_get_module_by_id(deark *c, const char *module_id)
 int de_run_module(deark *c, struct deark_module_info *mi, de_module_params *mparams, int moddisp)
 {
 	int old_moddisp;
+	const char *old_module_id;
 	if(!mi) return 0;
 	if(!mi->run_fn) return 0;
 	old_moddisp = c->module_disposition;
+	old_module_id = c->cur_module_id;
 	c->module_disposition = moddisp;
+	c->cur_module_id = mi->id;
 	if(c->module_nesting_level>0 && c->debug_level>=3) {
 		de_dbg3(c, "[using %s module]", mi->id);
 	}
@@ -723,6 +1006,7 @@ int de_run_module(deark *c, struct deark_module_info *mi, de_module_params *mpar
 	mi->run_fn(c, mparams);
 	c->module_nesting_level--;
 	c->module_disposition = old_moddisp;
+	c->cur_module_id = old_module_id;
 	return 1;
 }
 
@@ -739,6 +1023,60 @@ int de_run_module_by_id(deark *c, const char *id, de_module_params *mparams)
 	return de_run_module(c, module_to_use, mparams, DE_MODDISP_INTERNAL);
 }
 
+// Returns the best module to use, by looking at the file contents, etc.
+struct deark_module_info *de_detect_module_for_file(deark *c, int *errflag)
+{
+	int i;
+	int result;
+	int best_result = 0;
+	int orig_errcount;
+	struct deark_module_info *best_module = NULL;
+
+	*errflag = 0;
+
+	// Check for a UTF-8 BOM just once. Any module can use this flag.
+	if(dbuf_has_utf8_bom(c->infile, 0)) {
+		c->detection_data.has_utf8_bom = 1;
+	}
+
+	orig_errcount = c->error_count;
+	for(i=0; i<c->num_modules; i++) {
+		if(c->module_info[i].identify_fn==NULL) continue;
+
+		// If autodetect is disabled for this module, and its autodetect routine
+		// doesn't do anything that may be needed by other modules, don't bother
+		// to run this module's autodetection.
+		if((c->module_info[i].flags & DE_MODFLAG_DISABLEDETECT) &&
+			!(c->module_info[i].flags & DE_MODFLAG_SHAREDDETECTION))
+		{
+			continue;
+		}
+
+		result = c->module_info[i].identify_fn(c);
+
+		if(c->error_count > orig_errcount) {
+			// Detection routines don't normally produce errors. If one does,
+			// it's probably an internal error, or other serious problem.
+			*errflag = 1;
+			return NULL;
+		}
+
+		if(c->module_info[i].flags & DE_MODFLAG_DISABLEDETECT) {
+			// Ignore results of autodetection.
+			continue;
+		}
+
+		if(result <= best_result) continue;
+
+		// This is the best result so far.
+		best_result = result;
+		best_module = &c->module_info[i];
+		if(best_result>=100) break;
+	}
+
+	return best_module;
+}
+
 void de_run_module_by_id_on_slice(deark *c, const char *id, de_module_params *mparams,
 	dbuf *f, i64 pos, i64 len)
 {
@@ -760,6 +1098,102 @@ void de_run_module_by_id_on_slice(deark *c, const char *id, de_module_params *mp
 	c->infile = old_ifile;
 }
 
+// Called when an output file is closed, if recursion (-r) is enabled.
+// Try to identify the format of the file's contents, and if successful,
+// decode it as if it were a top-level input file. Files extracted from it
+// will be named "<basefn>.NNN.*".
+// 'f' is the file's contents, and 'fn' is its name.
+void de_recurse_into_file(deark *c, dbuf *f, const char *fn, const char *basefn)
+{
+	struct deark_module_info *mi = NULL;
+	int errflag;
+	dbuf *old_infile;
+	const char *old_input_filename;
+	char *old_base_output_filename;
+	int old_file_count, old_num_files_extracted;
+	int old_first_output_file, old_max_output_files;
+	int old_format_declared, old_module_nesting_level;
+	int old_suppress_detection_by_filename;
+	struct de_detection_data_struct old_detection_data;
+
+	if(f->len<1) return;
+	if(c->recursion_level >= c->recurse_maxdepth) return;
+
+	if(f->len > c->recurse_maxsize) {
+		de_dbg(c, "[not decoding %s: file too large]", fn);
+		return;
+	}
+
+	if(c->recurse_bytes_total + f->len > c->recurse_bytes_limit) {
+		if(!c->recurse_limit_warned) {
+			de_warn(c, "Expansion ratio limit reached. Not decoding %s, or any "
+				"subsequent extracted files.", fn);
+			c->recurse_limit_warned = 1;
+		}
+		return;
+	}
+	c->recurse_bytes_total += f->len;
+
+	old_infile = c->infile;
+	old_input_filename = c->input_filename;
+	old_base_output_filename = c->base_output_filename;
+	old_file_count = c->file_count;
+	old_num_files_extracted = c->num_files_extracted;
+	old_first_output_file = c->first_output_file;
+	old_max_output_files = c->max_output_files;
+	old_format_declared = c->format_declared;
+	old_module_nesting_level = c->module_nesting_level;
+	old_suppress_detection_by_filename = c->suppress_detection_by_filename;
+	old_detection_data = c->detection_data;
+
+	c->infile = f;
+	c->input_filename = fn;
+	c->base_output_filename = de_strdup(c, basefn);
+	c->file_count = 0;
+	c->num_files_extracted = 0;
+	c->first_output_file = 0;
+	c->max_output_files = -1;
+	c->format_declared = 0;
+	c->module_nesting_level = 0;
+	c->suppress_detection_by_filename = 0;
+	de_zeromem(&c->detection_data, sizeof(struct de_detection_data_struct));
+	c->recursion_level++;
+
+	mi = de_detect_module_for_file(c, &errflag);
+	if(errflag) goto done;
+	if(!mi) {
+		de_dbg(c, "[%s: format not recognized]", fn);
+		goto done;
+	}
+
+	// Don't use modules that would require -m (or -m would be recommended)
+	// if the file were a top-level input file.
+	if((mi->flags & (DE_MODFLAG_SECURITYWARNING|DE_MODFLAG_NONWORKING)) ||
+		!de_strcmp(mi->id, "unsupported"))
+	{
+		de_dbg(c, "[not decoding %s with %s module]", fn, mi->id);
+		goto done;
+	}
+
+	de_msg(c, "Decoding %s (module: %s)", fn, mi->id);
+	de_run_module(c, mi, NULL, DE_MODDISP_AUTODETECT);
+
+done:
+	c->recursion_level--;
+	de_free(c, c->base_output_filename);
+	c->infile = old_infile;
+	c->input_filename = old_input_filename;
+	c->base_output_filename = old_base_output_filename;
+	c->file_count = old_file_count;
+	c->num_files_extracted = old_num_files_extracted;
+	c->first_output_file = old_first_output_file;
+	c->max_output_files = old_max_output_files;
+	c->format_declared = old_format_declared;
+	c->module_nesting_level = old_module_nesting_level;
+	c->suppress_detection_by_filename = old_suppress_detection_by_filename;
+	c->detection_data = old_detection_data;
+}
+
 // Same as de_run_module_by_id_on_slice(), but takes just ->codes
 // as a parameter, instead of a full de_module_params struct.
 void de_run_module_by_id_on_slice2(deark *c, const char *id, const char *codes,
@@ -1444,150 +1878,3 @@ int de_inthashtable_remove_any_item(deark *c, struct de_inthashtable *ht, i64 *p
 	if(pvalue) *pvalue = NULL;
 	return 0;
 }
-
-// crcobj: Functions for performing CRC calculations, and other checksum-like
-// functions for which the result can fit in a 32-bit int.l
-
-struct de_crcobj {
-	u32 val;
-	unsigned int crctype;
-	deark *c;
-	u16 *table16;
-};
-
-// This is the CRC-16 algorithm used in MacBinary.
-// It is in the x^16 + x^12 + x^5 + 1 family.
-// CRC-16-CCITT is probably the best name for it, though I'm not completely
-// sure, and there are several algorithms that have been called "CRC-16-CCITT".
-static void de_crc16ccitt_init(struct de_crcobj *crco)
-{
-	const unsigned int polynomial = 0x1021;
-	unsigned int index;
-
-	crco->table16 = de_mallocarray(crco->c, 256, sizeof(u16));
-	crco->table16[0] = 0;
-	for(index=0; index<128; index++) {
-		unsigned int carry = crco->table16[index] & 0x8000;
-		unsigned int temp = (crco->table16[index] << 1) & 0xffff;
-		crco->table16[index * 2 + (carry ? 0 : 1)] = temp ^ polynomial;
-		crco->table16[index * 2 + (carry ? 1 : 0)] = temp;
-	}
-}
-
-static void de_crc16ccitt_continue(struct de_crcobj *crco, const u8 *buf, i64 buf_len)
-{
-	i64 k;
-
-	if(!crco->table16) return;
-	for(k=0; k<buf_len; k++) {
-		crco->val = ((crco->val<<8)&0xffff) ^
-			(u32)crco->table16[((crco->val>>8) ^ (u32)buf[k]) & 0xff];
-	}
-}
-
-// This is the CRC-16 algorithm used in ARC, LHA, ZOO, etc.
-// It is in the x^16 + x^15 + x^2 + 1 family.
-// It's some variant of CRC-16-IBM, and sometimes simply called "CRC-16". But
-// both these names are more ambiguous than I'd like, so I'm calling it "ARC".
-static void de_crc16arc_init(struct de_crcobj *crco)
-{
-	u32 i, k;
-
-	crco->table16 = de_mallocarray(crco->c, 256, sizeof(u16));
-	for(i=0; i<256; i++) {
-		crco->table16[i] = i;
-		for(k=0; k<8; k++)
-			crco->table16[i] = (crco->table16[i]>>1) ^ ((crco->table16[i] & 1) ? 0xa001 : 0);
-	}
-}
-
-static void de_crc16arc_continue(struct de_crcobj *crco, const u8 *buf, i64 buf_len)
-{
-	i64 k;
-
-	if(!crco->table16) return;
-	for(k=0; k<buf_len; k++) {
-		crco->val = ((crco->val>>8) ^
-			(u32)crco->table16[(crco->val ^ buf[k]) & 0xff]);
-	}
-}
-
-// Allocate, initializes, and resets a new object
-struct de_crcobj *de_crcobj_create(deark *c, unsigned int flags)
-{
-	struct de_crcobj *crco;
-
-	crco = de_malloc(c, sizeof(struct de_crcobj));
-	crco->c = c;
-	crco->crctype = flags;
-
-	switch(crco->crctype) {
-	case DE_CRCOBJ_CRC16_CCITT:
-		de_crc16ccitt_init(crco);
-		break;
-	case DE_CRCOBJ_CRC16_ARC:
-		de_crc16arc_init(crco);
-		break;
-	}
-
-	de_crcobj_reset(crco);
-	return crco;
-}
-
-void de_crcobj_destroy(struct de_crcobj *crco)
-{
-	deark *c;
-
-	if(!crco) return;
-	c = crco->c;
-	de_free(c, crco->table16);
-	de_free(c, crco);
-}
-
-void de_crcobj_reset(struct de_crcobj *crco)
-{
-	crco->val = 0;
-
-	switch(crco->crctype) {
-	case DE_CRCOBJ_CRC32_IEEE:
-		crco->val = de_crc32(NULL, 0);
-		break;
-	}
-}
-
-u32 de_crcobj_getval(struct de_crcobj *crco)
-{
-	return crco->val;
-}
-
-void de_crcobj_addbuf(struct de_crcobj *crco, const u8 *buf, i64 buf_len)
-{
-	switch(crco->crctype) {
-	case DE_CRCOBJ_CRC32_IEEE:
-		crco->val = de_crc32_continue(crco->val, buf, buf_len);
-		break;
-	case DE_CRCOBJ_CRC16_CCITT:
-		de_crc16ccitt_continue(crco, buf, buf_len);
-		break;
-	case DE_CRCOBJ_CRC16_ARC:
-		de_crc16arc_continue(crco, buf, buf_len);
-		break;
-	}
-}
-
-void de_crcobj_addbyte(struct de_crcobj *crco, u8 b)
-{
-	de_crcobj_addbuf(crco, &b, 1);
-}
-
-static int addslice_cbfn(struct de_bufferedreadctx *brctx, const u8 *buf,
-	i64 buf_len)
-{
-	de_crcobj_addbuf((struct de_crcobj*)brctx->userdata, buf, buf_len);
-	return 1;
-}
-
-void de_crcobj_addslice(struct de_crcobj *crco, dbuf *f, i64 pos, i64 len)
-{
-	dbuf_buffered_read(f, pos, len, addslice_cbfn, (void*)crco);
-}
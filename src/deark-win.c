@@ -36,13 +36,12 @@ void de_vsnprintf(char *buf, size_t buflen, const char *fmt, va_list ap)
 char *de_strdup(deark *c, const char *s)
 {
 	char *s2;
+	size_t len;
 
-	s2 = _strdup(s);
-	if(!s2) {
-		de_err(c, "Memory allocation failed");
-		de_fatalerror(c);
-		return NULL;
-	}
+	// Use de_malloc(), so that the memory can be freed with de_free().
+	len = de_strlen(s);
+	s2 = de_malloc(c, (i64)len+1);
+	de_memcpy(s2, s, len+1);
 	return s2;
 }
 
@@ -114,6 +113,34 @@ wchar_t *de_utf8_to_utf16_strdup(deark *c, const char *src)
 	return dst;
 }
 
+// Convert a filename to UTF-16. If c is NULL (e.g. we're in the writer
+// thread), this doesn't use the deark object, and returns NULL on failure
+// instead of reporting an error.
+// Free the result with free_utf16_filename().
+static WCHAR *filename_to_utf16(deark *c, const char *fn)
+{
+	WCHAR *dst;
+	int dstlen;
+
+	if(c) return de_utf8_to_utf16_strdup(c, fn);
+
+	dstlen = MultiByteToWideChar(CP_UTF8, 0, fn, -1, NULL, 0);
+	if(dstlen<1) return NULL;
+	dst = (WCHAR*)calloc((size_t)dstlen, sizeof(WCHAR));
+	if(!dst) return NULL;
+	if(MultiByteToWideChar(CP_UTF8, 0, fn, -1, dst, dstlen)<1) {
+		free(dst);
+		return NULL;
+	}
+	return dst;
+}
+
+static void free_utf16_filename(deark *c, WCHAR *fnW)
+{
+	if(c) de_free(c, fnW);
+	else free(fnW);
+}
+
 // Convert a string from utf8 to utf16, then write it to a FILE
 // (e.g. using fputws).
 void de_utf8_to_utf16_to_FILE(deark *c, const char *src, FILE *f)
@@ -212,7 +239,12 @@ FILE* de_fopen_for_read(deark *c, const char *fn, i64 *len,
 	return f;
 }
 
-// flags: 0x1 = append instead of overwriting
+// c can be NULL, in which case this is safe to call from a worker thread.
+// flags:
+//  0x1 = append instead of overwriting
+//  0x2 = also open for reading
+//  0x4 = if fn is an existing file, delete it first, instead of overwriting
+//        it (so that any other hard links to it are not changed)
 FILE* de_fopen_for_write(deark *c, const char *fn,
 	char *errmsg, size_t errmsg_len, int overwrite_mode,
 	unsigned int flags)
@@ -221,8 +253,15 @@ FILE* de_fopen_for_write(deark *c, const char *fn,
 	WCHAR *fnW = NULL;
 	FILE *f_ret = NULL;
 
-	modeW = (flags&0x1) ? L"ab" : L"wb";
-	fnW = de_utf8_to_utf16_strdup(c, fn);
+	if(flags&0x1)
+		modeW = (flags&0x2) ? L"a+b" : L"ab";
+	else
+		modeW = (flags&0x2) ? L"w+b" : L"wb";
+	fnW = filename_to_utf16(c, fn);
+	if(!fnW) {
+		de_strlcpy(errmsg, "Encoding conversion failed", errmsg_len);
+		goto done;
+	}
 
 	if(overwrite_mode==DE_OVERWRITEMODE_NEVER) {
 		DWORD fa = GetFileAttributesW(fnW);
@@ -231,14 +270,61 @@ FILE* de_fopen_for_write(deark *c, const char *fn,
 			goto done;
 		}
 	}
+	else if(flags&0x4) {
+		DWORD fa = GetFileAttributesW(fnW);
+		if(fa != INVALID_FILE_ATTRIBUTES && !(fa & FILE_ATTRIBUTE_DIRECTORY)) {
+			DeleteFileW(fnW);
+		}
+	}
 
 	f_ret = de_fopenW(c, fnW, modeW, errmsg, errmsg_len);
 
 done:
-	de_free(c, fnW);
+	free_utf16_filename(c, fnW);
 	return f_ret;
 }
 
+// Replace the existing file new_fn with a hard link to the existing file
+// existing_fn. The link is made under a temporary name, then renamed, so
+// that new_fn is never missing.
+// On failure, returns 0 and sets errmsg, and new_fn is unchanged.
+int de_replace_with_hard_link(deark *c, const char *existing_fn, const char *new_fn,
+	char *errmsg, size_t errmsg_len)
+{
+	WCHAR *existing_fnW = NULL;
+	WCHAR *new_fnW = NULL;
+	WCHAR *tmp_fnW = NULL;
+	char *tmp_fn = NULL;
+	size_t tmp_fn_len;
+	int retval = 0;
+
+	tmp_fn_len = de_strlen(new_fn) + 16;
+	tmp_fn = de_malloc(c, (i64)tmp_fn_len);
+	de_snprintf(tmp_fn, tmp_fn_len, "%s.dedup-tmp", new_fn);
+
+	existing_fnW = de_utf8_to_utf16_strdup(c, existing_fn);
+	new_fnW = de_utf8_to_utf16_strdup(c, new_fn);
+	tmp_fnW = de_utf8_to_utf16_strdup(c, tmp_fn);
+
+	if(!CreateHardLinkW(tmp_fnW, existing_fnW, NULL)) {
+		de_strlcpy(errmsg, "Failed to create hard link", errmsg_len);
+		goto done;
+	}
+	if(!MoveFileExW(tmp_fnW, new_fnW, MOVEFILE_REPLACE_EXISTING)) {
+		de_strlcpy(errmsg, "Failed to rename hard link", errmsg_len);
+		DeleteFileW(tmp_fnW);
+		goto done;
+	}
+	retval = 1;
+
+done:
+	de_free(c, existing_fnW);
+	de_free(c, new_fnW);
+	de_free(c, tmp_fnW);
+	de_free(c, tmp_fn);
+	return retval;
+}
+
 int de_fseek(FILE *fp, i64 offs, int whence)
 {
 	return _fseeki64(fp, (__int64)offs, whence);
@@ -254,28 +340,31 @@ int de_fclose(FILE *fp)
 	return fclose(fp);
 }
 
+void de_update_file_perms_by_name(deark *c, const char *fn,
+	unsigned int mode_flags, unsigned int flags)
+{
+	// Not implemented on Windows.
+}
+
 void de_update_file_perms(dbuf *f)
 {
 	// Not implemented on Windows.
 }
 
-void de_update_file_time(dbuf *f)
+void de_update_file_time_by_name(deark *c, const char *fn,
+	const struct de_timestamp *ts, unsigned int flags)
 {
 	WCHAR *fnW = NULL;
 	HANDLE fh = INVALID_HANDLE_VALUE;
 	i64 ft;
 	FILETIME crtime, actime, wrtime;
-	deark *c;
 
-	if(f->btype!=DBUF_TYPE_OFILE) return;
-	if(!f->fi_copy) return;
-	if(!f->fi_copy->mod_time.is_valid) return;
-	if(!f->name) return;
-	c = f->c;
+	if(!ts->is_valid) return;
 
-	ft = de_timestamp_to_FILETIME(&f->fi_copy->mod_time);
+	ft = de_timestamp_to_FILETIME(ts);
 	if(ft==0) goto done;
-	fnW = de_utf8_to_utf16_strdup(c, f->name);
+	fnW = filename_to_utf16(c, fn);
+	if(!fnW) goto done;
 	fh = CreateFileW(fnW, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, NULL,
 		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 	if(fh==INVALID_HANDLE_VALUE) goto done;
@@ -290,7 +379,15 @@ done:
 	if(fh != INVALID_HANDLE_VALUE) {
 		CloseHandle(fh);
 	}
-	de_free(c, fnW);
+	if(fnW) free_utf16_filename(c, fnW);
+}
+
+void de_update_file_time(dbuf *f)
+{
+	if(f->btype!=DBUF_TYPE_OFILE) return;
+	if(!f->fi_copy) return;
+	if(!f->name) return;
+	de_update_file_time_by_name(f->c, f->name, &f->fi_copy->mod_time, 0);
 }
 
 char **de_convert_args_to_utf8(int argc, wchar_t **argvW)
@@ -407,9 +504,87 @@ void de_current_time_to_timestamp(struct de_timestamp *ts)
 	de_FILETIME_to_timestamp(ft, ts, 0x1);
 }
 
+i64 de_get_clock_usec(void)
+{
+	LARGE_INTEGER freq, count;
+
+	if(!QueryPerformanceFrequency(&freq) || freq.QuadPart<1) return 0;
+	if(!QueryPerformanceCounter(&count)) return 0;
+	return (i64)((double)count.QuadPart * 1000000.0 / (double)freq.QuadPart);
+}
+
 void de_exitprocess(void)
 {
 	exit(1);
 }
 
+// Returns the number of processors available, or 1 if unknown.
+int de_get_cpu_count(void)
+{
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	if(si.dwNumberOfProcessors<1) return 1;
+	if(si.dwNumberOfProcessors>1024) return 1024;
+	return (int)si.dwNumberOfProcessors;
+}
+
+// Threads are not yet supported in the Windows version. de_thread_create()
+// always fails, so features that use threads fall back to doing their work
+// synchronously. The synchronization objects exist only so that such code
+// doesn't need special cases; they don't do anything.
+
+struct de_mutex_struct {
+	int reserved;
+};
+
+struct de_cond_struct {
+	int reserved;
+};
+
+de_thread *de_thread_create(deark *c, de_thread_fn fn, void *userdata)
+{
+	return NULL;
+}
+
+void de_thread_join(de_thread *t)
+{
+}
+
+de_mutex *de_mutex_create(deark *c)
+{
+	return de_malloc(c, sizeof(de_mutex));
+}
+
+void de_mutex_destroy(de_mutex *m)
+{
+	de_free(NULL, m);
+}
+
+void de_mutex_lock(de_mutex *m)
+{
+}
+
+void de_mutex_unlock(de_mutex *m)
+{
+}
+
+de_cond *de_cond_create(deark *c)
+{
+	return de_malloc(c, sizeof(de_cond));
+}
+
+void de_cond_destroy(de_cond *cv)
+{
+	de_free(NULL, cv);
+}
+
+void de_cond_wait(de_cond *cv, de_mutex *m)
+{
+}
+
+void de_cond_broadcast(de_cond *cv)
+{
+}
+
 #endif // DE_WINDOWS
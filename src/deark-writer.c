@@ -0,0 +1,350 @@
+// This file is part of Deark.
+// Copyright (C) 2019 Jason Summers
+// See the file COPYING for terms of use.
+
+// deark-writer.c
+//
+// The optional background writer thread ("-opt output:async").
+//
+// When enabled, the decoding thread doesn't touch the output files itself.
+// It queues up "open", "write", and "close" operations, and a second thread
+// does the fopen, fwrite, fclose, and updates the timestamps and permissions.
+// This is mainly useful when file creation is slow, e.g. on network
+// filesystems.
+//
+// The writer thread never prints anything, never allocates memory, and never
+// uses the deark object (which belongs to the main thread). Errors are
+// recorded in the file's de_asyncfile, and reported by the main thread the
+// next time it calls into this module.
+
+#define DE_NOT_IN_MODULE
+#include "deark-config.h"
+#include "deark-private.h"
+
+// Writes are collected into chunks of this size before being handed to the
+// writer thread.
+#define DE_ASYNCWRITER_CHUNK_SIZE 65536
+
+// If more than this many bytes are waiting to be written, the decoding
+// thread will wait for the writer thread to catch up.
+#define DE_ASYNCWRITER_MAX_PENDING (16*1048576)
+
+// Represents one output file. Allocated by the main thread. After the
+// "close" operation has been queued, it belongs to the writer thread.
+// Memory that is passed to the writer thread is allocated without a deark
+// object, so that it's never subject to memory tracking (see de_run()).
+struct de_asyncfile_struct {
+	// Fields used only by the writer thread
+	char *name;
+	int overwrite_mode;
+	FILE *fp;
+	int failed;
+	char errmsg[200]; // Valid if failed
+	unsigned int mode_flags;
+	struct de_timestamp mod_time; // is_valid=0 if we shouldn't set the time
+
+	// After the "close" operation, the writer thread puts the file on the
+	// "done" list, where the main thread can report errors and free it.
+	struct de_asyncfile_struct *next_done;
+
+	// Fields used only by the main thread
+	u8 *chunk;
+	i64 chunk_used;
+};
+typedef struct de_asyncfile_struct de_asyncfile;
+
+#define ASYNCOP_OPEN  1
+#define ASYNCOP_WRITE 2
+#define ASYNCOP_CLOSE 3
+
+struct asyncop_struct {
+	int optype;
+	de_asyncfile *af;
+	u8 *data; // For ASYNCOP_WRITE. Belongs to this op.
+	i64 data_len;
+	struct asyncop_struct *next;
+};
+
+struct asyncwriter_struct {
+	de_thread *thread;
+	de_mutex *mutex;
+	de_cond *cond_work; // Signaled when an op is queued, or on shutdown
+	de_cond *cond_space; // Signaled when pending ops have been processed
+	struct asyncop_struct *op_head;
+	struct asyncop_struct *op_tail;
+	i64 bytes_pending;
+	int shutdown_flag;
+	de_asyncfile *done_head;
+	de_asyncfile *done_tail;
+};
+
+// Called by the writer thread. Only the first error is remembered.
+static void record_error(de_asyncfile *af, const char *msg)
+{
+	if(af->failed) return;
+	af->failed = 1;
+	de_strlcpy(af->errmsg, msg, sizeof(af->errmsg));
+}
+
+static void destroy_asyncfile(de_asyncfile *af)
+{
+	if(!af) return;
+	de_free(NULL, af->name);
+	de_free(NULL, af->chunk);
+	de_free(NULL, af);
+}
+
+// Called by the writer thread, with the mutex unlocked.
+// The platform functions are called with a NULL deark object, and flag 0x1,
+// which makes them safe to use from this thread.
+static void process_op(struct asyncwriter_struct *aw, struct asyncop_struct *op)
+{
+	de_asyncfile *af = op->af;
+	char msgbuf[200];
+
+	switch(op->optype) {
+	case ASYNCOP_OPEN:
+		af->fp = de_fopen_for_write(NULL, af->name, msgbuf, sizeof(msgbuf),
+			af->overwrite_mode, 0);
+		if(!af->fp) {
+			record_error(af, msgbuf);
+		}
+		break;
+	case ASYNCOP_WRITE:
+		if(af->fp && !af->failed) {
+			if(fwrite(op->data, 1, (size_t)op->data_len, af->fp) != (size_t)op->data_len) {
+				record_error(af, "Write error");
+			}
+		}
+		break;
+	case ASYNCOP_CLOSE:
+		if(af->fp) {
+			if(de_fclose(af->fp)!=0) {
+				record_error(af, "Write error");
+			}
+			af->fp = NULL;
+		}
+		if(!af->failed) {
+			de_update_file_perms_by_name(NULL, af->name, af->mode_flags, 0x1);
+			de_update_file_time_by_name(NULL, af->name, &af->mod_time, 0x1);
+		}
+
+		de_mutex_lock(aw->mutex);
+		if(aw->done_tail) {
+			aw->done_tail->next_done = af;
+		}
+		else {
+			aw->done_head = af;
+		}
+		aw->done_tail = af;
+		de_mutex_unlock(aw->mutex);
+		break;
+	}
+}
+
+static void writer_thread_main(void *userdata)
+{
+	struct asyncwriter_struct *aw = (struct asyncwriter_struct*)userdata;
+	struct asyncop_struct *op;
+
+	de_mutex_lock(aw->mutex);
+	while(1) {
+		while(!aw->op_head && !aw->shutdown_flag) {
+			de_cond_wait(aw->cond_work, aw->mutex);
+		}
+		if(!aw->op_head) break; // Shutting down, and nothing left to do
+
+		op = aw->op_head;
+		aw->op_head = op->next;
+		if(!aw->op_head) aw->op_tail = NULL;
+		de_mutex_unlock(aw->mutex);
+
+		process_op(aw, op);
+
+		de_mutex_lock(aw->mutex);
+		aw->bytes_pending -= op->data_len;
+		de_cond_broadcast(aw->cond_space);
+		de_free(NULL, op->data);
+		de_free(NULL, op);
+	}
+	de_mutex_unlock(aw->mutex);
+}
+
+// Queue an operation. Takes ownership of 'data'.
+static void submit_op(deark *c, int optype, de_asyncfile *af,
+	u8 *data, i64 data_len)
+{
+	struct asyncwriter_struct *aw = (struct asyncwriter_struct*)c->asyncwriter_data;
+	struct asyncop_struct *op;
+
+	op = de_malloc(NULL, sizeof(struct asyncop_struct));
+	op->optype = optype;
+	op->af = af;
+	op->data = data;
+	op->data_len = data_len;
+
+	de_mutex_lock(aw->mutex);
+	while(aw->bytes_pending>0 && aw->bytes_pending+data_len > DE_ASYNCWRITER_MAX_PENDING) {
+		de_cond_wait(aw->cond_space, aw->mutex);
+	}
+	if(aw->op_tail) {
+		aw->op_tail->next = op;
+	}
+	else {
+		aw->op_head = op;
+	}
+	aw->op_tail = op;
+	aw->bytes_pending += data_len;
+	de_cond_broadcast(aw->cond_work);
+	de_mutex_unlock(aw->mutex);
+}
+
+// If threads are not supported, this does nothing, and files will be written
+// in the usual way.
+void de_asyncwriter_start(deark *c)
+{
+	struct asyncwriter_struct *aw;
+
+	if(c->asyncwriter_data) return;
+
+	aw = de_malloc(NULL, sizeof(struct asyncwriter_struct));
+	aw->mutex = de_mutex_create(c);
+	aw->cond_work = de_cond_create(c);
+	aw->cond_space = de_cond_create(c);
+
+	aw->thread = de_thread_create(c, writer_thread_main, (void*)aw);
+	if(!aw->thread) {
+		de_dbg(c, "[failed to start writer thread]");
+		de_cond_destroy(aw->cond_space);
+		de_cond_destroy(aw->cond_work);
+		de_mutex_destroy(aw->mutex);
+		de_free(c, aw);
+		return;
+	}
+
+	c->asyncwriter_data = (void*)aw;
+}
+
+// Report any errors that the writer thread has encountered so far, for the
+// files it has finished with, and free those files.
+void de_asyncwriter_report_errors(deark *c)
+{
+	struct asyncwriter_struct *aw = (struct asyncwriter_struct*)c->asyncwriter_data;
+	de_asyncfile *af;
+
+	if(!aw) return;
+
+	de_mutex_lock(aw->mutex);
+	af = aw->done_head;
+	aw->done_head = NULL;
+	aw->done_tail = NULL;
+	de_mutex_unlock(aw->mutex);
+
+	while(af) {
+		de_asyncfile *next = af->next_done;
+
+		if(af->failed) {
+			de_err(c, "Failed to write %s: %s", af->name, af->errmsg);
+		}
+		destroy_asyncfile(af);
+		af = next;
+	}
+}
+
+// Wait for all files to be written, then stop the writer thread.
+void de_asyncwriter_finish(deark *c)
+{
+	struct asyncwriter_struct *aw = (struct asyncwriter_struct*)c->asyncwriter_data;
+
+	if(!aw) return;
+
+	de_mutex_lock(aw->mutex);
+	aw->shutdown_flag = 1;
+	de_cond_broadcast(aw->cond_work);
+	de_mutex_unlock(aw->mutex);
+	de_thread_join(aw->thread);
+
+	de_asyncwriter_report_errors(c);
+
+	de_cond_destroy(aw->cond_space);
+	de_cond_destroy(aw->cond_work);
+	de_mutex_destroy(aw->mutex);
+	de_free(c, aw);
+	c->asyncwriter_data = NULL;
+}
+
+void de_asyncwriter_open_file(deark *c, dbuf *f)
+{
+	de_asyncfile *af;
+
+	de_asyncwriter_report_errors(c);
+
+	af = de_malloc(NULL, sizeof(de_asyncfile));
+	af->name = de_strdup(NULL, f->name);
+	af->overwrite_mode = c->overwrite_mode;
+	af->chunk = de_malloc(NULL, DE_ASYNCWRITER_CHUNK_SIZE);
+	f->asyncfile = af;
+
+	submit_op(c, ASYNCOP_OPEN, af, NULL, 0);
+}
+
+static void flush_chunk(dbuf *f)
+{
+	de_asyncfile *af = f->asyncfile;
+
+	if(af->chunk_used<1) return;
+	submit_op(f->c, ASYNCOP_WRITE, af, af->chunk, af->chunk_used);
+	af->chunk = de_malloc(NULL, DE_ASYNCWRITER_CHUNK_SIZE);
+	af->chunk_used = 0;
+}
+
+void de_asyncwriter_write(dbuf *f, const u8 *m, i64 len)
+{
+	de_asyncfile *af = f->asyncfile;
+
+	if(len<1) return;
+
+	if(af->chunk_used + len <= DE_ASYNCWRITER_CHUNK_SIZE) {
+		de_memcpy(&af->chunk[af->chunk_used], m, (size_t)len);
+		af->chunk_used += len;
+		return;
+	}
+
+	flush_chunk(f);
+
+	if(len >= DE_ASYNCWRITER_CHUNK_SIZE) {
+		u8 *data;
+
+		// Too big for a chunk. Give it its own op.
+		data = de_malloc(NULL, len);
+		de_memcpy(data, m, (size_t)len);
+		submit_op(f->c, ASYNCOP_WRITE, af, data, len);
+		return;
+	}
+
+	de_memcpy(af->chunk, m, (size_t)len);
+	af->chunk_used = len;
+}
+
+// After this, the dbuf no longer owns f->asyncfile.
+void de_asyncwriter_close_file(dbuf *f)
+{
+	deark *c = f->c;
+	de_asyncfile *af = f->asyncfile;
+
+	if(!af) return;
+	flush_chunk(f);
+	de_free(c, af->chunk);
+	af->chunk = NULL;
+
+	if(f->fi_copy) {
+		af->mode_flags = f->fi_copy->mode_flags;
+		if(c->preserve_file_times) {
+			af->mod_time = f->fi_copy->mod_time;
+		}
+	}
+
+	f->asyncfile = NULL;
+	submit_op(c, ASYNCOP_CLOSE, af, NULL, 0);
+	de_asyncwriter_report_errors(c);
+}
@@ -72,10 +72,13 @@ void *de_reallocarray(deark *c, void *m, i64 oldnmemb, size_t membsize,
 	i64 newnmemb);
 void de_free(deark *c, void *m);
 char *de_strdup(deark *c, const char *s);
+char *de_json_quote_string(deark *c, const char *s);
 int de_atoi(const char *string);
 i64 de_strtoll(const char *string, char **endptr, int base);
 i64 de_atoi64(const char *string);
 int de_strcasecmp(const char *a, const char *b);
+void de_snprintf(char *buf, size_t buflen, const char *fmt, ...)
+  de_gnuc_attribute ((format (printf, 3, 4)));
 
 // Used by de_set_extract_policy()
 #define DE_EXTRACTPOLICY_DEFAULT  0
@@ -101,6 +104,8 @@ typedef void (*de_specialmsgfn_type)(deark *c, unsigned int flags, unsigned int
 
 typedef void (*de_fatalerrorfn_type)(deark *c);
 
+typedef void (*de_extrlistfn_type)(deark *c, const char *fn);
+
 // Used by de_set_output_style()
 #define DE_OUTPUTSTYLE_DIRECT 0
 #define DE_OUTPUTSTYLE_ZIP    1
@@ -111,3 +116,25 @@ void de_printf(deark *c, unsigned int flags, const char *fmt, ...)
 	de_gnuc_attribute ((format (printf, 3, 4)));
 
 void de_utf8_to_ascii(const char *src, char *dst, size_t dstlen, unsigned int flags);
+
+// Threads and synchronization objects. On platforms that don't support
+// threads, de_thread_create() returns NULL.
+struct de_thread_struct;
+typedef struct de_thread_struct de_thread;
+struct de_mutex_struct;
+typedef struct de_mutex_struct de_mutex;
+struct de_cond_struct;
+typedef struct de_cond_struct de_cond;
+typedef void (*de_thread_fn)(void *userdata);
+
+de_thread *de_thread_create(deark *c, de_thread_fn fn, void *userdata);
+void de_thread_join(de_thread *t);
+de_mutex *de_mutex_create(deark *c);
+void de_mutex_destroy(de_mutex *m);
+void de_mutex_lock(de_mutex *m);
+void de_mutex_unlock(de_mutex *m);
+de_cond *de_cond_create(deark *c);
+void de_cond_destroy(de_cond *cv);
+void de_cond_wait(de_cond *cv, de_mutex *m);
+void de_cond_broadcast(de_cond *cv);
+int de_get_cpu_count(void);